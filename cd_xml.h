@@ -58,10 +58,49 @@
 //   relevant parts of the XML is copied, and it is safe to free the input
 //   buffer after the parser returns.
 //
+//   Text is trimmed of leading and trailing whitespace, and whitespace-only
+//   runs between tags, like the indentation of pretty-printed XML, produce no
+//   text nodes at all, so no flags are needed to strip them. Text interrupted
+//   by comments becomes a single text node with the comments removed. CDATA
+//   sections become text nodes of their own, flagged with CD_XML_TEXT_CDATA,
+//   whose content points directly into the input and is written back as
+//   CDATA.
+//
+//   Input is expected to be UTF-8 by default, and a UTF-8 byte order mark is
+//   skipped. UTF-16 input, recognized by its byte order mark or by an XML
+//   declaration, and input declared as ISO-8859-1, is transcoded to UTF-8 in
+//   a single pass into a buffer owned by the doc, so strings stay valid after
+//   the input is released, just like with CD_XML_FLAGS_COPY_STRINGS.
+//
+//   By default, memory is allocated through CD_XML_MALLOC, CD_XML_REALLOC and
+//   CD_XML_FREE. To give a doc its own allocator, e.g. a per-thread or
+//   per-request arena, pass a cd_xml_allocator_t via the allocator field of
+//   cd_xml_parse_options_t to cd_xml_init_and_parse_ex, or use
+//   cd_xml_init_ex. The doc and all its arrays, strings and parser scratch
+//   then go through that allocator.
+//
 //   The parser returns a status code that is either CD_XML_STATUS_SUCCESS (0)
 //   if everything went well, otherwise there is an error code for the first
 //   error it encountered.
 //
+//   Additional options can be passed using cd_xml_init_and_parse_ex, like a
+//   set of element paths to keep, in which case the rest of the XML is
+//   skipped without building any nodes:
+//
+//     const char* paths[] = { "catalog/book/title" };
+//     cd_xml_parse_options_t options = { paths, 1 };
+//     rv = cd_xml_init_and_parse_ex(&doc, xml, strlen(xml),
+//                                   CD_XML_FLAGS_NONE, &options);
+//
+//   When only a small part of a large doc is visited, setting the lazy
+//   option makes the parser record the positions of all tags and quotes in
+//   a structural index and build only the root element. Children of an
+//   element are built on demand with
+//
+//     rv = cd_xml_expand(doc, elem);
+//
+//   which uses the index to jump over the subtrees of the children.
+//
 //
 // To serialize a doc to XML:
 // --------------------------
@@ -85,6 +124,158 @@
 //   outputs everything on a single line.
 //
 //
+// To write XML without building a doc:
+// ------------------------------------
+//
+//   The streaming writer produces the same output as cd_xml_write, but
+//   writes directly to the output callback through a fixed-size buffer:
+//
+//     cd_xml_writer_t writer;
+//     cd_xml_writer_init(&writer, output_func, clientdata, true);
+//     cd_xml_writer_begin_element(&writer, cd_xml_no_ix, &foo_str);
+//     cd_xml_writer_attribute(&writer, cd_xml_no_ix, &baz_str, &quux_str);
+//     cd_xml_writer_text(&writer, &quux_str);
+//     cd_xml_writer_end_element(&writer);
+//     rv = cd_xml_writer_finish(&writer);
+//
+//   Namespaces are registered with cd_xml_writer_add_namespace before the
+//   root element is started, and are declared on the root element. Element
+//   names are not copied and must stay alive until the element is ended.
+//
+//
+// To save and load binary snapshots:
+// ----------------------------------
+//
+//   A doc can be saved in a binary format with cd_xml_save_binary, using the
+//   same output callback as cd_xml_write. Loading the snapshot with
+//
+//     rv = cd_xml_load_binary(&doc, data, size, CD_XML_FLAGS_NONE);
+//
+//   does no parsing, and the doc references strings directly in data. If
+//   data is an mmap'ed file, the pages can be shared between processes.
+//
+//
+// To stream records from large files:
+// -----------------------------------
+//
+//   Files that consist of a root with a huge number of repeated children can
+//   be read one child at a time, reading input in chunks from a callback or
+//   a file descriptor:
+//
+//     cd_xml_record_reader_t* reader =
+//         cd_xml_record_reader_init_fd(fd, 1, CD_XML_FLAGS_NONE, NULL);
+//     cd_xml_doc_t* record = NULL;
+//     while ((rv = cd_xml_record_reader_next(reader, &record)) ==
+//            CD_XML_STATUS_SUCCESS && record) {
+//       cd_xml_apply_visitor(record, clientdata, ...);
+//     }
+//     cd_xml_record_reader_free(&reader);
+//
+//   Each record is a regular doc, reused between records so its arrays keep
+//   their capacity, and only the current record is kept in memory.
+//
+//
+// To check XML without building a doc:
+// -------------------------------------
+//
+//   Well-formedness can be checked without allocating any memory with
+//
+//     size_t error_offset;
+//     rv = cd_xml_validate(xml, strlen(xml), CD_XML_FLAGS_NONE, &error_offset);
+//
+//   which checks nesting, end tags, namespace prefixes, entities and UTF-8
+//   the same way as cd_xml_init_and_parse, but only keeps a fixed-size
+//   stack of open elements and namespace prefixes.
+//
+//
+// To detect changes between docs:
+// -------------------------------
+//
+//   Every node can be given a hash of its subtree in one pass with
+//
+//     cd_xml_hash_t* hashes = malloc(sizeof(cd_xml_hash_t) * cd_xml_doc_node_count(doc));
+//     cd_xml_hash_subtrees(doc, hashes);
+//
+//   and nodes with equal hashes, also in different docs, have equal
+//   subtrees, so unchanged parts can be found or skipped without
+//   serializing and comparing them. hashes[0] covers the whole doc.
+//
+//   To ship only what changed, an edit script that turns doc a into doc b
+//   is computed with
+//
+//     cd_xml_doc_t* script = cd_xml_diff(a, b);
+//
+//   The script is itself a doc, so it can be sent with cd_xml_write and
+//   parsed on the other end, where it is applied to a doc equal to a with
+//
+//     cd_xml_patch(doc, script);
+//
+//   The ops of the script follow the elements that changed, starting with
+//   the children of <patch> for the root. Ops walk the children of their
+//   element in order: <keep n="2"/> skips and <delete n="2"/> removes two
+//   children, <insert> inserts its own children, <edit> applies its ops to
+//   the next child element and <text> replaces the next text. <set> and
+//   <unset> add, update or remove the attributes they carry, and <rename>
+//   gives the element the name of its child. Children after the last op
+//   are kept, e.g.:
+//
+//     <patch><keep n="41"/><edit><set v="2"/></edit><insert><x/></insert></patch>
+//
+//
+// Thread safety
+// -------------
+//
+//   The library has no mutable global state: the only statics are constant
+//   tables, and the stats binding of CD_XML_ENABLE_STATS is thread-local.
+//   Thus different docs can be parsed, built, written and freed concurrently
+//   from different threads, and a doc that is not modified can be read and
+//   written from several threads at once. Custom CD_XML_MALLOC and friends,
+//   as well as allocators passed via cd_xml_allocator_t that are shared
+//   between docs, must be thread-safe for this.
+//
+//   For batches of independent messages, cd_xml_parse_batch parses them over
+//   a work-stealing thread pool:
+//
+//     cd_xml_stringview_t inputs[N] = ...;
+//     cd_xml_doc_t* docs[N];
+//     cd_xml_parse_status_t statuses[N];
+//     bool ok = cd_xml_parse_batch(inputs, N, CD_XML_FLAGS_NONE, docs, statuses, 0);
+//
+//
+// Statistics
+// ----------
+//
+//   Define CD_XML_ENABLE_STATS (both when building the implementation and
+//   when including the header) to have the parser and writers count tokens,
+//   nodes, entity decodes, copies, allocations and output calls, as well as
+//   cycles spent per phase, into a cd_xml_stats_t:
+//
+//     cd_xml_stats_t stats = { 0 };
+//     cd_xml_stats_bind(&stats);
+//     rv = cd_xml_init_and_parse(&doc, xml, strlen(xml), CD_XML_FLAGS_NONE);
+//     cd_xml_stats_bind(NULL);
+//
+//   Stats are bound per thread. Work done by the worker threads of
+//   cd_xml_parse_batch and cd_xml_write_parallel is added to the stats bound
+//   on the calling thread when they finish, cycles are then summed over all
+//   threads. Without CD_XML_ENABLE_STATS, all counting is compiled out.
+//
+//
+// Limits
+// ------
+//
+//   Node, attribute and namespace indices are 32-bit by default, so a doc can
+//   hold up to 2^32-2 of each. Define CD_XML_LARGE (both when building the
+//   implementation and when including the header) to switch to 64-bit
+//   indices. Binary snapshots record the index width and only load in a
+//   build with matching width.
+//
+//   When an array hits the index limit, parsing fails with
+//   CD_XML_STATUS_LIMIT_EXCEEDED, and CD_XML_STATUS_OUT_OF_MEMORY is returned
+//   when an allocation fails. The cd_xml_add_* functions return cd_xml_no_ix
+//   in both cases.
+//
+//
 // To traverse the doc via visitors:
 // ---------------------------------
 //
@@ -127,6 +318,27 @@
 //   which is just the doc, clientdata and callbacks. Everything except the doc
 //   may be NULL.
 //
+//   The callbacks above are invoked through function pointers. To get them
+//   inlined into the traversal, use CD_XML_DEFINE_VISITOR to expand a
+//   traversal function at compile time:
+//
+//     cd_xml_visit_result_t enter(void* userdata,
+//                                 cd_xml_doc_t* doc,
+//                                 cd_xml_node_ix_t elem);
+//
+//     CD_XML_DEFINE_VISITOR(my_visit,
+//                           enter,
+//                           cd_xml_visit_noop_elem_exit,
+//                           cd_xml_visit_noop_attribute,
+//                           cd_xml_visit_noop_text)
+//
+//     my_visit(doc, clientdata);
+//
+//   Here elem_enter returns CD_XML_VISIT_CONTINUE to descend into the element,
+//   CD_XML_VISIT_SKIP_SUBTREE to skip its attributes, children and exit
+//   callback, or CD_XML_VISIT_STOP to abort the traversal. The other callbacks
+//   return false to abort. cd_xml.hpp has a templated equivalent, cd_xml::visit.
+//
 //
 // To create XML via API
 // ---------------------
@@ -171,6 +383,13 @@
 //      quux
 //    </foo>
 //
+//  Existing docs can be edited in place. Since nodes only link to their
+//  next sibling, the parent is passed along:
+//
+//    cd_xml_move_node(doc, foo, bar, foo, cd_xml_no_ix);  // Move bar last.
+//    cd_xml_remove_node(doc, foo, bar);                   // Detach bar.
+//    cd_xml_compact(doc);                                 // Reclaim bar.
+//
 //
 // To traverse the doc directly:
 // -----------------------------
@@ -193,6 +412,12 @@
 //
 //   Attributes are key-value pairs attached to elements.
 //
+//   Use cd_xml_doc_node, cd_xml_doc_attribute, cd_xml_doc_node_count and
+//   cd_xml_doc_attribute_count to get at nodes and attributes, as these also
+//   work when the doc is built with CD_XML_SEGMENTED, where nodes and
+//   attributes live in fixed-size blocks with stable addresses instead of
+//   single arrays.
+//
 // Revision history:
 // =================
 //
@@ -211,21 +436,32 @@ extern "C" {
 #include <stdbool.h>
 #include <string.h>
 
-typedef uint32_t cd_xml_ns_ix_t;
+#ifndef _WIN32
+#include <sys/uio.h>
+#endif
+
+// Define CD_XML_LARGE to use 64-bit indices for docs with more than 4 billion nodes or attributes.
+#ifdef CD_XML_LARGE
+typedef uint64_t cd_xml_ix_t;
+#else
+typedef uint32_t cd_xml_ix_t;
+#endif
+
+typedef cd_xml_ix_t cd_xml_ns_ix_t;
 
-typedef uint32_t cd_xml_att_ix_t;
+typedef cd_xml_ix_t cd_xml_att_ix_t;
 
-typedef uint32_t cd_xml_node_ix_t;
+typedef cd_xml_ix_t cd_xml_node_ix_t;
 
-static const uint32_t cd_xml_no_ix = (uint32_t)-1;
+static const cd_xml_ix_t cd_xml_no_ix = (cd_xml_ix_t)-1;
 
 
 // Stretchy-buf helpers
-#define cd_xml__sb_base(a) ((unsigned*)(a)-2)
+#define cd_xml__sb_base(a) ((cd_xml_ix_t*)(a)-2)
 #define cd_xml__sb_size(a) (cd_xml__sb_base(a)[0])
 
 // Get count of a stretchy-buf variable
-#define cd_xml_sb_size(a) ((a)?cd_xml__sb_size(a):0u)
+#define cd_xml_sb_size(a) ((a)?cd_xml__sb_size(a):(cd_xml_ix_t)0)
 
 // A non-owned view of a string.
 typedef struct {
@@ -251,25 +487,74 @@ typedef enum {
 typedef enum
 {
     CD_XML_FLAGS_NONE           = 0,                        // None
-    CD_XML_FLAGS_COPY_STRINGS   = 1                         // Make copies of all strings passed to library.
+    CD_XML_FLAGS_COPY_STRINGS   = 1,                        // Make copies of all strings passed to library.
+    CD_XML_FLAGS_NO_CHECKSUM    = 2,                        // Do not verify checksum when loading a binary snapshot.
+    CD_XML_FLAGS_TAG_BASE64     = 4                         // Set CD_XML_TEXT_BASE64 on large text nodes that look like base64.
 } cd_xml_flags_t;
 
+// Specifies properties of a text node
+typedef enum
+{
+    CD_XML_TEXT_NONE            = 0,                        // None
+    CD_XML_TEXT_BASE64          = 1,                        // Text looks like base64, set by parser when passed CD_XML_FLAGS_TAG_BASE64.
+    CD_XML_TEXT_CDATA           = 2                         // Text is written as CDATA, set by parser on CDATA sections.
+} cd_xml_text_flags_t;
+
+// Define CD_XML_CDATA_MIN_SIZE to have the writers emit text of at least this size as CDATA instead of escaping
+// it, when at least one in CD_XML_CDATA_ESCAPE_RATIO bytes would need escaping. Disabled by default.
+#ifndef CD_XML_CDATA_MIN_SIZE
+#define CD_XML_CDATA_MIN_SIZE SIZE_MAX
+#endif
+#ifndef CD_XML_CDATA_ESCAPE_RATIO
+#define CD_XML_CDATA_ESCAPE_RATIO 16
+#endif
+
+// Define CD_XML_BASE64_TAG_MIN_SIZE to set the minimum size of text nodes tagged by CD_XML_FLAGS_TAG_BASE64.
+
+#ifndef CD_XML_BASE64_TAG_MIN_SIZE
+#define CD_XML_BASE64_TAG_MIN_SIZE 256
+#endif
+
 // Specifies result of parsing
 typedef enum
 {
     CD_XML_STATUS_SUCCESS = 0,                              // Successful parsing.
     CD_XML_STATUS_POINTER_NOT_NULL,                         // doc-pointer passed to parser was not NULL.
     CD_XML_STATUS_UNKNOWN_NAMESPACE_PREFIX,                 // Element or attribute with namespace prefix that hasn't been defined.
-    CD_XML_STATUS_UNSUPPORTED_VERSION,                      // XML version is not 1.0.
-    CD_XML_STATUS_UNSUPPORTED_ENCODING,                     // XML encoding is not ASCII or UTF-8
+    CD_XML_STATUS_UNSUPPORTED_VERSION,                      // XML version is not 1.0, or unsupported binary snapshot version.
+    CD_XML_STATUS_UNSUPPORTED_ENCODING,                     // XML encoding is not UTF-8, ASCII, ISO-8859-1 or UTF-16.
     CD_XML_STATUS_MALFORMED_UTF8,                           // Illegal UTF-8 encoding encountered.
     CD_XML_STATUS_MALFORMED_ATTRIBUTE,                      // Error while parsing an attribute.
     CD_XML_STATUS_PREMATURE_EOF,                            // Encountered end-of-buffer before parsing was done.
     CD_XML_STATUS_MALFORMED_DECLARATION,                    // Error in the initial XML declaration.
     CD_XML_STATUS_UNEXPECTED_TOKEN,                         // Encountered unexpected token.
-    CD_XML_STATUS_MALFORMED_ENTITY                          // Error while parsing an entity.
+    CD_XML_STATUS_MALFORMED_ENTITY,                         // Error while parsing an entity.
+    CD_XML_STATUS_MALFORMED_BINARY,                         // Binary snapshot is truncated or inconsistent.
+    CD_XML_STATUS_CHECKSUM_MISMATCH,                        // Binary snapshot checksum does not match contents.
+    CD_XML_STATUS_OUT_OF_MEMORY,                            // Memory allocation failed.
+    CD_XML_STATUS_LIMIT_EXCEEDED,                           // Doc has too many items for index type, see CD_XML_LARGE.
+    CD_XML_STATUS_MALFORMED_UTF16,                          // Odd-sized UTF-16 input or unpaired surrogate.
+    CD_XML_STATUS_INPUT_ERROR                               // Input callback of record reader failed.
 } cd_xml_parse_status_t;
 
+// Allocator used for all memory owned by a doc, zero-initialize to use CD_XML_MALLOC, CD_XML_REALLOC and CD_XML_FREE.
+//
+// Sizes passed to realloc_func and free_func are the sizes of the original allocations.
+typedef struct {
+    void*                     (*alloc_func)(void* context, size_t size);                          // Allocate memory.
+    void*                     (*realloc_func)(void* context, void* ptr, size_t old_size, size_t new_size);  // Resize allocation, ptr may be NULL.
+    void                      (*free_func)(void* context, void* ptr, size_t size);                // Release allocation.
+    void*                       context;                    // Passed to the allocator functions.
+} cd_xml_allocator_t;
+
+// Optional parameters for cd_xml_init_and_parse_ex, zero-initialize for defaults.
+typedef struct {
+    const char* const*          keep_paths;                 // If non-NULL, only keep elements matching these paths, see cd_xml_init_and_parse_ex.
+    size_t                      keep_path_count;            // Number of paths in keep_paths.
+    const cd_xml_allocator_t*   allocator;                  // If non-NULL, allocator for doc and parser scratch.
+    bool                        lazy;                       // Only build the root element, see cd_xml_expand.
+} cd_xml_parse_options_t;
+
 // Holds data of an element
 typedef struct {                                            // Element data
     cd_xml_stringview_t name;                               // Element name.
@@ -283,6 +568,7 @@ typedef struct {                                            // Element data
 // Holds data of text 
 typedef struct {                                            // Text data
     cd_xml_stringview_t content;                           // Text contents
+    cd_xml_text_flags_t flags;                             // Text properties
 } node_text_t;
 
 // Holds data of a node, that is, an element or text.
@@ -301,23 +587,212 @@ typedef struct  {
     cd_xml_stringview_t         uri;                        // URI of namespace.
 } cd_xml_ns_t;
 
+// 128-bit content hash of a subtree, see cd_xml_hash_subtrees.
+typedef struct {
+    uint64_t                    lo;                         // Low 64 bits, usable as a hash on its own.
+    uint64_t                    hi;                         // High 64 bits.
+} cd_xml_hash_t;
+
 // Header of memory allocated, stored in a linked list out of cd_xml_doc._t.allocated_buffers.
 typedef struct cd_xml_buf_struct {
     struct cd_xml_buf_struct*   next;                       // Next allocated buffer or NULL.
+    size_t                      size;                       // Size of payload in bytes.
     char                        payload;                    // Offset of payload data.
 } cd_xml_buf_t;
 
+// Define CD_XML_SEGMENTED to store nodes and attributes in fixed-size blocks instead of single arrays.
+//
+// Blocks are never moved, so growing a doc does not copy existing items and does not need old plus new
+// capacity at the same time. Items are accessed using cd_xml_doc_node and cd_xml_doc_attribute in both
+// layouts. Define CD_XML_SEGMENT_SHIFT to set the number of items per block as a power of two.
+#ifndef CD_XML_SEGMENT_SHIFT
+#define CD_XML_SEGMENT_SHIFT 12
+#endif
+#define CD_XML_SEGMENT_SIZE ((cd_xml_ix_t)1 << CD_XML_SEGMENT_SHIFT)
+
 // XML DOM representation
 typedef struct {
     cd_xml_ns_t*                namespaces;                 // Array of namespaces, stretchy buf, count using cd_xml_sb_size.
-    cd_xml_node_t*              nodes;                      // Array of nodes, stretchy buf, count using cd_xml_sb_size.
-    cd_xml_attribute_t*         attributes;                 // Array of attributes, stretchy buf, count usng cd_xml_sb_size.
+#ifdef CD_XML_SEGMENTED
+    cd_xml_node_t**             node_blocks;                // Blocks of CD_XML_SEGMENT_SIZE nodes, stretchy buf.
+    cd_xml_attribute_t**        attribute_blocks;           // Blocks of CD_XML_SEGMENT_SIZE attributes, stretchy buf.
+    cd_xml_ix_t                 node_count;                 // Number of nodes, use cd_xml_doc_node_count.
+    cd_xml_ix_t                 attribute_count;            // Number of attributes, use cd_xml_doc_attribute_count.
+#else
+    cd_xml_node_t*              nodes;                      // Array of nodes, stretchy buf, count using cd_xml_doc_node_count.
+    cd_xml_attribute_t*         attributes;                 // Array of attributes, stretchy buf, count using cd_xml_doc_attribute_count.
+#endif
     cd_xml_buf_t*               allocated_buffers;          // Backing for modifieds strings.
+    cd_xml_buf_t*               arena;                      // Buffer in allocated_buffers kept by clearing for reuse, or NULL.
+    size_t                      arena_used;                 // Bytes of arena handed out since it was kept.
+    cd_xml_allocator_t          allocator;                  // Allocator for everything owned by doc.
+    struct cd_xml_lazy_struct*  lazy;                       // Structural index and unexpanded elements if parsed lazily, otherwise NULL.
 } cd_xml_doc_t;
 
+#ifdef CD_XML_SEGMENTED
+#define cd_xml_doc_node(doc,ix) (&(doc)->node_blocks[(ix) >> CD_XML_SEGMENT_SHIFT][(ix) & (CD_XML_SEGMENT_SIZE - 1)])
+#define cd_xml_doc_attribute(doc,ix) (&(doc)->attribute_blocks[(ix) >> CD_XML_SEGMENT_SHIFT][(ix) & (CD_XML_SEGMENT_SIZE - 1)])
+#define cd_xml_doc_node_count(doc) ((doc)->node_count)
+#define cd_xml_doc_attribute_count(doc) ((doc)->attribute_count)
+#else
+// Get pointer to a node of a doc from its index.
+#define cd_xml_doc_node(doc,ix) (&(doc)->nodes[ix])
+// Get pointer to an attribute of a doc from its index.
+#define cd_xml_doc_attribute(doc,ix) (&(doc)->attributes[ix])
+// Get number of nodes in a doc.
+#define cd_xml_doc_node_count(doc) cd_xml_sb_size((doc)->nodes)
+// Get number of attributes in a doc.
+#define cd_xml_doc_attribute_count(doc) cd_xml_sb_size((doc)->attributes)
+#endif
+
+// Memory usage of one of the arrays of a doc.
+typedef struct {
+    size_t                      count;                      // Number of items in use.
+    size_t                      capacity;                   // Number of items allocated.
+    size_t                      bytes_used;                 // Bytes of items in use.
+    size_t                      bytes_allocated;            // Bytes allocated, including stretchy-buf header.
+} cd_xml_memory_usage_t;
+
+// Breakdown of memory used by a doc, see cd_xml_doc_memory.
+typedef struct {
+    cd_xml_memory_usage_t       nodes;                      // Node array.
+    cd_xml_memory_usage_t       attributes;                 // Attribute array.
+    cd_xml_memory_usage_t       namespaces;                 // Namespace array.
+    cd_xml_memory_usage_t       strings;                    // Owned strings, count and capacity is the number of buffers.
+    size_t                      bytes_used;                 // Sum of bytes_used, including the doc struct.
+    size_t                      bytes_allocated;            // Sum of bytes_allocated, including the doc struct.
+} cd_xml_memory_report_t;
+
 // Callback function for consuming output from writer
 typedef bool (*cd_xml_output_func)(void* userdata, const char* ptr, size_t bytes);
 
+// Callback function for producing input to record reader, reads at most bytes into ptr.
+//
+// Returns the number of bytes read, 0 at end of input, or negative on error.
+typedef ptrdiff_t (*cd_xml_input_func)(void* userdata, char* ptr, size_t bytes);
+
+// Define CD_XML_RECORD_READER_CHUNK_SIZE to set the minimum number of bytes the record reader reads at a time.
+#ifndef CD_XML_RECORD_READER_CHUNK_SIZE
+#define CD_XML_RECORD_READER_CHUNK_SIZE 65536
+#endif
+
+// Streaming reader that yields the elements at a given depth as separate docs, see cd_xml_record_reader_init.
+typedef struct cd_xml_record_reader_struct cd_xml_record_reader_t;
+
+// Define CD_XML_VALIDATE_MAX_DEPTH to set the maximum element nesting depth cd_xml_validate can check.
+#ifndef CD_XML_VALIDATE_MAX_DEPTH
+#define CD_XML_VALIDATE_MAX_DEPTH 512
+#endif
+
+// Define CD_XML_VALIDATE_MAX_NAMESPACES to set the maximum number of namespace prefixes cd_xml_validate can keep in scope.
+#ifndef CD_XML_VALIDATE_MAX_NAMESPACES
+#define CD_XML_VALIDATE_MAX_NAMESPACES 64
+#endif
+
+#ifdef CD_XML_ENABLE_STATS
+
+// Phases with cycle counts in cd_xml_stats_t, entity decoding and namespace resolution are included in parse.
+typedef enum {
+    CD_XML_PHASE_PARSE = 0,                                 // Everything in cd_xml_init_and_parse[_ex].
+    CD_XML_PHASE_ENTITIES,                                  // Decoding of text and attribute values with entities.
+    CD_XML_PHASE_NAMESPACES,                                // Resolving namespace prefixes.
+    CD_XML_PHASE_WRITE,                                     // Everything in cd_xml_write[_parallel] and cd_xml_save_binary.
+    CD_XML_PHASE_COUNT
+} cd_xml_phase_t;
+
+// Counters filled by parser and writer when bound with cd_xml_stats_bind, all are accumulated.
+typedef struct {
+    uint64_t                    tokens;                     // Tokens produced by tokenizer.
+    uint64_t                    nodes;                      // Element and text nodes added.
+    uint64_t                    attributes;                 // Attributes added.
+    uint64_t                    namespaces;                 // Namespaces added.
+    uint64_t                    entity_decodes;             // Entities and character references decoded.
+    uint64_t                    bytes_copied;               // Bytes copied into doc-owned strings.
+    uint64_t                    arena_allocs;               // Buffers added to doc's allocated_buffers.
+    uint64_t                    arena_bytes;                // Payload bytes of buffers added to allocated_buffers.
+    uint64_t                    sb_reallocs;                // Stretchy-buf reallocations.
+    uint64_t                    output_calls;               // Output callback invocations.
+    uint64_t                    output_bytes;               // Bytes passed to output callbacks.
+    uint64_t                    cycles[CD_XML_PHASE_COUNT]; // Cycle counts (or ticks) spent per phase.
+} cd_xml_stats_t;
+
+// Bind stats to the calling thread, NULL to unbind.
+//
+// Worker threads of cd_xml_parse_batch and cd_xml_write_parallel count into stats of their own, which are added
+// to the stats of the calling thread when the workers are joined.
+//
+// Returns the previously bound stats.
+cd_xml_stats_t* cd_xml_stats_bind(cd_xml_stats_t* stats);
+
+#endif
+
+// Define CD_XML_WRITER_BUFFER_SIZE, CD_XML_WRITER_MAX_DEPTH, and CD_XML_WRITER_MAX_NAMESPACES to tune the streaming writer.
+
+#ifndef CD_XML_WRITER_BUFFER_SIZE
+#define CD_XML_WRITER_BUFFER_SIZE 4096
+#endif
+
+#ifndef CD_XML_WRITER_MAX_DEPTH
+#define CD_XML_WRITER_MAX_DEPTH 64
+#endif
+
+#ifndef CD_XML_WRITER_MAX_NAMESPACES
+#define CD_XML_WRITER_MAX_NAMESPACES 16
+#endif
+
+#ifndef _WIN32
+
+// Define CD_XML_FD_SINK_IOVECS, CD_XML_FD_SINK_STAGING_SIZE, and CD_XML_FD_SINK_COPY_THRESHOLD to tune the file-descriptor sink.
+
+#ifndef CD_XML_FD_SINK_IOVECS
+#define CD_XML_FD_SINK_IOVECS 64
+#endif
+
+#ifndef CD_XML_FD_SINK_STAGING_SIZE
+#define CD_XML_FD_SINK_STAGING_SIZE 4096
+#endif
+
+#ifndef CD_XML_FD_SINK_COPY_THRESHOLD
+#define CD_XML_FD_SINK_COPY_THRESHOLD 32
+#endif
+
+// File-descriptor sink that gathers output fragments into an iovec batch written with writev.
+//
+// Fragments shorter than CD_XML_FD_SINK_COPY_THRESHOLD are copied into a staging buffer, while longer
+// fragments are referenced in place and must stay valid until the next flush.
+typedef struct {
+    int                         fd;                         // File descriptor to write to.
+    unsigned                    iov_count;                  // Number of iovecs in batch.
+    size_t                      staged;                     // Number of bytes used in staging buffer.
+    bool                        ok;                         // False if any write has failed.
+    struct iovec                iov[CD_XML_FD_SINK_IOVECS]; // Batch of fragments.
+    char                        staging[CD_XML_FD_SINK_STAGING_SIZE];   // Backing for copied fragments.
+} cd_xml_fd_sink_t;
+
+#endif
+
+// Currently open element of streaming writer, used by cd_xml_writer_t.stack.
+typedef struct {
+    cd_xml_stringview_t         name;                       // Element name, must stay alive until element is ended.
+    cd_xml_ns_ix_t              namespace_ix;               // Index of element namespace, cd_xml_no_ix for no namespace.
+} cd_xml_writer_elem_t;
+
+// Streaming XML writer, writes XML directly to an output callback without building a doc.
+typedef struct {
+    cd_xml_output_func          output_func;                // Output callback.
+    void*                       userdata;                   // Userdata passed to output callback.
+    cd_xml_ns_t                 namespaces[CD_XML_WRITER_MAX_NAMESPACES];   // Namespaces, declared on root element.
+    unsigned                    namespace_count;            // Number of namespaces registered.
+    cd_xml_writer_elem_t        stack[CD_XML_WRITER_MAX_DEPTH]; // Stack of open elements.
+    unsigned                    depth;                      // Number of open elements.
+    size_t                      fill;                       // Number of bytes in buffer.
+    bool                        pretty;                     // Pretty-print output.
+    bool                        tag_open;                   // Start tag of innermost element is not yet closed with '>'.
+    bool                        has_root;                   // Root element has been started.
+    bool                        ok;                         // False if any error has occurred.
+    char                        buffer[CD_XML_WRITER_BUFFER_SIZE];  // Output buffer.
+} cd_xml_writer_t;
+
 // Visitor callback functions
 
 typedef bool(*cd_xml_visit_elem_enter)(void* userdata, cd_xml_doc_t* doc, cd_xml_ns_ix_t namespace_ix, cd_xml_stringview_t* name);
@@ -325,13 +800,83 @@ typedef bool(*cd_xml_visit_elem_exit)(void* userdata, cd_xml_doc_t* doc, cd_xml_
 typedef bool(*cd_xml_visit_attribute)(void* userdata, cd_xml_doc_t* doc, cd_xml_ns_ix_t namespace_ix, cd_xml_stringview_t* name, cd_xml_stringview_t* value);
 typedef bool(*cd_xml_visit_text)(void* userdata, cd_xml_doc_t* doc, cd_xml_stringview_t* text);
 
+// Result of elem_enter callback of statically dispatched visitors.
+typedef enum {
+    CD_XML_VISIT_CONTINUE = 0,                              // Visit attributes and children of element.
+    CD_XML_VISIT_SKIP_SUBTREE,                              // Skip attributes, children and exit callback of element.
+    CD_XML_VISIT_STOP                                       // Abort traversal.
+} cd_xml_visit_result_t;
+
+// No-op callbacks for CD_XML_DEFINE_VISITOR.
+static inline cd_xml_visit_result_t cd_xml_visit_noop_elem_enter(void* userdata, cd_xml_doc_t* doc, cd_xml_node_ix_t elem) { (void)userdata; (void)doc; (void)elem; return CD_XML_VISIT_CONTINUE; }
+static inline bool cd_xml_visit_noop_elem_exit(void* userdata, cd_xml_doc_t* doc, cd_xml_node_ix_t elem) { (void)userdata; (void)doc; (void)elem; return true; }
+static inline bool cd_xml_visit_noop_attribute(void* userdata, cd_xml_doc_t* doc, cd_xml_att_ix_t attribute) { (void)userdata; (void)doc; (void)attribute; return true; }
+static inline bool cd_xml_visit_noop_text(void* userdata, cd_xml_doc_t* doc, cd_xml_node_ix_t text) { (void)userdata; (void)doc; (void)text; return true; }
+
+// Define a static traversal function 'name' with the callbacks called directly, i.e. inlinable.
+//
+// Callbacks must have these signatures:
+//   cd_xml_visit_result_t elem_enter(void* userdata, cd_xml_doc_t* doc, cd_xml_node_ix_t elem);
+//   bool elem_exit(void* userdata, cd_xml_doc_t* doc, cd_xml_node_ix_t elem);
+//   bool attribute(void* userdata, cd_xml_doc_t* doc, cd_xml_att_ix_t attribute);
+//   bool text(void* userdata, cd_xml_doc_t* doc, cd_xml_node_ix_t text);
+//
+// The defined function has the signature bool name(cd_xml_doc_t* doc, void* userdata), and
+// returns false if the traversal was aborted.
+#define CD_XML_DEFINE_VISITOR(name, elem_enter, elem_exit, attribute, text)                      \
+static bool name##_recurse(cd_xml_doc_t* doc, void* userdata, cd_xml_node_ix_t elem_ix)          \
+{                                                                                                \
+    cd_xml_visit_result_t result = elem_enter(userdata, doc, elem_ix);                           \
+    if (result == CD_XML_VISIT_STOP) return false;                                               \
+    if (result == CD_XML_VISIT_SKIP_SUBTREE) return true;                                        \
+    cd_xml_att_ix_t att_ix = cd_xml_doc_node(doc, elem_ix)->data.element.first_attribute;        \
+    while (att_ix != cd_xml_no_ix) {                                                             \
+        if (!attribute(userdata, doc, att_ix)) return false;                                     \
+        att_ix = cd_xml_doc_attribute(doc, att_ix)->next_attribute;                              \
+    }                                                                                            \
+    cd_xml_node_ix_t child_ix = cd_xml_doc_node(doc, elem_ix)->data.element.first_child;         \
+    while (child_ix != cd_xml_no_ix) {                                                           \
+        if (cd_xml_doc_node(doc, child_ix)->kind == CD_XML_NODE_ELEMENT) {                       \
+            if (!name##_recurse(doc, userdata, child_ix)) return false;                          \
+        }                                                                                        \
+        else if (!text(userdata, doc, child_ix)) return false;                                   \
+        child_ix = cd_xml_doc_node(doc, child_ix)->next_sibling;                                 \
+    }                                                                                            \
+    return elem_exit(userdata, doc, elem_ix);                                                    \
+}                                                                                                \
+static bool name(cd_xml_doc_t* doc, void* userdata)                                              \
+{                                                                                                \
+    if (doc == NULL) return false;                                                               \
+    if (cd_xml_doc_node_count(doc) == 0) return true;                                            \
+    return name##_recurse(doc, userdata, 0);                                                     \
+}
+
 
 // Initialize a doc for building hierarchy via API
 cd_xml_doc_t* cd_xml_init(void);
 
+// Initialize a doc that uses a custom allocator for everything it owns, allocator is copied.
+cd_xml_doc_t* cd_xml_init_ex(const cd_xml_allocator_t* allocator);         // Allocator, NULL for default.
+
 // Free a doc and its resources.
 void cd_xml_free(cd_xml_doc_t** doc);
 
+// Report memory used by a doc, both in use and allocated.
+//
+// Memory referenced by the doc but not owned by it, like the input buffer when parsing without
+// CD_XML_FLAGS_COPY_STRINGS, is not included.
+void cd_xml_doc_memory(const cd_xml_doc_t*      doc,                    // XML doc.
+                       cd_xml_memory_report_t*  report);                // Report to fill in.
+
+// Trim slack from a doc that is to be kept around.
+//
+// Reallocates the node, attribute and namespace arrays to their exact size and moves all owned
+// strings into a single buffer, with CD_XML_SEGMENTED, blocks are kept whole. Pointers into the
+// arrays and into owned strings are invalidated, indices stay the same. Adding to the doc
+// afterwards works as normal. Strings are left in place while a lazily parsed doc has unexpanded
+// elements, as those still refer to the input buffer.
+void cd_xml_shrink_to_fit(cd_xml_doc_t* doc);
+
 // Register a new namespace.
 //
 // returns an index that can be used when creating elements and attributes.
@@ -369,6 +914,97 @@ cd_xml_node_ix_t cd_xml_add_text(cd_xml_doc_t*        doc,              // XML d
                                  cd_xml_node_ix_t     parent,           // Element to which the text is a child
                                  cd_xml_flags_t       flags);
 
+// Detach a node and its subtree from its parent.
+//
+// Nodes have no parent link, so the parent must be given, and finding the node among the children
+// of parent is linear in the number of preceding siblings. The root cannot be removed. The node
+// keeps its index and can be put back with cd_xml_insert_before, otherwise its slots are left as
+// tombstones until cd_xml_compact.
+//
+// Returns false if node is not a child of parent.
+bool cd_xml_remove_node(cd_xml_doc_t*       doc,                        // XML doc.
+                        cd_xml_node_ix_t    parent,                     // Element that node is a child of.
+                        cd_xml_node_ix_t    node);                      // Node to detach.
+
+// Detach an attribute from an element, its slot is left as a tombstone until cd_xml_compact.
+//
+// Returns false if attribute does not belong to element.
+bool cd_xml_remove_attribute(cd_xml_doc_t*      doc,                    // XML doc.
+                             cd_xml_node_ix_t   element,                // Element that has the attribute.
+                             cd_xml_att_ix_t    attribute);             // Attribute to detach.
+
+// Insert a detached node, see cd_xml_remove_node, as a child of parent.
+//
+// Checking that node is not an ancestor of parent walks the subtree of node. Checking that node is
+// not attached elsewhere would scan the whole doc, so only debug builds assert on that.
+//
+// Returns false if before is not a child of parent, node still has a next sibling, or parent is
+// node or inside its subtree.
+bool cd_xml_insert_before(cd_xml_doc_t*     doc,                        // XML doc.
+                          cd_xml_node_ix_t  parent,                     // Element to insert into.
+                          cd_xml_node_ix_t  before,                     // Child of parent to insert before, cd_xml_no_ix to append.
+                          cd_xml_node_ix_t  node);                      // Detached node to insert.
+
+// Move a node and its subtree to a new parent, same as cd_xml_remove_node followed by cd_xml_insert_before.
+//
+// Returns false if node is not a child of parent, before is not a child of new_parent, or new_parent
+// is node or inside its subtree, in which case node is left where it was.
+bool cd_xml_move_node(cd_xml_doc_t*     doc,                            // XML doc.
+                      cd_xml_node_ix_t  parent,                         // Current parent of node.
+                      cd_xml_node_ix_t  node,                           // Node to move.
+                      cd_xml_node_ix_t  new_parent,                     // Element to move node into.
+                      cd_xml_node_ix_t  before);                        // Child of new_parent to insert before, cd_xml_no_ix to append.
+
+// Drop tombstones and renumber nodes and attributes densely in document order.
+//
+// After edits, indices no longer follow document order and detached nodes and attributes still take
+// up space. Compaction rebuilds the arrays so that nodes are in pre-order and attributes in order of
+// their elements, which is the layout the parser produces. All node and attribute indices change,
+// except the root which stays 0, while namespaces and strings are untouched.
+//
+// Returns false if memory allocation failed or a lazily parsed doc has unexpanded elements, in which
+// case the doc is left unchanged.
+bool cd_xml_compact(cd_xml_doc_t* doc);
+
+// Compute a content hash of the subtree of every node.
+//
+// The hash of a text node covers its content, and the hash of an element covers its local name, namespace
+// URI, attributes and the hashes of its children in order. Namespace prefixes, the order of attributes and
+// whether text was CDATA do not matter, so equal hashes mean the subtrees are equal as XML with overwhelming
+// probability. The hash is not cryptographic and should not be trusted for adversarial input. When every
+// child has a higher index than its parent, as after parsing or cd_xml_compact, all nodes are hashed in one
+// pass from the end of the node array, otherwise the subtree of the root is walked recursively and the
+// entries of detached nodes are left zero.
+//
+// Returns false if a lazily parsed doc has unexpanded elements.
+bool cd_xml_hash_subtrees(const cd_xml_doc_t*   doc,                    // XML doc.
+                          cd_xml_hash_t*        out);                   // Array of cd_xml_doc_node_count(doc) hashes to receive the hash of each node.
+
+// Compute an edit script that turns doc a into doc b, see cd_xml_patch.
+//
+// Children are matched by subtree hash, see cd_xml_hash_subtrees, first by trimming equal children from both
+// ends, then by using children whose hash occurs exactly once among the remaining children on both sides as
+// anchors. Children between anchors are paired in order if they are text or elements with the same name and
+// the same values of the key attributes id, key and name, and paired elements are diffed recursively. The
+// script is a doc of its own with root element <patch>, see "To detect changes between docs", and only holds
+// the parts of b that changed.
+//
+// Returns the script, to be released with cd_xml_free, or NULL if memory allocation failed, either doc is
+// empty or a lazily parsed doc has unexpanded elements.
+cd_xml_doc_t* cd_xml_diff(const cd_xml_doc_t*   a,                      // Doc to diff from.
+                          const cd_xml_doc_t*   b);                     // Doc to diff to.
+
+// Apply an edit script from cd_xml_diff to a doc equal to the doc the script was computed from.
+//
+// Deleted nodes are detached as with cd_xml_remove_node and left as tombstones until cd_xml_compact, and
+// inserted nodes and strings are copied into doc, with namespaces matched by URI. Work is proportional to the
+// size of the script plus the number of children skipped by keep ops.
+//
+// Returns false if memory allocation failed or the script does not fit doc, in which case doc may be left
+// partially patched.
+bool cd_xml_patch(cd_xml_doc_t*         doc,                            // XML doc to patch.
+                  const cd_xml_doc_t*   script);                        // Edit script from cd_xml_diff.
+
 // Parse XML and build a doc
 //
 // Returns CD_XML_STATUS_SUCCESS if everything went well.
@@ -377,14 +1013,221 @@ cd_xml_parse_status_t cd_xml_init_and_parse(cd_xml_doc_t**  doc,        // Point
                                             size_t          size,       // Size of XML data
                                             cd_xml_flags_t  flags);
 
+// Parse XML with additional options and build a doc
+//
+// If options->keep_paths is set, only the parts of the doc that match one of the paths are kept. A path is
+// a sequence of '/'-separated local element names starting at the root, like "catalog/book/title", where
+// "*" matches any name. Elements matching a path are kept with their entire subtree, while their ancestors
+// are kept with attributes but without text. Subtrees that cannot match are skipped with a fast scan that
+// only tracks nesting, comments and quotes, and no nodes are created and no entities decoded for them.
+// Note that the contents of skipped subtrees are not checked for well-formedness.
+//
+// If options->lazy is set, the input is indexed and only the root element with its attributes is built,
+// see cd_xml_expand. It cannot be combined with keep_paths. An unexpanded element looks childless when
+// navigating the doc, so expand elements before accessing their children. Writing, saving, hashing,
+// diffing, patching and compacting refuse docs that still have unexpanded elements.
+//
+// Returns CD_XML_STATUS_SUCCESS if everything went well.
+cd_xml_parse_status_t cd_xml_init_and_parse_ex(cd_xml_doc_t**                  doc,        // Pointer to a doc-pointer to NULL
+                                               const char*                     data,       // Pointer to XML data
+                                               size_t                          size,       // Size of XML data
+                                               cd_xml_flags_t                  flags,
+                                               const cd_xml_parse_options_t*   options);   // Options, NULL for defaults.
+
+// Build the children of an element of a lazily parsed doc
+//
+// Children are appended as text and element nodes with attributes, while their own contents are left
+// unexpanded, so node indices already handed out stay valid. The input passed to the parser must stay
+// alive until no more elements are expanded. Does nothing if the element is already expanded or the doc
+// was not parsed lazily. Lazily parsed subtrees are checked for well-formedness when expanded. If
+// expansion fails, the nodes it added are removed again and the element stays unexpanded.
+//
+// Returns CD_XML_STATUS_SUCCESS if everything went well.
+cd_xml_parse_status_t cd_xml_expand(cd_xml_doc_t*       doc,            // XML doc.
+                                    cd_xml_node_ix_t    elem);          // Element to expand.
+
+// Parse a batch of independent XML documents using a pool of threads
+//
+// Each input is parsed as with cd_xml_init_and_parse, and docs[i] receives the doc of inputs[i], or NULL
+// if that input failed to parse. Items are spread over the threads with work-stealing, and each thread
+// reuses its parser scratch buffers between items. threads = 0 uses the number of hardware threads.
+//
+// Returns true if all inputs parsed successfully.
+bool cd_xml_parse_batch(const cd_xml_stringview_t*  inputs,                 // XML of each document, must stay alive as for cd_xml_init_and_parse.
+                        size_t                      count,                  // Number of inputs.
+                        cd_xml_flags_t              flags,
+                        cd_xml_doc_t**              docs,                   // Array of count doc pointers to receive the docs.
+                        cd_xml_parse_status_t*      statuses,               // Array of count statuses to receive the result of each input, may be NULL.
+                        unsigned                    threads);               // Number of threads to use, 0 for hardware threads.
+
+// Create a record reader that parses the elements at depth of a stream as separate docs.
+//
+// The root element is at depth 0, so depth 1 yields the children of the root. Input must be UTF-8,
+// and memory use is bounded by the largest record, not the size of the stream.
+//
+// Returns NULL if allocation failed.
+cd_xml_record_reader_t* cd_xml_record_reader_init(cd_xml_input_func         input_func,     // Input callback.
+                                                  void*                     userdata,       // Userdata passed to input callback.
+                                                  size_t                    depth,          // Depth of record elements.
+                                                  cd_xml_flags_t            flags,
+                                                  const cd_xml_allocator_t* allocator);     // Allocator, NULL for default.
+
+#ifndef _WIN32
+
+// Create a record reader that reads from a file descriptor, see cd_xml_record_reader_init.
+cd_xml_record_reader_t* cd_xml_record_reader_init_fd(int                        fd,         // File descriptor to read from, not closed.
+                                                     size_t                     depth,      // Depth of record elements.
+                                                     cd_xml_flags_t             flags,
+                                                     const cd_xml_allocator_t*  allocator); // Allocator, NULL for default.
+
+#endif
+
+// Parse the next record.
+//
+// On success, *doc is set to the record, or to NULL when the stream is done. The doc is owned by the reader
+// and reused for every record, so it is only valid until the next call. Namespaces declared on ancestors
+// of the record are registered in the doc. After an error, the same error is returned on every call.
+cd_xml_parse_status_t cd_xml_record_reader_next(cd_xml_record_reader_t* reader,
+                                                cd_xml_doc_t**          doc);   // Receives the record doc.
+
+// Release reader, including the record doc, and set *reader to NULL.
+void cd_xml_record_reader_free(cd_xml_record_reader_t** reader);
+
+// Check that XML is well-formed without building a doc
+//
+// Accepts the same input as cd_xml_init_and_parse, except that only UTF-8 input is supported and UTF-16 or
+// ISO-8859-1 input gives CD_XML_STATUS_UNSUPPORTED_ENCODING, and that an entity split by a comment is rejected.
+// When input has several errors, the status may be that of another error than the parser reports. No memory is
+// allocated, instead elements nested deeper than CD_XML_VALIDATE_MAX_DEPTH or more than
+// CD_XML_VALIDATE_MAX_NAMESPACES namespace prefixes in scope give CD_XML_STATUS_LIMIT_EXCEEDED. Nothing is
+// printed on errors.
+//
+// Returns CD_XML_STATUS_SUCCESS if data is well-formed.
+cd_xml_parse_status_t cd_xml_validate(const char*       data,           // Pointer to XML data
+                                      size_t            size,           // Size of XML data
+                                      cd_xml_flags_t    flags,
+                                      size_t*           error_offset);  // Receives byte offset of first error, may be NULL.
+
 // Serialzie doc as XML
 //
-// Return true if everything went well.
+// Return true if everything went well, false also if doc was parsed lazily and has unexpanded elements.
 bool cd_xml_write(cd_xml_doc_t*         doc,                            // XML doc.
                   cd_xml_output_func    output_func,                    // output callback, returns true if everything is OK.
                   void*                 userdata,                       // userdata passed to output callback.
                   bool                  pretty);
 
+#ifndef _WIN32
+
+// Initialize a file-descriptor sink, pass the sink as userdata and cd_xml_fd_sink_output as output callback.
+void cd_xml_fd_sink_init(cd_xml_fd_sink_t*  sink,
+                         int                fd);                        // File descriptor to write to, not closed by sink.
+
+// Output callback for cd_xml_fd_sink_t.
+//
+// Longer fragments are referenced and not copied, so the output must not be produced from buffers that are
+// reused or freed before the next flush. This holds for cd_xml_write, but not for cd_xml_writer_t or
+// cd_xml_write_parallel.
+//
+// Returns true if everything went well.
+bool cd_xml_fd_sink_output(void*        userdata,                       // Pointer to cd_xml_fd_sink_t.
+                           const char*  ptr,
+                           size_t       bytes);
+
+// Write all pending fragments to the file descriptor.
+//
+// Returns true if everything went well.
+bool cd_xml_fd_sink_flush(cd_xml_fd_sink_t* sink);
+
+// Serialize doc as XML to a file descriptor using a cd_xml_fd_sink_t.
+//
+// Return true if everything went well.
+bool cd_xml_write_fd(cd_xml_doc_t*  doc,                                // XML doc.
+                     int            fd,                                 // File descriptor to write to, not closed.
+                     bool           pretty);
+
+#endif
+
+// Serialize doc as XML using multiple threads
+//
+// Subtrees are serialized into per-thread buffers and then passed to output_func in order, producing
+// the same output as cd_xml_write. Since the entire output is buffered before output_func is invoked,
+// this needs memory proportional to the output size. Pass 0 as threads to use all hardware threads.
+//
+// Return true if everything went well, false also if doc was parsed lazily and has unexpanded elements.
+bool cd_xml_write_parallel(cd_xml_doc_t*        doc,                    // XML doc.
+                           cd_xml_output_func   output_func,            // output callback, returns true if everything is OK.
+                           void*                userdata,               // userdata passed to output callback.
+                           bool                 pretty,                 // Pretty-print output.
+                           unsigned             threads);               // Max number of threads to use, 0 for number of hardware threads.
+
+// Save doc as a binary snapshot
+//
+// The snapshot stores the namespaces, nodes and attributes arrays together with a single string pool,
+// using offsets instead of pointers. It is versioned, checksummed and has native endianness. The
+// state of lazy parsing is not saved, so docs with unexpanded elements are refused.
+//
+// Return true if everything went well.
+bool cd_xml_save_binary(cd_xml_doc_t*       doc,                        // XML doc.
+                        cd_xml_output_func  output_func,                // output callback, returns true if everything is OK.
+                        void*               userdata);                  // userdata passed to output callback.
+
+// Load doc from a binary snapshot
+//
+// Loading does no parsing, the arrays are converted in a single pass and strings reference the string pool
+// in place. Thus, like with cd_xml_init_and_parse, data must stay alive as long as the doc unless
+// CD_XML_FLAGS_COPY_STRINGS is passed, and an mmap'ed snapshot can be shared between processes. A second
+// pass checks that links form trees and lists, so that a corrupt snapshot cannot make traversals loop.
+//
+// Returns CD_XML_STATUS_SUCCESS if everything went well.
+cd_xml_parse_status_t cd_xml_load_binary(cd_xml_doc_t**     doc,        // Pointer to a doc-pointer to NULL
+                                         const void*        data,       // Pointer to snapshot, should be 8-byte aligned.
+                                         size_t             size,       // Size of snapshot
+                                         cd_xml_flags_t     flags);     // CD_XML_FLAGS_COPY_STRINGS and CD_XML_FLAGS_NO_CHECKSUM are relevant.
+
+// Parse whitespace-separated numbers from a text node, or from the text children of an element.
+//
+// Returns the number of values in the text, of which at most cap are written to out, or (size_t)-1 if the
+// text contains something that is not a number. Numbers are decimal with '.' as decimal point regardless
+// of locale, inf, nan and hex floats are not accepted, and floats and doubles are correctly rounded.
+size_t cd_xml_parse_floats(cd_xml_doc_t*    doc,                        // XML doc.
+                           cd_xml_node_ix_t node,                       // Text node or element.
+                           float*           out,                        // Array to write values to.
+                           size_t           cap);                       // Capacity of out.
+
+size_t cd_xml_parse_doubles(cd_xml_doc_t*       doc,
+                            cd_xml_node_ix_t    node,
+                            double*             out,
+                            size_t              cap);
+
+size_t cd_xml_parse_ints(cd_xml_doc_t*      doc,
+                         cd_xml_node_ix_t   node,
+                         int*               out,
+                         size_t             cap);
+
+// Parse whitespace-separated numbers from a string, like an attribute value.
+//
+// Returns the number of values in the text, of which at most cap are written to out, or (size_t)-1 if the
+// text contains something that is not a number.
+size_t cd_xml_parse_floats_strv(const cd_xml_stringview_t* text, float* out, size_t cap);
+
+size_t cd_xml_parse_doubles_strv(const cd_xml_stringview_t* text, double* out, size_t cap);
+
+size_t cd_xml_parse_ints_strv(const cd_xml_stringview_t* text, int* out, size_t cap);
+
+// Get an upper bound of the number of bytes cd_xml_text_base64_decode writes for a node.
+size_t cd_xml_text_base64_size(cd_xml_doc_t*    doc,                    // XML doc.
+                               cd_xml_node_ix_t node);                  // Text node or element.
+
+// Decode base64 from a text node, or from the text children of an element.
+//
+// Whitespace is skipped, and out must have room for cd_xml_text_base64_size bytes. Decoding uses
+// AVX2 or SSSE3 when enabled at compile time.
+//
+// Returns the number of bytes written to out, or (size_t)-1 if the text is not valid base64.
+size_t cd_xml_text_base64_decode(cd_xml_doc_t*      doc,                // XML doc.
+                                 cd_xml_node_ix_t   node,               // Text node or element.
+                                 void*              out);               // Buffer to write decoded bytes to.
+
 // Runs a set of visitor callbacks on the doc
 //
 // Returns true if everything went well.
@@ -395,6 +1238,58 @@ bool cd_xml_apply_visitor(cd_xml_doc_t*           doc,                  // XML d
                           cd_xml_visit_attribute  attribute,            // Callback when traversing an element's attributes.
                           cd_xml_visit_text       text);                // Callback when traversing a text node.
 
+// Initialize a streaming writer
+//
+// Output is buffered, and nothing is guaranteed to be passed to output_func before cd_xml_writer_finish.
+void cd_xml_writer_init(cd_xml_writer_t*    writer,                     // Writer to initialize.
+                        cd_xml_output_func  output_func,                // output callback, returns true if everything is OK.
+                        void*               userdata,                   // userdata passed to output callback.
+                        bool                pretty);                    // Pretty-print output.
+
+// Register a namespace with a streaming writer, must be done before root element is started.
+//
+// Returns an index that can be used when writing elements and attributes, or cd_xml_no_ix on error.
+cd_xml_ns_ix_t cd_xml_writer_add_namespace(cd_xml_writer_t*     writer,
+                                           cd_xml_stringview_t* prefix, // Prefix to use, NULL or empty for default namespace. Must stay alive until finish.
+                                           cd_xml_stringview_t* uri);   // Uri for namespace, must stay alive until finish.
+
+// Start a new element as a child of the current element.
+//
+// Returns true if everything went well.
+bool cd_xml_writer_begin_element(cd_xml_writer_t*       writer,
+                                 cd_xml_ns_ix_t         ns,             // Namespace index, cd_xml_no_ix if irrelevant.
+                                 cd_xml_stringview_t*   name);          // Name of element, must stay alive until element is ended.
+
+// Add an attribute to the current element, must be done before any children are written.
+//
+// Returns true if everything went well.
+bool cd_xml_writer_attribute(cd_xml_writer_t*       writer,
+                             cd_xml_ns_ix_t         ns,                 // Namespace index, cd_xml_no_ix if irrelevant.
+                             cd_xml_stringview_t*   name,               // Name of attribute.
+                             cd_xml_stringview_t*   value);             // Value of attribute, is escaped as needed.
+
+// Add text as a child of the current element.
+//
+// Returns true if everything went well.
+bool cd_xml_writer_text(cd_xml_writer_t*        writer,
+                        cd_xml_stringview_t*    text);                  // Text, is escaped as needed.
+
+// Add text as a CDATA section, split into several sections if text contains ]]>.
+//
+// Returns true if everything went well.
+bool cd_xml_writer_cdata(cd_xml_writer_t*       writer,
+                         cd_xml_stringview_t*   text);                  // Text, written as is.
+
+// End the current element.
+//
+// Returns true if everything went well.
+bool cd_xml_writer_end_element(cd_xml_writer_t* writer);
+
+// End all open elements and flush output.
+//
+// Returns true if everything went well during the lifetime of the writer.
+bool cd_xml_writer_finish(cd_xml_writer_t* writer);
+
 // Helper func to create stringviews from C-strings
 inline cd_xml_stringview_t cd_xml_strv(const char* str)
 {
@@ -412,6 +1307,43 @@ inline cd_xml_stringview_t cd_xml_strv(const char* str)
 #include <assert.h>
 #include <stdarg.h>
 
+#ifndef CD_XML_NO_THREADS
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+#endif
+
+#ifndef _WIN32
+#include <errno.h>
+#include <unistd.h>
+#endif
+
+#include <limits.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define CD_XML_SSE2
+#include <emmintrin.h>
+#endif
+
+#if defined(__AVX2__)
+#define CD_XML_AVX2
+#include <immintrin.h>
+#endif
+
+#if defined(__SSSE3__) || defined(CD_XML_AVX2)
+#define CD_XML_SSSE3
+#include <tmmintrin.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
 // Define CD_XML_MALLOC, CD_XML_FREE, and CD_XML_REALLOC for custom allocation
 
 #ifndef CD_XML_MALLOC
@@ -426,6 +1358,73 @@ inline cd_xml_stringview_t cd_xml_strv(const char* str)
 #define CD_XML_REALLOC(ptr,size) realloc(ptr,size)
 #endif
 
+// Statistics, compiles to nothing unless CD_XML_ENABLE_STATS is defined.
+
+#ifdef CD_XML_ENABLE_STATS
+
+#ifdef _MSC_VER
+#define CD_XML_THREAD_LOCAL __declspec(thread)
+#else
+#define CD_XML_THREAD_LOCAL __thread
+#endif
+
+#if !defined(_MSC_VER) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#endif
+
+static CD_XML_THREAD_LOCAL cd_xml_stats_t* cd_xml_stats_current = NULL;
+
+cd_xml_stats_t* cd_xml_stats_bind(cd_xml_stats_t* stats)
+{
+    cd_xml_stats_t* rv = cd_xml_stats_current;
+    cd_xml_stats_current = stats;
+    return rv;
+}
+
+static uint64_t cd_xml_cycles(void)
+{
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    uint64_t rv;
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r"(rv));
+    return rv;
+#else
+    return (uint64_t)clock();
+#endif
+}
+
+// Add all counters of src to dst.
+static void cd_xml_stats_merge(cd_xml_stats_t* dst, const cd_xml_stats_t* src)
+{
+    dst->tokens += src->tokens;
+    dst->nodes += src->nodes;
+    dst->attributes += src->attributes;
+    dst->namespaces += src->namespaces;
+    dst->entity_decodes += src->entity_decodes;
+    dst->bytes_copied += src->bytes_copied;
+    dst->arena_allocs += src->arena_allocs;
+    dst->arena_bytes += src->arena_bytes;
+    dst->sb_reallocs += src->sb_reallocs;
+    dst->output_calls += src->output_calls;
+    dst->output_bytes += src->output_bytes;
+    for (unsigned i = 0; i < CD_XML_PHASE_COUNT; i++) {
+        dst->cycles[i] += src->cycles[i];
+    }
+}
+
+#define CD_XML_STATS_ADD(field, n) do { if (cd_xml_stats_current) cd_xml_stats_current->field += (n); } while(0)
+#define CD_XML_STATS_PHASE_BEGIN(var) uint64_t var = cd_xml_stats_current ? cd_xml_cycles() : 0
+#define CD_XML_STATS_PHASE_END(var, phase) do { if (cd_xml_stats_current) cd_xml_stats_current->cycles[phase] += cd_xml_cycles() - (var); } while(0)
+
+#else
+
+#define CD_XML_STATS_ADD(field, n) ((void)0)
+#define CD_XML_STATS_PHASE_BEGIN(var) ((void)0)
+#define CD_XML_STATS_PHASE_END(var, phase) ((void)0)
+
+#endif
+
 // Recognized token types
 typedef enum {
     CD_XML_TOKEN_EOF                    = 0,
@@ -442,7 +1441,8 @@ typedef enum {
     CD_XML_TOKEN_ENDTAG_START,                              // </
     CD_XML_TOKEN_PROC_INSTR_START,                          // <?
     CD_XML_TOKEN_PROC_INSTR_STOP,                           // ?>
-    CD_XML_TOKEN_XML_DECL_START                             // <?xml
+    CD_XML_TOKEN_XML_DECL_START,                            // <?xml
+    CD_XML_TOKEN_CDATA                                      // <![CDATA[ ... ]]>
 } cd_xml_token_kind_t;
 
 // Decoded token
@@ -470,6 +1470,34 @@ typedef struct {
     cd_xml_ns_ix_t              namespace_ix;               // Index of bound namespace.
 } cd_xml_namespace_binding_t;
 
+// Element of a lazily parsed doc whose contents have not been built yet.
+typedef struct {
+    const char*                 tag_end;                    // The '>' ending the start tag of the element.
+    cd_xml_stringview_t         prefix;                     // Namespace prefix of element as written, to match the end tag.
+    cd_xml_ns_ix_t              namespace_default;          // Default namespace inside element.
+    cd_xml_ix_t                 bindings_begin;             // Namespace-prefix bindings in scope, range of cd_xml_lazy_t.bindings.
+    cd_xml_ix_t                 bindings_end;
+} cd_xml_lazy_elem_t;
+
+// State of a lazily parsed doc, see cd_xml_expand.
+typedef struct cd_xml_lazy_struct {
+    cd_xml_stringview_t         input;                      // Input that was parsed, after any transcoding.
+    bool                        indexed;                    // Structural index has been built.
+    cd_xml_ix_t*                offsets;                    // Offsets of every '<', '>', '"' and '\'' in input, stretchy buf.
+    cd_xml_lazy_elem_t*         pending;                    // Unexpanded elements, stretchy buf.
+    cd_xml_ix_t*                node_pending;               // Index into pending per node, or cd_xml_no_ix, stretchy buf.
+    cd_xml_namespace_binding_t* bindings;                   // Snapshots of namespace-prefix bindings, stretchy buf.
+    cd_xml_flags_t              flags;                      // Flags passed to parser.
+} cd_xml_lazy_t;
+
+// Encoding of the input buffer, detected from BOM or XML declaration.
+typedef enum {
+    CD_XML_ENCODING_UTF8 = 0,                               // UTF-8 or ASCII, parsed as-is.
+    CD_XML_ENCODING_LATIN1,                                 // ISO-8859-1, transcoded to UTF-8 before parsing.
+    CD_XML_ENCODING_UTF16LE,                                // UTF-16 little endian, transcoded to UTF-8 before parsing.
+    CD_XML_ENCODING_UTF16BE                                 // UTF-16 big endian, transcoded to UTF-8 before parsing.
+} cd_xml_encoding_t;
+
 // State used during parsing
 typedef struct {
     cd_xml_doc_t*               doc;                        // Document that gets built during parsing.
@@ -482,8 +1510,33 @@ typedef struct {
     cd_xml_namespace_binding_t* namespace_resolve_stack;    // Namespace-prefix bindings, most recent bindings last.
     cd_xml_flags_t              flags;                      //
     cd_xml_parse_status_t       status;                     // Either success or first error encountered.
+    const cd_xml_allocator_t*   scratch_allocator;          // Allocator for the stacks and stash, NULL for default.
+    const char* const*          keep_paths;                 // Paths of elements to keep, NULL to keep everything.
+    size_t                      keep_path_count;            // Number of paths in keep_paths.
+    cd_xml_stringview_t*        keep_path_stack;            // Local names of current element and its ancestors.
+    bool                        keep_all;                   // Current element is inside a subtree matching a keep path.
+    bool                        skipped;                    // Element start tag matched no keep path and was skipped.
+    bool                        after_comment;              // A comment was skipped right before current token.
+    cd_xml_encoding_t           encoding;                   // Encoding of original input.
+    size_t                      level;                      // Number of elements entered, contents past the first level are skipped if lazy.
+    bool                        quiet;                      // Do not print errors and debug messages.
+    const char*                 error_at;                   // Position of first reported error, NULL if none.
 } cd_xml_parse_context_t;
 
+// Parser scratch buffers that can be reused between parses, see cd_xml_parse_with_scratch.
+typedef struct {
+    cd_xml_att_triple_t*        attribute_stash;            // cd_xml_parse_context_t.attribute_stash.
+    cd_xml_namespace_binding_t* namespace_resolve_stack;    // cd_xml_parse_context_t.namespace_resolve_stack.
+    cd_xml_stringview_t*        keep_path_stack;            // cd_xml_parse_context_t.keep_path_stack.
+} cd_xml_parse_scratch_t;
+
+// Result of matching an element against the keep paths.
+typedef enum {
+    CD_XML_SELECT_SKIP,                                     // No path can match element or its descendants.
+    CD_XML_SELECT_ANCESTOR,                                 // Element is an ancestor of a possible match.
+    CD_XML_SELECT_KEEP                                      // Element matches a path, keep its entire subtree.
+} cd_xml_select_t;
+
 #define CD_XML_MIN(a,b) ((a)<(b)?(a):(b))
 #define CD_XML_MAX(a,b) ((a)<(b)?(b):(a))
 #define CD_XML_STRINGVIEW_FORMAT(text) (int)((text).end-(text).begin),(text).begin
@@ -496,33 +1549,323 @@ typedef struct {
 
 #define cd_xml__sb_cap(a) (cd_xml__sb_base(a)[1])
 #define cd_xml__sb_must_grow(a) (((a)==NULL)||(cd_xml__sb_cap(a) <= cd_xml__sb_size(a)+1u))
-#define cd_xml__sb_do_grow(a) (*(void**)&(a)=cd_xml__sb_grow((a),sizeof(*(a))))
-#define cd_xml__sb_maybe_grow(a) (cd_xml__sb_must_grow(a)?cd_xml__sb_do_grow(a):0)
-#define cd_xml_sb_push(a,x) (cd_xml__sb_maybe_grow(a),(a)[cd_xml__sb_size(a)++]=(x))
+#define cd_xml__sb_bytes(a,item_size) (2*sizeof(cd_xml_ix_t) + (item_size)*cd_xml__sb_cap(a))
+#define cd_xml__sb_maybe_grow(al,a) (cd_xml__sb_must_grow(a)?cd_xml__sb_grow_to((al),(void**)&(a),sizeof(*(a)),0):true)
+// Push x onto a, evaluates to false if a could not grow, see cd_xml_sb_failure.
+#define cd_xml_sb_push(al,a,x) (cd_xml__sb_maybe_grow(al,a)?((a)[cd_xml__sb_size(a)++]=(x),true):false)
+// Why a failed push failed, either hit the index limit or ran out of memory.
+#define cd_xml_sb_failure(a) (cd_xml__sb_max_capacity(sizeof(*(a))) <= cd_xml_sb_size(a)+1u?CD_XML_STATUS_LIMIT_EXCEEDED:CD_XML_STATUS_OUT_OF_MEMORY)
 #define cd_xml_sb_shrink(a,n) ((a)&&((n)<cd_xml__sb_size(a))?cd_xml__sb_size(a)=(n):0)
-#define cd_xml_sb_free(a) (cd_xml__sb_free((void**)&(a)))
+#define cd_xml_sb_free(al,a) (cd_xml__sb_free((al),(void**)&(a),sizeof(*(a))))
 
-static void cd_xml__sb_free(void** a) {
+// Allocation helpers, allocator may be NULL or zero-initialized to use CD_XML_MALLOC and friends.
+
+static void* cd_xml_alloc(const cd_xml_allocator_t* allocator, size_t size)
+{
+    if (allocator && allocator->alloc_func) return allocator->alloc_func(allocator->context, size);
+    return CD_XML_MALLOC(size);
+}
+
+static void* cd_xml_realloc(const cd_xml_allocator_t* allocator, void* ptr, size_t old_size, size_t new_size)
+{
+    if (allocator && allocator->realloc_func) return allocator->realloc_func(allocator->context, ptr, old_size, new_size);
+    return CD_XML_REALLOC(ptr, new_size);
+}
+
+static void cd_xml_dealloc(const cd_xml_allocator_t* allocator, void* ptr, size_t size)
+{
+    if (allocator && allocator->free_func) allocator->free_func(allocator->context, ptr, size);
+    else CD_XML_FREE(ptr);
+}
+
+static void cd_xml__sb_free(const cd_xml_allocator_t* allocator, void** a, size_t item_size) {
     if(*a) {
-        CD_XML_FREE(cd_xml__sb_base(*a));
+        cd_xml_dealloc(allocator, cd_xml__sb_base(*a), cd_xml__sb_bytes(*a, item_size));
         *a = NULL;
     }
 }
 
-static void* cd_xml__sb_grow(void* ptr, size_t item_size)
+// Max capacity of a stretchy-buf so that indices stay below cd_xml_no_ix and the byte size fits in size_t.
+static cd_xml_ix_t cd_xml__sb_max_capacity(size_t item_size)
+{
+    size_t max_items = (SIZE_MAX - 2*sizeof(cd_xml_ix_t)) / item_size;
+    return max_items < (size_t)cd_xml_no_ix ? (cd_xml_ix_t)max_items : cd_xml_no_ix;
+}
+
+// Grow a stretchy-buf to at least min_capacity and at least one free slot.
+//
+// Returns false and leaves *a untouched if the limit is hit or allocation fails.
+static bool cd_xml__sb_grow_to(const cd_xml_allocator_t* allocator, void** a, size_t item_size, size_t min_capacity)
 {
-    unsigned size = cd_xml_sb_size(ptr);
-    unsigned new_size = 2 * size;
-    if(new_size < 16) new_size = 16;
-    unsigned* base = (unsigned*)CD_XML_REALLOC(ptr ? cd_xml__sb_base(ptr) : NULL, 2*sizeof(unsigned) + item_size * new_size);
-    assert(base && "Failed to allocate memory");
+    void* ptr = *a;
+    cd_xml_ix_t size = cd_xml_sb_size(ptr);
+    cd_xml_ix_t max_capacity = cd_xml__sb_max_capacity(item_size);
+    if (max_capacity <= size || max_capacity < min_capacity) return false;
+    cd_xml_ix_t new_size = size <= max_capacity / 2 ? 2 * size : max_capacity;
+    if(new_size < min_capacity) new_size = (cd_xml_ix_t)min_capacity;
+    if(new_size < 16) new_size = max_capacity < 16 ? max_capacity : 16;
+    if(new_size <= size) return false;
+    cd_xml_ix_t* base = (cd_xml_ix_t*)cd_xml_realloc(allocator,
+                                                     ptr ? cd_xml__sb_base(ptr) : NULL,
+                                                     ptr ? cd_xml__sb_bytes(ptr, item_size) : 0,
+                                                     2*sizeof(cd_xml_ix_t) + item_size * (size_t)new_size);
+    if (base == NULL) return false;
+    CD_XML_STATS_ADD(sb_reallocs, 1);
     base[0] = size;
     base[1] = new_size;
+    *a = base + 2;
+    return true;
+}
+
+// Reallocate a stretchy-buf so that capacity equals size, freeing it if empty.
+static void* cd_xml__sb_shrink_to_fit(const cd_xml_allocator_t* allocator, void* ptr, size_t item_size)
+{
+    if (ptr == NULL) return NULL;
+    cd_xml_ix_t size = cd_xml__sb_size(ptr);
+    if (size == 0) {
+        cd_xml__sb_free(allocator, &ptr, item_size);
+        return NULL;
+    }
+    if (cd_xml__sb_cap(ptr) == size) return ptr;
+    cd_xml_ix_t* base = (cd_xml_ix_t*)cd_xml_realloc(allocator,
+                                                     cd_xml__sb_base(ptr),
+                                                     cd_xml__sb_bytes(ptr, item_size),
+                                                     2*sizeof(cd_xml_ix_t) + item_size * (size_t)size);
+    if (base == NULL) return ptr;   // Keep the slack if shrinking fails.
+    CD_XML_STATS_ADD(sb_reallocs, 1);
+    base[1] = size;
     return base + 2;
 }
 
+// Threading helpers, define CD_XML_NO_THREADS to run everything on the calling thread.
+
+#ifdef CD_XML_NO_THREADS
+typedef int cd_xml_mutex_t;
+typedef int cd_xml_thread_t;
+static void cd_xml_mutex_init(cd_xml_mutex_t* m) { (void)m; }
+static void cd_xml_mutex_destroy(cd_xml_mutex_t* m) { (void)m; }
+static void cd_xml_mutex_lock(cd_xml_mutex_t* m) { (void)m; }
+static void cd_xml_mutex_unlock(cd_xml_mutex_t* m) { (void)m; }
+static bool cd_xml_thread_start(cd_xml_thread_t* t, void(*func)(void*), void* arg) { (void)t; (void)func; (void)arg; return false; }
+static void cd_xml_thread_join(cd_xml_thread_t* t) { (void)t; }
+static unsigned cd_xml_hardware_threads(void) { return 1; }
+#elif defined(_WIN32)
+typedef CRITICAL_SECTION cd_xml_mutex_t;
+typedef struct {
+    HANDLE                      handle;
+    void                        (*func)(void*);
+    void*                       arg;
+} cd_xml_thread_t;
+static void cd_xml_mutex_init(cd_xml_mutex_t* m) { InitializeCriticalSection(m); }
+static void cd_xml_mutex_destroy(cd_xml_mutex_t* m) { DeleteCriticalSection(m); }
+static void cd_xml_mutex_lock(cd_xml_mutex_t* m) { EnterCriticalSection(m); }
+static void cd_xml_mutex_unlock(cd_xml_mutex_t* m) { LeaveCriticalSection(m); }
+static DWORD WINAPI cd_xml_thread_main(LPVOID arg)
+{
+    cd_xml_thread_t* t = (cd_xml_thread_t*)arg;
+    t->func(t->arg);
+    return 0;
+}
+static bool cd_xml_thread_start(cd_xml_thread_t* t, void(*func)(void*), void* arg)
+{
+    t->func = func;
+    t->arg = arg;
+    t->handle = CreateThread(NULL, 0, cd_xml_thread_main, t, 0, NULL);
+    return t->handle != NULL;
+}
+static void cd_xml_thread_join(cd_xml_thread_t* t)
+{
+    WaitForSingleObject(t->handle, INFINITE);
+    CloseHandle(t->handle);
+}
+static unsigned cd_xml_hardware_threads(void)
+{
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors ? info.dwNumberOfProcessors : 1;
+}
+#else
+typedef pthread_mutex_t cd_xml_mutex_t;
+typedef struct {
+    pthread_t                   handle;
+    void                        (*func)(void*);
+    void*                       arg;
+} cd_xml_thread_t;
+static void cd_xml_mutex_init(cd_xml_mutex_t* m) { pthread_mutex_init(m, NULL); }
+static void cd_xml_mutex_destroy(cd_xml_mutex_t* m) { pthread_mutex_destroy(m); }
+static void cd_xml_mutex_lock(cd_xml_mutex_t* m) { pthread_mutex_lock(m); }
+static void cd_xml_mutex_unlock(cd_xml_mutex_t* m) { pthread_mutex_unlock(m); }
+static void* cd_xml_thread_main(void* arg)
+{
+    cd_xml_thread_t* t = (cd_xml_thread_t*)arg;
+    t->func(t->arg);
+    return NULL;
+}
+static bool cd_xml_thread_start(cd_xml_thread_t* t, void(*func)(void*), void* arg)
+{
+    t->func = func;
+    t->arg = arg;
+    return pthread_create(&t->handle, NULL, cd_xml_thread_main, t) == 0;
+}
+static void cd_xml_thread_join(cd_xml_thread_t* t)
+{
+    pthread_join(t->handle, NULL);
+}
+static unsigned cd_xml_hardware_threads(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n < 1 ? 1 : (unsigned)n;
+}
+#endif
+
+// Range of work items owned by one thread in cd_xml_parallel_for.
+typedef struct {
+    cd_xml_mutex_t              lock;                       // Protects begin and end.
+    size_t                      begin;                      // First item not yet taken.
+    size_t                      end;                        // One past last item.
+} cd_xml_work_range_t;
+
+// State shared by the threads of cd_xml_parallel_for.
+typedef struct {
+    cd_xml_work_range_t*        ranges;                     // One range per thread.
+    cd_xml_thread_t*            threads;                    // Worker threads, thread 0 is the calling thread.
+    unsigned                    thread_count;               // Number of threads.
+    void                        (*func)(void* arg, unsigned thread, size_t item);
+    void*                       arg;                        // Argument passed to func.
+#ifdef CD_XML_ENABLE_STATS
+    cd_xml_stats_t*             stats;                      // Stats bound on the calling thread, or NULL.
+#endif
+} cd_xml_work_pool_t;
+
+// Argument of a worker thread.
+typedef struct {
+    cd_xml_work_pool_t*         pool;
+    unsigned                    thread;
+#ifdef CD_XML_ENABLE_STATS
+    cd_xml_stats_t              stats;                      // Counts of this thread, merged into pool stats after join.
+#endif
+} cd_xml_worker_t;
+
+static bool cd_xml_work_take(cd_xml_work_range_t* range, size_t* item)
+{
+    bool rv = false;
+    cd_xml_mutex_lock(&range->lock);
+    if (range->begin < range->end) {
+        *item = range->begin++;
+        rv = true;
+    }
+    cd_xml_mutex_unlock(&range->lock);
+    return rv;
+}
+
+// Steal the upper half of the remaining items of another thread.
+static bool cd_xml_work_steal(cd_xml_work_pool_t* pool, unsigned thread)
+{
+    for (unsigned k = 1; k < pool->thread_count; k++) {
+        cd_xml_work_range_t* victim = &pool->ranges[(thread + k) % pool->thread_count];
+        size_t begin = 0, end = 0;
+        cd_xml_mutex_lock(&victim->lock);
+        if (victim->begin < victim->end) {
+            end = victim->end;
+            begin = victim->begin + (victim->end - victim->begin) / 2;
+            victim->end = begin;
+        }
+        cd_xml_mutex_unlock(&victim->lock);
+        if (begin < end) {
+            cd_xml_work_range_t* own = &pool->ranges[thread];
+            cd_xml_mutex_lock(&own->lock);
+            own->begin = begin;
+            own->end = end;
+            cd_xml_mutex_unlock(&own->lock);
+            return true;
+        }
+    }
+    return false;
+}
+
+static void cd_xml_worker_main(void* arg)
+{
+    cd_xml_worker_t* worker = (cd_xml_worker_t*)arg;
+    cd_xml_work_pool_t* pool = worker->pool;
+#ifdef CD_XML_ENABLE_STATS
+    // Thread 0 is the calling thread and already has the stats bound.
+    if (worker->thread != 0 && pool->stats) cd_xml_stats_bind(&worker->stats);
+#endif
+    size_t item;
+    do {
+        while (cd_xml_work_take(&pool->ranges[worker->thread], &item)) {
+            pool->func(pool->arg, worker->thread, item);
+        }
+    } while (cd_xml_work_steal(pool, worker->thread));
+#ifdef CD_XML_ENABLE_STATS
+    if (worker->thread != 0 && pool->stats) cd_xml_stats_bind(NULL);
+#endif
+}
+
+// Run func on items [0,count) using up to thread_count threads, including the calling thread.
+//
+// Each thread starts with a contiguous range of items, and steals from other threads when it runs out.
+static void cd_xml_parallel_for(unsigned thread_count,
+                                size_t   count,
+                                void     (*func)(void* arg, unsigned thread, size_t item),
+                                void*    arg)
+{
+    if (thread_count < 1) thread_count = 1;
+    if (count < thread_count) thread_count = count ? (unsigned)count : 1;
+
+    cd_xml_work_pool_t pool = {
+        .thread_count = thread_count,
+        .func = func,
+        .arg = arg,
+#ifdef CD_XML_ENABLE_STATS
+        .stats = cd_xml_stats_current
+#endif
+    };
+    pool.ranges = (cd_xml_work_range_t*)CD_XML_MALLOC(sizeof(cd_xml_work_range_t) * thread_count);
+    pool.threads = (cd_xml_thread_t*)CD_XML_MALLOC(sizeof(cd_xml_thread_t) * thread_count);
+    cd_xml_worker_t* workers = (cd_xml_worker_t*)CD_XML_MALLOC(sizeof(cd_xml_worker_t) * thread_count);
+    bool* started = (bool*)CD_XML_MALLOC(sizeof(bool) * thread_count);
+    assert(pool.ranges && pool.threads && workers && started && "Failed to allocate memory");
+
+    for (unsigned i = 0; i < thread_count; i++) {
+        cd_xml_mutex_init(&pool.ranges[i].lock);
+        pool.ranges[i].begin = (count * i) / thread_count;
+        pool.ranges[i].end = (count * (i + 1)) / thread_count;
+        workers[i].pool = &pool;
+        workers[i].thread = i;
+#ifdef CD_XML_ENABLE_STATS
+        memset(&workers[i].stats, 0, sizeof(workers[i].stats));
+#endif
+    }
+    // If a thread fails to start, its items get stolen by the others.
+    for (unsigned i = 1; i < thread_count; i++) {
+        started[i] = cd_xml_thread_start(&pool.threads[i], cd_xml_worker_main, &workers[i]);
+    }
+    cd_xml_worker_main(&workers[0]);
+    for (unsigned i = 1; i < thread_count; i++) {
+        if (started[i]) cd_xml_thread_join(&pool.threads[i]);
+    }
+#ifdef CD_XML_ENABLE_STATS
+    if (pool.stats) {
+        for (unsigned i = 1; i < thread_count; i++) {
+            cd_xml_stats_merge(pool.stats, &workers[i].stats);
+        }
+    }
+#endif
+
+    for (unsigned i = 0; i < thread_count; i++) {
+        cd_xml_mutex_destroy(&pool.ranges[i].lock);
+    }
+    CD_XML_FREE(started);
+    CD_XML_FREE(workers);
+    CD_XML_FREE(pool.threads);
+    CD_XML_FREE(pool.ranges);
+}
+
 static void cd_xml_report_error(cd_xml_parse_context_t* ctx, const char* a, const char* b, const char* fmt, ...)
 {
+    if (ctx->error_at == NULL) ctx->error_at = a;
+    if (ctx->quiet) return;
     assert(a <= b);
     assert(ctx->input.begin <= a);
     assert(b <= ctx->input.end);
@@ -547,6 +1890,7 @@ static void cd_xml_report_error(cd_xml_parse_context_t* ctx, const char* a, cons
 
 static void cd_xml_report_debug(cd_xml_parse_context_t* ctx, const char* fmt, ...)
 {
+    if (ctx->quiet) return;
     va_list args;
     va_start(args, fmt);
     vprintf(fmt, args);
@@ -554,17 +1898,80 @@ static void cd_xml_report_debug(cd_xml_parse_context_t* ctx, const char* fmt, ..
     fputc('\n', stderr);
 }
 
-static bool cd_xml_strcmp(cd_xml_stringview_t* a, const char* b)
+static bool cd_xml_strcmp(const cd_xml_stringview_t* a, const char* b)
 {
     size_t n = a->end - a->begin;
-    return (strncmp(a->begin, b, n) == 0) && (b[n] == '\0');
+    return (strlen(b) == n) && (n == 0 || memcmp(a->begin, b, n) == 0);
 }
 
-static bool cd_xml_strvcmp(cd_xml_stringview_t* a,cd_xml_stringview_t* b)
+static bool cd_xml_strvcmp(const cd_xml_stringview_t* a, const cd_xml_stringview_t* b)
 {
     size_t na = a->end - a->begin;
     size_t nb = b->end - b->begin;
-    return (na == nb) && (memcmp(a->begin, b->begin, na) == 0);
+    return (na == nb) && (na == 0 || memcmp(a->begin, b->begin, na) == 0);
+}
+
+// Like cd_xml_strcmp, but ignoring ASCII case.
+static bool cd_xml_strcasecmp(const cd_xml_stringview_t* a, const char* b)
+{
+    const char* p = a->begin;
+    for (; p < a->end && *b; p++, b++) {
+        char c = ('a' <= *p && *p <= 'z') ? (char)(*p - 'a' + 'A') : *p;
+        char d = ('a' <= *b && *b <= 'z') ? (char)(*b - 'a' + 'A') : *b;
+        if (c != d) return false;
+    }
+    return p == a->end && *b == '\0';
+}
+
+static unsigned cd_xml_ctz(unsigned x)
+{
+    assert(x);
+#ifdef _MSC_VER
+    unsigned long ix;
+    _BitScanForward(&ix, x);
+    return (unsigned)ix;
+#else
+    return (unsigned)__builtin_ctz(x);
+#endif
+}
+
+// Skip XML whitespace, 16 bytes at a time when SSE2 is available.
+static const char* cd_xml_skip_space(const char* p, const char* end)
+{
+#ifdef CD_XML_SSE2
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i nl = _mm_set1_epi8('\n');
+    const __m128i cr = _mm_set1_epi8('\r');
+    while (p + 16 <= end) {
+        __m128i v = _mm_loadu_si128((const __m128i*)p);
+        __m128i ws = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, space), _mm_cmpeq_epi8(v, tab)),
+                                  _mm_or_si128(_mm_cmpeq_epi8(v, nl), _mm_cmpeq_epi8(v, cr)));
+        unsigned mask = ~(unsigned)_mm_movemask_epi8(ws) & 0xffffu;
+        if (mask) return p + cd_xml_ctz(mask);
+        p += 16;
+    }
+#endif
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) p++;
+    return p;
+}
+
+static const char* cd_xml_skip_nonspace(const char* p, const char* end)
+{
+    while (p < end && !(*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) p++;
+    return p;
+}
+
+// Find str in [p,end), returns pointer past the match or NULL.
+static const char* cd_xml_find_str(const char* p, const char* end, const char* str, size_t n)
+{
+    while(p + n <= end) {
+        p = (const char*)memchr(p, str[0], end - p - n + 1);
+        if(p == NULL) return NULL;
+        if(memcmp(p, str, n) == 0) return p + n;
+        p++;
+    }
+    return NULL;
 }
 
 static bool cd_xml_isspace(uint32_t c)
@@ -656,6 +2063,7 @@ static bool cd_xml_next_token(cd_xml_parse_context_t* ctx)
 {
     if(ctx->status != CD_XML_STATUS_SUCCESS) return false;
     ctx->matched = ctx->current;
+    ctx->after_comment = false;
 
 restart:
     ctx->current.text.begin = ctx->chr.text.begin;
@@ -672,7 +2080,10 @@ restart:
     case '\r':
     case '\v':
     case '\f':
-        do { cd_xml_next_char(ctx); } while(cd_xml_isspace(ctx->chr.code));
+        do {    // Whitespace is ASCII, so skip runs without decoding char by char.
+            ctx->chr.text.end = cd_xml_skip_space(ctx->chr.text.end, ctx->input.end);
+            cd_xml_next_char(ctx);
+        } while(cd_xml_isspace(ctx->chr.code));
         goto restart;
         break;
     case '/':
@@ -720,6 +2131,7 @@ restart:
                             cd_xml_next_char(ctx);
                             if(ctx->chr.code == '>') {
                                 cd_xml_next_char(ctx);
+                                ctx->after_comment = true;
                                 goto restart;
                             }
                         }
@@ -731,6 +2143,24 @@ restart:
                     return false;
                 }
             }
+            else if(ctx->chr.code == '[' &&
+                    7 <= ctx->input.end - ctx->chr.text.begin &&
+                    memcmp(ctx->chr.text.begin, "[CDATA[", 7) == 0)
+            {
+                // CDATA section, contents are raw bytes, so search for the terminator directly.
+                const char* end = cd_xml_find_str(ctx->chr.text.begin + 7, ctx->input.end, "]]>", 3);
+                if(end == NULL) {
+                    ctx->current.kind = CD_XML_TOKEN_EOF;
+                    ctx->status = CD_XML_STATUS_PREMATURE_EOF;
+                    ctx->current.text.end = ctx->input.end;
+                    cd_xml_report_error(ctx, ctx->current.text.begin, ctx->current.text.end, "EOF while scanning for end of CDATA section");
+                    return false;
+                }
+                ctx->current.kind = CD_XML_TOKEN_CDATA;
+                ctx->chr.text.end = end;
+                cd_xml_next_char(ctx);
+                goto done;
+            }
             ctx->chr = save;
         }
         break;
@@ -752,9 +2182,13 @@ restart:
     case 'O': case 'P': case 'Q': case 'R': case 'S': case 'T': case 'U':
     case 'V': case 'W': case 'X': case 'Y': case 'Z':
     case '_':
-        //cd_xml_next_char(ctx);
         ctx->current.kind = CD_XML_TOKEN_NAME;
-        do { cd_xml_next_char(ctx); } while(cd_xml_is_name_char(ctx->chr.code));
+        {   // Name chars are ASCII, so scan bytes without decoding char by char.
+            const char* p = ctx->chr.text.end;
+            while(p < ctx->input.end && cd_xml_is_name_char((unsigned char)*p)) p++;
+            ctx->chr.text.end = p;
+            cd_xml_next_char(ctx);
+        }
         break;
     default:
         cd_xml_next_char(ctx);
@@ -762,6 +2196,7 @@ restart:
     }
 done:
     ctx->current.text.end = ctx->chr.text.begin;
+    CD_XML_STATS_ADD(tokens, 1);
     return true;
 }
 
@@ -789,29 +2224,65 @@ static bool cd_xml_expect_token(cd_xml_parse_context_t* ctx, cd_xml_token_kind_t
     return false;
 }
 
+// Set status after a failed push onto a stretchy-buf, always returns false.
+#define cd_xml_report_doc_failure(ctx,a,where) cd_xml_report_failure((ctx), cd_xml_sb_failure(a), (where))
+
+// Status for failing to add an item to an array of count items, either hit the index limit or ran out of memory.
+static cd_xml_parse_status_t cd_xml_push_failure(cd_xml_ix_t count, size_t item_size)
+{
+#ifdef CD_XML_SEGMENTED
+    (void)item_size;
+    cd_xml_ix_t limit = cd_xml_no_ix - 1;
+#else
+    cd_xml_ix_t limit = cd_xml__sb_max_capacity(item_size);
+#endif
+    return limit <= count ? CD_XML_STATUS_LIMIT_EXCEEDED : CD_XML_STATUS_OUT_OF_MEMORY;
+}
+
+static bool cd_xml_report_failure(cd_xml_parse_context_t* ctx, cd_xml_parse_status_t status, cd_xml_stringview_t where)
+{
+    ctx->status = status;
+    cd_xml_report_error(ctx, where.begin, where.end, status == CD_XML_STATUS_LIMIT_EXCEEDED ? "Too many items for index type" : "Failed to allocate memory");
+    return false;
+}
+
 static char* cd_xml_alloc_buf(cd_xml_doc_t* doc, size_t bytes)
 {
-    cd_xml_buf_t* buf = (cd_xml_buf_t*)CD_XML_MALLOC(offsetof(cd_xml_buf_t, payload) + bytes);
-    assert(buf && "Failed to allocate memory");
+    if (doc->arena && bytes <= doc->arena->size - doc->arena_used) {
+        char* p = &doc->arena->payload + doc->arena_used;
+        doc->arena_used += bytes;
+        return p;
+    }
+    if (SIZE_MAX - offsetof(cd_xml_buf_t, payload) < bytes) return NULL;
+    cd_xml_buf_t* buf = (cd_xml_buf_t*)cd_xml_alloc(&doc->allocator, offsetof(cd_xml_buf_t, payload) + bytes);
+    if (buf == NULL) return NULL;
+    CD_XML_STATS_ADD(arena_allocs, 1);
+    CD_XML_STATS_ADD(arena_bytes, bytes);
+    buf->size = bytes;
     buf->next = doc->allocated_buffers;
     doc->allocated_buffers = buf;
 
     return &buf->payload;
 }
 
-static cd_xml_stringview_t cd_xml_strvdup(cd_xml_doc_t* doc, const cd_xml_stringview_t* src)
+// Copy a string into doc-owned memory, returns false if allocation failed.
+static bool cd_xml_strvdup(cd_xml_doc_t* doc, cd_xml_stringview_t* dst, const cd_xml_stringview_t* src)
 {
-    if (cd_xml_strv_empty(*src)) return *src;
+    if (cd_xml_strv_empty(*src)) {
+        *dst = *src;
+        return true;
+    }
     assert(src->begin < src->end);
 
     size_t N = src->end - src->begin;
     char* buf = cd_xml_alloc_buf(doc, N);
+    if (buf == NULL) return false;
     memcpy(buf, src->begin, N);
+    CD_XML_STATS_ADD(bytes_copied, N);
 
-    cd_xml_stringview_t rv;
-    rv.begin = buf;
-    rv.end = buf + N;
-    return rv;
+    dst->begin = buf;
+    dst->end = buf + N;
+    return true;
 }
 
 static bool cd_xml_decode_entities(cd_xml_parse_context_t* ctx,
@@ -823,9 +2294,16 @@ static bool cd_xml_decode_entities(cd_xml_parse_context_t* ctx,
         *out = in;
         return true;
     }
+    CD_XML_STATS_PHASE_BEGIN(phase_start);
+    CD_XML_STATS_ADD(entity_decodes, amps);
   
     ptrdiff_t size = in.end - in.begin;
     char* begin = cd_xml_alloc_buf(ctx->doc, size);
+    if (begin == NULL) {
+        ctx->status = CD_XML_STATUS_OUT_OF_MEMORY;
+        cd_xml_report_error(ctx, in.begin, in.end, "Failed to allocate memory");
+        return false;
+    }
     char* end = begin;
     while(in.begin < in.end) {
         if(*in.begin == '&') {
@@ -946,9 +2424,100 @@ static bool cd_xml_decode_entities(cd_xml_parse_context_t* ctx,
     
     out->begin = begin;
     out->end = end;
+    CD_XML_STATS_ADD(bytes_copied, end - begin);
+    CD_XML_STATS_PHASE_END(phase_start, CD_XML_PHASE_ENTITIES);
     return true;
 }
 
+// Check the entity starting with '&' at p without decoding it, returns pointer past it or NULL if malformed.
+//
+// Accepts the same entities as cd_xml_decode_entities.
+static const char* cd_xml_check_entity(cd_xml_parse_context_t* ctx, const char* p, const char* end)
+{
+    const char* entity_start = p++;
+    const char* semicolon = p < end ? (const char*)memchr(p, ';', end - p) : NULL;
+    if (semicolon == NULL) {
+        ctx->status = CD_XML_STATUS_MALFORMED_ENTITY;
+        cd_xml_report_error(ctx, entity_start, end, "Failed to find terminating ; of entity");
+        return NULL;
+    }
+    cd_xml_stringview_t e = { p, semicolon };
+    if (p < semicolon && *p == '#') {
+        bool hex = p + 1 < semicolon && p[1] == 'x';
+        uint32_t code = 0;
+        for (p += hex ? 2 : 1; p < semicolon; p++) {
+            unsigned c = (unsigned char)*p;
+            unsigned digit = ('0' <= c && c <= '9') ? c - '0' :
+                             (hex && 'a' <= c && c <= 'f') ? c - 'a' + 10 :
+                             (hex && 'A' <= c && c <= 'F') ? c - 'A' + 10 : 16;
+            if ((hex ? 16 : 10) <= digit) {
+                ctx->status = CD_XML_STATUS_MALFORMED_ENTITY;
+                cd_xml_report_error(ctx, entity_start, p + 1, "Illegal digit %c in entity", c);
+                return NULL;
+            }
+            code = (hex ? code << 4 : 10u * code) + digit;
+            if (0x10ffff < code) {
+                ctx->status = CD_XML_STATUS_MALFORMED_ENTITY;
+                cd_xml_report_error(ctx, entity_start, p + 1, "Entity code too large for UTF-8 encoding");
+                return NULL;
+            }
+        }
+    }
+    else if (!(cd_xml_strcmp(&e, "quot") || cd_xml_strcmp(&e, "amp") || cd_xml_strcmp(&e, "apos") ||
+               cd_xml_strcmp(&e, "lt") || cd_xml_strcmp(&e, "gt")))
+    {
+        ctx->status = CD_XML_STATUS_MALFORMED_ENTITY;
+        cd_xml_report_error(ctx, entity_start, semicolon, "Unrecognized named entity '%.*s'", CD_XML_STRINGVIEW_FORMAT(e));
+        return NULL;
+    }
+    return semicolon + 1;
+}
+
+// Check entities and UTF-8 of text or an attribute value for cd_xml_validate, skipping runs without entities
+// and non-ASCII 16 bytes at a time when SSE2 is available.
+//
+// Returns where the tokenizer should continue, which is end, a '\0', or malformed UTF-8 that the tokenizer
+// reports, or NULL if an entity is malformed.
+static const char* cd_xml_validate_text(cd_xml_parse_context_t* ctx, const char* p, const char* end)
+{
+#ifdef CD_XML_SSE2
+    const __m128i amp = _mm_set1_epi8('&');
+    const __m128i zero = _mm_setzero_si128();
+#endif
+    while (p < end) {
+#ifdef CD_XML_SSE2
+        for (; p + 16 <= end; p += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i*)p);
+            unsigned mask = (unsigned)_mm_movemask_epi8(_mm_or_si128(v, _mm_or_si128(_mm_cmpeq_epi8(v, amp), _mm_cmpeq_epi8(v, zero))));
+            if (mask) {
+                p += cd_xml_ctz(mask);
+                break;
+            }
+        }
+        if (end <= p) break;
+#endif
+        unsigned c = (unsigned char)*p;
+        if (c == '&') {
+            if ((p = cd_xml_check_entity(ctx, p, end)) == NULL) return NULL;
+        }
+        else if (c == '\0') {
+            return p;
+        }
+        else if (c < 0x80) {
+            p++;
+        }
+        else {
+            ptrdiff_t n = (c & 0xe0) == 0xc0 ? 2 : (c & 0xf0) == 0xe0 ? 3 : (c & 0xf8) == 0xf0 ? 4 : 0;
+            if (n == 0 || end - p < n) return p;
+            for (ptrdiff_t i = 1; i < n; i++) {
+                if (((unsigned char)p[i] & 0xc0) != 0x80) return p;
+            }
+            p += n;
+        }
+    }
+    return p;
+}
+
 static bool cd_xml_parse_attribute_value(cd_xml_parse_context_t* ctx, cd_xml_stringview_t* out)
 {
     cd_xml_token_kind_t delimiter = ctx->current.kind;
@@ -959,6 +2528,13 @@ static bool cd_xml_parse_attribute_value(cd_xml_parse_context_t* ctx, cd_xml_str
     }
     unsigned amps = 0;
     cd_xml_stringview_t in = ctx->chr.text;
+    if (ctx->doc == NULL) {     // Only validating, check up to the delimiter at once, see cd_xml_validate.
+        const char* end = (const char*)memchr(in.begin, (int)delimiter, ctx->input.end - in.begin);
+        const char* p = cd_xml_validate_text(ctx, in.begin, end ? end : ctx->input.end);
+        if (p == NULL) return false;
+        ctx->chr.text.end = p;
+        if (!cd_xml_next_char(ctx)) return false;
+    }
     while(ctx->chr.code && (ctx->chr.code != delimiter)) {
         if(ctx->chr.code == '&') { amps++; }
         if (!cd_xml_next_char(ctx)) return false;
@@ -969,6 +2545,10 @@ static bool cd_xml_parse_attribute_value(cd_xml_parse_context_t* ctx, cd_xml_str
         return false;
     }
     in.end = ctx->chr.text.begin;
+    if (ctx->doc == NULL) {
+        *out = in;
+        return cd_xml_next_char(ctx) && cd_xml_next_token(ctx);
+    }
     if (cd_xml_next_char(ctx)) {
         if (cd_xml_next_token(ctx)) {
             if (cd_xml_decode_entities(ctx, out, in, amps)) {
@@ -979,6 +2559,178 @@ static bool cd_xml_parse_attribute_value(cd_xml_parse_context_t* ctx, cd_xml_str
     return false;
 }
 
+// Peek at the encoding attribute of an XML declaration at the start of an
+// 8-bit input, without running the tokenizer. Returns an empty view if none.
+static cd_xml_stringview_t cd_xml_peek_declared_encoding(const char* p, const char* end)
+{
+    cd_xml_stringview_t none = { NULL, NULL };
+    if (end - p < 6 || memcmp(p, "<?xml", 5) != 0 || !(p[5] == ' ' || p[5] == '\t' || p[5] == '\n' || p[5] == '\r')) return none;
+    const char* decl_end = cd_xml_find_str(p, end, "?>", 2);
+    if (decl_end == NULL) return none;
+    const char* q = cd_xml_find_str(p + 5, decl_end, "encoding", 8);
+    if (q == NULL) return none;
+    q = cd_xml_skip_space(q, decl_end);
+    if (q == decl_end || *q != '=') return none;
+    q = cd_xml_skip_space(q + 1, decl_end);
+    if (q == decl_end || (*q != '"' && *q != '\'')) return none;
+    const char* value_end = (const char*)memchr(q + 1, *q, decl_end - q - 1);
+    if (value_end == NULL) return none;
+    cd_xml_stringview_t value = { q + 1, value_end };
+    return value;
+}
+
+// Transcode ISO-8859-1 to UTF-8, dst must hold 2*(end-src) bytes. Runs of
+// ASCII are copied 16 bytes at a time when SSE2 is available.
+static char* cd_xml_transcode_latin1(char* dst, const char* src, const char* end)
+{
+    while (src < end) {
+#ifdef CD_XML_SSE2
+        while (src + 16 <= end) {
+            __m128i v = _mm_loadu_si128((const __m128i*)src);
+            unsigned mask = (unsigned)_mm_movemask_epi8(v);
+            _mm_storeu_si128((__m128i*)dst, v);
+            if (mask) {
+                unsigned n = cd_xml_ctz(mask);
+                src += n;
+                dst += n;
+                break;
+            }
+            src += 16;
+            dst += 16;
+        }
+        if (src == end) break;
+#endif
+        uint8_t c = (uint8_t)*src++;
+        if (c < 0x80) {
+            *dst++ = (char)c;
+        }
+        else {
+            *dst++ = (char)(0xC0 | (c >> 6));
+            *dst++ = (char)(0x80 | (c & 0x3F));
+        }
+    }
+    return dst;
+}
+
+// Transcode UTF-16 to UTF-8, dst must hold 3*(end-src)/2 bytes. Returns NULL
+// on an unpaired surrogate, with *src pointing at the offending code unit.
+// Runs of ASCII are narrowed 8 code units at a time when SSE2 is available.
+static char* cd_xml_transcode_utf16(char* dst, const char** src, const char* end, bool big_endian)
+{
+    const uint8_t* p = (const uint8_t*)*src;
+    const uint8_t* e = (const uint8_t*)end;
+    const unsigned hi = big_endian ? 0 : 1;
+    const unsigned lo = big_endian ? 1 : 0;
+    while (p + 1 < e) {
+#ifdef CD_XML_SSE2
+        const __m128i non_ascii = _mm_set1_epi16((short)0xFF80);
+        const __m128i zero = _mm_setzero_si128();
+        while (p + 16 <= e) {
+            __m128i v = _mm_loadu_si128((const __m128i*)p);
+            if (big_endian) v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(v, non_ascii), zero)) != 0xFFFF) break;
+            _mm_storel_epi64((__m128i*)dst, _mm_packus_epi16(v, v));
+            p += 16;
+            dst += 8;
+        }
+        if (p + 1 >= e) break;
+#endif
+        uint32_t c = ((uint32_t)p[hi] << 8) | p[lo];
+        if (c < 0x80) {
+            *dst++ = (char)c;
+        }
+        else if (c < 0x800) {
+            *dst++ = (char)(0xC0 | (c >> 6));
+            *dst++ = (char)(0x80 | (c & 0x3F));
+        }
+        else if (c < 0xD800 || 0xDFFF < c) {
+            *dst++ = (char)(0xE0 | (c >> 12));
+            *dst++ = (char)(0x80 | ((c >> 6) & 0x3F));
+            *dst++ = (char)(0x80 | (c & 0x3F));
+        }
+        else {
+            uint32_t d = p + 3 < e ? (((uint32_t)p[2 + hi] << 8) | p[2 + lo]) : 0;
+            if (0xDBFF < c || d < 0xDC00 || 0xDFFF < d) {
+                *src = (const char*)p;
+                return NULL;
+            }
+            c = 0x10000 + ((c - 0xD800) << 10) + (d - 0xDC00);
+            *dst++ = (char)(0xF0 | (c >> 18));
+            *dst++ = (char)(0x80 | ((c >> 12) & 0x3F));
+            *dst++ = (char)(0x80 | ((c >> 6) & 0x3F));
+            *dst++ = (char)(0x80 | (c & 0x3F));
+            p += 2;
+        }
+        p += 2;
+    }
+    *src = (const char*)p;
+    return dst;
+}
+
+// Detect the input encoding from a BOM or the XML declaration, skip any BOM,
+// and transcode non-UTF-8 input in a single pass into a doc-owned buffer, so
+// the parser and the resulting strings can reference it directly.
+static bool cd_xml_transcode_input(cd_xml_parse_context_t* ctx)
+{
+    const char* begin = ctx->input.begin;
+    const char* end = ctx->input.end;
+    size_t size = end - begin;
+    const uint8_t* b = (const uint8_t*)begin;
+
+    if (3 <= size && b[0] == 0xEF && b[1] == 0xBB && b[2] == 0xBF) {
+        ctx->input.begin = begin + 3;
+        ctx->chr.text.end = ctx->input.begin;
+        return true;
+    }
+    if (2 <= size && ((b[0] == 0xFF && b[1] == 0xFE) || (b[0] == 0xFE && b[1] == 0xFF))) {
+        ctx->encoding = b[0] == 0xFF ? CD_XML_ENCODING_UTF16LE : CD_XML_ENCODING_UTF16BE;
+        begin += 2;
+    }
+    else if (4 <= size && b[0] == '<' && b[1] == 0 && b[2] == '?' && b[3] == 0) {
+        ctx->encoding = CD_XML_ENCODING_UTF16LE;
+    }
+    else if (4 <= size && b[0] == 0 && b[1] == '<' && b[2] == 0 && b[3] == '?') {
+        ctx->encoding = CD_XML_ENCODING_UTF16BE;
+    }
+    else {
+        cd_xml_stringview_t declared = cd_xml_peek_declared_encoding(begin, end);
+        if (!(cd_xml_strcasecmp(&declared, "ISO-8859-1") || cd_xml_strcasecmp(&declared, "Latin-1") || cd_xml_strcasecmp(&declared, "Latin1"))) return true;
+        ctx->encoding = CD_XML_ENCODING_LATIN1;
+    }
+
+    size = end - begin;
+    char* dst = NULL;
+    if (ctx->encoding == CD_XML_ENCODING_LATIN1) {
+        if (size && (SIZE_MAX / 2 < size || (dst = cd_xml_alloc_buf(ctx->doc, 2 * size)) == NULL)) {
+            cd_xml_stringview_t where = { begin, begin };
+            return cd_xml_report_failure(ctx, CD_XML_STATUS_OUT_OF_MEMORY, where);
+        }
+        ctx->input.end = size ? cd_xml_transcode_latin1(dst, begin, end) : dst;
+    }
+    else {
+        if (size & 1) {
+            ctx->status = CD_XML_STATUS_MALFORMED_UTF16;
+            cd_xml_report_error(ctx, end - 1, end, "Odd number of bytes in UTF-16 input");
+            return false;
+        }
+        if (size && (SIZE_MAX / 3 < size / 2 || (dst = cd_xml_alloc_buf(ctx->doc, 3 * (size / 2))) == NULL)) {
+            cd_xml_stringview_t where = { begin, begin };
+            return cd_xml_report_failure(ctx, CD_XML_STATUS_OUT_OF_MEMORY, where);
+        }
+        const char* src = begin;
+        ctx->input.end = size ? cd_xml_transcode_utf16(dst, &src, end, ctx->encoding == CD_XML_ENCODING_UTF16BE) : dst;
+        if (ctx->input.end == NULL) {
+            ctx->input.end = end;
+            ctx->status = CD_XML_STATUS_MALFORMED_UTF16;
+            cd_xml_report_error(ctx, src, src + 2 <= end ? src + 2 : end, "Unpaired surrogate in UTF-16 input");
+            return false;
+        }
+    }
+    ctx->input.begin = dst;
+    ctx->chr.text.end = dst;
+    return true;
+}
+
 static bool cd_xml_parse_xml_decl(cd_xml_parse_context_t* ctx, bool is_decl)
 {
     assert(ctx->matched.kind == is_decl ? CD_XML_TOKEN_XML_DECL_START : CD_XML_TOKEN_PROC_INSTR_START);
@@ -1003,8 +2755,12 @@ static bool cd_xml_parse_xml_decl(cd_xml_parse_context_t* ctx, bool is_decl)
                     }
                 }
                 else if(cd_xml_strcmp(&name, "encoding")) {
-                    if(cd_xml_strcmp(&value, "ASCII")) { }
-                    if(cd_xml_strcmp(&value, "UTF-8")) { }
+                    bool utf8 = cd_xml_strcasecmp(&value, "UTF-8") || cd_xml_strcasecmp(&value, "ASCII") || cd_xml_strcasecmp(&value, "US-ASCII");
+                    bool latin1 = cd_xml_strcasecmp(&value, "ISO-8859-1") || cd_xml_strcasecmp(&value, "Latin-1") || cd_xml_strcasecmp(&value, "Latin1");
+                    bool utf16 = cd_xml_strcasecmp(&value, "UTF-16") || cd_xml_strcasecmp(&value, "UTF-16LE") || cd_xml_strcasecmp(&value, "UTF-16BE");
+                    if(utf8 && ctx->encoding == CD_XML_ENCODING_UTF8) { }
+                    else if(latin1 && ctx->encoding == CD_XML_ENCODING_LATIN1) { }
+                    else if(utf16 && (ctx->encoding == CD_XML_ENCODING_UTF16LE || ctx->encoding == CD_XML_ENCODING_UTF16BE)) { }
                     else {
                         ctx->status = CD_XML_STATUS_UNSUPPORTED_ENCODING;
                         cd_xml_report_error(ctx, att_begin, ctx->chr.text.begin, "Unsupported encoding %.*s", CD_XML_STRINGVIEW_FORMAT(value));
@@ -1095,13 +2851,16 @@ static bool cd_xml_parse_attribute(cd_xml_parse_context_t* ctx)
         }
         
         cd_xml_ns_ix_t ns = cd_xml_add_namespace(ctx->doc, &name, &value, ctx->flags);
+        if(ns == cd_xml_no_ix) return cd_xml_report_doc_failure(ctx, ctx->doc->namespaces, name);
         
         cd_xml_namespace_binding_t binding = {
             .prefix = name,
             .namespace_ix = ns
         };
-        cd_xml_sb_push(ctx->namespace_resolve_stack, binding);
-        return ns != cd_xml_no_ix;
+        if(!cd_xml_sb_push(ctx->scratch_allocator, ctx->namespace_resolve_stack, binding)) {
+            return cd_xml_report_doc_failure(ctx, ctx->namespace_resolve_stack, name);
+        }
+        return true;
     }
 
     // Default namespace
@@ -1113,8 +2872,9 @@ static bool cd_xml_parse_attribute(cd_xml_parse_context_t* ctx)
         }
 
         cd_xml_ns_ix_t namespace_ix = cd_xml_add_namespace(ctx->doc, NULL, &value, ctx->flags);
+        if(namespace_ix == cd_xml_no_ix) return cd_xml_report_doc_failure(ctx, ctx->doc->namespaces, name);
         ctx->namespace_default = namespace_ix;
-        return namespace_ix != cd_xml_no_ix;
+        return true;
     }
     
     cd_xml_att_triple_t att = {
@@ -1122,28 +2882,129 @@ static bool cd_xml_parse_attribute(cd_xml_parse_context_t* ctx)
         .name = name,
         .value = value
     };
-    cd_xml_sb_push(ctx->attribute_stash, att);
+    if(!cd_xml_sb_push(ctx->scratch_allocator, ctx->attribute_stash, att)) {
+        return cd_xml_report_doc_failure(ctx, ctx->attribute_stash, name);
+    }
     return true;
 }
 
-static bool cd_xml_parse_element_tag_start(cd_xml_parse_context_t* ctx, cd_xml_stringview_t* ns, cd_xml_stringview_t* name)
+static cd_xml_select_t cd_xml_select_element(cd_xml_parse_context_t* ctx)
 {
-    assert(ctx->matched.kind == CD_XML_TOKEN_TAG_START);
-    if(!cd_xml_expect_token(ctx, CD_XML_TOKEN_NAME, "Expected element name")) return false;
-
-    ns->begin = NULL;
-    ns->end = NULL;
-    *name = ctx->matched.text;
-    if(cd_xml_match_token(ctx, CD_XML_TOKEN_COLON)) {
-        if (!cd_xml_match_token(ctx, CD_XML_TOKEN_NAME)) {
-            ctx->status = CD_XML_STATUS_UNEXPECTED_TOKEN;
-            cd_xml_report_error(ctx, name->begin, ctx->matched.text.end, "Expected element name after ':'");
-            return false;
+    cd_xml_ix_t depth = cd_xml_sb_size(ctx->keep_path_stack);
+    cd_xml_select_t rv = CD_XML_SELECT_SKIP;
+    for(size_t i = 0; i < ctx->keep_path_count; i++) {
+        const char* p = ctx->keep_paths[i];
+        if(*p == '/') p++;
+
+        bool match = true;
+        for(cd_xml_ix_t d = 0; match && d < depth; d++) {
+            cd_xml_stringview_t segment = { .begin = p, .end = strchr(p, '/') };
+            if(segment.end == NULL) segment.end = p + strlen(p);
+            match = !cd_xml_strv_empty(segment) &&
+                    (cd_xml_strcmp(&segment, "*") || cd_xml_strvcmp(&segment, &ctx->keep_path_stack[d]));
+            p = *segment.end ? segment.end + 1 : segment.end;
+        }
+        if(match) {
+            if(*p == '\0') return CD_XML_SELECT_KEEP;
+            rv = CD_XML_SELECT_ANCESTOR;
         }
-        *ns = *name;
-        *name = ctx->matched.text;
     }
-
+    return rv;
+}
+
+// Scans past '>' of a tag, skipping quoted attribute values. Returns NULL on EOF.
+static const char* cd_xml_skip_tag(const char* p, const char* end, bool* empty)
+{
+    while(p < end) {
+        char c = *p++;
+        if(c == '"' || c == '\'') {
+            p = (const char*)memchr(p, c, end - p);
+            if(p == NULL) return NULL;
+            p++;
+        }
+        else if(c == '>') {
+            *empty = p[-2] == '/';
+            return p;
+        }
+    }
+    return NULL;
+}
+
+// Skips the rest of an element whose name has just been matched, tracking only nesting, comments and quotes.
+static bool cd_xml_skip_element(cd_xml_parse_context_t* ctx)
+{
+    const char* tag_start = ctx->matched.text.begin;
+    const char* end = ctx->input.end;
+    bool empty = false;
+    const char* p = cd_xml_skip_tag(ctx->current.text.begin, end, &empty);
+    size_t depth = empty ? 0 : 1;
+    while(p && depth) {
+        p = (const char*)memchr(p, '<', end - p);
+        if(p == NULL || end - p < 2) {
+            p = NULL;
+        }
+        else if(p[1] == '/') {
+            p = (const char*)memchr(p, '>', end - p);
+            if(p) p++;
+            depth--;
+        }
+        else if(end - p >= 4 && memcmp(p, "<!--", 4) == 0) {
+            p = cd_xml_find_str(p + 4, end, "-->", 3);
+        }
+        else if(end - p >= 9 && memcmp(p, "<![CDATA[", 9) == 0) {
+            p = cd_xml_find_str(p + 9, end, "]]>", 3);
+        }
+        else if(p[1] == '?') {
+            p = cd_xml_find_str(p + 2, end, "?>", 2);
+        }
+        else {
+            p = cd_xml_skip_tag(p + 1, end, &empty);
+            if(!empty) depth++;
+        }
+    }
+    if(p == NULL) {
+        ctx->status = CD_XML_STATUS_PREMATURE_EOF;
+        cd_xml_report_error(ctx, tag_start, ctx->current.text.end, "EOF while skipping element");
+        return false;
+    }
+    ctx->chr.text.end = p;
+    return cd_xml_next_char(ctx) && cd_xml_next_token(ctx);
+}
+
+static bool cd_xml_parse_element_tag_start(cd_xml_parse_context_t* ctx, cd_xml_stringview_t* ns, cd_xml_stringview_t* name)
+{
+    assert(ctx->matched.kind == CD_XML_TOKEN_TAG_START);
+    if(!cd_xml_expect_token(ctx, CD_XML_TOKEN_NAME, "Expected element name")) return false;
+
+    ns->begin = NULL;
+    ns->end = NULL;
+    *name = ctx->matched.text;
+    if(cd_xml_match_token(ctx, CD_XML_TOKEN_COLON)) {
+        if (!cd_xml_match_token(ctx, CD_XML_TOKEN_NAME)) {
+            ctx->status = CD_XML_STATUS_UNEXPECTED_TOKEN;
+            cd_xml_report_error(ctx, name->begin, ctx->matched.text.end, "Expected element name after ':'");
+            return false;
+        }
+        *ns = *name;
+        *name = ctx->matched.text;
+    }
+
+    if(ctx->keep_paths && !ctx->keep_all) {
+        if(!cd_xml_sb_push(ctx->scratch_allocator, ctx->keep_path_stack, *name)) {
+            return cd_xml_report_doc_failure(ctx, ctx->keep_path_stack, *name);
+        }
+        switch(cd_xml_select_element(ctx)) {
+        case CD_XML_SELECT_SKIP:
+            ctx->skipped = true;
+            return cd_xml_skip_element(ctx);
+        case CD_XML_SELECT_KEEP:
+            ctx->keep_all = true;
+            break;
+        case CD_XML_SELECT_ANCESTOR:
+            break;
+        }
+    }
+
     // parse attributes
     // get all namespaces defines before we start to resolve stuff
     while(cd_xml_match_token(ctx, CD_XML_TOKEN_NAME)) {
@@ -1155,6 +3016,242 @@ static bool cd_xml_parse_element_tag_start(cd_xml_parse_context_t* ctx, cd_xml_s
 
 static bool cd_xml_parse_element(cd_xml_parse_context_t* ctx, cd_xml_node_ix_t parent);
 
+static bool cd_xml_looks_like_base64(const cd_xml_stringview_t* text);
+
+// Copy text without the comments inside it, so text on both sides of a comment becomes a single node.
+//
+// The tokenizer has already checked the comments. Processing instructions are left in text by the
+// tokenizer, so a '<' that does not start a comment is copied as is.
+static bool cd_xml_strip_comments(cd_xml_parse_context_t* ctx, cd_xml_stringview_t* out, cd_xml_stringview_t in)
+{
+    char* begin = cd_xml_alloc_buf(ctx->doc, in.end - in.begin);
+    if (begin == NULL) {
+        ctx->status = CD_XML_STATUS_OUT_OF_MEMORY;
+        cd_xml_report_error(ctx, in.begin, in.end, "Failed to allocate memory");
+        return false;
+    }
+    char* end = begin;
+    while (in.begin < in.end) {
+        const char* lt = memchr(in.begin, '<', in.end - in.begin);
+        if (lt == NULL) lt = in.end;
+        memcpy(end, in.begin, lt - in.begin);
+        end += lt - in.begin;
+        in.begin = lt;
+        if (in.begin == in.end) break;
+        if (4 <= in.end - in.begin && memcmp(in.begin, "<!--", 4) == 0) {
+            const char* comment = in.begin;
+            in.begin = cd_xml_find_str(in.begin + 4, in.end, "-->", 3);
+            if (in.begin == NULL) {
+                ctx->status = CD_XML_STATUS_PREMATURE_EOF;
+                cd_xml_report_error(ctx, comment, in.end, "Unterminated comment in text");
+                return false;
+            }
+        }
+        else {
+            *end++ = *in.begin++;
+        }
+    }
+    out->begin = begin;
+    out->end = end;
+    return true;
+}
+
+static bool cd_xml_parse_add_text(cd_xml_parse_context_t*   ctx,
+                                  cd_xml_stringview_t       text,
+                                  unsigned                  amps,
+                                  unsigned                  comments,
+                                  cd_xml_node_ix_t          parent)
+{
+    cd_xml_stringview_t where = text;
+    cd_xml_stringview_t decoded;
+    if (comments) {
+        if (!cd_xml_strip_comments(ctx, &text, text)) return false;
+        // Entity errors point into the stripped copy, so report them against it and not the input.
+        cd_xml_stringview_t input = ctx->input;
+        ctx->input = text;
+        bool ok = cd_xml_decode_entities(ctx, &decoded, text, amps);
+        ctx->input = input;
+        if (!ok) return false;
+    }
+    else if (!cd_xml_decode_entities(ctx, &decoded, text, amps)) return false;
+    cd_xml_node_ix_t text_ix = cd_xml_add_text(ctx->doc, &decoded, parent, ctx->flags);
+    if (text_ix == cd_xml_no_ix) return cd_xml_report_failure(ctx, cd_xml_push_failure(cd_xml_doc_node_count(ctx->doc), sizeof(cd_xml_node_t)), where);
+    if ((ctx->flags & CD_XML_FLAGS_TAG_BASE64) &&
+        (amps == 0) &&
+        (CD_XML_BASE64_TAG_MIN_SIZE <= (size_t)(text.end - text.begin)) &&
+        cd_xml_looks_like_base64(&text))
+    {
+        cd_xml_doc_node(ctx->doc, text_ix)->data.text.flags = CD_XML_TEXT_BASE64;
+    }
+    return true;
+}
+
+// Build the structural index of a lazily parsed doc, the offsets of all '<', '>', '"' and '\'' of the input.
+static bool cd_xml_lazy_build_index(cd_xml_parse_context_t* ctx)
+{
+    cd_xml_lazy_t* lazy = ctx->doc->lazy;
+    const cd_xml_allocator_t* allocator = &ctx->doc->allocator;
+    const char* begin = ctx->input.begin;
+    const char* end = ctx->input.end;
+    cd_xml_stringview_t where = { begin, begin };
+    if ((size_t)cd_xml_no_ix <= (size_t)(end - begin)) return cd_xml_report_failure(ctx, CD_XML_STATUS_LIMIT_EXCEEDED, where);
+    lazy->input = ctx->input;
+    lazy->indexed = true;
+
+    const char* p = begin;
+#ifdef CD_XML_SSE2
+    const __m128i lt = _mm_set1_epi8('<');
+    const __m128i gt = _mm_set1_epi8('>');
+    const __m128i quot = _mm_set1_epi8('"');
+    const __m128i apos = _mm_set1_epi8('\'');
+    for (; p + 16 <= end; p += 16) {
+        if (lazy->offsets == NULL || cd_xml__sb_cap(lazy->offsets) - cd_xml__sb_size(lazy->offsets) < 16) {
+            if (!cd_xml__sb_grow_to(allocator, (void**)&lazy->offsets, sizeof(cd_xml_ix_t), cd_xml_sb_size(lazy->offsets) + 16)) {
+                return cd_xml_report_doc_failure(ctx, lazy->offsets, where);
+            }
+        }
+        __m128i v = _mm_loadu_si128((const __m128i*)p);
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, lt), _mm_cmpeq_epi8(v, gt)),
+                                                                 _mm_or_si128(_mm_cmpeq_epi8(v, quot), _mm_cmpeq_epi8(v, apos))));
+        cd_xml_ix_t* out = lazy->offsets + cd_xml__sb_size(lazy->offsets);
+        while (mask) {
+            *out++ = (cd_xml_ix_t)(p - begin) + cd_xml_ctz(mask);
+            mask &= mask - 1;
+        }
+        cd_xml__sb_size(lazy->offsets) = (cd_xml_ix_t)(out - lazy->offsets);
+    }
+#endif
+    for (; p < end; p++) {
+        if (*p == '<' || *p == '>' || *p == '"' || *p == '\'') {
+            if (!cd_xml_sb_push(allocator, lazy->offsets, (cd_xml_ix_t)(p - begin))) return cd_xml_report_doc_failure(ctx, lazy->offsets, where);
+        }
+    }
+    return true;
+}
+
+// Find the end tag matching the start tag ending at tag_end by walking the structural index, NULL if there is none.
+static const char* cd_xml_lazy_find_end_tag(const cd_xml_lazy_t* lazy, const char* tag_end)
+{
+    const char* base = lazy->input.begin;
+    const char* end = lazy->input.end;
+    const cd_xml_ix_t* offsets = lazy->offsets;
+    cd_xml_ix_t n = cd_xml_sb_size(offsets);
+
+    // First index entry past tag_end.
+    cd_xml_ix_t target = (cd_xml_ix_t)(tag_end - base);
+    cd_xml_ix_t i = 0;
+    for (cd_xml_ix_t hi = n; i < hi; ) {
+        cd_xml_ix_t mid = i + (hi - i) / 2;
+        if (offsets[mid] <= target) i = mid + 1;
+        else hi = mid;
+    }
+
+    size_t depth = 0;
+    for (; i < n; i++) {
+        const char* p = base + offsets[i];
+        if (*p != '<') continue;
+        if (end - p < 2) return NULL;
+
+        const char* skip_to = NULL;
+        if (end - p >= 4 && memcmp(p, "<!--", 4) == 0) {
+            skip_to = cd_xml_find_str(p + 4, end, "-->", 3);
+        }
+        else if (end - p >= 9 && memcmp(p, "<![CDATA[", 9) == 0) {
+            skip_to = cd_xml_find_str(p + 9, end, "]]>", 3);
+        }
+        else if (p[1] == '?') {
+            skip_to = cd_xml_find_str(p + 2, end, "?>", 2);
+        }
+        else {
+            bool closing = p[1] == '/';
+            if (closing && depth == 0) return p;
+
+            // Find the '>' of the tag, ignoring any inside quoted attribute values.
+            char quote = 0;
+            for (i++; i < n; i++) {
+                char c = base[offsets[i]];
+                if (quote) {
+                    if (c == quote) quote = 0;
+                }
+                else if (c == '"' || c == '\'') quote = c;
+                else if (c == '>') break;
+            }
+            if (i == n) return NULL;
+            if (closing) depth--;
+            else if (base[offsets[i] - 1] != '/') depth++;
+            continue;
+        }
+        if (skip_to == NULL) return NULL;
+        while (i + 1 < n && base + offsets[i + 1] < skip_to) i++;
+    }
+    return NULL;
+}
+
+// Register the element whose start tag was just matched as unexpanded, and jump to its end tag.
+static bool cd_xml_lazy_skip_contents(cd_xml_parse_context_t* ctx, cd_xml_stringview_t* elem_namespace, cd_xml_node_ix_t elem)
+{
+    cd_xml_lazy_t* lazy = ctx->doc->lazy;
+    const cd_xml_allocator_t* allocator = &ctx->doc->allocator;
+    const char* tag_end = ctx->matched.text.begin;
+    cd_xml_stringview_t where = { tag_end, ctx->matched.text.end };
+    if (ctx->status != CD_XML_STATUS_SUCCESS) return false;
+    if (!lazy->indexed && !cd_xml_lazy_build_index(ctx)) return false;
+
+    // Snapshot bindings in scope, siblings usually share the snapshot of the previous element.
+    cd_xml_ix_t count = cd_xml_sb_size(ctx->namespace_resolve_stack);
+    cd_xml_lazy_elem_t pending = {
+        .tag_end = tag_end,
+        .prefix = *elem_namespace,
+        .namespace_default = ctx->namespace_default
+    };
+    cd_xml_ix_t pending_count = cd_xml_sb_size(lazy->pending);
+    const cd_xml_lazy_elem_t* last = pending_count ? &lazy->pending[pending_count - 1] : NULL;
+    bool shared = last && last->bindings_end - last->bindings_begin == count;
+    for (cd_xml_ix_t i = 0; shared && i < count; i++) {
+        const cd_xml_namespace_binding_t* a = &lazy->bindings[last->bindings_begin + i];
+        const cd_xml_namespace_binding_t* b = &ctx->namespace_resolve_stack[i];
+        shared = a->prefix.begin == b->prefix.begin && a->prefix.end == b->prefix.end && a->namespace_ix == b->namespace_ix;
+    }
+    if (shared) {
+        pending.bindings_begin = last->bindings_begin;
+        pending.bindings_end = last->bindings_end;
+    }
+    else {
+        pending.bindings_begin = cd_xml_sb_size(lazy->bindings);
+        for (cd_xml_ix_t i = 0; i < count; i++) {
+            if (!cd_xml_sb_push(allocator, lazy->bindings, ctx->namespace_resolve_stack[i])) return cd_xml_report_doc_failure(ctx, lazy->bindings, where);
+        }
+        pending.bindings_end = cd_xml_sb_size(lazy->bindings);
+    }
+
+    while (cd_xml_sb_size(lazy->node_pending) <= elem) {
+        if (!cd_xml_sb_push(allocator, lazy->node_pending, cd_xml_no_ix)) return cd_xml_report_doc_failure(ctx, lazy->node_pending, where);
+    }
+    if (!cd_xml_sb_push(allocator, lazy->pending, pending)) return cd_xml_report_doc_failure(ctx, lazy->pending, where);
+    lazy->node_pending[elem] = pending_count;
+
+    const char* end_tag = cd_xml_lazy_find_end_tag(lazy, tag_end);
+    if (end_tag == NULL) {
+        ctx->status = CD_XML_STATUS_PREMATURE_EOF;
+        cd_xml_report_error(ctx, where.begin, where.end, "EOF while skipping element");
+        return false;
+    }
+    ctx->chr.text.end = end_tag;
+    return cd_xml_next_char(ctx) && cd_xml_next_token(ctx);
+}
+
+static void cd_xml_lazy_free(cd_xml_doc_t* doc)
+{
+    cd_xml_lazy_t* lazy = doc->lazy;
+    if (lazy == NULL) return;
+    cd_xml_sb_free(&doc->allocator, lazy->offsets);
+    cd_xml_sb_free(&doc->allocator, lazy->pending);
+    cd_xml_sb_free(&doc->allocator, lazy->node_pending);
+    cd_xml_sb_free(&doc->allocator, lazy->bindings);
+    cd_xml_dealloc(&doc->allocator, lazy, sizeof(cd_xml_lazy_t));
+    doc->lazy = NULL;
+}
+
 static bool cd_xml_parse_element_contents(cd_xml_parse_context_t*   ctx,
                                           cd_xml_stringview_t*      elem_namespace,
                                           cd_xml_stringview_t*      elem_name,
@@ -1172,9 +3269,14 @@ static bool cd_xml_parse_element_contents(cd_xml_parse_context_t*   ctx,
     }
 
     unsigned amps = 0;
+    unsigned comments = 0;
     cd_xml_stringview_t text = { NULL, NULL};
     const char* tag_start = ctx->matched.text.begin;
 
+    if(ctx->doc->lazy && ctx->level) {
+        if(!cd_xml_lazy_skip_contents(ctx, elem_namespace, parent)) return false;
+    }
+
     while(ctx->status == CD_XML_STATUS_SUCCESS) {
 
         if(cd_xml_match_token(ctx, CD_XML_TOKEN_ENDTAG_START)) {
@@ -1198,23 +3300,40 @@ static bool cd_xml_parse_element_contents(cd_xml_parse_context_t*   ctx,
 
             if(!cd_xml_expect_token(ctx, CD_XML_TOKEN_TAG_END, "In end-tag, expected >")) return false;
 
-            if(text.begin != NULL) {
-                cd_xml_stringview_t decoded;
-                if (!cd_xml_decode_entities(ctx, &decoded, text, amps)) return false;
-                cd_xml_add_text(ctx->doc, &decoded, parent, ctx->flags);
-                text.begin = NULL;
+            if(text.begin != NULL && (ctx->keep_all || !ctx->keep_paths)) {
+                if (!cd_xml_parse_add_text(ctx, text, amps, comments, parent)) return false;
             }
+            text.begin = NULL;
+            amps = 0;
+            comments = 0;
             break;
         }
 
+        else if(cd_xml_match_token(ctx, CD_XML_TOKEN_CDATA)) {
+
+            if(text.begin != NULL && (ctx->keep_all || !ctx->keep_paths)) {
+                if (!cd_xml_parse_add_text(ctx, text, amps, comments, parent)) return false;
+            }
+            text.begin = NULL;
+            amps = 0;
+            comments = 0;
+
+            cd_xml_stringview_t content = { ctx->matched.text.begin + 9, ctx->matched.text.end - 3 };
+            if(!cd_xml_strv_empty(content) && (ctx->keep_all || !ctx->keep_paths)) {
+                cd_xml_node_ix_t text_ix = cd_xml_add_text(ctx->doc, &content, parent, ctx->flags);
+                if (text_ix == cd_xml_no_ix) return cd_xml_report_failure(ctx, cd_xml_push_failure(cd_xml_doc_node_count(ctx->doc), sizeof(cd_xml_node_t)), content);
+                cd_xml_doc_node(ctx->doc, text_ix)->data.text.flags = CD_XML_TEXT_CDATA;
+            }
+        }
+
         else if(cd_xml_match_token(ctx, CD_XML_TOKEN_TAG_START)) {
 
-            if(text.begin != NULL) {
-                cd_xml_stringview_t decoded;
-                if (!cd_xml_decode_entities(ctx, &decoded, text, amps)) return false;
-                cd_xml_add_text(ctx->doc, &decoded, parent, ctx->flags);
-                text.begin = NULL;
+            if(text.begin != NULL && (ctx->keep_all || !ctx->keep_paths)) {
+                if (!cd_xml_parse_add_text(ctx, text, amps, comments, parent)) return false;
             }
+            text.begin = NULL;
+            amps = 0;
+            comments = 0;
 
             if(!cd_xml_parse_element(ctx, parent)) return false;
 
@@ -1236,6 +3355,9 @@ static bool cd_xml_parse_element_contents(cd_xml_parse_context_t*   ctx,
             if(text.begin == NULL) {
                 text.begin = ctx->current.text.begin;
             }
+            else if(ctx->after_comment) {
+                comments++;
+            }
             text.end = ctx->current.text.end;
             cd_xml_next_token(ctx);
         }
@@ -1250,17 +3372,19 @@ static bool cd_xml_resolve_namespace(cd_xml_parse_context_t*    ctx,
 {
     // Note: Assumption here is that the number of namespaces are pretty low (1-3),
     // so a linear search suffices.
-    unsigned n = cd_xml_sb_size(ctx->namespace_resolve_stack);
+    CD_XML_STATS_PHASE_BEGIN(phase_start);
+    cd_xml_ix_t n = cd_xml_sb_size(ctx->namespace_resolve_stack);
 #ifdef _WIN32
 #pragma warning(push)
 #pragma warning(disable:6293)
 #endif
-    for(unsigned i = n-1; i<n; i--) {
+    for(cd_xml_ix_t i = n-1; i<n; i--) {
 #ifdef _WIN32
 #pragma warning(pop)
 #endif
         if(cd_xml_strvcmp(&ctx->namespace_resolve_stack[i].prefix, prefix)) {
             *ns_ix = ctx->namespace_resolve_stack[i].namespace_ix;
+            CD_XML_STATS_PHASE_END(phase_start, CD_XML_PHASE_NAMESPACES);
             return true;
         }
     }
@@ -1272,12 +3396,21 @@ static bool cd_xml_resolve_namespace(cd_xml_parse_context_t*    ctx,
 static bool cd_xml_parse_element(cd_xml_parse_context_t* ctx, cd_xml_node_ix_t parent)
 {
     cd_xml_ns_ix_t parent_default_ns = ctx->namespace_default;
-    unsigned parent_bind_stack_height = cd_xml_sb_size(ctx->namespace_resolve_stack);
+    cd_xml_ix_t parent_bind_stack_height = cd_xml_sb_size(ctx->namespace_resolve_stack);
+    cd_xml_ix_t parent_keep_path_height = cd_xml_sb_size(ctx->keep_path_stack);
+    bool parent_keep_all = ctx->keep_all;
 
     cd_xml_stringview_t elem_ns = { NULL, NULL };
     cd_xml_stringview_t elem_name = ctx->matched.text;
 
+    bool rv = false;
     if(cd_xml_parse_element_tag_start(ctx, &elem_ns, &elem_name)) {
+        if(ctx->skipped) {
+            ctx->skipped = false;
+            rv = true;
+            goto done;
+        }
+
 
 
         cd_xml_ns_ix_t elem_ns_ix = ctx->namespace_default;
@@ -1285,8 +3418,9 @@ static bool cd_xml_parse_element(cd_xml_parse_context_t* ctx, cd_xml_node_ix_t p
             if(!cd_xml_resolve_namespace(ctx, &elem_ns_ix, &elem_ns)) return false;
         }
         cd_xml_node_ix_t elem_ix = cd_xml_add_element(ctx->doc, elem_ns_ix, &elem_name, parent, ctx->flags);
+        if(elem_ix == cd_xml_no_ix) return cd_xml_report_failure(ctx, cd_xml_push_failure(cd_xml_doc_node_count(ctx->doc), sizeof(cd_xml_node_t)), elem_name);
 
-        for(unsigned i=0; i<cd_xml_sb_size(ctx->attribute_stash); i++) {
+        for(cd_xml_ix_t i=0; i<cd_xml_sb_size(ctx->attribute_stash); i++) {
             cd_xml_att_triple_t* att = &ctx->attribute_stash[i];
 
             cd_xml_ns_ix_t att_ns_ix = cd_xml_no_ix;
@@ -1295,24 +3429,112 @@ static bool cd_xml_parse_element(cd_xml_parse_context_t* ctx, cd_xml_node_ix_t p
             }
 
             
-            cd_xml_add_attribute(ctx->doc,
-                                 att_ns_ix,
-                                 &att->name,
-                                 &att->value,
-                                 elem_ix,
-                                 ctx->flags);
+            if(cd_xml_add_attribute(ctx->doc,
+                                    att_ns_ix,
+                                    &att->name,
+                                    &att->value,
+                                    elem_ix,
+                                    ctx->flags) == cd_xml_no_ix)
+            {
+                return cd_xml_report_failure(ctx, cd_xml_push_failure(cd_xml_doc_attribute_count(ctx->doc), sizeof(cd_xml_attribute_t)), att->name);
+            }
         }
+        // Stash is consumed, don't let attributes carry over to child elements.
+        cd_xml_sb_shrink(ctx->attribute_stash, 0);
 
-
-        if(cd_xml_parse_element_contents(ctx, &elem_ns, &elem_name, elem_ix)) {
-            cd_xml_sb_shrink(ctx->namespace_resolve_stack, parent_bind_stack_height);
-            ctx->namespace_default = parent_default_ns;
-            return true;
-        }
+        ctx->level++;
+        rv = cd_xml_parse_element_contents(ctx, &elem_ns, &elem_name, elem_ix);
+        ctx->level--;
     }
+done:
     cd_xml_sb_shrink(ctx->namespace_resolve_stack, parent_bind_stack_height);
+    cd_xml_sb_shrink(ctx->keep_path_stack, parent_keep_path_height);
     ctx->namespace_default = parent_default_ns;
-    return false;
+    ctx->keep_all = parent_keep_all;
+    return rv;
+}
+
+#ifdef CD_XML_SEGMENTED
+
+// Grow a segmented array to count items, allocating new blocks as needed.
+static bool cd_xml_seg_resize(const cd_xml_allocator_t* allocator, void*** blocks, cd_xml_ix_t* size, size_t item_size, uint64_t count)
+{
+    if ((uint64_t)cd_xml_no_ix - 1 < count) return false;
+    cd_xml_ix_t block_count = (cd_xml_ix_t)((count + CD_XML_SEGMENT_SIZE - 1) >> CD_XML_SEGMENT_SHIFT);
+    while (cd_xml_sb_size(*blocks) < block_count) {
+        void* block = cd_xml_alloc(allocator, item_size << CD_XML_SEGMENT_SHIFT);
+        if (block == NULL) return false;
+        if (!cd_xml_sb_push(allocator, *blocks, block)) {
+            cd_xml_dealloc(allocator, block, item_size << CD_XML_SEGMENT_SHIFT);
+            return false;
+        }
+    }
+    *size = (cd_xml_ix_t)count;
+    return true;
+}
+
+static void cd_xml_seg_free(const cd_xml_allocator_t* allocator, void*** blocks, size_t item_size)
+{
+    for (cd_xml_ix_t i = 0; i < cd_xml_sb_size(*blocks); i++) {
+        cd_xml_dealloc(allocator, (*blocks)[i], item_size << CD_XML_SEGMENT_SHIFT);
+    }
+    cd_xml_sb_free(allocator, *blocks);
+}
+
+static bool cd_xml_resize_nodes(cd_xml_doc_t* doc, uint64_t count)
+{
+    return cd_xml_seg_resize(&doc->allocator, (void***)&doc->node_blocks, &doc->node_count, sizeof(cd_xml_node_t), count);
+}
+
+static bool cd_xml_resize_attributes(cd_xml_doc_t* doc, uint64_t count)
+{
+    return cd_xml_seg_resize(&doc->allocator, (void***)&doc->attribute_blocks, &doc->attribute_count, sizeof(cd_xml_attribute_t), count);
+}
+
+#else
+
+static bool cd_xml_resize_nodes(cd_xml_doc_t* doc, uint64_t count)
+{
+    if (SIZE_MAX < count || !cd_xml__sb_grow_to(&doc->allocator, (void**)&doc->nodes, sizeof(cd_xml_node_t), (size_t)count)) return false;
+    cd_xml__sb_size(doc->nodes) = (cd_xml_ix_t)count;
+    return true;
+}
+
+static bool cd_xml_resize_attributes(cd_xml_doc_t* doc, uint64_t count)
+{
+    if (SIZE_MAX < count || !cd_xml__sb_grow_to(&doc->allocator, (void**)&doc->attributes, sizeof(cd_xml_attribute_t), (size_t)count)) return false;
+    cd_xml__sb_size(doc->attributes) = (cd_xml_ix_t)count;
+    return true;
+}
+
+#endif
+
+// Append an uninitialized node, returns NULL on failure.
+static cd_xml_node_t* cd_xml_push_node(cd_xml_doc_t* doc)
+{
+    cd_xml_ix_t ix = cd_xml_doc_node_count(doc);
+#ifdef CD_XML_SEGMENTED
+    if (ix & (CD_XML_SEGMENT_SIZE - 1)) doc->node_count++;  // Room in last block.
+    else if (!cd_xml_resize_nodes(doc, (uint64_t)ix + 1)) return NULL;
+#else
+    if (!cd_xml__sb_maybe_grow(&doc->allocator, doc->nodes)) return NULL;
+    cd_xml__sb_size(doc->nodes)++;
+#endif
+    return cd_xml_doc_node(doc, ix);
+}
+
+// Append an uninitialized attribute, returns NULL on failure.
+static cd_xml_attribute_t* cd_xml_push_attribute(cd_xml_doc_t* doc)
+{
+    cd_xml_ix_t ix = cd_xml_doc_attribute_count(doc);
+#ifdef CD_XML_SEGMENTED
+    if (ix & (CD_XML_SEGMENT_SIZE - 1)) doc->attribute_count++;
+    else if (!cd_xml_resize_attributes(doc, (uint64_t)ix + 1)) return NULL;
+#else
+    if (!cd_xml__sb_maybe_grow(&doc->allocator, doc->attributes)) return NULL;
+    cd_xml__sb_size(doc->attributes)++;
+#endif
+    return cd_xml_doc_attribute(doc, ix);
 }
 
 cd_xml_att_ix_t cd_xml_add_namespace(cd_xml_doc_t* doc,
@@ -1324,7 +3546,7 @@ cd_xml_att_ix_t cd_xml_add_namespace(cd_xml_doc_t* doc,
 
     // Assume that number of namespaces are quite low, so
     // a linear search will do for now.
-    for(unsigned i=0; i<cd_xml_sb_size(doc->namespaces); i++) {
+    for(cd_xml_ix_t i=0; i<cd_xml_sb_size(doc->namespaces); i++) {
         if(cd_xml_strvcmp(&doc->namespaces[i].uri, uri)) {
             // Match
             return i;
@@ -1332,14 +3554,17 @@ cd_xml_att_ix_t cd_xml_add_namespace(cd_xml_doc_t* doc,
     }
 
     // Register new namespace
-    unsigned ix = cd_xml_sb_size(doc->namespaces);
+    cd_xml_ns_ix_t ix = cd_xml_sb_size(doc->namespaces);
     cd_xml_ns_t x = {0};
     bool copy = (flags & CD_XML_FLAGS_COPY_STRINGS);
     if (prefix) {
-        x.prefix = copy ? cd_xml_strvdup(doc, prefix) : *prefix;
+        if (!copy) x.prefix = *prefix;
+        else if (!cd_xml_strvdup(doc, &x.prefix, prefix)) return cd_xml_no_ix;
     }
-    x.uri = copy ? cd_xml_strvdup(doc, uri) : *uri;
-    cd_xml_sb_push(doc->namespaces, x);
+    if (!copy) x.uri = *uri;
+    else if (!cd_xml_strvdup(doc, &x.uri, uri)) return cd_xml_no_ix;
+    if (!cd_xml_sb_push(&doc->allocator, doc->namespaces, x)) return cd_xml_no_ix;
+    CD_XML_STATS_ADD(namespaces, 1);
     return ix;
 }
 
@@ -1349,8 +3574,8 @@ cd_xml_node_ix_t cd_xml_add_text(cd_xml_doc_t*        doc,
                                  cd_xml_flags_t       flags)
 {
     assert((parent != cd_xml_no_ix) && "Text node must have a parent");
-    assert((cd_xml_sb_size(doc->nodes) != 0) && "Text node cannot be root");
-    assert((doc->nodes[parent].kind == CD_XML_NODE_ELEMENT) && "Parent node of text must be an element");
+    assert((cd_xml_doc_node_count(doc) != 0) && "Text node cannot be root");
+    assert((cd_xml_doc_node(doc, parent)->kind == CD_XML_NODE_ELEMENT) && "Parent node of text must be an element");
 
     cd_xml_node_t text = {
         .next_sibling = cd_xml_no_ix,
@@ -1358,18 +3583,21 @@ cd_xml_node_ix_t cd_xml_add_text(cd_xml_doc_t*        doc,
         .kind = CD_XML_NODE_TEXT
     };
     if (flags & CD_XML_FLAGS_COPY_STRINGS) {
-        text.data.text.content = cd_xml_strvdup(doc, content);
+        if (!cd_xml_strvdup(doc, &text.data.text.content, content)) return cd_xml_no_ix;
     }
-    cd_xml_node_ix_t elem_ix = cd_xml_sb_size(doc->nodes);
-    cd_xml_sb_push(doc->nodes, text);
+    cd_xml_node_ix_t elem_ix = cd_xml_doc_node_count(doc);
+    cd_xml_node_t* slot = cd_xml_push_node(doc);
+    if (slot == NULL) return cd_xml_no_ix;
+    *slot = text;
+    CD_XML_STATS_ADD(nodes, 1);
     if (parent != cd_xml_no_ix) {
-        if (doc->nodes[parent].data.element.first_child == cd_xml_no_ix) {    // first child of parent
-            doc->nodes[parent].data.element.first_child = elem_ix;
-            doc->nodes[parent].data.element.last_child = elem_ix;
+        if (cd_xml_doc_node(doc, parent)->data.element.first_child == cd_xml_no_ix) {    // first child of parent
+            cd_xml_doc_node(doc, parent)->data.element.first_child = elem_ix;
+            cd_xml_doc_node(doc, parent)->data.element.last_child = elem_ix;
         }
         else {
-            doc->nodes[doc->nodes[parent].data.element.last_child].next_sibling = elem_ix;
-            doc->nodes[parent].data.element.last_child = elem_ix;
+            cd_xml_doc_node(doc, cd_xml_doc_node(doc, parent)->data.element.last_child)->next_sibling = elem_ix;
+            cd_xml_doc_node(doc, parent)->data.element.last_child = elem_ix;
         }
     }
     return elem_ix;
@@ -1382,8 +3610,8 @@ cd_xml_node_ix_t cd_xml_add_element(cd_xml_doc_t*        doc,
                                     cd_xml_node_ix_t     parent,
                                     cd_xml_flags_t       flags)
 {
-    assert(((parent != cd_xml_no_ix) || (cd_xml_sb_size(doc->nodes) == 0)) && "Root element must be the first element added to the document");
-    assert(((parent == cd_xml_no_ix) || (parent < cd_xml_sb_size(doc->nodes))) && "Invalid parent index");
+    assert(((parent != cd_xml_no_ix) || (cd_xml_doc_node_count(doc) == 0)) && "Root element must be the first element added to the document");
+    assert(((parent == cd_xml_no_ix) || (parent < cd_xml_doc_node_count(doc))) && "Invalid parent index");
 
     cd_xml_node_t element = {
         .next_sibling = cd_xml_no_ix,
@@ -1398,18 +3626,21 @@ cd_xml_node_ix_t cd_xml_add_element(cd_xml_doc_t*        doc,
         }
     };
     if (flags & CD_XML_FLAGS_COPY_STRINGS) {
-        element.data.element.name = cd_xml_strvdup(doc, name);
+        if (!cd_xml_strvdup(doc, &element.data.element.name, name)) return cd_xml_no_ix;
     }
-    cd_xml_node_ix_t elem_ix = cd_xml_sb_size(doc->nodes);
-    cd_xml_sb_push(doc->nodes, element);
+    cd_xml_node_ix_t elem_ix = cd_xml_doc_node_count(doc);
+    cd_xml_node_t* slot = cd_xml_push_node(doc);
+    if (slot == NULL) return cd_xml_no_ix;
+    *slot = element;
+    CD_XML_STATS_ADD(nodes, 1);
     if (parent != cd_xml_no_ix) {
-        if (doc->nodes[parent].data.element.first_child == cd_xml_no_ix) {    // first child of parent
-            doc->nodes[parent].data.element.first_child = elem_ix;
-            doc->nodes[parent].data.element.last_child = elem_ix;
+        if (cd_xml_doc_node(doc, parent)->data.element.first_child == cd_xml_no_ix) {    // first child of parent
+            cd_xml_doc_node(doc, parent)->data.element.first_child = elem_ix;
+            cd_xml_doc_node(doc, parent)->data.element.last_child = elem_ix;
         }
         else {
-            doc->nodes[doc->nodes[parent].data.element.last_child].next_sibling = elem_ix;
-            doc->nodes[parent].data.element.last_child = elem_ix;
+            cd_xml_doc_node(doc, cd_xml_doc_node(doc, parent)->data.element.last_child)->next_sibling = elem_ix;
+            cd_xml_doc_node(doc, parent)->data.element.last_child = elem_ix;
         }
     }
     return elem_ix;
@@ -1425,9 +3656,9 @@ cd_xml_att_ix_t cd_xml_add_attribute(cd_xml_doc_t*        doc,
     assert(name && "Name cannot be null");
     assert(value && "Value cannot be null");
     assert((ns == cd_xml_no_ix || ns < cd_xml_sb_size(doc->namespaces)) && "Illegal namespace index");
-    assert((element_ix < cd_xml_sb_size(doc->nodes)) && "Illegal element index");
+    assert((element_ix < cd_xml_doc_node_count(doc)) && "Illegal element index");
 
-    cd_xml_att_ix_t att_ix = cd_xml_sb_size(doc->attributes);
+    cd_xml_att_ix_t att_ix = cd_xml_doc_attribute_count(doc);
     cd_xml_attribute_t att = {
         .name = *name,
         .value = *value,
@@ -1435,12 +3666,15 @@ cd_xml_att_ix_t cd_xml_add_attribute(cd_xml_doc_t*        doc,
         .next_attribute = cd_xml_no_ix
     };
     if (flags & CD_XML_FLAGS_COPY_STRINGS) {
-        att.name = cd_xml_strvdup(doc, name);
-        att.value = cd_xml_strvdup(doc, value);  // Note: If invoked from parser, doc already owns this string.
+        if (!cd_xml_strvdup(doc, &att.name, name)) return cd_xml_no_ix;
+        if (!cd_xml_strvdup(doc, &att.value, value)) return cd_xml_no_ix;  // Note: If invoked from parser, doc already owns this string.
     }
-    cd_xml_sb_push(doc->attributes, att);
+    cd_xml_attribute_t* slot = cd_xml_push_attribute(doc);
+    if (slot == NULL) return cd_xml_no_ix;
+    *slot = att;
+    CD_XML_STATS_ADD(attributes, 1);
 
-    cd_xml_node_t* elem = &doc->nodes[element_ix];
+    cd_xml_node_t* elem = cd_xml_doc_node(doc, element_ix);
     assert(elem->kind == CD_XML_NODE_ELEMENT);
     
     if(elem->data.element.first_attribute == cd_xml_no_ix) {
@@ -1448,286 +3682,3756 @@ cd_xml_att_ix_t cd_xml_add_attribute(cd_xml_doc_t*        doc,
         elem->data.element.last_attribute = att_ix;
     }
     else {
-        doc->attributes[elem->data.element.last_attribute].next_attribute = att_ix;
+        cd_xml_doc_attribute(doc, elem->data.element.last_attribute)->next_attribute = att_ix;
         elem->data.element.last_attribute = att_ix;
     }
     return att_ix;
 }
 
-
-cd_xml_doc_t* cd_xml_init()
+// Unlink node from the children of parent, given the child before it or cd_xml_no_ix if node is first.
+static void cd_xml_unlink_child(cd_xml_doc_t* doc, cd_xml_node_ix_t parent, cd_xml_node_ix_t prev_ix, cd_xml_node_ix_t node)
 {
-    cd_xml_doc_t* doc = CD_XML_MALLOC(sizeof(cd_xml_doc_t));
-    assert(doc && "Failed to allocate memory");
-    memset(doc, 0, sizeof(cd_xml_doc_t));
-    return doc;
+    cd_xml_node_t* p = cd_xml_doc_node(doc, parent);
+    cd_xml_node_t* n = cd_xml_doc_node(doc, node);
+    if (prev_ix == cd_xml_no_ix) p->data.element.first_child = n->next_sibling;
+    else cd_xml_doc_node(doc, prev_ix)->next_sibling = n->next_sibling;
+    if (p->data.element.last_child == node) p->data.element.last_child = prev_ix;
+    n->next_sibling = cd_xml_no_ix;
 }
 
-void cd_xml_free(cd_xml_doc_t** doc)
+// Link a detached node into the children of parent between prev_ix and before, either may be cd_xml_no_ix.
+static void cd_xml_link_child(cd_xml_doc_t* doc, cd_xml_node_ix_t parent, cd_xml_node_ix_t prev_ix, cd_xml_node_ix_t before, cd_xml_node_ix_t node)
 {
-    assert(doc);
-    if (*doc == NULL) return;
+    cd_xml_node_t* p = cd_xml_doc_node(doc, parent);
+    cd_xml_doc_node(doc, node)->next_sibling = before;
+    if (prev_ix == cd_xml_no_ix) p->data.element.first_child = node;
+    else cd_xml_doc_node(doc, prev_ix)->next_sibling = node;
+    if (before == cd_xml_no_ix) p->data.element.last_child = node;
+}
 
-    cd_xml_sb_free((*doc)->namespaces);
-    cd_xml_sb_free((*doc)->nodes);
-    cd_xml_sb_free((*doc)->attributes);
-    cd_xml_buf_t* cb = (*doc)->allocated_buffers;
-    while(cb) {
-        cd_xml_buf_t* nb = cb->next;
-        CD_XML_FREE(cb);
-        cb = nb;
+bool cd_xml_remove_node(cd_xml_doc_t* doc, cd_xml_node_ix_t parent, cd_xml_node_ix_t node)
+{
+    assert(parent < cd_xml_doc_node_count(doc) && "Illegal parent index");
+    assert(node != 0 && "Root cannot be removed");
+    cd_xml_node_t* p = cd_xml_doc_node(doc, parent);
+    if (p->kind != CD_XML_NODE_ELEMENT) return false;
+
+    cd_xml_node_ix_t prev_ix = cd_xml_no_ix;
+    cd_xml_node_ix_t child_ix = p->data.element.first_child;
+    while (child_ix != cd_xml_no_ix && child_ix != node) {
+        prev_ix = child_ix;
+        child_ix = cd_xml_doc_node(doc, child_ix)->next_sibling;
     }
-    
-    *doc = NULL;
+    if (child_ix == cd_xml_no_ix) return false;
+    cd_xml_unlink_child(doc, parent, prev_ix, node);
+    return true;
 }
 
-
-cd_xml_parse_status_t cd_xml_init_and_parse(cd_xml_doc_t**  doc,
-                                            const char*     data,
-                                            size_t          size,
-                                            cd_xml_flags_t  flags)
+bool cd_xml_remove_attribute(cd_xml_doc_t* doc, cd_xml_node_ix_t element, cd_xml_att_ix_t attribute)
 {
-    if(*doc != NULL) {
-        return CD_XML_STATUS_POINTER_NOT_NULL;
-    }
-    *doc = cd_xml_init();
-    assert(*doc);
-    
-    cd_xml_parse_context_t ctx = {
-        .doc = *doc,
-        .input = {
-            .begin = data,
-            .end = data + size
-        },
-        .chr = {
-            .text = {
-                .end = data
-            }
-        },
-        .namespace_default = cd_xml_no_ix,
-        .flags = flags,
-        .status = CD_XML_STATUS_SUCCESS
-    };
-    
-    if (cd_xml_next_char(&ctx) && cd_xml_next_token(&ctx)) {
-        if(cd_xml_parse_prolog(&ctx)) {
-            if(cd_xml_expect_token(&ctx, CD_XML_TOKEN_TAG_START, "Expected element start '<'")) {
-                if(cd_xml_parse_element(&ctx, cd_xml_no_ix)) {
-                    if(cd_xml_expect_token(&ctx, CD_XML_TOKEN_EOF, "Expexted EOF")) {
-                        if(ctx.status == CD_XML_STATUS_SUCCESS) {
-                            goto exit;
-                        }
-                    }
-                }
-            }
-        }
+    assert(element < cd_xml_doc_node_count(doc) && "Illegal element index");
+    cd_xml_node_t* elem = cd_xml_doc_node(doc, element);
+    if (elem->kind != CD_XML_NODE_ELEMENT) return false;
+
+    cd_xml_att_ix_t prev_ix = cd_xml_no_ix;
+    cd_xml_att_ix_t att_ix = elem->data.element.first_attribute;
+    while (att_ix != cd_xml_no_ix && att_ix != attribute) {
+        prev_ix = att_ix;
+        att_ix = cd_xml_doc_attribute(doc, att_ix)->next_attribute;
     }
+    if (att_ix == cd_xml_no_ix) return false;
 
-    cd_xml_free(doc);
-    *doc = NULL;
+    cd_xml_attribute_t* att = cd_xml_doc_attribute(doc, attribute);
+    if (prev_ix == cd_xml_no_ix) elem->data.element.first_attribute = att->next_attribute;
+    else cd_xml_doc_attribute(doc, prev_ix)->next_attribute = att->next_attribute;
+    if (elem->data.element.last_attribute == attribute) elem->data.element.last_attribute = prev_ix;
+    att->next_attribute = cd_xml_no_ix;
+    return true;
+}
 
-exit:
-    cd_xml_sb_free(ctx.attribute_stash);
-    cd_xml_sb_free(ctx.namespace_resolve_stack);
+// Check if ix is node or a descendant of node.
+static bool cd_xml_subtree_contains(const cd_xml_doc_t* doc, cd_xml_node_ix_t node, cd_xml_node_ix_t ix)
+{
+    if (node == ix) return true;
+    const cd_xml_node_t* n = cd_xml_doc_node(doc, node);
+    if (n->kind != CD_XML_NODE_ELEMENT) return false;
+    for (cd_xml_node_ix_t child_ix = n->data.element.first_child; child_ix != cd_xml_no_ix; child_ix = cd_xml_doc_node(doc, child_ix)->next_sibling) {
+        if (cd_xml_subtree_contains(doc, child_ix, ix)) return true;
+    }
+    return false;
+}
 
-    return ctx.status;
+#ifndef NDEBUG
+// Check that no element has node as a child, linear in the size of the doc.
+static bool cd_xml_is_detached(const cd_xml_doc_t* doc, cd_xml_node_ix_t node)
+{
+    for (cd_xml_node_ix_t i = 0; i < cd_xml_doc_node_count(doc); i++) {
+        const cd_xml_node_t* n = cd_xml_doc_node(doc, i);
+        if (n->kind == CD_XML_NODE_ELEMENT && (n->data.element.first_child == node || n->data.element.last_child == node)) return false;
+        if (n->next_sibling == node) return false;
+    }
+    return true;
 }
+#endif
 
-static bool cd_xml_encode_and_write(cd_xml_output_func      output_func,
-                                    void*                   userdata,
-                                    cd_xml_stringview_t*    text)
+bool cd_xml_insert_before(cd_xml_doc_t* doc, cd_xml_node_ix_t parent, cd_xml_node_ix_t before, cd_xml_node_ix_t node)
 {
-    const char* done = text->begin;
-    for (const char* p = text->begin; p < text->end; p++) {
-        const char* enc = NULL;
-        switch (*p) {
-        case '"':  enc = "&quot;"; break;
-        case '&':  enc = "&amp;";  break;
-        case '\'': enc = "&apos;"; break;
-        case '<':  enc = "&lt;";   break;
-        case '>':  enc = "&gt;";   break;
-        default: break;
-        }
-        if (enc) {
-            if (0 < p - done) {
-                if (!output_func(userdata, done, p - done)) return false;
-            }
-            done = p + 1;
-            if (!output_func(userdata, CD_XML_WRITE_HELPER(enc))) return false;
-        }
+    assert(parent < cd_xml_doc_node_count(doc) && "Illegal parent index");
+    assert(node != 0 && node < cd_xml_doc_node_count(doc) && "Illegal node index");
+    cd_xml_node_t* p = cd_xml_doc_node(doc, parent);
+    if (p->kind != CD_XML_NODE_ELEMENT) return false;
+    if (cd_xml_doc_node(doc, node)->next_sibling != cd_xml_no_ix) return false;     // Still linked among siblings.
+    assert(cd_xml_is_detached(doc, node) && "Node must be detached before it is inserted");
+    if (cd_xml_subtree_contains(doc, node, parent)) return false;
+
+    cd_xml_node_ix_t prev_ix = cd_xml_no_ix;
+    if (before == cd_xml_no_ix) {
+        prev_ix = p->data.element.last_child;
     }
-    if (0 < text->end - done) {
-        if (!output_func(userdata, done, text->end - done)) return false;
+    else {
+        cd_xml_node_ix_t child_ix = p->data.element.first_child;
+        while (child_ix != cd_xml_no_ix && child_ix != before) {
+            prev_ix = child_ix;
+            child_ix = cd_xml_doc_node(doc, child_ix)->next_sibling;
+        }
+        if (child_ix == cd_xml_no_ix) return false;
     }
+    cd_xml_link_child(doc, parent, prev_ix, before, node);
     return true;
 }
 
-static bool cd_xml_write_indent(cd_xml_doc_t*       doc,
-                                cd_xml_output_func  output_func,
-                                void*               userdata,
+bool cd_xml_move_node(cd_xml_doc_t*     doc,
+                      cd_xml_node_ix_t  parent,
+                      cd_xml_node_ix_t  node,
+                      cd_xml_node_ix_t  new_parent,
+                      cd_xml_node_ix_t  before)
+{
+    assert(node < cd_xml_doc_node_count(doc) && "Illegal node index");
+    cd_xml_node_ix_t next_ix = cd_xml_doc_node(doc, node)->next_sibling;
+    if (!cd_xml_remove_node(doc, parent, node)) return false;
+    if (cd_xml_insert_before(doc, new_parent, before, node)) return true;
+    cd_xml_insert_before(doc, parent, next_ix, node);   // Put node back where it was.
+    return false;
+}
+
+// Copy a node with attributes and subtree into the node and attribute arrays of dst in pre-order.
+static cd_xml_node_ix_t cd_xml_compact_node(cd_xml_doc_t* dst, cd_xml_doc_t* src, cd_xml_node_ix_t src_ix)
+{
+    cd_xml_node_ix_t dst_ix = cd_xml_doc_node_count(dst);
+    cd_xml_node_t* node = cd_xml_push_node(dst);
+    if (node == NULL) return cd_xml_no_ix;
+    *node = *cd_xml_doc_node(src, src_ix);
+    node->next_sibling = cd_xml_no_ix;
+    if (node->kind != CD_XML_NODE_ELEMENT) return dst_ix;
+
+    node->data.element.first_attribute = cd_xml_no_ix;
+    node->data.element.last_attribute = cd_xml_no_ix;
+    node->data.element.first_child = cd_xml_no_ix;
+    node->data.element.last_child = cd_xml_no_ix;
+
+    cd_xml_att_ix_t prev_att = cd_xml_no_ix;
+    const cd_xml_node_t* src_node = cd_xml_doc_node(src, src_ix);
+    for (cd_xml_att_ix_t att_ix = src_node->data.element.first_attribute; att_ix != cd_xml_no_ix; att_ix = cd_xml_doc_attribute(src, att_ix)->next_attribute) {
+        cd_xml_att_ix_t new_att = cd_xml_doc_attribute_count(dst);
+        cd_xml_attribute_t* att = cd_xml_push_attribute(dst);
+        if (att == NULL) return cd_xml_no_ix;
+        *att = *cd_xml_doc_attribute(src, att_ix);
+        att->next_attribute = cd_xml_no_ix;
+        if (prev_att == cd_xml_no_ix) cd_xml_doc_node(dst, dst_ix)->data.element.first_attribute = new_att;
+        else cd_xml_doc_attribute(dst, prev_att)->next_attribute = new_att;
+        prev_att = new_att;
+    }
+    cd_xml_doc_node(dst, dst_ix)->data.element.last_attribute = prev_att;
+
+    cd_xml_node_ix_t prev_child = cd_xml_no_ix;
+    for (cd_xml_node_ix_t child_ix = src_node->data.element.first_child; child_ix != cd_xml_no_ix; child_ix = cd_xml_doc_node(src, child_ix)->next_sibling) {
+        cd_xml_node_ix_t new_child = cd_xml_compact_node(dst, src, child_ix);
+        if (new_child == cd_xml_no_ix) return cd_xml_no_ix;
+        if (prev_child == cd_xml_no_ix) cd_xml_doc_node(dst, dst_ix)->data.element.first_child = new_child;
+        else cd_xml_doc_node(dst, prev_child)->next_sibling = new_child;
+        prev_child = new_child;
+    }
+    cd_xml_doc_node(dst, dst_ix)->data.element.last_child = prev_child;
+    return dst_ix;
+}
+
+// Free the node and attribute arrays of a doc and leave them empty.
+static void cd_xml_free_items(cd_xml_doc_t* doc)
+{
+#ifdef CD_XML_SEGMENTED
+    cd_xml_seg_free(&doc->allocator, (void***)&doc->node_blocks, sizeof(cd_xml_node_t));
+    cd_xml_seg_free(&doc->allocator, (void***)&doc->attribute_blocks, sizeof(cd_xml_attribute_t));
+    doc->node_count = 0;
+    doc->attribute_count = 0;
+#else
+    cd_xml_sb_free(&doc->allocator, doc->nodes);
+    cd_xml_sb_free(&doc->allocator, doc->attributes);
+#endif
+}
+
+// Check if a lazily parsed doc has elements that are not expanded yet.
+static bool cd_xml_has_pending(const cd_xml_doc_t* doc)
+{
+    if (doc->lazy) {    // Unexpanded elements are tracked by node index.
+        for (cd_xml_ix_t i = 0; i < cd_xml_sb_size(doc->lazy->node_pending); i++) {
+            if (doc->lazy->node_pending[i] != cd_xml_no_ix) return true;
+        }
+    }
+    return false;
+}
+
+bool cd_xml_compact(cd_xml_doc_t* doc)
+{
+    if (doc == NULL || cd_xml_doc_node_count(doc) == 0) return true;
+    if (cd_xml_has_pending(doc)) return false;
+
+    cd_xml_doc_t dst = *doc;    // Shares namespaces, strings and allocator.
+#ifdef CD_XML_SEGMENTED
+    dst.node_blocks = NULL;
+    dst.attribute_blocks = NULL;
+    dst.node_count = 0;
+    dst.attribute_count = 0;
+#else
+    dst.nodes = NULL;
+    dst.attributes = NULL;
+#endif
+    if (cd_xml_compact_node(&dst, doc, 0) == cd_xml_no_ix) {
+        cd_xml_free_items(&dst);
+        return false;
+    }
+    cd_xml_free_items(doc);
+    *doc = dst;
+    return true;
+}
+
+static uint64_t cd_xml_hash_rotl(uint64_t x, unsigned r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+// Final avalanche of MurmurHash3.
+static uint64_t cd_xml_hash_fmix(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdull;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ull;
+    x ^= x >> 33;
+    return x;
+}
+
+static cd_xml_hash_t cd_xml_hash_init(uint64_t seed)
+{
+    cd_xml_hash_t hash = {
+        .lo = 0x9e3779b97f4a7c15ull ^ seed,
+        .hi = 0xcbf29ce484222325ull + seed
+    };
+    return hash;
+}
+
+// Mix one word into both lanes, as the body of 128-bit MurmurHash3 but with the lanes kept independent until
+// cd_xml_hash_final so they can be computed in parallel.
+static void cd_xml_hash_word(cd_xml_hash_t* hash, uint64_t word)
+{
+    hash->lo = cd_xml_hash_rotl(hash->lo ^ (word * 0x87c37b91114253d5ull), 27) * 5 + 0x52dce729;
+    hash->hi = cd_xml_hash_rotl(hash->hi ^ (word * 0x4cf5ad432745937full), 31) * 5 + 0x38495ab5;
+}
+
+// Mix a string in 8-byte words, where the last word holds the remaining bytes and the length, so that
+// concatenations of different strings differ.
+static void cd_xml_hash_string(cd_xml_hash_t* hash, const cd_xml_stringview_t* str)
+{
+    size_t size = str->end - str->begin;
+    const char* p = str->begin;
+    for (; p + 8 <= str->end; p += 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        cd_xml_hash_word(hash, word);
+    }
+    // Gather the 0-7 remaining bytes with fixed-size loads that may overlap, which is unambiguous as the
+    // length is known.
+    uint64_t tail = 0;
+    size_t rest = str->end - p;
+    if (rest >= 4) {
+        uint32_t a, b;
+        memcpy(&a, p, 4);
+        memcpy(&b, str->end - 4, 4);
+        tail = a | ((uint64_t)b << 32);
+    }
+    else if (rest) {
+        tail = (uint64_t)(unsigned char)p[0] | ((uint64_t)(unsigned char)p[rest >> 1] << 8) | ((uint64_t)(unsigned char)p[rest - 1] << 16);
+    }
+    cd_xml_hash_word(hash, tail + size * 0x9e3779b97f4a7c15ull);
+}
+
+// URI of a namespace, empty for no namespace.
+static cd_xml_stringview_t cd_xml_ns_uri(const cd_xml_doc_t* doc, cd_xml_ns_ix_t ns_ix)
+{
+    cd_xml_stringview_t none = { NULL, NULL };
+    return ns_ix == cd_xml_no_ix ? none : doc->namespaces[ns_ix].uri;
+}
+
+// Mix the URI of a namespace, where no namespace hashes as an empty URI.
+static void cd_xml_hash_namespace(cd_xml_hash_t* hash, const cd_xml_doc_t* doc, cd_xml_ns_ix_t ns_ix)
+{
+    cd_xml_stringview_t uri = cd_xml_ns_uri(doc, ns_ix);
+    cd_xml_hash_string(hash, &uri);
+}
+
+static cd_xml_hash_t cd_xml_hash_final(cd_xml_hash_t hash)
+{
+    hash.lo = cd_xml_hash_fmix(hash.lo);
+    hash.hi = cd_xml_hash_fmix(hash.hi);
+    hash.lo += hash.hi;
+    hash.hi += hash.lo;
+    return hash;
+}
+
+// Hash a node given the hashes of its children.
+static cd_xml_hash_t cd_xml_hash_node(const cd_xml_doc_t* doc, const cd_xml_hash_t* out, cd_xml_node_ix_t node_ix)
+{
+    const cd_xml_node_t* node = cd_xml_doc_node(doc, node_ix);
+    cd_xml_hash_t hash = cd_xml_hash_init(node->kind);
+    if (node->kind != CD_XML_NODE_ELEMENT) {
+        cd_xml_hash_string(&hash, &node->data.text.content);
+        return cd_xml_hash_final(hash);
+    }
+    cd_xml_hash_namespace(&hash, doc, node->data.element.namespace_ix);
+    cd_xml_hash_string(&hash, &node->data.element.name);
+
+    // Attributes are unordered, so their hashes are combined by addition.
+    cd_xml_hash_t atts = { 0, 0 };
+    uint64_t att_count = 0;
+    for (cd_xml_att_ix_t att_ix = node->data.element.first_attribute; att_ix != cd_xml_no_ix; att_ix = cd_xml_doc_attribute(doc, att_ix)->next_attribute) {
+        const cd_xml_attribute_t* att = cd_xml_doc_attribute(doc, att_ix);
+        cd_xml_hash_t att_hash = cd_xml_hash_init(CD_XML_NODE_TEXT + 1);     // Seeded apart from node kinds.
+        cd_xml_hash_namespace(&att_hash, doc, att->namespace_ix);
+        cd_xml_hash_string(&att_hash, &att->name);
+        cd_xml_hash_string(&att_hash, &att->value);
+        att_hash = cd_xml_hash_final(att_hash);
+        atts.lo += att_hash.lo;
+        atts.hi += att_hash.hi;
+        att_count++;
+    }
+    if (att_count) {
+        cd_xml_hash_word(&hash, atts.lo);
+        cd_xml_hash_word(&hash, atts.hi);
+    }
+
+    uint64_t child_count = 0;
+    for (cd_xml_node_ix_t child_ix = node->data.element.first_child; child_ix != cd_xml_no_ix; child_ix = cd_xml_doc_node(doc, child_ix)->next_sibling) {
+        cd_xml_hash_word(&hash, out[child_ix].lo);
+        cd_xml_hash_word(&hash, out[child_ix].hi);
+        child_count++;
+    }
+    cd_xml_hash_word(&hash, (att_count << 32) ^ child_count);   // Tells apart attributes from children.
+    return cd_xml_hash_final(hash);
+}
+
+// Hash the children of a node before the node itself, for docs where children may precede their parent.
+static void cd_xml_hash_subtree(const cd_xml_doc_t* doc, cd_xml_hash_t* out, cd_xml_node_ix_t node_ix)
+{
+    const cd_xml_node_t* node = cd_xml_doc_node(doc, node_ix);
+    if (node->kind == CD_XML_NODE_ELEMENT) {
+        for (cd_xml_node_ix_t child_ix = node->data.element.first_child; child_ix != cd_xml_no_ix; child_ix = cd_xml_doc_node(doc, child_ix)->next_sibling) {
+            cd_xml_hash_subtree(doc, out, child_ix);
+        }
+    }
+    out[node_ix] = cd_xml_hash_node(doc, out, node_ix);
+}
+
+bool cd_xml_hash_subtrees(const cd_xml_doc_t* doc, cd_xml_hash_t* out)
+{
+    cd_xml_ix_t node_count = cd_xml_doc_node_count(doc);
+    if (node_count == 0) return true;
+    if (cd_xml_has_pending(doc)) return false;
+
+    // Children have higher indices than their parent unless the doc was edited, so that a reverse sweep
+    // always finds the hashes of children done.
+    for (cd_xml_ix_t i = node_count; i-- > 0; ) {
+        const cd_xml_node_t* node = cd_xml_doc_node(doc, i);
+        if (node->kind == CD_XML_NODE_ELEMENT && node->data.element.first_child != cd_xml_no_ix) {
+            bool ordered = true;
+            for (cd_xml_node_ix_t child_ix = node->data.element.first_child; ordered && child_ix != cd_xml_no_ix; child_ix = cd_xml_doc_node(doc, child_ix)->next_sibling) {
+                ordered = i < child_ix;
+            }
+            if (!ordered) {
+                memset(out, 0, sizeof(cd_xml_hash_t) * node_count);
+                cd_xml_hash_subtree(doc, out, 0);
+                return true;
+            }
+        }
+        out[i] = cd_xml_hash_node(doc, out, i);
+    }
+    return true;
+}
+
+// Like cd_xml_strv, which as a C99 inline function has no external definition to fall back on.
+static cd_xml_stringview_t cd_xml_cstrv(const char* str)
+{
+    cd_xml_stringview_t rv = { str, str + strlen(str) };
+    return rv;
+}
+
+static bool cd_xml_hash_equal(const cd_xml_hash_t* a, const cd_xml_hash_t* b)
+{
+    return a->lo == b->lo && a->hi == b->hi;
+}
+
+// Find an attribute of an element by namespace URI and local name, returns cd_xml_no_ix if not found.
+static cd_xml_att_ix_t cd_xml_find_attribute(const cd_xml_doc_t*          doc,
+                                             cd_xml_node_ix_t             elem_ix,
+                                             const cd_xml_stringview_t*   uri,
+                                             const cd_xml_stringview_t*   name)
+{
+    for (cd_xml_att_ix_t att_ix = cd_xml_doc_node(doc, elem_ix)->data.element.first_attribute; att_ix != cd_xml_no_ix; att_ix = cd_xml_doc_attribute(doc, att_ix)->next_attribute) {
+        const cd_xml_attribute_t* att = cd_xml_doc_attribute(doc, att_ix);
+        if (!cd_xml_strvcmp(&att->name, name)) continue;
+        cd_xml_stringview_t att_uri = cd_xml_ns_uri(doc, att->namespace_ix);
+        if (cd_xml_strvcmp(&att_uri, uri)) return att_ix;
+    }
+    return cd_xml_no_ix;
+}
+
+// Namespace of dst with the URI of a namespace of src, which is added if missing.
+//
+// The prefix is kept unless it is taken, or empty since a default namespace would also apply to the
+// elements of dst without namespace when written.
+static cd_xml_ns_ix_t cd_xml_copy_namespace(cd_xml_doc_t* dst, const cd_xml_doc_t* src, cd_xml_ns_ix_t ns_ix)
+{
+    if (ns_ix == cd_xml_no_ix) return cd_xml_no_ix;
+    cd_xml_stringview_t uri = src->namespaces[ns_ix].uri;
+    cd_xml_stringview_t prefix = src->namespaces[ns_ix].prefix;
+    cd_xml_ix_t count = cd_xml_sb_size(dst->namespaces);
+    for (cd_xml_ix_t i = 0; i < count; i++) {
+        if (cd_xml_strvcmp(&dst->namespaces[i].uri, &uri)) return i;
+    }
+
+    char buf[32];
+    for (unsigned long long k = count; ; k++) {
+        bool taken = cd_xml_strv_empty(prefix);
+        for (cd_xml_ix_t i = 0; i < count && !taken; i++) {
+            taken = cd_xml_strvcmp(&dst->namespaces[i].prefix, &prefix);
+        }
+        if (!taken) break;
+        snprintf(buf, sizeof(buf), "ns%llu", k);
+        prefix = cd_xml_cstrv(buf);
+    }
+    return cd_xml_add_namespace(dst, &prefix, &uri, CD_XML_FLAGS_COPY_STRINGS);
+}
+
+// Copy a node of src with attributes and subtree into dst as the last child of parent, or detached if
+// parent is cd_xml_no_ix. Strings are copied, returns cd_xml_no_ix on failure.
+static cd_xml_node_ix_t cd_xml_copy_subtree(cd_xml_doc_t* dst, const cd_xml_doc_t* src, cd_xml_node_ix_t src_ix, cd_xml_node_ix_t parent)
+{
+    const cd_xml_node_t* src_node = cd_xml_doc_node(src, src_ix);
+    cd_xml_node_t node = *src_node;
+    node.next_sibling = cd_xml_no_ix;
+    if (node.kind == CD_XML_NODE_ELEMENT) {
+        node.data.element.namespace_ix = cd_xml_copy_namespace(dst, src, src_node->data.element.namespace_ix);
+        if (node.data.element.namespace_ix == cd_xml_no_ix && src_node->data.element.namespace_ix != cd_xml_no_ix) return cd_xml_no_ix;
+        if (!cd_xml_strvdup(dst, &node.data.element.name, &src_node->data.element.name)) return cd_xml_no_ix;
+        node.data.element.first_child = cd_xml_no_ix;
+        node.data.element.last_child = cd_xml_no_ix;
+        node.data.element.first_attribute = cd_xml_no_ix;
+        node.data.element.last_attribute = cd_xml_no_ix;
+    }
+    else if (!cd_xml_strvdup(dst, &node.data.text.content, &src_node->data.text.content)) return cd_xml_no_ix;
+
+    cd_xml_node_ix_t dst_ix = cd_xml_doc_node_count(dst);
+    cd_xml_node_t* slot = cd_xml_push_node(dst);
+    if (slot == NULL) return cd_xml_no_ix;
+    *slot = node;
+    CD_XML_STATS_ADD(nodes, 1);
+    if (parent != cd_xml_no_ix) {
+        cd_xml_link_child(dst, parent, cd_xml_doc_node(dst, parent)->data.element.last_child, cd_xml_no_ix, dst_ix);
+    }
+    if (node.kind != CD_XML_NODE_ELEMENT) return dst_ix;
+
+    for (cd_xml_att_ix_t att_ix = src_node->data.element.first_attribute; att_ix != cd_xml_no_ix; att_ix = cd_xml_doc_attribute(src, att_ix)->next_attribute) {
+        cd_xml_attribute_t att = *cd_xml_doc_attribute(src, att_ix);
+        cd_xml_ns_ix_t ns = cd_xml_copy_namespace(dst, src, att.namespace_ix);
+        if (ns == cd_xml_no_ix && att.namespace_ix != cd_xml_no_ix) return cd_xml_no_ix;
+        if (cd_xml_add_attribute(dst, ns, &att.name, &att.value, dst_ix, CD_XML_FLAGS_COPY_STRINGS) == cd_xml_no_ix) return cd_xml_no_ix;
+    }
+    for (cd_xml_node_ix_t child_ix = src_node->data.element.first_child; child_ix != cd_xml_no_ix; child_ix = cd_xml_doc_node(src, child_ix)->next_sibling) {
+        if (cd_xml_copy_subtree(dst, src, child_ix, dst_ix) == cd_xml_no_ix) return cd_xml_no_ix;
+    }
+    return dst_ix;
+}
+
+// Ops of an edit script, see cd_xml_diff.
+typedef enum {
+    CD_XML_EDIT_KEEP,                                       // Skip the next n children.
+    CD_XML_EDIT_DELETE,                                     // Detach the next n children.
+    CD_XML_EDIT_INSERT,                                     // Insert the children of the op.
+    CD_XML_EDIT_EDIT,                                       // Apply the ops of the op to the next child element.
+    CD_XML_EDIT_TEXT,                                       // Replace the content of the next child text.
+    CD_XML_EDIT_SET,                                        // Add or update the attributes of the op.
+    CD_XML_EDIT_UNSET,                                      // Remove the attributes of the op.
+    CD_XML_EDIT_RENAME,                                     // Give the element the name of the element child of the op.
+    CD_XML_EDIT_COUNT
+} cd_xml_edit_op_t;
+
+// Element names of the ops.
+static const char* cd_xml_edit_op_names[CD_XML_EDIT_COUNT] = { "keep", "delete", "insert", "edit", "text", "set", "unset", "rename" };
+
+// What to do with a child of an element, produced when matching the children of two elements.
+typedef struct {
+    cd_xml_edit_op_t            op;                         // CD_XML_EDIT_KEEP, _DELETE, _INSERT or _EDIT.
+    cd_xml_node_ix_t            a;                          // Child of a, cd_xml_no_ix for CD_XML_EDIT_INSERT.
+    cd_xml_node_ix_t            b;                          // Child of b, cd_xml_no_ix for CD_XML_EDIT_KEEP and _DELETE.
+} cd_xml_diff_step_t;
+
+// A child of a or b, sorted to find children with equal hashes or keys.
+typedef struct {
+    uint64_t                    lo;                         // Low bits of hash, or key.
+    uint64_t                    hi;                         // High bits of hash, zero for key.
+    cd_xml_ix_t                 side;                       // 0 for a child of a, 1 for a child of b.
+    cd_xml_ix_t                 pos;                        // Position in cd_xml_diff_t.children.
+} cd_xml_diff_entry_t;
+
+// A pair of children with a hash that occurs once among the children of both elements.
+typedef struct {
+    cd_xml_ix_t                 a;                          // Position of child of a in cd_xml_diff_t.children.
+    cd_xml_ix_t                 b;                          // Position of child of b in cd_xml_diff_t.children.
+    cd_xml_ix_t                 prev;                       // Previous anchor of longest increasing run ending here.
+} cd_xml_diff_anchor_t;
+
+typedef struct {
+    const cd_xml_doc_t*         a;                          // Doc to diff from.
+    const cd_xml_doc_t*         b;                          // Doc to diff to.
+    cd_xml_doc_t*               script;                     // Edit script being built.
+    cd_xml_hash_t*              a_hashes;                   // Subtree hashes of a.
+    cd_xml_hash_t*              b_hashes;                   // Subtree hashes of b.
+    cd_xml_node_ix_t*           children;                   // Children of a followed by children of b of the element pair being matched.
+    cd_xml_diff_entry_t*        entries;                    // Scratch for sorting children.
+    cd_xml_diff_anchor_t*       anchors;                    // Scratch for anchors.
+    cd_xml_ix_t*                chain;                      // Scratch for longest increasing run of anchors.
+    cd_xml_diff_step_t*         steps;                      // Steps of the element pairs being diffed, used as a stack.
+} cd_xml_diff_t;
+
+static int cd_xml_diff_entry_cmp(const void* a, const void* b)
+{
+    const cd_xml_diff_entry_t* x = (const cd_xml_diff_entry_t*)a;
+    const cd_xml_diff_entry_t* y = (const cd_xml_diff_entry_t*)b;
+    if (x->lo != y->lo) return x->lo < y->lo ? -1 : 1;
+    if (x->hi != y->hi) return x->hi < y->hi ? -1 : 1;
+    if (x->side != y->side) return x->side < y->side ? -1 : 1;
+    return x->pos < y->pos ? -1 : (x->pos > y->pos ? 1 : 0);
+}
+
+static int cd_xml_diff_anchor_cmp(const void* a, const void* b)
+{
+    const cd_xml_diff_anchor_t* x = (const cd_xml_diff_anchor_t*)a;
+    const cd_xml_diff_anchor_t* y = (const cd_xml_diff_anchor_t*)b;
+    return x->a < y->a ? -1 : (x->a > y->a ? 1 : 0);
+}
+
+// Key that children must share to be paired, made of the kind, and for elements the namespace URI, local
+// name and values of the key attributes id, key and name.
+static uint64_t cd_xml_diff_key(const cd_xml_doc_t* doc, cd_xml_node_ix_t node_ix)
+{
+    const cd_xml_node_t* node = cd_xml_doc_node(doc, node_ix);
+    cd_xml_hash_t hash = cd_xml_hash_init(node->kind);
+    if (node->kind == CD_XML_NODE_ELEMENT) {
+        cd_xml_hash_namespace(&hash, doc, node->data.element.namespace_ix);
+        cd_xml_hash_string(&hash, &node->data.element.name);
+        uint64_t keys = 0;
+        for (cd_xml_att_ix_t att_ix = node->data.element.first_attribute; att_ix != cd_xml_no_ix; att_ix = cd_xml_doc_attribute(doc, att_ix)->next_attribute) {
+            const cd_xml_attribute_t* att = cd_xml_doc_attribute(doc, att_ix);
+            if (att->namespace_ix != cd_xml_no_ix) continue;
+            if (!cd_xml_strcmp(&att->name, "id") && !cd_xml_strcmp(&att->name, "key") && !cd_xml_strcmp(&att->name, "name")) continue;
+            cd_xml_hash_t att_hash = cd_xml_hash_init(CD_XML_NODE_TEXT + 1);
+            cd_xml_hash_string(&att_hash, &att->name);
+            cd_xml_hash_string(&att_hash, &att->value);
+            keys += cd_xml_hash_final(att_hash).lo;
+        }
+        cd_xml_hash_word(&hash, keys);
+    }
+    return cd_xml_hash_final(hash).lo;
+}
+
+static bool cd_xml_diff_step(cd_xml_diff_t* diff, cd_xml_edit_op_t op, cd_xml_node_ix_t a, cd_xml_node_ix_t b)
+{
+    cd_xml_diff_step_t step = { op, a, b };
+    return cd_xml_sb_push(&diff->script->allocator, diff->steps, step);
+}
+
+// Keep a child of a if equal to the child of b it is paired with, otherwise edit it.
+static bool cd_xml_diff_pair(cd_xml_diff_t* diff, cd_xml_node_ix_t a, cd_xml_node_ix_t b)
+{
+    bool equal = cd_xml_hash_equal(&diff->a_hashes[a], &diff->b_hashes[b]);
+    return cd_xml_diff_step(diff, equal ? CD_XML_EDIT_KEEP : CD_XML_EDIT_EDIT, a, equal ? cd_xml_no_ix : b);
+}
+
+// Match children of a and b between anchors, pairing them in order by key.
+static bool cd_xml_diff_gap(cd_xml_diff_t* diff, cd_xml_ix_t a_begin, cd_xml_ix_t a_end, cd_xml_ix_t b_begin, cd_xml_ix_t b_end)
+{
+    const cd_xml_allocator_t* allocator = &diff->script->allocator;
+    cd_xml_sb_shrink(diff->entries, 0);
+    if (b_begin < b_end) {
+        for (cd_xml_ix_t i = a_begin; i < a_end; i++) {
+            cd_xml_diff_entry_t entry = { cd_xml_diff_key(diff->a, diff->children[i]), 0, 0, i };
+            if (!cd_xml_sb_push(allocator, diff->entries, entry)) return false;
+        }
+    }
+    cd_xml_ix_t entry_count = cd_xml_sb_size(diff->entries);
+    if (entry_count) qsort(diff->entries, entry_count, sizeof(cd_xml_diff_entry_t), cd_xml_diff_entry_cmp);
+
+    cd_xml_ix_t cursor = a_begin;
+    for (cd_xml_ix_t j = b_begin; j < b_end; j++) {
+        uint64_t key = cd_xml_diff_key(diff->b, diff->children[j]);
+        cd_xml_ix_t lo = 0, hi = entry_count;
+        while (lo < hi) {   // First entry with the key at or after cursor.
+            cd_xml_ix_t mid = lo + (hi - lo) / 2;
+            const cd_xml_diff_entry_t* e = &diff->entries[mid];
+            if (e->lo < key || (e->lo == key && e->pos < cursor)) lo = mid + 1;
+            else hi = mid;
+        }
+        if (lo < entry_count && diff->entries[lo].lo == key) {
+            cd_xml_ix_t pos = diff->entries[lo].pos;
+            for (; cursor < pos; cursor++) {
+                if (!cd_xml_diff_step(diff, CD_XML_EDIT_DELETE, diff->children[cursor], cd_xml_no_ix)) return false;
+            }
+            if (!cd_xml_diff_pair(diff, diff->children[pos], diff->children[j])) return false;
+            cursor = pos + 1;
+        }
+        else if (!cd_xml_diff_step(diff, CD_XML_EDIT_INSERT, cd_xml_no_ix, diff->children[j])) return false;
+    }
+    for (; cursor < a_end; cursor++) {
+        if (!cd_xml_diff_step(diff, CD_XML_EDIT_DELETE, diff->children[cursor], cd_xml_no_ix)) return false;
+    }
+    return true;
+}
+
+// Match the children of a_ix and b_ix and push the steps that turn the former into the latter.
+//
+// Equal children are trimmed from both ends, then children whose hash occurs exactly once on both sides
+// are used as anchors, and the longest run of anchors in the same order on both sides is kept. Children
+// between these are paired by cd_xml_diff_gap.
+static bool cd_xml_diff_children(cd_xml_diff_t* diff, cd_xml_node_ix_t a_ix, cd_xml_node_ix_t b_ix)
+{
+    const cd_xml_allocator_t* allocator = &diff->script->allocator;
+    cd_xml_sb_shrink(diff->children, 0);
+    for (cd_xml_node_ix_t child_ix = cd_xml_doc_node(diff->a, a_ix)->data.element.first_child; child_ix != cd_xml_no_ix; child_ix = cd_xml_doc_node(diff->a, child_ix)->next_sibling) {
+        if (!cd_xml_sb_push(allocator, diff->children, child_ix)) return false;
+    }
+    cd_xml_ix_t n = cd_xml_sb_size(diff->children);
+    for (cd_xml_node_ix_t child_ix = cd_xml_doc_node(diff->b, b_ix)->data.element.first_child; child_ix != cd_xml_no_ix; child_ix = cd_xml_doc_node(diff->b, child_ix)->next_sibling) {
+        if (!cd_xml_sb_push(allocator, diff->children, child_ix)) return false;
+    }
+    cd_xml_ix_t m = cd_xml_sb_size(diff->children) - n;
+    const cd_xml_node_ix_t* a = diff->children;
+    const cd_xml_node_ix_t* b = diff->children + n;
+
+    cd_xml_ix_t head = 0;
+    while (head < n && head < m && cd_xml_hash_equal(&diff->a_hashes[a[head]], &diff->b_hashes[b[head]])) head++;
+    cd_xml_ix_t tail = 0;
+    while (tail < n - head && tail < m - head && cd_xml_hash_equal(&diff->a_hashes[a[n - 1 - tail]], &diff->b_hashes[b[m - 1 - tail]])) tail++;
+    for (cd_xml_ix_t i = 0; i < head; i++) {
+        if (!cd_xml_diff_step(diff, CD_XML_EDIT_KEEP, a[i], cd_xml_no_ix)) return false;
+    }
+
+    cd_xml_sb_shrink(diff->entries, 0);
+    for (cd_xml_ix_t i = head; i < n - tail; i++) {
+        cd_xml_diff_entry_t entry = { diff->a_hashes[a[i]].lo, diff->a_hashes[a[i]].hi, 0, i };
+        if (!cd_xml_sb_push(allocator, diff->entries, entry)) return false;
+    }
+    for (cd_xml_ix_t j = head; j < m - tail; j++) {
+        cd_xml_diff_entry_t entry = { diff->b_hashes[b[j]].lo, diff->b_hashes[b[j]].hi, 1, n + j };
+        if (!cd_xml_sb_push(allocator, diff->entries, entry)) return false;
+    }
+    cd_xml_ix_t entry_count = cd_xml_sb_size(diff->entries);
+    if (entry_count) qsort(diff->entries, entry_count, sizeof(cd_xml_diff_entry_t), cd_xml_diff_entry_cmp);
+    cd_xml_sb_shrink(diff->anchors, 0);
+    for (cd_xml_ix_t i = 0; i < entry_count; ) {
+        cd_xml_ix_t e = i + 1;
+        while (e < entry_count && diff->entries[e].lo == diff->entries[i].lo && diff->entries[e].hi == diff->entries[i].hi) e++;
+        if (e == i + 2 && diff->entries[i].side == 0 && diff->entries[i + 1].side == 1) {
+            cd_xml_diff_anchor_t anchor = { diff->entries[i].pos, diff->entries[i + 1].pos, cd_xml_no_ix };
+            if (!cd_xml_sb_push(allocator, diff->anchors, anchor)) return false;
+        }
+        i = e;
+    }
+
+    // Longest run of anchors increasing on both sides, by patience sorting.
+    cd_xml_ix_t anchor_count = cd_xml_sb_size(diff->anchors);
+    if (anchor_count) qsort(diff->anchors, anchor_count, sizeof(cd_xml_diff_anchor_t), cd_xml_diff_anchor_cmp);
+    cd_xml_sb_shrink(diff->chain, 0);
+    for (cd_xml_ix_t k = 0; k < anchor_count; k++) {
+        cd_xml_ix_t lo = 0, hi = cd_xml_sb_size(diff->chain);
+        while (lo < hi) {
+            cd_xml_ix_t mid = lo + (hi - lo) / 2;
+            if (diff->anchors[diff->chain[mid]].b < diff->anchors[k].b) lo = mid + 1;
+            else hi = mid;
+        }
+        diff->anchors[k].prev = lo ? diff->chain[lo - 1] : cd_xml_no_ix;
+        if (lo < cd_xml_sb_size(diff->chain)) diff->chain[lo] = k;
+        else if (!cd_xml_sb_push(allocator, diff->chain, k)) return false;
+    }
+    cd_xml_ix_t run = cd_xml_sb_size(diff->chain);
+    for (cd_xml_ix_t k = run ? diff->chain[run - 1] : cd_xml_no_ix, i = run; k != cd_xml_no_ix; k = diff->anchors[k].prev) {
+        diff->chain[--i] = k;
+    }
+
+    // Gaps use entries, but anchors and chain are left intact.
+    cd_xml_ix_t a_pos = head;
+    cd_xml_ix_t b_pos = n + head;
+    for (cd_xml_ix_t i = 0; i < run; i++) {
+        const cd_xml_diff_anchor_t anchor = diff->anchors[diff->chain[i]];
+        if (!cd_xml_diff_gap(diff, a_pos, anchor.a, b_pos, anchor.b)) return false;
+        if (!cd_xml_diff_step(diff, CD_XML_EDIT_KEEP, diff->children[anchor.a], cd_xml_no_ix)) return false;
+        a_pos = anchor.a + 1;
+        b_pos = anchor.b + 1;
+    }
+    if (!cd_xml_diff_gap(diff, a_pos, n - tail, b_pos, n + m - tail)) return false;
+
+    for (cd_xml_ix_t i = n - tail; i < n; i++) {
+        if (!cd_xml_diff_step(diff, CD_XML_EDIT_KEEP, diff->children[i], cd_xml_no_ix)) return false;
+    }
+    return true;
+}
+
+static cd_xml_node_ix_t cd_xml_diff_op(cd_xml_diff_t* diff, cd_xml_node_ix_t parent, cd_xml_edit_op_t op)
+{
+    cd_xml_stringview_t name = cd_xml_cstrv(cd_xml_edit_op_names[op]);
+    return cd_xml_add_element(diff->script, cd_xml_no_ix, &name, parent, CD_XML_FLAGS_NONE);
+}
+
+static bool cd_xml_diff_element(cd_xml_diff_t* diff, cd_xml_node_ix_t op_ix, cd_xml_node_ix_t a_ix, cd_xml_node_ix_t b_ix);
+
+// Add ops for the steps in [begin, end) to op_ix, where runs of keep, delete and insert steps share an op.
+static bool cd_xml_diff_emit(cd_xml_diff_t* diff, cd_xml_node_ix_t op_ix, cd_xml_ix_t begin, cd_xml_ix_t end)
+{
+    for (cd_xml_ix_t i = begin; i < end; ) {
+        cd_xml_diff_step_t step = diff->steps[i];  // Copy, edits push steps of their own.
+        cd_xml_ix_t run = i + 1;
+        if (step.op != CD_XML_EDIT_EDIT) {
+            while (run < end && diff->steps[run].op == step.op) run++;
+            if (step.op == CD_XML_EDIT_KEEP && run == end) break;   // Remaining children are kept anyway.
+        }
+
+        const cd_xml_node_t* b = step.b != cd_xml_no_ix ? cd_xml_doc_node(diff->b, step.b) : NULL;
+        bool is_text = step.op == CD_XML_EDIT_EDIT && b->kind == CD_XML_NODE_TEXT;
+        cd_xml_node_ix_t child_op = cd_xml_diff_op(diff, op_ix, is_text ? CD_XML_EDIT_TEXT : step.op);
+        if (child_op == cd_xml_no_ix) return false;
+        if (step.op == CD_XML_EDIT_KEEP || step.op == CD_XML_EDIT_DELETE) {
+            char buf[32];
+            snprintf(buf, sizeof(buf), "%llu", (unsigned long long)(run - i));
+            cd_xml_stringview_t name = cd_xml_cstrv("n");
+            cd_xml_stringview_t value = cd_xml_cstrv(buf);
+            if (cd_xml_add_attribute(diff->script, cd_xml_no_ix, &name, &value, child_op, CD_XML_FLAGS_COPY_STRINGS) == cd_xml_no_ix) return false;
+        }
+        else if (step.op == CD_XML_EDIT_INSERT) {
+            for (cd_xml_ix_t k = i; k < run; k++) {
+                if (cd_xml_copy_subtree(diff->script, diff->b, diff->steps[k].b, child_op) == cd_xml_no_ix) return false;
+            }
+        }
+        else if (is_text) {
+            if (!cd_xml_strv_empty(b->data.text.content)) {
+                if (cd_xml_copy_subtree(diff->script, diff->b, step.b, child_op) == cd_xml_no_ix) return false;
+            }
+        }
+        else if (!cd_xml_diff_element(diff, child_op, step.a, step.b)) return false;
+        i = run;
+    }
+    return true;
+}
+
+// Add ops to op_ix that turn element a_ix of a into element b_ix of b, except for its name.
+static bool cd_xml_diff_element(cd_xml_diff_t* diff, cd_xml_node_ix_t op_ix, cd_xml_node_ix_t a_ix, cd_xml_node_ix_t b_ix)
+{
+    cd_xml_node_ix_t set_op = cd_xml_no_ix;
+    for (cd_xml_att_ix_t att_ix = cd_xml_doc_node(diff->b, b_ix)->data.element.first_attribute; att_ix != cd_xml_no_ix; att_ix = cd_xml_doc_attribute(diff->b, att_ix)->next_attribute) {
+        cd_xml_attribute_t att = *cd_xml_doc_attribute(diff->b, att_ix);
+        cd_xml_stringview_t uri = cd_xml_ns_uri(diff->b, att.namespace_ix);
+        cd_xml_att_ix_t a_att = cd_xml_find_attribute(diff->a, a_ix, &uri, &att.name);
+        if (a_att != cd_xml_no_ix && cd_xml_strvcmp(&cd_xml_doc_attribute(diff->a, a_att)->value, &att.value)) continue;
+
+        if (set_op == cd_xml_no_ix && (set_op = cd_xml_diff_op(diff, op_ix, CD_XML_EDIT_SET)) == cd_xml_no_ix) return false;
+        cd_xml_ns_ix_t ns = cd_xml_copy_namespace(diff->script, diff->b, att.namespace_ix);
+        if (ns == cd_xml_no_ix && att.namespace_ix != cd_xml_no_ix) return false;
+        if (cd_xml_add_attribute(diff->script, ns, &att.name, &att.value, set_op, CD_XML_FLAGS_COPY_STRINGS) == cd_xml_no_ix) return false;
+    }
+    cd_xml_node_ix_t unset_op = cd_xml_no_ix;
+    for (cd_xml_att_ix_t att_ix = cd_xml_doc_node(diff->a, a_ix)->data.element.first_attribute; att_ix != cd_xml_no_ix; att_ix = cd_xml_doc_attribute(diff->a, att_ix)->next_attribute) {
+        cd_xml_attribute_t att = *cd_xml_doc_attribute(diff->a, att_ix);
+        cd_xml_stringview_t uri = cd_xml_ns_uri(diff->a, att.namespace_ix);
+        if (cd_xml_find_attribute(diff->b, b_ix, &uri, &att.name) != cd_xml_no_ix) continue;
+
+        if (unset_op == cd_xml_no_ix && (unset_op = cd_xml_diff_op(diff, op_ix, CD_XML_EDIT_UNSET)) == cd_xml_no_ix) return false;
+        cd_xml_ns_ix_t ns = cd_xml_copy_namespace(diff->script, diff->a, att.namespace_ix);
+        if (ns == cd_xml_no_ix && att.namespace_ix != cd_xml_no_ix) return false;
+        cd_xml_stringview_t empty = cd_xml_cstrv("");
+        if (cd_xml_add_attribute(diff->script, ns, &att.name, &empty, unset_op, CD_XML_FLAGS_COPY_STRINGS) == cd_xml_no_ix) return false;
+    }
+
+    cd_xml_ix_t base = cd_xml_sb_size(diff->steps);
+    bool ok = cd_xml_diff_children(diff, a_ix, b_ix) && cd_xml_diff_emit(diff, op_ix, base, cd_xml_sb_size(diff->steps));
+    cd_xml_sb_shrink(diff->steps, base);
+    return ok;
+}
+
+cd_xml_doc_t* cd_xml_diff(const cd_xml_doc_t* a, const cd_xml_doc_t* b)
+{
+    if (cd_xml_doc_node_count(a) == 0 || cd_xml_doc_node_count(b) == 0) return NULL;
+    if (cd_xml_has_pending(a) || cd_xml_has_pending(b)) return NULL;
+
+    cd_xml_diff_t diff = { 0 };
+    diff.a = a;
+    diff.b = b;
+    diff.script = cd_xml_init_ex(&a->allocator);
+    if (diff.script == NULL) return NULL;
+    const cd_xml_allocator_t* allocator = &diff.script->allocator;
+    diff.a_hashes = (cd_xml_hash_t*)cd_xml_alloc(allocator, sizeof(cd_xml_hash_t) * cd_xml_doc_node_count(a));
+    diff.b_hashes = (cd_xml_hash_t*)cd_xml_alloc(allocator, sizeof(cd_xml_hash_t) * cd_xml_doc_node_count(b));
+
+    cd_xml_stringview_t patch_name = cd_xml_cstrv("patch");
+    bool ok = diff.a_hashes && diff.b_hashes && cd_xml_hash_subtrees(a, diff.a_hashes) && cd_xml_hash_subtrees(b, diff.b_hashes) &&
+              cd_xml_add_element(diff.script, cd_xml_no_ix, &patch_name, cd_xml_no_ix, CD_XML_FLAGS_NONE) != cd_xml_no_ix;
+    if (ok && !cd_xml_hash_equal(&diff.a_hashes[0], &diff.b_hashes[0])) {
+        const cd_xml_node_t* a_root = cd_xml_doc_node(a, 0);
+        const cd_xml_node_t* b_root = cd_xml_doc_node(b, 0);
+        cd_xml_stringview_t a_uri = cd_xml_ns_uri(a, a_root->data.element.namespace_ix);
+        cd_xml_stringview_t b_uri = cd_xml_ns_uri(b, b_root->data.element.namespace_ix);
+        if (!cd_xml_strvcmp(&a_uri, &b_uri) || !cd_xml_strvcmp(&a_root->data.element.name, &b_root->data.element.name)) {
+            cd_xml_node_ix_t rename_op = cd_xml_diff_op(&diff, 0, CD_XML_EDIT_RENAME);
+            cd_xml_stringview_t name = b_root->data.element.name;
+            cd_xml_ns_ix_t ns = cd_xml_copy_namespace(diff.script, b, b_root->data.element.namespace_ix);
+            ok = rename_op != cd_xml_no_ix && (ns != cd_xml_no_ix || b_root->data.element.namespace_ix == cd_xml_no_ix) &&
+                 cd_xml_add_element(diff.script, ns, &name, rename_op, CD_XML_FLAGS_COPY_STRINGS) != cd_xml_no_ix;
+        }
+        ok = ok && cd_xml_diff_element(&diff, 0, 0, 0);
+    }
+
+    if (diff.a_hashes) cd_xml_dealloc(allocator, diff.a_hashes, sizeof(cd_xml_hash_t) * cd_xml_doc_node_count(a));
+    if (diff.b_hashes) cd_xml_dealloc(allocator, diff.b_hashes, sizeof(cd_xml_hash_t) * cd_xml_doc_node_count(b));
+    cd_xml_sb_free(allocator, diff.children);
+    cd_xml_sb_free(allocator, diff.entries);
+    cd_xml_sb_free(allocator, diff.anchors);
+    cd_xml_sb_free(allocator, diff.chain);
+    cd_xml_sb_free(allocator, diff.steps);
+    if (!ok) cd_xml_free(&diff.script);
+    return diff.script;
+}
+
+// Parse the count of a keep or delete op.
+static bool cd_xml_patch_count(const cd_xml_doc_t* script, cd_xml_node_ix_t op_ix, size_t* count)
+{
+    cd_xml_stringview_t none = { NULL, NULL };
+    cd_xml_stringview_t name = cd_xml_cstrv("n");
+    cd_xml_att_ix_t att_ix = cd_xml_find_attribute(script, op_ix, &none, &name);
+    if (att_ix == cd_xml_no_ix) return false;
+    const cd_xml_stringview_t* value = &cd_xml_doc_attribute(script, att_ix)->value;
+    if (cd_xml_strv_empty(*value)) return false;
+    *count = 0;
+    for (const char* p = value->begin; p < value->end; p++) {
+        if (*p < '0' || '9' < *p || (SIZE_MAX - (size_t)(*p - '0')) / 10 < *count) return false;
+        *count = 10 * *count + (size_t)(*p - '0');
+    }
+    return true;
+}
+
+// Apply the ops that are children of op_ix of script to element elem_ix of doc.
+static bool cd_xml_patch_element(cd_xml_doc_t* doc, const cd_xml_doc_t* script, cd_xml_node_ix_t elem_ix, cd_xml_node_ix_t op_ix)
+{
+    cd_xml_node_ix_t prev_ix = cd_xml_no_ix;
+    cd_xml_node_ix_t child_ix = cd_xml_doc_node(doc, elem_ix)->data.element.first_child;
+    for (cd_xml_node_ix_t ix = cd_xml_doc_node(script, op_ix)->data.element.first_child; ix != cd_xml_no_ix; ix = cd_xml_doc_node(script, ix)->next_sibling) {
+        const cd_xml_node_t* op = cd_xml_doc_node(script, ix);
+        if (op->kind != CD_XML_NODE_ELEMENT) return false;
+        unsigned kind = 0;
+        while (kind < CD_XML_EDIT_COUNT && !cd_xml_strcmp(&op->data.element.name, cd_xml_edit_op_names[kind])) kind++;
+
+        size_t count = 0;
+        switch (kind) {
+        case CD_XML_EDIT_KEEP:
+            if (!cd_xml_patch_count(script, ix, &count)) return false;
+            for (; count; count--) {
+                if (child_ix == cd_xml_no_ix) return false;
+                prev_ix = child_ix;
+                child_ix = cd_xml_doc_node(doc, child_ix)->next_sibling;
+            }
+            break;
+        case CD_XML_EDIT_DELETE:
+            if (!cd_xml_patch_count(script, ix, &count)) return false;
+            for (; count; count--) {
+                if (child_ix == cd_xml_no_ix) return false;
+                cd_xml_node_ix_t next_ix = cd_xml_doc_node(doc, child_ix)->next_sibling;
+                cd_xml_unlink_child(doc, elem_ix, prev_ix, child_ix);
+                child_ix = next_ix;
+            }
+            break;
+        case CD_XML_EDIT_INSERT:
+            for (cd_xml_node_ix_t src_ix = op->data.element.first_child; src_ix != cd_xml_no_ix; src_ix = cd_xml_doc_node(script, src_ix)->next_sibling) {
+                cd_xml_node_ix_t node_ix = cd_xml_copy_subtree(doc, script, src_ix, cd_xml_no_ix);
+                if (node_ix == cd_xml_no_ix) return false;
+                cd_xml_link_child(doc, elem_ix, prev_ix, child_ix, node_ix);
+                prev_ix = node_ix;
+            }
+            break;
+        case CD_XML_EDIT_EDIT:
+            if (child_ix == cd_xml_no_ix || cd_xml_doc_node(doc, child_ix)->kind != CD_XML_NODE_ELEMENT) return false;
+            if (!cd_xml_patch_element(doc, script, child_ix, ix)) return false;
+            prev_ix = child_ix;
+            child_ix = cd_xml_doc_node(doc, child_ix)->next_sibling;
+            break;
+        case CD_XML_EDIT_TEXT: {
+            if (child_ix == cd_xml_no_ix || cd_xml_doc_node(doc, child_ix)->kind != CD_XML_NODE_TEXT) return false;
+            node_text_t text = { { NULL, NULL }, CD_XML_TEXT_NONE };
+            if (op->data.element.first_child != cd_xml_no_ix) {
+                const cd_xml_node_t* src = cd_xml_doc_node(script, op->data.element.first_child);
+                if (src->kind != CD_XML_NODE_TEXT || src->next_sibling != cd_xml_no_ix) return false;
+                text.flags = src->data.text.flags;
+                if (!cd_xml_strvdup(doc, &text.content, &src->data.text.content)) return false;
+            }
+            cd_xml_doc_node(doc, child_ix)->data.text = text;
+            prev_ix = child_ix;
+            child_ix = cd_xml_doc_node(doc, child_ix)->next_sibling;
+            break;
+        }
+        case CD_XML_EDIT_SET:
+            for (cd_xml_att_ix_t src_ix = op->data.element.first_attribute; src_ix != cd_xml_no_ix; src_ix = cd_xml_doc_attribute(script, src_ix)->next_attribute) {
+                cd_xml_attribute_t src = *cd_xml_doc_attribute(script, src_ix);
+                cd_xml_stringview_t uri = cd_xml_ns_uri(script, src.namespace_ix);
+                cd_xml_att_ix_t att_ix = cd_xml_find_attribute(doc, elem_ix, &uri, &src.name);
+                if (att_ix != cd_xml_no_ix) {
+                    cd_xml_stringview_t value;
+                    if (!cd_xml_strvdup(doc, &value, &src.value)) return false;
+                    cd_xml_doc_attribute(doc, att_ix)->value = value;
+                    continue;
+                }
+                cd_xml_ns_ix_t ns = cd_xml_copy_namespace(doc, script, src.namespace_ix);
+                if (ns == cd_xml_no_ix && src.namespace_ix != cd_xml_no_ix) return false;
+                if (cd_xml_add_attribute(doc, ns, &src.name, &src.value, elem_ix, CD_XML_FLAGS_COPY_STRINGS) == cd_xml_no_ix) return false;
+            }
+            break;
+        case CD_XML_EDIT_UNSET:
+            for (cd_xml_att_ix_t src_ix = op->data.element.first_attribute; src_ix != cd_xml_no_ix; src_ix = cd_xml_doc_attribute(script, src_ix)->next_attribute) {
+                const cd_xml_attribute_t* src = cd_xml_doc_attribute(script, src_ix);
+                cd_xml_stringview_t uri = cd_xml_ns_uri(script, src->namespace_ix);
+                cd_xml_att_ix_t att_ix = cd_xml_find_attribute(doc, elem_ix, &uri, &src->name);
+                if (att_ix == cd_xml_no_ix || !cd_xml_remove_attribute(doc, elem_ix, att_ix)) return false;
+            }
+            break;
+        case CD_XML_EDIT_RENAME: {
+            cd_xml_node_ix_t src_ix = op->data.element.first_child;
+            if (src_ix == cd_xml_no_ix || cd_xml_doc_node(script, src_ix)->kind != CD_XML_NODE_ELEMENT) return false;
+            const node_element_t* src = &cd_xml_doc_node(script, src_ix)->data.element;
+            cd_xml_stringview_t name;
+            cd_xml_ns_ix_t ns = cd_xml_copy_namespace(doc, script, src->namespace_ix);
+            if (ns == cd_xml_no_ix && src->namespace_ix != cd_xml_no_ix) return false;
+            if (!cd_xml_strvdup(doc, &name, &src->name)) return false;
+            cd_xml_doc_node(doc, elem_ix)->data.element.name = name;
+            cd_xml_doc_node(doc, elem_ix)->data.element.namespace_ix = ns;
+            break;
+        }
+        default:
+            return false;
+        }
+    }
+    return true;
+}
+
+bool cd_xml_patch(cd_xml_doc_t* doc, const cd_xml_doc_t* script)
+{
+    if (cd_xml_doc_node_count(doc) == 0 || cd_xml_doc_node_count(script) == 0) return false;
+    if (cd_xml_has_pending(doc)) return false;
+    const cd_xml_node_t* root = cd_xml_doc_node(script, 0);
+    if (root->kind != CD_XML_NODE_ELEMENT || !cd_xml_strcmp(&root->data.element.name, "patch")) return false;
+    return cd_xml_patch_element(doc, script, 0, 0);
+}
+
+
+cd_xml_doc_t* cd_xml_init()
+{
+    return cd_xml_init_ex(NULL);
+}
+
+cd_xml_doc_t* cd_xml_init_ex(const cd_xml_allocator_t* allocator)
+{
+    cd_xml_doc_t* doc = cd_xml_alloc(allocator, sizeof(cd_xml_doc_t));
+    if (doc == NULL) return NULL;
+    memset(doc, 0, sizeof(cd_xml_doc_t));
+    if (allocator) doc->allocator = *allocator;
+    return doc;
+}
+
+// Free all strings owned by doc.
+static void cd_xml_free_buffers(cd_xml_doc_t* doc)
+{
+    cd_xml_buf_t* cb = doc->allocated_buffers;
+    while(cb) {
+        cd_xml_buf_t* nb = cb->next;
+        cd_xml_dealloc(&doc->allocator, cb, offsetof(cd_xml_buf_t, payload) + cb->size);
+        cb = nb;
+    }
+    doc->allocated_buffers = NULL;
+    doc->arena = NULL;
+    doc->arena_used = 0;
+}
+
+// Bytes of a string buffer that hold strings.
+static size_t cd_xml_buf_used(const cd_xml_doc_t* doc, const cd_xml_buf_t* buf)
+{
+    return buf == doc->arena ? doc->arena_used : buf->size;
+}
+
+// Remove all contents of doc, keeping the capacity of its arrays for reuse.
+static void cd_xml_clear(cd_xml_doc_t* doc)
+{
+    cd_xml_sb_shrink(doc->namespaces, 0);
+#ifdef CD_XML_SEGMENTED
+    doc->node_count = 0;
+    doc->attribute_count = 0;
+#else
+    cd_xml_sb_shrink(doc->nodes, 0);
+    cd_xml_sb_shrink(doc->attributes, 0);
+#endif
+    // Replace the string buffers with a single arena that fits them all, so a doc that is refilled
+    // with similar contents stops allocating.
+    if (doc->allocated_buffers && doc->allocated_buffers == doc->arena && doc->arena->next == NULL) {
+        doc->arena_used = 0;
+        return;
+    }
+    size_t bytes = 0;
+    for (cd_xml_buf_t* buf = doc->allocated_buffers; buf; buf = buf->next) bytes += cd_xml_buf_used(doc, buf);
+    cd_xml_free_buffers(doc);
+    if (bytes && cd_xml_alloc_buf(doc, bytes)) {
+        doc->arena = doc->allocated_buffers;
+    }
+}
+
+void cd_xml_free(cd_xml_doc_t** doc)
+{
+    assert(doc);
+    if (*doc == NULL) return;
+
+    cd_xml_allocator_t allocator = (*doc)->allocator;
+    cd_xml_sb_free(&allocator, (*doc)->namespaces);
+    cd_xml_free_items(*doc);
+    cd_xml_free_buffers(*doc);
+    cd_xml_lazy_free(*doc);
+    cd_xml_dealloc(&allocator, *doc, sizeof(cd_xml_doc_t));
+    *doc = NULL;
+}
+
+
+static void cd_xml_memory_usage(cd_xml_memory_usage_t* usage, const void* ptr, size_t item_size)
+{
+    usage->count = cd_xml_sb_size(ptr);
+    usage->capacity = ptr ? cd_xml__sb_cap(ptr) : 0;
+    usage->bytes_used = item_size * usage->count;
+    usage->bytes_allocated = ptr ? 2 * sizeof(cd_xml_ix_t) + item_size * usage->capacity : 0;
+}
+
+#ifdef CD_XML_SEGMENTED
+static void cd_xml_memory_usage_segmented(cd_xml_memory_usage_t* usage, void** blocks, cd_xml_ix_t count, size_t item_size)
+{
+    cd_xml_memory_usage(usage, blocks, sizeof(void*));  // Block table.
+    usage->count = count;
+    usage->capacity = (size_t)cd_xml_sb_size(blocks) << CD_XML_SEGMENT_SHIFT;
+    usage->bytes_used = item_size * usage->count;
+    usage->bytes_allocated += item_size * usage->capacity;
+}
+#endif
+
+void cd_xml_doc_memory(const cd_xml_doc_t* doc, cd_xml_memory_report_t* report)
+{
+    memset(report, 0, sizeof(*report));
+    if (doc == NULL) return;
+#ifdef CD_XML_SEGMENTED
+    cd_xml_memory_usage_segmented(&report->nodes, (void**)doc->node_blocks, doc->node_count, sizeof(cd_xml_node_t));
+    cd_xml_memory_usage_segmented(&report->attributes, (void**)doc->attribute_blocks, doc->attribute_count, sizeof(cd_xml_attribute_t));
+#else
+    cd_xml_memory_usage(&report->nodes, doc->nodes, sizeof(cd_xml_node_t));
+    cd_xml_memory_usage(&report->attributes, doc->attributes, sizeof(cd_xml_attribute_t));
+#endif
+    cd_xml_memory_usage(&report->namespaces, doc->namespaces, sizeof(cd_xml_ns_t));
+    for (cd_xml_buf_t* buf = doc->allocated_buffers; buf; buf = buf->next) {
+        report->strings.count++;
+        report->strings.bytes_used += cd_xml_buf_used(doc, buf);
+        report->strings.bytes_allocated += offsetof(cd_xml_buf_t, payload) + buf->size;
+    }
+    report->strings.capacity = report->strings.count;
+
+    report->bytes_used = sizeof(cd_xml_doc_t);
+    report->bytes_allocated = sizeof(cd_xml_doc_t);
+    const cd_xml_memory_usage_t* parts[] = { &report->nodes, &report->attributes, &report->namespaces, &report->strings };
+    for (size_t i = 0; i < sizeof(parts) / sizeof(parts[0]); i++) {
+        report->bytes_used += parts[i]->bytes_used;
+        report->bytes_allocated += parts[i]->bytes_allocated;
+    }
+}
+
+// Old location and new location of a string buffer when compacting.
+typedef struct {
+    const char*                 begin;                      // Start of old payload.
+    const char*                 end;                        // End of old payload.
+    char*                       target;                     // Start of new location.
+} cd_xml_buf_remap_t;
+
+static int cd_xml_buf_remap_cmp(const void* a, const void* b)
+{
+    uintptr_t pa = (uintptr_t)((const cd_xml_buf_remap_t*)a)->begin;
+    uintptr_t pb = (uintptr_t)((const cd_xml_buf_remap_t*)b)->begin;
+    return pa < pb ? -1 : (pb < pa ? 1 : 0);
+}
+
+// Move a stringview that points into an old buffer to its new location, leave it alone otherwise.
+static void cd_xml_remap_strv(const cd_xml_buf_remap_t* remaps, size_t count, cd_xml_stringview_t* s)
+{
+    if (s->begin == NULL) return;
+    uintptr_t p = (uintptr_t)s->begin;
+    size_t lo = 0, hi = count;
+    while (lo < hi) {   // Find last buffer that starts at or before p.
+        size_t mid = lo + (hi - lo) / 2;
+        if ((uintptr_t)remaps[mid].begin <= p) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo == 0) return;
+    const cd_xml_buf_remap_t* r = &remaps[lo - 1];
+    size_t length = s->end - s->begin;
+    if ((uintptr_t)r->end < p + length || ((uintptr_t)r->end == p && length != 0)) return;
+    s->begin = r->target + (s->begin - r->begin);
+    s->end = s->begin + length;
+}
+
+static void cd_xml_compact_strings(cd_xml_doc_t* doc)
+{
+    size_t count = 0;
+    size_t bytes = 0;
+    for (cd_xml_buf_t* buf = doc->allocated_buffers; buf; buf = buf->next) {
+        count++;
+        bytes += cd_xml_buf_used(doc, buf);
+    }
+    if (count < 2) return;
+
+    cd_xml_buf_remap_t* remaps = (cd_xml_buf_remap_t*)cd_xml_alloc(&doc->allocator, sizeof(cd_xml_buf_remap_t) * count);
+    if (remaps == NULL) return;
+    cd_xml_buf_t* old_buffers = doc->allocated_buffers;
+    cd_xml_buf_t* old_arena = doc->arena;
+    doc->allocated_buffers = NULL;
+    doc->arena = NULL;
+    char* dst = cd_xml_alloc_buf(doc, bytes);
+    if (dst == NULL) {  // Leave strings as they are.
+        doc->allocated_buffers = old_buffers;
+        doc->arena = old_arena;
+        cd_xml_dealloc(&doc->allocator, remaps, sizeof(cd_xml_buf_remap_t) * count);
+        return;
+    }
+
+    size_t i = 0;
+    for (cd_xml_buf_t* buf = old_buffers; buf; buf = buf->next, i++) {
+        size_t used = buf == old_arena ? doc->arena_used : buf->size;
+        memcpy(dst, &buf->payload, used);
+        remaps[i].begin = &buf->payload;
+        remaps[i].end = &buf->payload + used;
+        remaps[i].target = dst;
+        dst += used;
+    }
+    doc->arena_used = 0;
+    qsort(remaps, count, sizeof(cd_xml_buf_remap_t), cd_xml_buf_remap_cmp);
+
+    for (cd_xml_ix_t k = 0; k < cd_xml_sb_size(doc->namespaces); k++) {
+        cd_xml_remap_strv(remaps, count, &doc->namespaces[k].prefix);
+        cd_xml_remap_strv(remaps, count, &doc->namespaces[k].uri);
+    }
+    for (cd_xml_ix_t k = 0; k < cd_xml_doc_node_count(doc); k++) {
+        cd_xml_node_t* node = cd_xml_doc_node(doc, k);
+        if (node->kind == CD_XML_NODE_ELEMENT) cd_xml_remap_strv(remaps, count, &node->data.element.name);
+        else cd_xml_remap_strv(remaps, count, &node->data.text.content);
+    }
+    for (cd_xml_ix_t k = 0; k < cd_xml_doc_attribute_count(doc); k++) {
+        cd_xml_remap_strv(remaps, count, &cd_xml_doc_attribute(doc, k)->name);
+        cd_xml_remap_strv(remaps, count, &cd_xml_doc_attribute(doc, k)->value);
+    }
+
+    while (old_buffers) {
+        cd_xml_buf_t* next = old_buffers->next;
+        cd_xml_dealloc(&doc->allocator, old_buffers, offsetof(cd_xml_buf_t, payload) + old_buffers->size);
+        old_buffers = next;
+    }
+    cd_xml_dealloc(&doc->allocator, remaps, sizeof(cd_xml_buf_remap_t) * count);
+}
+
+void cd_xml_shrink_to_fit(cd_xml_doc_t* doc)
+{
+    if (doc == NULL) return;
+#ifdef CD_XML_SEGMENTED
+    *(void**)&doc->node_blocks = cd_xml__sb_shrink_to_fit(&doc->allocator, doc->node_blocks, sizeof(cd_xml_node_t*));
+    *(void**)&doc->attribute_blocks = cd_xml__sb_shrink_to_fit(&doc->allocator, doc->attribute_blocks, sizeof(cd_xml_attribute_t*));
+#else
+    *(void**)&doc->nodes = cd_xml__sb_shrink_to_fit(&doc->allocator, doc->nodes, sizeof(cd_xml_node_t));
+    *(void**)&doc->attributes = cd_xml__sb_shrink_to_fit(&doc->allocator, doc->attributes, sizeof(cd_xml_attribute_t));
+#endif
+    *(void**)&doc->namespaces = cd_xml__sb_shrink_to_fit(&doc->allocator, doc->namespaces, sizeof(cd_xml_ns_t));
+    if (!cd_xml_has_pending(doc)) cd_xml_compact_strings(doc);
+}
+
+static cd_xml_parse_status_t cd_xml_parse_with_scratch(cd_xml_doc_t**                  doc,
+                                                       const char*                     data,
+                                                       size_t                          size,
+                                                       cd_xml_flags_t                  flags,
+                                                       const cd_xml_parse_options_t*   options,
+                                                       cd_xml_parse_scratch_t*         scratch,
+                                                       const cd_xml_allocator_t*       scratch_allocator);
+
+cd_xml_parse_status_t cd_xml_init_and_parse(cd_xml_doc_t**  doc,
+                                            const char*     data,
+                                            size_t          size,
+                                            cd_xml_flags_t  flags)
+{
+    return cd_xml_init_and_parse_ex(doc, data, size, flags, NULL);
+}
+
+cd_xml_parse_status_t cd_xml_init_and_parse_ex(cd_xml_doc_t**                  doc,
+                                               const char*                     data,
+                                               size_t                          size,
+                                               cd_xml_flags_t                  flags,
+                                               const cd_xml_parse_options_t*   options)
+{
+    cd_xml_allocator_t allocator = { 0 };
+    if (options && options->allocator) allocator = *options->allocator;
+
+    cd_xml_parse_scratch_t scratch = { 0 };
+    cd_xml_parse_status_t rv = cd_xml_parse_with_scratch(doc, data, size, flags, options, &scratch, &allocator);
+    cd_xml_sb_free(&allocator, scratch.attribute_stash);
+    cd_xml_sb_free(&allocator, scratch.namespace_resolve_stack);
+    cd_xml_sb_free(&allocator, scratch.keep_path_stack);
+    return rv;
+}
+
+// Parse the prolog and root element of ctx->input into ctx->doc.
+static bool cd_xml_parse_document(cd_xml_parse_context_t* ctx)
+{
+    if (cd_xml_transcode_input(ctx) && cd_xml_next_char(ctx) && cd_xml_next_token(ctx)) {
+        if(cd_xml_parse_prolog(ctx)) {
+            if(cd_xml_expect_token(ctx, CD_XML_TOKEN_TAG_START, "Expected element start '<'")) {
+                if(cd_xml_parse_element(ctx, cd_xml_no_ix)) {
+                    if(cd_xml_expect_token(ctx, CD_XML_TOKEN_EOF, "Expexted EOF")) {
+                        return ctx->status == CD_XML_STATUS_SUCCESS;
+                    }
+                }
+            }
+        }
+    }
+    return false;
+}
+
+// Parse into a new doc using scratch buffers that are left allocated for the next parse.
+static cd_xml_parse_status_t cd_xml_parse_with_scratch(cd_xml_doc_t**                  doc,
+                                                       const char*                     data,
+                                                       size_t                          size,
+                                                       cd_xml_flags_t                  flags,
+                                                       const cd_xml_parse_options_t*   options,
+                                                       cd_xml_parse_scratch_t*         scratch,
+                                                       const cd_xml_allocator_t*       scratch_allocator)
+{
+    if(*doc != NULL) {
+        return CD_XML_STATUS_POINTER_NOT_NULL;
+    }
+    CD_XML_STATS_PHASE_BEGIN(phase_start);
+    *doc = cd_xml_init_ex(options ? options->allocator : NULL);
+    if (*doc == NULL) return CD_XML_STATUS_OUT_OF_MEMORY;
+    if (options && options->lazy) {
+        assert(options->keep_paths == NULL && "Lazy parsing cannot be combined with keep paths");
+        (*doc)->lazy = (cd_xml_lazy_t*)cd_xml_alloc(&(*doc)->allocator, sizeof(cd_xml_lazy_t));
+        if ((*doc)->lazy == NULL) {
+            cd_xml_free(doc);
+            return CD_XML_STATUS_OUT_OF_MEMORY;
+        }
+        memset((*doc)->lazy, 0, sizeof(cd_xml_lazy_t));
+        (*doc)->lazy->flags = flags;
+    }
+    
+    cd_xml_parse_context_t ctx = {
+        .doc = *doc,
+        .input = {
+            .begin = data,
+            .end = data + size
+        },
+        .chr = {
+            .text = {
+                .end = data
+            }
+        },
+        .namespace_default = cd_xml_no_ix,
+        .namespace_resolve_stack = scratch->namespace_resolve_stack,
+        .attribute_stash = scratch->attribute_stash,
+        .keep_path_stack = scratch->keep_path_stack,
+        .flags = flags,
+        .status = CD_XML_STATUS_SUCCESS,
+        .scratch_allocator = scratch_allocator
+    };
+    cd_xml_sb_shrink(ctx.attribute_stash, 0);
+    cd_xml_sb_shrink(ctx.namespace_resolve_stack, 0);
+    cd_xml_sb_shrink(ctx.keep_path_stack, 0);
+    if(options && options->keep_paths) {
+        ctx.keep_paths = options->keep_paths;
+        ctx.keep_path_count = options->keep_path_count;
+    }
+    
+    if (cd_xml_parse_document(&ctx)) goto exit;
+
+    cd_xml_free(doc);
+    *doc = NULL;
+
+exit:
+    scratch->attribute_stash = ctx.attribute_stash;
+    scratch->namespace_resolve_stack = ctx.namespace_resolve_stack;
+    scratch->keep_path_stack = ctx.keep_path_stack;
+
+    CD_XML_STATS_PHASE_END(phase_start, CD_XML_PHASE_PARSE);
+    return ctx.status;
+}
+
+// Shared state of cd_xml_parse_batch.
+typedef struct {
+    const cd_xml_stringview_t*  inputs;                     // XML of each item.
+    cd_xml_flags_t              flags;                      // Parse flags.
+    cd_xml_doc_t**              docs;                       // Resulting doc of each item.
+    cd_xml_parse_status_t*      statuses;                   // Resulting status of each item, may be NULL.
+    cd_xml_parse_scratch_t*     scratch;                    // Scratch buffers per thread.
+    bool*                       failed;                     // Set per thread if any item failed.
+} cd_xml_parse_batch_t;
+
+static void cd_xml_parse_batch_item(void* arg, unsigned thread, size_t item)
+{
+    cd_xml_parse_batch_t* batch = (cd_xml_parse_batch_t*)arg;
+    const cd_xml_stringview_t* input = &batch->inputs[item];
+    batch->docs[item] = NULL;
+    cd_xml_parse_status_t status = cd_xml_parse_with_scratch(&batch->docs[item],
+                                                             input->begin,
+                                                             input->end - input->begin,
+                                                             batch->flags,
+                                                             NULL,
+                                                             &batch->scratch[thread],
+                                                             NULL);
+    if (batch->statuses) batch->statuses[item] = status;
+    if (status != CD_XML_STATUS_SUCCESS) batch->failed[thread] = true;
+}
+
+bool cd_xml_parse_batch(const cd_xml_stringview_t*  inputs,
+                        size_t                      count,
+                        cd_xml_flags_t              flags,
+                        cd_xml_doc_t**              docs,
+                        cd_xml_parse_status_t*      statuses,
+                        unsigned                    threads)
+{
+    if (count == 0) return true;
+    if (threads == 0) threads = cd_xml_hardware_threads();
+    if (count < threads) threads = (unsigned)count;
+
+    cd_xml_parse_batch_t batch = {
+        .inputs = inputs,
+        .flags = flags,
+        .docs = docs,
+        .statuses = statuses
+    };
+    batch.scratch = (cd_xml_parse_scratch_t*)CD_XML_MALLOC(sizeof(cd_xml_parse_scratch_t) * threads);
+    batch.failed = (bool*)CD_XML_MALLOC(sizeof(bool) * threads);
+    assert(batch.scratch && batch.failed && "Failed to allocate memory");
+    memset(batch.scratch, 0, sizeof(cd_xml_parse_scratch_t) * threads);
+    memset(batch.failed, 0, sizeof(bool) * threads);
+
+    cd_xml_parallel_for(threads, count, cd_xml_parse_batch_item, &batch);
+
+    bool rv = true;
+    for (unsigned i = 0; i < threads; i++) {
+        if (batch.failed[i]) rv = false;
+        cd_xml_sb_free(NULL, batch.scratch[i].attribute_stash);
+        cd_xml_sb_free(NULL, batch.scratch[i].namespace_resolve_stack);
+        cd_xml_sb_free(NULL, batch.scratch[i].keep_path_stack);
+    }
+    CD_XML_FREE(batch.scratch);
+    CD_XML_FREE(batch.failed);
+    return rv;
+}
+
+struct cd_xml_record_reader_struct {
+    cd_xml_input_func           input_func;                 // Input callback.
+    void*                       userdata;                   // Userdata passed to input callback.
+    cd_xml_allocator_t          allocator;                  // Allocator for reader, buffers and record doc.
+    cd_xml_flags_t              flags;                      // Flags used when parsing records.
+    size_t                      record_depth;               // Depth of record elements.
+    size_t                      depth;                      // Number of currently open elements.
+    char*                       buffer;                     // Buffered input.
+    size_t                      capacity;                   // Size of buffer in bytes.
+    size_t                      fill;                       // Number of bytes of input in buffer.
+    size_t                      pos;                        // Scan position in buffer.
+    char*                       ancestor_tags;              // Start tags of open ancestors that declare namespaces, stretchy buf.
+    size_t*                     ancestor_ends;              // End offset in ancestor_tags per open ancestor, stretchy buf.
+    bool                        started;                    // First input has been read, and any BOM skipped.
+    bool                        eof;                        // Input callback has signalled end of input.
+    cd_xml_parse_status_t       status;                     // Either success or first error encountered.
+    cd_xml_doc_t*               doc;                        // Record doc, reused for every record.
+    cd_xml_parse_scratch_t      scratch;                    // Parser scratch, reused for every record.
+};
+
+#ifndef _WIN32
+
+static ptrdiff_t cd_xml_fd_input(void* userdata, char* ptr, size_t bytes)
+{
+    int fd = (int)(intptr_t)userdata;
+    while (true) {
+        ssize_t n = read(fd, ptr, bytes);
+        if (n < 0 && errno == EINTR) continue;
+        return (ptrdiff_t)n;
+    }
+}
+
+cd_xml_record_reader_t* cd_xml_record_reader_init_fd(int fd, size_t depth, cd_xml_flags_t flags, const cd_xml_allocator_t* allocator)
+{
+    return cd_xml_record_reader_init(cd_xml_fd_input, (void*)(intptr_t)fd, depth, flags, allocator);
+}
+
+#endif
+
+cd_xml_record_reader_t* cd_xml_record_reader_init(cd_xml_input_func         input_func,
+                                                  void*                     userdata,
+                                                  size_t                    depth,
+                                                  cd_xml_flags_t            flags,
+                                                  const cd_xml_allocator_t* allocator)
+{
+    cd_xml_record_reader_t* reader = (cd_xml_record_reader_t*)cd_xml_alloc(allocator, sizeof(cd_xml_record_reader_t));
+    if (reader == NULL) return NULL;
+    memset(reader, 0, sizeof(cd_xml_record_reader_t));
+    if (allocator) reader->allocator = *allocator;
+    reader->input_func = input_func;
+    reader->userdata = userdata;
+    reader->record_depth = depth;
+    reader->flags = flags;
+    reader->status = CD_XML_STATUS_SUCCESS;
+    reader->doc = cd_xml_init_ex(allocator);
+    if (reader->doc == NULL) {
+        cd_xml_dealloc(allocator, reader, sizeof(cd_xml_record_reader_t));
+        return NULL;
+    }
+    return reader;
+}
+
+void cd_xml_record_reader_free(cd_xml_record_reader_t** reader)
+{
+    assert(reader);
+    cd_xml_record_reader_t* r = *reader;
+    if (r == NULL) return;
+
+    cd_xml_allocator_t allocator = r->allocator;
+    cd_xml_free(&r->doc);
+    cd_xml_sb_free(&allocator, r->scratch.attribute_stash);
+    cd_xml_sb_free(&allocator, r->scratch.namespace_resolve_stack);
+    cd_xml_sb_free(&allocator, r->scratch.keep_path_stack);
+    cd_xml_sb_free(&allocator, r->ancestor_tags);
+    cd_xml_sb_free(&allocator, r->ancestor_ends);
+    if (r->buffer) cd_xml_dealloc(&allocator, r->buffer, r->capacity);
+    cd_xml_dealloc(&allocator, r, sizeof(cd_xml_record_reader_t));
+    *reader = NULL;
+}
+
+// Returns pointer past the markup that starts with '<' at p, or NULL if it is not complete before end.
+static const char* cd_xml_record_markup_end(const char* p, const char* end)
+{
+    if (end - p < 2) return NULL;
+    if (p[1] == '?') return cd_xml_find_str(p + 2, end, "?>", 2);
+    if (p[1] == '!') {
+        size_t n = (size_t)(end - p);
+        if (memcmp(p, "<!--", n < 4 ? n : 4) == 0) return n < 4 ? NULL : cd_xml_find_str(p + 4, end, "-->", 3);
+        if (memcmp(p, "<![CDATA[", n < 9 ? n : 9) == 0) return n < 9 ? NULL : cd_xml_find_str(p + 9, end, "]]>", 3);
+    }
+    // Tag or doctype, '>' may occur within quotes and doctype internal subset.
+    char quote = 0;
+    unsigned brackets = 0;
+    for (p++; p < end; p++) {
+        if (quote) {
+            if (*p == quote) quote = 0;
+        }
+        else if (*p == '"' || *p == '\'') quote = *p;
+        else if (*p == '[') brackets++;
+        else if (*p == ']' && brackets) brackets--;
+        else if (*p == '>' && brackets == 0) return p + 1;
+    }
+    return NULL;
+}
+
+// Discard consumed input before keep and read more, returns false on error or if input is exhausted.
+static bool cd_xml_record_reader_fill(cd_xml_record_reader_t* reader, size_t keep)
+{
+    if (reader->eof) return false;
+    assert(keep <= reader->pos && reader->pos <= reader->fill);
+    if (keep) memmove(reader->buffer, reader->buffer + keep, reader->fill - keep);
+    reader->fill -= keep;
+    reader->pos -= keep;
+
+    if (reader->capacity - reader->fill < CD_XML_RECORD_READER_CHUNK_SIZE) {
+        size_t capacity = 2 * reader->capacity;
+        if (capacity < reader->fill + CD_XML_RECORD_READER_CHUNK_SIZE) capacity = reader->fill + CD_XML_RECORD_READER_CHUNK_SIZE;
+        char* buffer = (char*)cd_xml_realloc(&reader->allocator, reader->buffer, reader->capacity, capacity);
+        if (buffer == NULL) {
+            reader->status = CD_XML_STATUS_OUT_OF_MEMORY;
+            return false;
+        }
+        reader->buffer = buffer;
+        reader->capacity = capacity;
+    }
+
+    ptrdiff_t n = reader->input_func(reader->userdata, reader->buffer + reader->fill, reader->capacity - reader->fill);
+    if (n < 0) {
+        reader->status = CD_XML_STATUS_INPUT_ERROR;
+        return false;
+    }
+    if (n == 0) {
+        reader->eof = true;
+        return false;
+    }
+    reader->fill += (size_t)n;
+    if (!reader->started) {
+        reader->started = true;
+        if (3 <= reader->fill && memcmp(reader->buffer, "\xEF\xBB\xBF", 3) == 0) reader->pos = 3;
+    }
+    return true;
+}
+
+// Remember the start tag of an ancestor of the records, only kept if it declares namespaces.
+static bool cd_xml_record_reader_push_ancestor(cd_xml_record_reader_t* reader, const char* begin, const char* end)
+{
+    size_t offset = cd_xml_sb_size(reader->ancestor_tags);
+    if (cd_xml_find_str(begin, end, "xmlns", 5)) {
+        size_t n = (size_t)(end - begin);
+        if (!cd_xml__sb_grow_to(&reader->allocator, (void**)&reader->ancestor_tags, 1, offset + n)) {
+            reader->status = cd_xml_push_failure(offset, 1);
+            return false;
+        }
+        memcpy(reader->ancestor_tags + offset, begin, n);
+        cd_xml__sb_size(reader->ancestor_tags) += (cd_xml_ix_t)n;
+        offset += n;
+    }
+    if (!cd_xml_sb_push(&reader->allocator, reader->ancestor_ends, offset)) {
+        reader->status = cd_xml_sb_failure(reader->ancestor_ends);
+        return false;
+    }
+    return true;
+}
+
+static void cd_xml_record_reader_pop_ancestor(cd_xml_record_reader_t* reader)
+{
+    cd_xml_ix_t n = cd_xml_sb_size(reader->ancestor_ends);
+    assert(n);
+    cd_xml_sb_shrink(reader->ancestor_ends, n - 1);
+    cd_xml_sb_shrink(reader->ancestor_tags, n == 1 ? 0 : reader->ancestor_ends[n - 2]);
+}
+
+// Point the parser at new input, keeping doc, namespace bindings and scratch.
+static void cd_xml_parse_set_input(cd_xml_parse_context_t* ctx, const char* begin, const char* end)
+{
+    ctx->input.begin = begin;
+    ctx->input.end = end;
+    memset(&ctx->chr, 0, sizeof(ctx->chr));
+    memset(&ctx->current, 0, sizeof(ctx->current));
+    memset(&ctx->matched, 0, sizeof(ctx->matched));
+    ctx->chr.text.end = begin;
+    ctx->after_comment = false;
+}
+
+// Parse the start tags of the ancestors to register and bind the namespaces they declare.
+static bool cd_xml_parse_ancestor_tags(cd_xml_parse_context_t* ctx, const char* begin, const char* end)
+{
+    cd_xml_parse_set_input(ctx, begin, end);
+    if (!cd_xml_next_char(ctx) || !cd_xml_next_token(ctx)) return false;
+    while (cd_xml_match_token(ctx, CD_XML_TOKEN_TAG_START)) {
+        cd_xml_stringview_t ns, name;
+        if (!cd_xml_parse_element_tag_start(ctx, &ns, &name)) return false;
+        cd_xml_sb_shrink(ctx->attribute_stash, 0);
+        if (!cd_xml_expect_token(ctx, CD_XML_TOKEN_TAG_END, "Expected '>'")) return false;
+    }
+    return cd_xml_expect_token(ctx, CD_XML_TOKEN_EOF, "Expected ancestor start tag");
+}
+
+static cd_xml_parse_status_t cd_xml_record_reader_parse(cd_xml_record_reader_t* reader, const char* begin, const char* end)
+{
+    cd_xml_parse_context_t ctx = {
+        .doc = reader->doc,
+        .namespace_default = cd_xml_no_ix,
+        .namespace_resolve_stack = reader->scratch.namespace_resolve_stack,
+        .attribute_stash = reader->scratch.attribute_stash,
+        .keep_path_stack = reader->scratch.keep_path_stack,
+        .flags = reader->flags,
+        .status = CD_XML_STATUS_SUCCESS,
+        .scratch_allocator = &reader->allocator
+    };
+    cd_xml_sb_shrink(ctx.attribute_stash, 0);
+    cd_xml_sb_shrink(ctx.namespace_resolve_stack, 0);
+    cd_xml_sb_shrink(ctx.keep_path_stack, 0);
+
+    bool ok = true;
+    if (cd_xml_sb_size(reader->ancestor_tags)) {
+        ok = cd_xml_parse_ancestor_tags(&ctx, reader->ancestor_tags, reader->ancestor_tags + cd_xml_sb_size(reader->ancestor_tags));
+    }
+    if (ok) {
+        cd_xml_parse_set_input(&ctx, begin, end);
+        ok = cd_xml_parse_document(&ctx);
+    }
+    if (!ok && ctx.status == CD_XML_STATUS_SUCCESS) ctx.status = CD_XML_STATUS_UNEXPECTED_TOKEN;
+
+    reader->scratch.attribute_stash = ctx.attribute_stash;
+    reader->scratch.namespace_resolve_stack = ctx.namespace_resolve_stack;
+    reader->scratch.keep_path_stack = ctx.keep_path_stack;
+    return ctx.status;
+}
+
+cd_xml_parse_status_t cd_xml_record_reader_next(cd_xml_record_reader_t* reader, cd_xml_doc_t** doc)
+{
+    *doc = NULL;
+    if (reader->status != CD_XML_STATUS_SUCCESS) return reader->status;
+    cd_xml_clear(reader->doc);
+
+    // Scan markup only, text between tags needs no attention to track depth.
+    size_t record_begin = SIZE_MAX;
+    while (true) {
+        const char* begin = reader->buffer + reader->pos;
+        const char* end = reader->buffer + reader->fill;
+        const char* lt = begin < end ? (const char*)memchr(begin, '<', end - begin) : NULL;
+        const char* markup_end = lt ? cd_xml_record_markup_end(lt, end) : NULL;
+        if (markup_end == NULL) {
+            reader->pos = lt ? (size_t)(lt - reader->buffer) : reader->fill;
+            if (cd_xml_record_reader_fill(reader, record_begin == SIZE_MAX ? reader->pos : record_begin)) {
+                if (record_begin != SIZE_MAX) record_begin = 0;     // Fill moved the record to the start of the buffer.
+                continue;
+            }
+            if (reader->status != CD_XML_STATUS_SUCCESS) return reader->status;
+            if (reader->depth == 0 && reader->pos == reader->fill) return CD_XML_STATUS_SUCCESS;  // Done.
+            reader->status = CD_XML_STATUS_PREMATURE_EOF;
+            return reader->status;
+        }
+        reader->pos = (size_t)(markup_end - reader->buffer);
+
+        if (lt[1] == '?' || lt[1] == '!') continue;
+
+        if (lt[1] == '/') {
+            if (reader->depth == 0) {
+                reader->status = CD_XML_STATUS_UNEXPECTED_TOKEN;
+                return reader->status;
+            }
+            reader->depth--;
+            if (reader->depth < reader->record_depth) {
+                cd_xml_record_reader_pop_ancestor(reader);
+            }
+            else if (reader->depth == reader->record_depth) {
+                break;
+            }
+            continue;
+        }
+
+        bool empty = markup_end[-2] == '/';
+        if (reader->depth == reader->record_depth) {
+            record_begin = (size_t)(lt - reader->buffer);
+            if (empty) break;
+        }
+        else if (reader->depth < reader->record_depth && !empty) {
+            if (!cd_xml_record_reader_push_ancestor(reader, lt, markup_end)) return reader->status;
+        }
+        if (!empty) reader->depth++;
+    }
+
+    assert(record_begin != SIZE_MAX);
+    reader->status = cd_xml_record_reader_parse(reader, reader->buffer + record_begin, reader->buffer + reader->pos);
+    if (reader->status != CD_XML_STATUS_SUCCESS) return reader->status;
+    *doc = reader->doc;
+    return CD_XML_STATUS_SUCCESS;
+}
+
+cd_xml_parse_status_t cd_xml_expand(cd_xml_doc_t* doc, cd_xml_node_ix_t elem)
+{
+    cd_xml_lazy_t* lazy = doc->lazy;
+    if (lazy == NULL || cd_xml_sb_size(lazy->node_pending) <= elem || lazy->node_pending[elem] == cd_xml_no_ix) {
+        return CD_XML_STATUS_SUCCESS;
+    }
+    cd_xml_lazy_elem_t pending = lazy->pending[lazy->node_pending[elem]];
+
+    // Children are appended, so a failed expansion is undone by dropping everything added after these.
+    cd_xml_ix_t node_count = cd_xml_doc_node_count(doc);
+    cd_xml_ix_t attribute_count = cd_xml_doc_attribute_count(doc);
+    cd_xml_ix_t pending_count = cd_xml_sb_size(lazy->pending);
+    cd_xml_ix_t node_pending_count = cd_xml_sb_size(lazy->node_pending);
+    cd_xml_ix_t bindings_count = cd_xml_sb_size(lazy->bindings);
+
+    cd_xml_parse_context_t ctx = {
+        .doc = doc,
+        .namespace_default = pending.namespace_default,
+        .flags = lazy->flags,
+        .status = CD_XML_STATUS_SUCCESS,
+        .scratch_allocator = &doc->allocator
+    };
+    cd_xml_parse_set_input(&ctx, lazy->input.begin, lazy->input.end);
+    ctx.chr.text.end = pending.tag_end;
+
+    bool ok = true;
+    for (cd_xml_ix_t i = pending.bindings_begin; ok && i < pending.bindings_end; i++) {
+        ok = cd_xml_sb_push(&doc->allocator, ctx.namespace_resolve_stack, lazy->bindings[i]);
+        if (!ok) ctx.status = cd_xml_sb_failure(ctx.namespace_resolve_stack);
+    }
+    if (ok) {
+        cd_xml_stringview_t name = cd_xml_doc_node(doc, elem)->data.element.name;
+        ok = cd_xml_next_char(&ctx) && cd_xml_next_token(&ctx) && cd_xml_parse_element_contents(&ctx, &pending.prefix, &name, elem);
+    }
+    if (!ok && ctx.status == CD_XML_STATUS_SUCCESS) ctx.status = CD_XML_STATUS_UNEXPECTED_TOKEN;
+
+    if (ok) {
+        lazy->node_pending[elem] = cd_xml_no_ix;
+    }
+    else {
+        cd_xml_resize_nodes(doc, node_count);
+        cd_xml_resize_attributes(doc, attribute_count);
+        cd_xml_doc_node(doc, elem)->data.element.first_child = cd_xml_no_ix;
+        cd_xml_doc_node(doc, elem)->data.element.last_child = cd_xml_no_ix;
+        cd_xml_sb_shrink(lazy->pending, pending_count);
+        cd_xml_sb_shrink(lazy->node_pending, node_pending_count);
+        cd_xml_sb_shrink(lazy->bindings, bindings_count);
+    }
+
+    cd_xml_sb_free(&doc->allocator, ctx.attribute_stash);
+    cd_xml_sb_free(&doc->allocator, ctx.namespace_resolve_stack);
+    cd_xml_sb_free(&doc->allocator, ctx.keep_path_stack);
+    return ctx.status;
+}
+
+// Element on the stack of cd_xml_validate.
+typedef struct {
+    cd_xml_stringview_t     prefix;                         // Namespace prefix, empty if none.
+    cd_xml_stringview_t     name;                           // Local name.
+    const char*             tag_start;                      // Start of start tag, for error messages.
+    unsigned                binding_count;                  // Number of namespace prefixes in scope of parent.
+} cd_xml_validate_elem_t;
+
+static bool cd_xml_validate_resolve(cd_xml_stringview_t* bindings, unsigned count, cd_xml_stringview_t* prefix)
+{
+    for (unsigned i = count; i--; ) {
+        if (cd_xml_strvcmp(&bindings[i], prefix)) return true;
+    }
+    return false;
+}
+
+
+// Check a start tag token by token after its '<' has been matched, mirroring cd_xml_parse_element_tag_start.
+static bool cd_xml_validate_tag_tokens(cd_xml_parse_context_t* ctx,
+                                       cd_xml_validate_elem_t* elem,
+                                       cd_xml_stringview_t*    bindings,
+                                       unsigned*               binding_count)
+{
+    if(!cd_xml_expect_token(ctx, CD_XML_TOKEN_NAME, "Expected element name")) return false;
+    elem->name = ctx->matched.text;
+    if(cd_xml_match_token(ctx, CD_XML_TOKEN_COLON)) {
+        if (!cd_xml_match_token(ctx, CD_XML_TOKEN_NAME)) {
+            ctx->status = CD_XML_STATUS_UNEXPECTED_TOKEN;
+            cd_xml_report_error(ctx, elem->name.begin, ctx->matched.text.end, "Expected element name after ':'");
+            return false;
+        }
+        elem->prefix = elem->name;
+        elem->name = ctx->matched.text;
+    }
+
+    // Attribute prefixes may be bound by later attributes of the same tag, so if a prefix does not resolve,
+    // the attributes are scanned once more when all bindings of the tag are known.
+    cd_xml_chr_state_t attributes_chr = ctx->chr;
+    cd_xml_token_t attributes_current = ctx->current;
+    bool rescan = false;
+    for(unsigned pass = 0; pass < 2; pass++) {
+        while(cd_xml_match_token(ctx, CD_XML_TOKEN_NAME)) {
+            cd_xml_stringview_t prefix = { NULL, NULL };
+            cd_xml_stringview_t name = ctx->matched.text;
+            if(cd_xml_match_token(ctx, CD_XML_TOKEN_COLON)) {
+                if (!cd_xml_match_token(ctx, CD_XML_TOKEN_NAME)) {
+                    ctx->status = CD_XML_STATUS_UNEXPECTED_TOKEN;
+                    cd_xml_report_error(ctx, name.begin, ctx->matched.text.end, "Expected attribute name after ':'");
+                    return false;
+                }
+                prefix = name;
+                name = ctx->matched.text;
+            }
+            if (!cd_xml_match_token(ctx, CD_XML_TOKEN_EQUAL)) {
+                ctx->status = CD_XML_STATUS_UNEXPECTED_TOKEN;
+                cd_xml_report_error(ctx, name.begin, ctx->matched.text.end, "Expected '=' after attribute name");
+                return false;
+            }
+            cd_xml_stringview_t value;
+            if(!cd_xml_parse_attribute_value(ctx, &value)) return false;
+
+            if(cd_xml_strcmp(&prefix, "xmlns") || (prefix.begin == NULL && cd_xml_strcmp(&name, "xmlns"))) {
+                if(pass) continue;
+                if(cd_xml_strv_empty(value)) {
+                    ctx->status = CD_XML_STATUS_MALFORMED_ATTRIBUTE;
+                    cd_xml_report_error(ctx, name.begin, ctx->chr.text.end, "Empty namespace uri");
+                    return false;
+                }
+                if(prefix.begin == NULL) continue;
+                if(*binding_count == CD_XML_VALIDATE_MAX_NAMESPACES) {
+                    ctx->status = CD_XML_STATUS_LIMIT_EXCEEDED;
+                    cd_xml_report_error(ctx, name.begin, name.end, "Too many namespace prefixes in scope");
+                    return false;
+                }
+                bindings[(*binding_count)++] = name;
+            }
+            else if(prefix.begin != NULL && !cd_xml_validate_resolve(bindings, *binding_count, &prefix)) {
+                if(pass) {
+                    ctx->status = CD_XML_STATUS_UNKNOWN_NAMESPACE_PREFIX;
+                    cd_xml_report_error(ctx, prefix.begin, prefix.end, "Unable to resolve namespace prefix");
+                    return false;
+                }
+                rescan = true;
+            }
+        }
+        if(pass || !rescan) break;
+        ctx->chr = attributes_chr;
+        ctx->current = attributes_current;
+    }
+
+    if(!cd_xml_strv_empty(elem->prefix) && !cd_xml_validate_resolve(bindings, *binding_count, &elem->prefix)) {
+        ctx->status = CD_XML_STATUS_UNKNOWN_NAMESPACE_PREFIX;
+        cd_xml_report_error(ctx, elem->prefix.begin, elem->prefix.end, "Unable to resolve namespace prefix");
+        return false;
+    }
+
+    return true;
+}
+
+// Scan a name as the tokenizer would, returns p if there is none.
+static const char* cd_xml_validate_name(const char* p, const char* end)
+{
+    if(p < end && *p != '.' && *p != '-' && cd_xml_is_name_char((unsigned char)*p)) {
+        do { p++; } while(p < end && cd_xml_is_name_char((unsigned char)*p));
+    }
+    return p;
+}
+
+// Check a start tag directly on the bytes after its '<', accepting only the common form of names, attributes
+// with ASCII values without entities, and single spaces or newlines between them.
+//
+// Returns the position of the closing '>' or '/>', or NULL if the tag must be checked by cd_xml_validate_tag_tokens
+// instead, in which case no error is reported and bindings past elem->binding_count are stale.
+static const char* cd_xml_validate_tag_bytes(const char*             p,
+                                             const char*             end,
+                                             cd_xml_validate_elem_t* elem,
+                                             cd_xml_stringview_t*    bindings,
+                                             unsigned*               binding_count)
+{
+    cd_xml_stringview_t name = { p, cd_xml_validate_name(p, end) };
+    if(cd_xml_strv_empty(name)) return NULL;
+    p = name.end;
+    if(p < end && *p == ':') {
+        elem->prefix = name;
+        name.begin = p + 1;
+        name.end = cd_xml_validate_name(name.begin, end);
+        if(cd_xml_strv_empty(name)) return NULL;
+        p = name.end;
+    }
+    elem->name = name;
+
+    while(true) {
+        while(p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) p++;
+        if(end <= p) return NULL;
+        if(*p == '>' || (*p == '/' && p + 1 < end && p[1] == '>')) break;
+
+        cd_xml_stringview_t prefix = { NULL, NULL };
+        name.begin = p;
+        name.end = cd_xml_validate_name(p, end);
+        if(cd_xml_strv_empty(name)) return NULL;
+        p = name.end;
+        if(p < end && *p == ':') {
+            prefix = name;
+            name.begin = p + 1;
+            name.end = cd_xml_validate_name(name.begin, end);
+            if(cd_xml_strv_empty(name)) return NULL;
+            p = name.end;
+        }
+        if(end - p < 2 || *p != '=' || (p[1] != '"' && p[1] != '\'')) return NULL;
+        char delimiter = p[1];
+        const char* value = p += 2;
+        for(; p < end && *p != delimiter; p++) {
+            if(*p == '&' || *p == '\0' || (*p & 0x80)) return NULL;
+        }
+        if(end <= p) return NULL;
+        p++;
+
+        if(cd_xml_strcmp(&prefix, "xmlns")) {
+            if(value + 1 == p || *binding_count == CD_XML_VALIDATE_MAX_NAMESPACES) return NULL;
+            bindings[(*binding_count)++] = name;
+        }
+        else if(prefix.begin == NULL && cd_xml_strcmp(&name, "xmlns")) {
+            if(value + 1 == p) return NULL;
+        }
+        else if(prefix.begin != NULL && !cd_xml_validate_resolve(bindings, *binding_count, &prefix)) {
+            return NULL;
+        }
+    }
+    if(!cd_xml_strv_empty(elem->prefix) && !cd_xml_validate_resolve(bindings, *binding_count, &elem->prefix)) return NULL;
+    return p;
+}
+
+// Check a start tag when the current token is its '<', pushing the element onto elems unless it is an empty tag.
+static bool cd_xml_validate_tag(cd_xml_parse_context_t* ctx,
+                                cd_xml_validate_elem_t* elems,
+                                unsigned*               depth,
+                                cd_xml_stringview_t*    bindings,
+                                unsigned*               binding_count)
+{
+    assert(ctx->current.kind == CD_XML_TOKEN_TAG_START);
+    cd_xml_validate_elem_t elem = {
+        .tag_start = ctx->current.text.begin,
+        .binding_count = *binding_count
+    };
+    bool empty = false;
+    const char* tag_end = cd_xml_validate_tag_bytes(ctx->current.text.end, ctx->input.end, &elem, bindings, binding_count);
+    if(tag_end != NULL) {
+        empty = *tag_end == '/';
+        ctx->chr.text.end = tag_end + (empty ? 2 : 1);
+        if(!cd_xml_next_char(ctx) || !cd_xml_next_token(ctx)) {
+            // Same status as cd_xml_parse_element_contents gives when matching the end of the tag fails.
+            ctx->status = CD_XML_STATUS_UNEXPECTED_TOKEN;
+            return false;
+        }
+    }
+    else {
+        elem.prefix.begin = elem.prefix.end = NULL;
+        *binding_count = elem.binding_count;
+        if(!cd_xml_next_token(ctx) || !cd_xml_validate_tag_tokens(ctx, &elem, bindings, binding_count)) return false;
+
+        empty = cd_xml_match_token(ctx, CD_XML_TOKEN_EMPTYTAG_END);
+        if(!empty && !cd_xml_match_token(ctx, CD_XML_TOKEN_TAG_END)) {
+            cd_xml_report_error(ctx, ctx->current.text.begin, ctx->current.text.end, "Expected either attribute name, > or />");
+            ctx->status = CD_XML_STATUS_UNEXPECTED_TOKEN;
+            return false;
+        }
+        tag_end = ctx->matched.text.begin;
+    }
+    if(empty) {
+        *binding_count = elem.binding_count;
+        return true;
+    }
+    if(*depth == CD_XML_VALIDATE_MAX_DEPTH) {
+        ctx->status = CD_XML_STATUS_LIMIT_EXCEEDED;
+        cd_xml_report_error(ctx, elem.tag_start, tag_end + 1, "Elements nested too deep");
+        return false;
+    }
+    elems[(*depth)++] = elem;
+    return true;
+}
+
+cd_xml_parse_status_t cd_xml_validate(const char* data, size_t size, cd_xml_flags_t flags, size_t* error_offset)
+{
+    cd_xml_validate_elem_t elems[CD_XML_VALIDATE_MAX_DEPTH];
+    cd_xml_stringview_t bindings[CD_XML_VALIDATE_MAX_NAMESPACES];
+    unsigned depth = 0;
+    unsigned binding_count = 0;
+
+    // No doc, so attribute values are only checked and not decoded, see cd_xml_parse_attribute_value.
+    cd_xml_parse_context_t ctx = {
+        .input = {
+            .begin = data,
+            .end = data + size
+        },
+        .chr = {
+            .text = {
+                .end = data
+            }
+        },
+        .namespace_default = cd_xml_no_ix,
+        .flags = flags,
+        .status = CD_XML_STATUS_SUCCESS,
+        .quiet = true
+    };
+
+    const uint8_t* b = (const uint8_t*)data;
+    if (3 <= size && b[0] == 0xEF && b[1] == 0xBB && b[2] == 0xBF) {
+        ctx.input.begin = data + 3;
+        ctx.chr.text.end = ctx.input.begin;
+    }
+    else if ((2 <= size && ((b[0] == 0xFF && b[1] == 0xFE) || (b[0] == 0xFE && b[1] == 0xFF))) ||
+             (4 <= size && ((b[0] == '<' && b[1] == 0 && b[2] == '?' && b[3] == 0) || (b[0] == 0 && b[1] == '<' && b[2] == 0 && b[3] == '?'))))
+    {
+        ctx.status = CD_XML_STATUS_UNSUPPORTED_ENCODING;
+        cd_xml_report_error(&ctx, data, data, "UTF-16 input is not supported by validation");
+    }
+
+    if(ctx.status == CD_XML_STATUS_SUCCESS &&
+       cd_xml_next_char(&ctx) &&
+       cd_xml_next_token(&ctx) &&
+       cd_xml_parse_prolog(&ctx) &&
+       (ctx.current.kind == CD_XML_TOKEN_TAG_START || cd_xml_expect_token(&ctx, CD_XML_TOKEN_TAG_START, "Expected element start '<'")) &&
+       cd_xml_validate_tag(&ctx, elems, &depth, bindings, &binding_count))
+    {
+        while(depth && ctx.status == CD_XML_STATUS_SUCCESS) {
+            cd_xml_validate_elem_t* elem = &elems[depth - 1];
+
+            if(ctx.current.kind == CD_XML_TOKEN_ENDTAG_START) {
+                // Compare end tags written exactly as </prefix:name> directly, anything else is tokenized below.
+                const char* p = ctx.chr.text.begin;
+                size_t prefix_size = elem->prefix.end - elem->prefix.begin;
+                size_t name_size = elem->name.end - elem->name.begin;
+                size_t name_at = prefix_size ? prefix_size + 1 : 0;
+                if(name_at + name_size < (size_t)(ctx.input.end - p) &&
+                   (prefix_size == 0 || (memcmp(p, elem->prefix.begin, prefix_size) == 0 && p[prefix_size] == ':')) &&
+                   memcmp(p + name_at, elem->name.begin, name_size) == 0 &&
+                   p[name_at + name_size] == '>')
+                {
+                    ctx.chr.text.end = p + name_at + name_size + 1;
+                    if(cd_xml_next_char(&ctx)) cd_xml_next_token(&ctx);
+                    binding_count = elem->binding_count;
+                    depth--;
+                    continue;
+                }
+            }
+
+            if(cd_xml_match_token(&ctx, CD_XML_TOKEN_ENDTAG_START)) {
+                if(!cd_xml_expect_token(&ctx, CD_XML_TOKEN_NAME, "In end-tag, expected name")) break;
+
+                cd_xml_stringview_t name = ctx.matched.text;
+                if(cd_xml_match_token(&ctx, CD_XML_TOKEN_COLON)) {
+                    if(!cd_xml_strvcmp(&name, &elem->prefix)) {
+                        cd_xml_report_error(&ctx, name.begin, name.end, "Namespace prefix mismatch");
+                        ctx.status = CD_XML_STATUS_MALFORMED_ENTITY;
+                        break;
+                    }
+                    if(!cd_xml_expect_token(&ctx, CD_XML_TOKEN_NAME, "Expected name after prefix")) break;
+                    name = ctx.matched.text;
+                }
+                if(!cd_xml_strvcmp(&name, &elem->name)) {
+                    cd_xml_report_error(&ctx, name.begin, name.end, "Namespace prefix mismatch");
+                    ctx.status = CD_XML_STATUS_MALFORMED_ENTITY;
+                    break;
+                }
+                if(!cd_xml_expect_token(&ctx, CD_XML_TOKEN_TAG_END, "In end-tag, expected >")) break;
+
+                binding_count = elem->binding_count;
+                depth--;
+            }
+            else if(cd_xml_match_token(&ctx, CD_XML_TOKEN_CDATA)) { }
+            else if(ctx.current.kind == CD_XML_TOKEN_TAG_START) {
+                if(!cd_xml_validate_tag(&ctx, elems, &depth, bindings, &binding_count)) break;
+            }
+            else if(ctx.current.kind == CD_XML_TOKEN_EOF) {
+                ctx.status = CD_XML_STATUS_PREMATURE_EOF;
+                cd_xml_report_error(&ctx, elem->tag_start, ctx.chr.text.end, "EOF while scanning for end of tag");
+            }
+            else {
+                // Text, which is checked up to the next markup without running the tokenizer. Tokens
+                // starting with '<' are processing instructions, which the parser treats as text.
+                const char* p = *ctx.current.text.begin == '<' ? ctx.chr.text.begin : ctx.current.text.begin;
+                const char* lt = (const char*)memchr(p, '<', ctx.input.end - p);
+                if((p = cd_xml_validate_text(&ctx, p, lt ? lt : ctx.input.end)) == NULL) break;
+                ctx.chr.text.end = p;
+                if(cd_xml_next_char(&ctx)) cd_xml_next_token(&ctx);
+            }
+        }
+        if(ctx.status == CD_XML_STATUS_SUCCESS) {
+            cd_xml_expect_token(&ctx, CD_XML_TOKEN_EOF, "Expexted EOF");
+        }
+    }
+
+    if(error_offset) {
+        const char* error_at = ctx.error_at ? ctx.error_at : ctx.chr.text.begin;
+        *error_offset = ctx.status == CD_XML_STATUS_SUCCESS ? 0 : (size_t)(error_at - data);
+    }
+    return ctx.status;
+}
+
+static bool cd_xml_encode_and_write(cd_xml_output_func      output_func,
+                                    void*                   userdata,
+                                    cd_xml_stringview_t*    text)
+{
+    const char* done = text->begin;
+    for (const char* p = text->begin; p < text->end; p++) {
+        const char* enc = NULL;
+        switch (*p) {
+        case '"':  enc = "&quot;"; break;
+        case '&':  enc = "&amp;";  break;
+        case '\'': enc = "&apos;"; break;
+        case '<':  enc = "&lt;";   break;
+        case '>':  enc = "&gt;";   break;
+        default: break;
+        }
+        if (enc) {
+            if (0 < p - done) {
+                if (!output_func(userdata, done, p - done)) return false;
+            }
+            done = p + 1;
+            if (!output_func(userdata, CD_XML_WRITE_HELPER(enc))) return false;
+        }
+    }
+    if (0 < text->end - done) {
+        if (!output_func(userdata, done, text->end - done)) return false;
+    }
+    return true;
+}
+
+// Write text escaped, or as CDATA if asked for or if CD_XML_CDATA_MIN_SIZE says it is cheaper.
+static bool cd_xml_write_text(cd_xml_output_func      output_func,
+                              void*                   userdata,
+                              cd_xml_stringview_t*    text,
+                              bool                    cdata)
+{
+    size_t size = text->end - text->begin;
+    if (!cdata && CD_XML_CDATA_MIN_SIZE <= size) {
+        size_t specials = 0;
+        for (const char* p = text->begin; p < text->end; p++) {
+            specials += (*p == '<') | (*p == '>') | (*p == '&');
+        }
+        cdata = size <= specials * CD_XML_CDATA_ESCAPE_RATIO;
+    }
+    if (!cdata) return cd_xml_encode_and_write(output_func, userdata, text);
+
+    // ]]> cannot occur inside CDATA, so end the section between ]] and > and start a new one.
+    const char* p = text->begin;
+    if (!output_func(userdata, CD_XML_WRITE_HELPER("<![CDATA["))) return false;
+    for (const char* q = cd_xml_find_str(p, text->end, "]]>", 3); q; q = cd_xml_find_str(p, text->end, "]]>", 3)) {
+        if (!output_func(userdata, p, q - 1 - p)) return false;
+        if (!output_func(userdata, CD_XML_WRITE_HELPER("]]><![CDATA["))) return false;
+        p = q - 1;
+    }
+    if (p < text->end && !output_func(userdata, p, text->end - p)) return false;
+    return output_func(userdata, CD_XML_WRITE_HELPER("]]>"));
+}
+
+static bool cd_xml_write_indent(cd_xml_doc_t*       doc,
+                                cd_xml_output_func  output_func,
+                                void*               userdata,
                                 size_t              cols,
                                 bool                needs_sep,
                                 bool                pretty)
 {
-    static const char* indent = "\n                                        ";
-    const size_t indent_l = strlen(indent);
-    if (pretty) {
-        if (!output_func(userdata, indent, CD_XML_MIN(cols + 1, indent_l))) return false;
+    static const char indent[] = "\n                                        ";
+    const size_t indent_l = sizeof(indent) - 1;
+    if (pretty) {
+        if (!output_func(userdata, indent, CD_XML_MIN(cols + 1, indent_l))) return false;
+    }
+    else if(needs_sep) {
+              if (!output_func(userdata, CD_XML_WRITE_HELPER(" "))) return false;
+    }
+    return true;
+}
+
+static bool cd_xml_write_namespace_defs(cd_xml_ns_t*        namespaces,
+                                        cd_xml_ix_t         namespace_count,
+                                        cd_xml_output_func  output_func,
+                                        void*               userdata,
+                                        size_t              name_length,
+                                        size_t              depth,
+                                        bool                pretty)
+{
+    for (cd_xml_ix_t i = 0; i < namespace_count; i++) {
+        cd_xml_ns_t* ns = &namespaces[i];
+
+        if(!cd_xml_write_indent(NULL,
+                                output_func,
+                                userdata,
+                                2 * (size_t)depth + 2 + name_length,
+                                true,
+                                (i != 0) && pretty)) return false;
+        
+        if (cd_xml_strv_empty(ns->prefix)) {    // default namespace
+            if (!output_func(userdata, CD_XML_WRITE_HELPER("xmlns=\""))) return false;
+            if (!output_func(userdata, CD_XML_WRITE_HELPERV(ns->uri))) return false;
+            if (!output_func(userdata, CD_XML_WRITE_HELPER("\""))) return false;
+        }
+        else {                                  // prefixed namespace
+            if (!output_func(userdata, CD_XML_WRITE_HELPER("xmlns:"))) return false;
+            if (!output_func(userdata, CD_XML_WRITE_HELPERV(ns->prefix))) return false;
+            if (!output_func(userdata, CD_XML_WRITE_HELPER("=\""))) return false;
+            if (!output_func(userdata, CD_XML_WRITE_HELPERV(ns->uri))) return false;
+            if (!output_func(userdata, CD_XML_WRITE_HELPER("\""))) return false;
+        }
+    }
+
+    return true;
+}
+
+static bool cd_xml_write_attribute(cd_xml_output_func   output_func,
+                                   void*                userdata,
+                                   cd_xml_ns_t*         ns,             // NULL if attribute has no namespace.
+                                   cd_xml_stringview_t* name,
+                                   cd_xml_stringview_t* value)
+{
+    if(!output_func(userdata, CD_XML_WRITE_HELPER(" "))) return false;
+    if(ns) {
+        if(!output_func(userdata, CD_XML_WRITE_HELPERV(ns->prefix))) return false;
+        if(!output_func(userdata, CD_XML_WRITE_HELPER(":"))) return false;
+    }
+    if(!output_func(userdata, CD_XML_WRITE_HELPERV(*name))) return false;
+    if(!output_func(userdata, CD_XML_WRITE_HELPER("=\""))) return false;
+    if(!cd_xml_encode_and_write(output_func, userdata, value)) return false;
+    if(!output_func(userdata, CD_XML_WRITE_HELPER("\""))) return false;
+    return true;
+}
+
+static bool cd_xml_write_element_attributes(cd_xml_doc_t*       doc,
+                                            cd_xml_output_func  output_func,
+                                            void*               userdata,
+                                            cd_xml_node_t*      elem,
+                                            size_t              depth)
+{
+    for(cd_xml_att_ix_t att_ix = elem->data.element.first_attribute; att_ix != cd_xml_no_ix; att_ix = cd_xml_doc_attribute(doc, att_ix)->next_attribute) {
+        cd_xml_attribute_t* att = cd_xml_doc_attribute(doc, att_ix);
+        cd_xml_ns_t* ns = NULL;
+        if(att->namespace_ix != cd_xml_no_ix) {
+            assert(att->namespace_ix < cd_xml_sb_size(doc->namespaces));
+            ns = &doc->namespaces[att->namespace_ix];
+        }
+        if(!cd_xml_write_attribute(output_func, userdata, ns, &att->name, &att->value)) return false;
+    }
+    return true;
+}
+
+static bool cd_xml_write_qname(cd_xml_output_func   output_func,
+                               void*                userdata,
+                               cd_xml_ns_t*         ns,                 // NULL if name has no namespace.
+                               cd_xml_stringview_t* name)
+{
+    if(ns && !cd_xml_strv_empty(ns->prefix)) {  // empty -> default namespace
+        if (!output_func(userdata, CD_XML_WRITE_HELPERV(ns->prefix))) return false;
+        if (!output_func(userdata, CD_XML_WRITE_HELPER(":"))) return false;
+    }
+    if (!output_func(userdata, CD_XML_WRITE_HELPERV(*name))) return false;
+    return true;
+}
+
+static bool cd_xml_write_element_name(cd_xml_doc_t*      doc,
+                                      cd_xml_output_func output_func,
+                                      void*              userdata,
+                                      cd_xml_node_t*     elem)
+{
+    cd_xml_ns_t* ns = NULL;
+    if (elem->data.element.namespace_ix != cd_xml_no_ix) {
+        assert(elem->data.element.namespace_ix < cd_xml_sb_size(doc->namespaces));
+        ns = &doc->namespaces[elem->data.element.namespace_ix];
+    }
+    return cd_xml_write_qname(output_func, userdata, ns, &elem->data.element.name);
+}
+
+// Writes indentation and start tag up to but not including the closing '>' or '/>'.
+static bool cd_xml_write_start_tag(cd_xml_doc_t*      doc,
+                                   cd_xml_output_func output_func,
+                                   void*              userdata,
+                                   cd_xml_node_ix_t   elem_ix,
+                                   size_t             depth,
+                                   bool               pretty)
+{
+    cd_xml_node_t* elem = cd_xml_doc_node(doc, elem_ix);
+    assert(elem->kind == CD_XML_NODE_ELEMENT);
+
+    if(!cd_xml_write_indent(doc,
+                            output_func,
+                            userdata,
+                            2 * depth,
+                            false,
+                            pretty)) return false;
+    
+    if (!output_func(userdata, "<", 1)) return false;
+
+    if(!cd_xml_write_element_name(doc, output_func, userdata, elem)) return false;
+
+    if (elem_ix == 0) {
+        if(!cd_xml_write_namespace_defs(doc->namespaces, cd_xml_sb_size(doc->namespaces),
+                                        output_func, userdata,
+                                        elem->data.element.name.end - elem->data.element.name.begin,
+                                        depth, pretty)) return false;
+    }
+    if(!cd_xml_write_element_attributes(doc,
+                                        output_func, userdata,
+                                        elem, depth)) return false;
+    return true;
+}
+
+static bool cd_xml_write_end_tag(cd_xml_doc_t*      doc,
+                                 cd_xml_output_func output_func,
+                                 void*              userdata,
+                                 cd_xml_node_ix_t   elem_ix,
+                                 size_t             depth,
+                                 bool               pretty)
+{
+    if(!cd_xml_write_indent(doc,
+                            output_func,
+                            userdata,
+                            2 * depth,
+                            false,
+                            pretty)) return false;
+
+    if (!output_func(userdata, "<//", 2)) return false;
+    if(!cd_xml_write_element_name(doc, output_func, userdata, cd_xml_doc_node(doc, elem_ix))) return false;
+    if (!output_func(userdata, ">", 1)) return false;
+    return true;
+}
+
+static bool cd_xml_write_element(cd_xml_doc_t*      doc,
+                                 cd_xml_output_func output_func,
+                                 void*              userdata,
+                                 cd_xml_node_ix_t   elem_ix,
+                                 size_t             depth,
+                                 bool               pretty)
+{
+
+    assert(elem_ix < cd_xml_doc_node_count(doc));
+    cd_xml_node_t* elem = cd_xml_doc_node(doc, elem_ix);
+
+    if (elem->kind == CD_XML_NODE_ELEMENT) {
+        if(!cd_xml_write_start_tag(doc, output_func, userdata, elem_ix, depth, pretty)) return false;
+
+        if (elem->data.element.first_child == cd_xml_no_ix) {
+            if (!output_func(userdata, "/>", 2)) return false;
+            return true;
+        }
+        else {
+            if (!output_func(userdata, ">", 1)) return false;
+
+            for (cd_xml_node_ix_t child_ix = elem->data.element.first_child; child_ix != cd_xml_no_ix; child_ix = cd_xml_doc_node(doc, child_ix)->next_sibling) {
+                if (!cd_xml_write_element(doc, output_func, userdata, child_ix, depth + 1, pretty)) return false;
+            }
+
+            if(!cd_xml_write_end_tag(doc, output_func, userdata, elem_ix, depth, pretty)) return false;
+        }
+    }
+    else if (elem->kind == CD_XML_NODE_TEXT) {
+        if(!cd_xml_write_indent(doc,
+                                output_func,
+                                userdata,
+                                2 * depth,
+                                false,
+                                pretty)) return false;
+        if (!cd_xml_write_text(output_func,
+                               userdata,
+                               &elem->data.text.content,
+                               (elem->data.text.flags & CD_XML_TEXT_CDATA) != 0)) return false;
+    }
+    else {
+        assert(0 && "Illegal elem kind");
+    }
+    return true;
+}
+
+#ifdef CD_XML_ENABLE_STATS
+
+// Output callback that counts calls before forwarding to the wrapped callback.
+typedef struct {
+    cd_xml_output_func          output_func;                // Wrapped callback.
+    void*                       userdata;                   // Userdata of wrapped callback.
+} cd_xml_stats_output_t;
+
+static bool cd_xml_stats_output(void* userdata, const char* ptr, size_t bytes)
+{
+    cd_xml_stats_output_t* wrapped = (cd_xml_stats_output_t*)userdata;
+    CD_XML_STATS_ADD(output_calls, 1);
+    CD_XML_STATS_ADD(output_bytes, bytes);
+    return wrapped->output_func(wrapped->userdata, ptr, bytes);
+}
+
+// Wrap output_func with cd_xml_stats_output if stats are bound and it is not already wrapped.
+#define CD_XML_STATS_WRAP_OUTPUT(func, ...)                                         \
+    if (cd_xml_stats_current && output_func != cd_xml_stats_output) {               \
+        cd_xml_stats_output_t wrapped = { output_func, userdata };                  \
+        CD_XML_STATS_PHASE_BEGIN(phase_start);                                      \
+        bool rv = func(doc, cd_xml_stats_output, &wrapped, __VA_ARGS__);            \
+        CD_XML_STATS_PHASE_END(phase_start, CD_XML_PHASE_WRITE);                    \
+        return rv;                                                                  \
+    }
+
+#else
+
+#define CD_XML_STATS_WRAP_OUTPUT(func, ...)
+
+#endif
+
+bool cd_xml_write(cd_xml_doc_t* doc, cd_xml_output_func output_func, void* userdata, bool pretty)
+{
+    if (cd_xml_has_pending(doc)) return false;
+    CD_XML_STATS_WRAP_OUTPUT(cd_xml_write, pretty);
+    const char* decl = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>";
+    if (!output_func(userdata, decl, strlen(decl))) return false;
+    if (cd_xml_doc_node_count(doc) != 0) {
+        if (!cd_xml_write_element(doc, output_func, userdata, 0, 0, pretty)) return false;
+    }
+    if (!output_func(userdata, "\n", 1)) return false;
+    return true;
+}
+
+// Output callback that appends to a char stretchy-buf pointed to by userdata.
+static bool cd_xml_buffer_output(void* userdata, const char* ptr, size_t bytes)
+{
+    char** buf = (char**)userdata;
+    size_t size = cd_xml_sb_size(*buf);
+    if((*buf == NULL) || (cd_xml__sb_cap(*buf) < size + bytes)) {
+        if(SIZE_MAX - size < bytes) return false;
+        if(!cd_xml__sb_grow_to(NULL, (void**)buf, 1, size + bytes)) return false;
+    }
+    memcpy(*buf + size, ptr, bytes);
+    cd_xml__sb_size(*buf) = (cd_xml_ix_t)(size + bytes);
+    return true;
+}
+
+// Kind of piece of output produced by the parallel writer.
+typedef enum {
+    CD_XML_PIECE_SUBTREE,                                   // An entire subtree.
+    CD_XML_PIECE_START_TAG,                                 // Start tag of an element whose children are separate pieces.
+    CD_XML_PIECE_END_TAG                                    // End tag of an element whose children are separate pieces.
+} cd_xml_piece_kind_t;
+
+// A piece of output produced by the parallel writer, pieces are concatenated in order.
+typedef struct {
+    cd_xml_node_ix_t            node_ix;                    // Node that this piece represents.
+    cd_xml_piece_kind_t         kind;                       // What part of the node this piece represents.
+    size_t                      depth;                      // Depth of node, used for indentation.
+    unsigned                    thread;                     // Thread whose buffer holds the output.
+    size_t                      offset;                     // Offset of output in thread buffer.
+    size_t                      size;                       // Size of output in bytes.
+} cd_xml_piece_t;
+
+// State shared by the threads of the parallel writer.
+typedef struct {
+    cd_xml_doc_t*               doc;                        // Doc being serialized.
+    cd_xml_piece_t*             pieces;                     // Pieces to produce, stretchy buf.
+    char**                      buffers;                    // Output buffer per thread, stretchy bufs.
+    bool*                       failed;                     // Per thread failure flag.
+    bool                        pretty;                     // Pretty-print output.
+} cd_xml_write_parallel_t;
+
+static cd_xml_node_ix_t cd_xml_count_subtree(cd_xml_doc_t* doc, cd_xml_node_ix_t node_ix, cd_xml_node_ix_t* sizes)
+{
+    cd_xml_node_ix_t size = 1;
+    cd_xml_node_t* node = cd_xml_doc_node(doc, node_ix);
+    if (node->kind == CD_XML_NODE_ELEMENT) {
+        for (cd_xml_node_ix_t child_ix = node->data.element.first_child; child_ix != cd_xml_no_ix; child_ix = cd_xml_doc_node(doc, child_ix)->next_sibling) {
+            size += cd_xml_count_subtree(doc, child_ix, sizes);
+        }
+    }
+    sizes[node_ix] = size;
+    return size;
+}
+
+// Splits subtrees larger than max_size into start tag, children and end tag pieces.
+static bool cd_xml_split_pieces(cd_xml_write_parallel_t* wp,
+                                cd_xml_node_ix_t*        sizes,
+                                cd_xml_node_ix_t         node_ix,
+                                size_t                   depth,
+                                cd_xml_node_ix_t         max_size)
+{
+    cd_xml_node_t* node = cd_xml_doc_node(wp->doc, node_ix);
+    cd_xml_piece_t piece = {
+        .node_ix = node_ix,
+        .kind = CD_XML_PIECE_SUBTREE,
+        .depth = depth
+    };
+    if (sizes[node_ix] <= max_size || node->kind != CD_XML_NODE_ELEMENT || node->data.element.first_child == cd_xml_no_ix) {
+        return cd_xml_sb_push(NULL, wp->pieces, piece);
+    }
+    piece.kind = CD_XML_PIECE_START_TAG;
+    if (!cd_xml_sb_push(NULL, wp->pieces, piece)) return false;
+    for (cd_xml_node_ix_t child_ix = node->data.element.first_child; child_ix != cd_xml_no_ix; child_ix = cd_xml_doc_node(wp->doc, child_ix)->next_sibling) {
+        if (!cd_xml_split_pieces(wp, sizes, child_ix, depth + 1, max_size)) return false;
+    }
+    piece.kind = CD_XML_PIECE_END_TAG;
+    return cd_xml_sb_push(NULL, wp->pieces, piece);
+}
+
+static void cd_xml_write_piece(void* arg, unsigned thread, size_t item)
+{
+    cd_xml_write_parallel_t* wp = (cd_xml_write_parallel_t*)arg;
+    cd_xml_piece_t* piece = &wp->pieces[item];
+    char** buf = &wp->buffers[thread];
+
+    piece->thread = thread;
+    piece->offset = cd_xml_sb_size(*buf);
+    bool ok = true;
+    switch (piece->kind) {
+    case CD_XML_PIECE_SUBTREE:
+        ok = cd_xml_write_element(wp->doc, cd_xml_buffer_output, buf, piece->node_ix, piece->depth, wp->pretty);
+        break;
+    case CD_XML_PIECE_START_TAG:
+        ok = cd_xml_write_start_tag(wp->doc, cd_xml_buffer_output, buf, piece->node_ix, piece->depth, wp->pretty) &&
+             cd_xml_buffer_output(buf, ">", 1);
+        break;
+    case CD_XML_PIECE_END_TAG:
+        ok = cd_xml_write_end_tag(wp->doc, cd_xml_buffer_output, buf, piece->node_ix, piece->depth, wp->pretty);
+        break;
+    }
+    if (!ok) wp->failed[thread] = true;
+    piece->size = cd_xml_sb_size(*buf) - piece->offset;
+}
+
+bool cd_xml_write_parallel(cd_xml_doc_t*        doc,
+                           cd_xml_output_func   output_func,
+                           void*                userdata,
+                           bool                 pretty,
+                           unsigned             threads)
+{
+    if (cd_xml_has_pending(doc)) return false;
+    CD_XML_STATS_WRAP_OUTPUT(cd_xml_write_parallel, pretty, threads);
+    if (threads == 0) threads = cd_xml_hardware_threads();
+    cd_xml_node_ix_t node_count = cd_xml_doc_node_count(doc);
+    if (threads < 2 || node_count < 2) {
+        return cd_xml_write(doc, output_func, userdata, pretty);
+    }
+
+    cd_xml_node_ix_t* sizes = (cd_xml_node_ix_t*)CD_XML_MALLOC(sizeof(cd_xml_node_ix_t) * node_count);
+    assert(sizes && "Failed to allocate memory");
+    cd_xml_node_ix_t total = cd_xml_count_subtree(doc, 0, sizes);
+
+    // Aim for several pieces per thread so that work-stealing can even out skewed subtrees.
+    cd_xml_write_parallel_t wp = {
+        .doc = doc,
+        .pretty = pretty
+    };
+    cd_xml_node_ix_t max_size = total / (8 * threads);
+    bool split = cd_xml_split_pieces(&wp, sizes, 0, 0, max_size < 1 ? 1 : max_size);
+    CD_XML_FREE(sizes);
+    if (!split) {   // Out of memory for pieces, fall back to serial writing.
+        cd_xml_sb_free(NULL, wp.pieces);
+        return cd_xml_write(doc, output_func, userdata, pretty);
+    }
+
+    wp.buffers = (char**)CD_XML_MALLOC(sizeof(char*) * threads);
+    wp.failed = (bool*)CD_XML_MALLOC(sizeof(bool) * threads);
+    assert(wp.buffers && wp.failed && "Failed to allocate memory");
+    for (unsigned i = 0; i < threads; i++) {
+        wp.buffers[i] = NULL;
+        wp.failed[i] = false;
+    }
+
+    cd_xml_parallel_for(threads, cd_xml_sb_size(wp.pieces), cd_xml_write_piece, &wp);
+
+    bool rv = true;
+    for (unsigned i = 0; i < threads; i++) {
+        if (wp.failed[i]) rv = false;
+    }
+    const char* decl = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>";
+    if (rv && !output_func(userdata, decl, strlen(decl))) rv = false;
+    for (cd_xml_ix_t i = 0; rv && i < cd_xml_sb_size(wp.pieces); i++) {
+        cd_xml_piece_t* piece = &wp.pieces[i];
+        if (piece->size && !output_func(userdata, wp.buffers[piece->thread] + piece->offset, piece->size)) rv = false;
+    }
+    if (rv && !output_func(userdata, "\n", 1)) rv = false;
+
+    for (unsigned i = 0; i < threads; i++) {
+        cd_xml_sb_free(NULL, wp.buffers[i]);
+    }
+    CD_XML_FREE(wp.buffers);
+    CD_XML_FREE(wp.failed);
+    cd_xml_sb_free(NULL, wp.pieces);
+    return rv;
+}
+
+#ifndef _WIN32
+
+void cd_xml_fd_sink_init(cd_xml_fd_sink_t*  sink,
+                         int                fd)
+{
+    sink->fd = fd;
+    sink->iov_count = 0;
+    sink->staged = 0;
+    sink->ok = true;
+}
+
+bool cd_xml_fd_sink_flush(cd_xml_fd_sink_t* sink)
+{
+    struct iovec* iov = sink->iov;
+    unsigned iov_count = sink->iov_count;
+    while (sink->ok && iov_count) {
+        ssize_t written = writev(sink->fd, iov, (int)iov_count);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            sink->ok = false;
+            break;
+        }
+        // Skip fully written iovecs and adjust a partially written one.
+        size_t left = (size_t)written;
+        while (iov_count && iov->iov_len <= left) {
+            left -= iov->iov_len;
+            iov++;
+            iov_count--;
+        }
+        if (iov_count) {
+            iov->iov_base = (char*)iov->iov_base + left;
+            iov->iov_len -= left;
+        }
+    }
+    sink->iov_count = 0;
+    sink->staged = 0;
+    return sink->ok;
+}
+
+bool cd_xml_fd_sink_output(void* userdata, const char* ptr, size_t bytes)
+{
+    cd_xml_fd_sink_t* sink = (cd_xml_fd_sink_t*)userdata;
+    if (!sink->ok) return false;
+    if (bytes == 0) return true;
+
+    bool copy = bytes < CD_XML_FD_SINK_COPY_THRESHOLD;
+    if ((sink->iov_count == CD_XML_FD_SINK_IOVECS) || (copy && (sizeof(sink->staging) < sink->staged + bytes))) {
+        if (!cd_xml_fd_sink_flush(sink)) return false;
+    }
+    if (copy) {
+        char* dst = sink->staging + sink->staged;
+        memcpy(dst, ptr, bytes);
+        sink->staged += bytes;
+        ptr = dst;
+    }
+
+    // Extend previous iovec if this fragment is contiguous with it.
+    if (sink->iov_count) {
+        struct iovec* last = &sink->iov[sink->iov_count - 1];
+        if ((char*)last->iov_base + last->iov_len == ptr) {
+            last->iov_len += bytes;
+            return true;
+        }
+    }
+    sink->iov[sink->iov_count].iov_base = (void*)ptr;
+    sink->iov[sink->iov_count].iov_len = bytes;
+    sink->iov_count++;
+    return true;
+}
+
+bool cd_xml_write_fd(cd_xml_doc_t* doc, int fd, bool pretty)
+{
+    cd_xml_fd_sink_t sink;
+    cd_xml_fd_sink_init(&sink, fd);
+    bool rv = cd_xml_write(doc, cd_xml_fd_sink_output, &sink, pretty);
+    return cd_xml_fd_sink_flush(&sink) && rv;
+}
+
+#endif
+
+static bool cd_xml_writer_flush(cd_xml_writer_t* writer)
+{
+    if (writer->fill) {
+        CD_XML_STATS_ADD(output_calls, 1);
+        CD_XML_STATS_ADD(output_bytes, writer->fill);
+        if (!writer->output_func(writer->userdata, writer->buffer, writer->fill)) return false;
+        writer->fill = 0;
+    }
+    return true;
+}
+
+static bool cd_xml_writer_output(void* userdata, const char* ptr, size_t bytes)
+{
+    cd_xml_writer_t* writer = (cd_xml_writer_t*)userdata;
+    if (sizeof(writer->buffer) < writer->fill + bytes) {
+        if (!cd_xml_writer_flush(writer)) return false;
+        if (sizeof(writer->buffer) <= bytes) {  // Too large to buffer, pass directly through.
+            CD_XML_STATS_ADD(output_calls, 1);
+            CD_XML_STATS_ADD(output_bytes, bytes);
+            return writer->output_func(writer->userdata, ptr, bytes);
+        }
+    }
+    memcpy(writer->buffer + writer->fill, ptr, bytes);
+    writer->fill += bytes;
+    return true;
+}
+
+static cd_xml_ns_t* cd_xml_writer_namespace(cd_xml_writer_t* writer, cd_xml_ns_ix_t ns)
+{
+    if (ns == cd_xml_no_ix) return NULL;
+    assert(ns < writer->namespace_count && "Illegal namespace index");
+    return &writer->namespaces[ns];
+}
+
+static bool cd_xml_writer_close_tag(cd_xml_writer_t* writer)
+{
+    if (writer->tag_open) {
+        writer->tag_open = false;
+        if (!cd_xml_writer_output(writer, ">", 1)) return false;
+    }
+    return true;
+}
+
+void cd_xml_writer_init(cd_xml_writer_t*    writer,
+                        cd_xml_output_func  output_func,
+                        void*               userdata,
+                        bool                pretty)
+{
+    assert(writer && output_func);
+    writer->output_func = output_func;
+    writer->userdata = userdata;
+    writer->namespace_count = 0;
+    writer->depth = 0;
+    writer->fill = 0;
+    writer->pretty = pretty;
+    writer->tag_open = false;
+    writer->has_root = false;
+    writer->ok = cd_xml_writer_output(writer, CD_XML_WRITE_HELPER("<?xml version=\"1.0\" encoding=\"UTF-8\"?>"));
+}
+
+cd_xml_ns_ix_t cd_xml_writer_add_namespace(cd_xml_writer_t*     writer,
+                                           cd_xml_stringview_t* prefix,
+                                           cd_xml_stringview_t* uri)
+{
+    assert(uri->begin < uri->end && "URI cannot be empty");
+    if (writer->has_root) {
+        assert(0 && "Namespaces must be added before root element is started");
+        writer->ok = false;
+        return cd_xml_no_ix;
+    }
+
+    // Same rule as cd_xml_add_namespace, a uri is only registered once.
+    for (unsigned i = 0; i < writer->namespace_count; i++) {
+        if (cd_xml_strvcmp(&writer->namespaces[i].uri, uri)) {
+            return i;
+        }
+    }
+    if (writer->namespace_count == CD_XML_WRITER_MAX_NAMESPACES) {
+        writer->ok = false;
+        return cd_xml_no_ix;
+    }
+
+    cd_xml_ns_t* ns = &writer->namespaces[writer->namespace_count];
+    ns->prefix.begin = NULL;
+    ns->prefix.end = NULL;
+    if (prefix) {
+        ns->prefix = *prefix;
+    }
+    ns->uri = *uri;
+    return writer->namespace_count++;
+}
+
+bool cd_xml_writer_begin_element(cd_xml_writer_t*       writer,
+                                 cd_xml_ns_ix_t         ns,
+                                 cd_xml_stringview_t*   name)
+{
+    assert(name->begin < name->end && "Name cannot be empty");
+    if (!writer->ok) return false;
+    if ((writer->depth == 0 && writer->has_root) || (writer->depth == CD_XML_WRITER_MAX_DEPTH)) {
+        writer->ok = false;
+        return false;
+    }
+
+    if (!cd_xml_writer_close_tag(writer) ||
+        !cd_xml_write_indent(NULL, cd_xml_writer_output, writer, 2 * (size_t)writer->depth, false, writer->pretty) ||
+        !cd_xml_writer_output(writer, "<", 1) ||
+        !cd_xml_write_qname(cd_xml_writer_output, writer, cd_xml_writer_namespace(writer, ns), name))
+    {
+        writer->ok = false;
+        return false;
+    }
+
+    if (writer->depth == 0) {
+        writer->has_root = true;
+        if (!cd_xml_write_namespace_defs(writer->namespaces, writer->namespace_count,
+                                         cd_xml_writer_output, writer,
+                                         name->end - name->begin,
+                                         0, writer->pretty))
+        {
+            writer->ok = false;
+            return false;
+        }
+    }
+
+    writer->stack[writer->depth].name = *name;
+    writer->stack[writer->depth].namespace_ix = ns;
+    writer->depth++;
+    writer->tag_open = true;
+    return true;
+}
+
+bool cd_xml_writer_attribute(cd_xml_writer_t*       writer,
+                             cd_xml_ns_ix_t         ns,
+                             cd_xml_stringview_t*   name,
+                             cd_xml_stringview_t*   value)
+{
+    if (!writer->ok) return false;
+    if (!writer->tag_open) {
+        assert(0 && "Attributes must be written before element children");
+        writer->ok = false;
+        return false;
+    }
+    if (!cd_xml_write_attribute(cd_xml_writer_output, writer, cd_xml_writer_namespace(writer, ns), name, value)) {
+        writer->ok = false;
+        return false;
+    }
+    return true;
+}
+
+static bool cd_xml_writer_text_or_cdata(cd_xml_writer_t*       writer,
+                                        cd_xml_stringview_t*   text,
+                                        bool                   cdata)
+{
+    if (!writer->ok) return false;
+    if (writer->depth == 0) {
+        assert(0 && "Text must have a parent element");
+        writer->ok = false;
+        return false;
+    }
+    if (!cd_xml_writer_close_tag(writer) ||
+        !cd_xml_write_indent(NULL, cd_xml_writer_output, writer, 2 * (size_t)writer->depth, false, writer->pretty) ||
+        !cd_xml_write_text(cd_xml_writer_output, writer, text, cdata))
+    {
+        writer->ok = false;
+        return false;
+    }
+    return true;
+}
+
+bool cd_xml_writer_text(cd_xml_writer_t*        writer,
+                        cd_xml_stringview_t*    text)
+{
+    return cd_xml_writer_text_or_cdata(writer, text, false);
+}
+
+bool cd_xml_writer_cdata(cd_xml_writer_t*       writer,
+                         cd_xml_stringview_t*   text)
+{
+    return cd_xml_writer_text_or_cdata(writer, text, true);
+}
+
+bool cd_xml_writer_end_element(cd_xml_writer_t* writer)
+{
+    if (!writer->ok) return false;
+    if (writer->depth == 0) {
+        writer->ok = false;
+        return false;
+    }
+    writer->depth--;
+    if (writer->tag_open) {
+        writer->tag_open = false;
+        if (!cd_xml_writer_output(writer, "/>", 2)) {
+            writer->ok = false;
+            return false;
+        }
+        return true;
+    }
+
+    cd_xml_writer_elem_t* elem = &writer->stack[writer->depth];
+    if (!cd_xml_write_indent(NULL, cd_xml_writer_output, writer, 2 * (size_t)writer->depth, false, writer->pretty) ||
+        !cd_xml_writer_output(writer, "</", 2) ||
+        !cd_xml_write_qname(cd_xml_writer_output, writer, cd_xml_writer_namespace(writer, elem->namespace_ix), &elem->name) ||
+        !cd_xml_writer_output(writer, ">", 1))
+    {
+        writer->ok = false;
+        return false;
+    }
+    return true;
+}
+
+bool cd_xml_writer_finish(cd_xml_writer_t* writer)
+{
+    while (writer->ok && writer->depth) {
+        cd_xml_writer_end_element(writer);
+    }
+    if (writer->ok) {
+        writer->ok = cd_xml_writer_output(writer, "\n", 1) && cd_xml_writer_flush(writer);
+    }
+    return writer->ok;
+}
+
+#define CD_XML_BINARY_MAGIC "CDXMLBIN"
+#ifdef CD_XML_LARGE
+#define CD_XML_BINARY_VERSION 0x101u                        // Version 1 with 64-bit indices.
+#else
+#define CD_XML_BINARY_VERSION 1u
+#endif
+#define CD_XML_BINARY_ENDIAN 0x01020304u
+
+// Header of binary snapshot, followed by namespace, node and attribute records and the string pool.
+typedef struct {
+    char                        magic[8];                   // CD_XML_BINARY_MAGIC.
+    uint32_t                    version;                    // CD_XML_BINARY_VERSION.
+    uint32_t                    endian;                     // CD_XML_BINARY_ENDIAN in native byte order.
+    uint64_t                    namespace_count;            // Number of namespace records.
+    uint64_t                    node_count;                 // Number of node records.
+    uint64_t                    attribute_count;            // Number of attribute records.
+    uint64_t                    strings_size;               // Size of string pool in bytes.
+    uint64_t                    checksum;                   // Checksum of everything following the header.
+} cd_xml_binary_header_t;
+
+// String in binary snapshot, as offsets into string pool.
+typedef struct {
+    uint64_t                    begin;                      // Offset of first byte.
+    uint64_t                    end;                        // Offset of one past last byte.
+} cd_xml_binary_span_t;
+
+// Namespace record of binary snapshot.
+typedef struct {
+    cd_xml_binary_span_t        prefix;
+    cd_xml_binary_span_t        uri;
+} cd_xml_binary_ns_t;
+
+// Node record of binary snapshot.
+typedef struct {
+    cd_xml_binary_span_t        text;                       // Element name or text content.
+    cd_xml_ix_t                 namespace_ix;
+    cd_xml_ix_t                 first_child;
+    cd_xml_ix_t                 last_child;
+    cd_xml_ix_t                 first_attribute;
+    cd_xml_ix_t                 last_attribute;
+    cd_xml_ix_t                 next_sibling;
+    uint32_t                    kind;
+    uint32_t                    text_flags;                 // Zero padding in older snapshots, which reads as CD_XML_TEXT_NONE.
+} cd_xml_binary_node_t;
+
+// Attribute record of binary snapshot.
+typedef struct {
+    cd_xml_binary_span_t        name;
+    cd_xml_binary_span_t        value;
+    cd_xml_ix_t                 namespace_ix;
+    cd_xml_ix_t                 next_attribute;
+} cd_xml_binary_attribute_t;
+
+// Running checksum and size, used as userdata for cd_xml_checksum_output.
+//
+// Input is consumed in 8-byte words, so the result is independent of how the input is split into updates.
+typedef struct {
+    uint64_t                    hash;                       // Hash of consumed words.
+    uint64_t                    size;                       // Total number of bytes.
+    unsigned                    tail_size;                  // Number of bytes in tail.
+    unsigned char               tail[8];                    // Bytes not yet forming a complete word.
+} cd_xml_checksum_t;
+
+static void cd_xml_checksum_init(cd_xml_checksum_t* checksum)
+{
+    memset(checksum, 0, sizeof(*checksum));
+    checksum->hash = 0xcbf29ce484222325ull;
+}
+
+static void cd_xml_checksum_word(cd_xml_checksum_t* checksum, const void* ptr)
+{
+    uint64_t word;
+    memcpy(&word, ptr, 8);
+    checksum->hash = (checksum->hash ^ word) * 0x100000001b3ull;
+    checksum->hash ^= checksum->hash >> 29;
+}
+
+static void cd_xml_checksum_update(cd_xml_checksum_t* checksum, const char* ptr, size_t bytes)
+{
+    size_t i = 0;
+    checksum->size += bytes;
+    while (checksum->tail_size && i < bytes) {
+        checksum->tail[checksum->tail_size++] = ptr[i++];
+        if (checksum->tail_size == 8) {
+            cd_xml_checksum_word(checksum, checksum->tail);
+            checksum->tail_size = 0;
+        }
     }
-    else if(needs_sep) {
-              if (!output_func(userdata, CD_XML_WRITE_HELPER(" "))) return false;
+    for (; i + 8 <= bytes; i += 8) {
+        cd_xml_checksum_word(checksum, ptr + i);
+    }
+    for (; i < bytes; i++) {
+        checksum->tail[checksum->tail_size++] = ptr[i];
     }
+}
+
+static uint64_t cd_xml_checksum_final(cd_xml_checksum_t* checksum)
+{
+    uint64_t hash = checksum->hash;
+    for (unsigned i = 0; i < checksum->tail_size; i++) {
+        hash = (hash ^ checksum->tail[i]) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+static bool cd_xml_checksum_output(void* userdata, const char* ptr, size_t bytes)
+{
+    cd_xml_checksum_update((cd_xml_checksum_t*)userdata, ptr, bytes);
     return true;
 }
 
-static bool cd_xml_write_namespace_defs(cd_xml_doc_t*       doc,
-                                        cd_xml_output_func  output_func,
-                                        void*               userdata,
-                                        cd_xml_node_t*      elem,
-                                        size_t              depth,
-                                        bool                pretty)
+static cd_xml_binary_span_t cd_xml_binary_span(uint64_t* pool_size, const cd_xml_stringview_t* str)
 {
-    for (unsigned i = 0; i < cd_xml_sb_size(doc->namespaces); i++) {
-        cd_xml_ns_t* ns = &doc->namespaces[i];
+    cd_xml_binary_span_t span;
+    span.begin = *pool_size;
+    *pool_size += str->end - str->begin;
+    span.end = *pool_size;
+    return span;
+}
 
-        if(!cd_xml_write_indent(doc,
-                                output_func,
-                                userdata,
-                                2 * (size_t)depth + 2 + (elem->data.element.name.end - elem->data.element.name.begin),
-                                true,
-                                (i != 0) && pretty)) return false;
-        
-        if (cd_xml_strv_empty(ns->prefix)) {    // default namespace
-            if (!output_func(userdata, CD_XML_WRITE_HELPER("xmlns=\""))) return false;
-            if (!output_func(userdata, CD_XML_WRITE_HELPERV(ns->uri))) return false;
-            if (!output_func(userdata, CD_XML_WRITE_HELPER("\""))) return false;
+// Writes records and string pool. Strings are laid out in the pool in the same order as the records reference them.
+static bool cd_xml_save_binary_body(cd_xml_doc_t* doc, cd_xml_output_func output_func, void* userdata)
+{
+    uint64_t pool_size = 0;
+    for (cd_xml_ix_t i = 0; i < cd_xml_sb_size(doc->namespaces); i++) {
+        cd_xml_binary_ns_t rec;
+        rec.prefix = cd_xml_binary_span(&pool_size, &doc->namespaces[i].prefix);
+        rec.uri = cd_xml_binary_span(&pool_size, &doc->namespaces[i].uri);
+        if (!output_func(userdata, (const char*)&rec, sizeof(rec))) return false;
+    }
+    for (cd_xml_ix_t i = 0; i < cd_xml_doc_node_count(doc); i++) {
+        cd_xml_node_t* node = cd_xml_doc_node(doc, i);
+        cd_xml_binary_node_t rec;
+        memset(&rec, 0, sizeof(rec));
+        rec.next_sibling = node->next_sibling;
+        rec.kind = node->kind;
+        if (node->kind == CD_XML_NODE_ELEMENT) {
+            rec.text = cd_xml_binary_span(&pool_size, &node->data.element.name);
+            rec.namespace_ix = node->data.element.namespace_ix;
+            rec.first_child = node->data.element.first_child;
+            rec.last_child = node->data.element.last_child;
+            rec.first_attribute = node->data.element.first_attribute;
+            rec.last_attribute = node->data.element.last_attribute;
         }
-        else {                                  // prefixed namespace
-            if (!output_func(userdata, CD_XML_WRITE_HELPER("xmlns:"))) return false;
-            if (!output_func(userdata, CD_XML_WRITE_HELPERV(ns->prefix))) return false;
-            if (!output_func(userdata, CD_XML_WRITE_HELPER("=\""))) return false;
-            if (!output_func(userdata, CD_XML_WRITE_HELPERV(ns->uri))) return false;
-            if (!output_func(userdata, CD_XML_WRITE_HELPER("\""))) return false;
+        else {
+            rec.text = cd_xml_binary_span(&pool_size, &node->data.text.content);
+            rec.text_flags = node->data.text.flags;
+            rec.namespace_ix = rec.first_child = rec.last_child = rec.first_attribute = rec.last_attribute = cd_xml_no_ix;
         }
+        if (!output_func(userdata, (const char*)&rec, sizeof(rec))) return false;
+    }
+    for (cd_xml_ix_t i = 0; i < cd_xml_doc_attribute_count(doc); i++) {
+        cd_xml_attribute_t* att = cd_xml_doc_attribute(doc, i);
+        cd_xml_binary_attribute_t rec;
+        rec.name = cd_xml_binary_span(&pool_size, &att->name);
+        rec.value = cd_xml_binary_span(&pool_size, &att->value);
+        rec.namespace_ix = att->namespace_ix;
+        rec.next_attribute = att->next_attribute;
+        if (!output_func(userdata, (const char*)&rec, sizeof(rec))) return false;
     }
 
+    for (cd_xml_ix_t i = 0; i < cd_xml_sb_size(doc->namespaces); i++) {
+        if (!output_func(userdata, CD_XML_WRITE_HELPERV(doc->namespaces[i].prefix))) return false;
+        if (!output_func(userdata, CD_XML_WRITE_HELPERV(doc->namespaces[i].uri))) return false;
+    }
+    for (cd_xml_ix_t i = 0; i < cd_xml_doc_node_count(doc); i++) {
+        cd_xml_node_t* node = cd_xml_doc_node(doc, i);
+        cd_xml_stringview_t* text = node->kind == CD_XML_NODE_ELEMENT ? &node->data.element.name : &node->data.text.content;
+        if (!output_func(userdata, CD_XML_WRITE_HELPERV(*text))) return false;
+    }
+    for (cd_xml_ix_t i = 0; i < cd_xml_doc_attribute_count(doc); i++) {
+        if (!output_func(userdata, CD_XML_WRITE_HELPERV(cd_xml_doc_attribute(doc, i)->name))) return false;
+        if (!output_func(userdata, CD_XML_WRITE_HELPERV(cd_xml_doc_attribute(doc, i)->value))) return false;
+    }
     return true;
 }
 
-static bool cd_xml_write_element_attributes(cd_xml_doc_t*       doc,
-                                            cd_xml_output_func  output_func,
-                                            void*               userdata,
-                                            cd_xml_node_t*      elem,
-                                            size_t              depth)
+bool cd_xml_save_binary(cd_xml_doc_t* doc, cd_xml_output_func output_func, void* userdata)
 {
-    for(cd_xml_att_ix_t att_ix = elem->data.element.first_attribute; att_ix != cd_xml_no_ix; att_ix = doc->attributes[att_ix].next_attribute) {
-        cd_xml_attribute_t* att = &doc->attributes[att_ix];
-        if(!output_func(userdata, CD_XML_WRITE_HELPER(" "))) return false;
-        if(att->namespace_ix != cd_xml_no_ix) {
-            assert(att->namespace_ix < cd_xml_sb_size(doc->attributes));
-            if(!output_func(userdata, CD_XML_WRITE_HELPERV(doc->namespaces[att->namespace_ix].prefix))) return false;
-            if(!output_func(userdata, CD_XML_WRITE_HELPER(":"))) return false;
-        }
-        if(!output_func(userdata, CD_XML_WRITE_HELPERV(att->name))) return false;
-        if(!output_func(userdata, CD_XML_WRITE_HELPER("=\""))) return false;
-        if(!cd_xml_encode_and_write(output_func, userdata, &att->value)) return false;
-        if(!output_func(userdata, CD_XML_WRITE_HELPER("\""))) return false;
+    if (cd_xml_has_pending(doc)) return false;
+#ifdef CD_XML_ENABLE_STATS
+    if (cd_xml_stats_current && output_func != cd_xml_stats_output) {
+        cd_xml_stats_output_t wrapped = { output_func, userdata };
+        CD_XML_STATS_PHASE_BEGIN(phase_start);
+        bool rv = cd_xml_save_binary(doc, cd_xml_stats_output, &wrapped);
+        CD_XML_STATS_PHASE_END(phase_start, CD_XML_PHASE_WRITE);
+        return rv;
     }
+#endif
+    cd_xml_checksum_t checksum;
+    cd_xml_checksum_init(&checksum);
+    cd_xml_save_binary_body(doc, cd_xml_checksum_output, &checksum);
+
+    cd_xml_binary_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CD_XML_BINARY_MAGIC, sizeof(header.magic));
+    header.version = CD_XML_BINARY_VERSION;
+    header.endian = CD_XML_BINARY_ENDIAN;
+    header.namespace_count = cd_xml_sb_size(doc->namespaces);
+    header.node_count = cd_xml_doc_node_count(doc);
+    header.attribute_count = cd_xml_doc_attribute_count(doc);
+    header.strings_size = checksum.size - (header.namespace_count * sizeof(cd_xml_binary_ns_t) +
+                                           header.node_count * sizeof(cd_xml_binary_node_t) +
+                                           header.attribute_count * sizeof(cd_xml_binary_attribute_t));
+    header.checksum = cd_xml_checksum_final(&checksum);
+
+    if (!output_func(userdata, (const char*)&header, sizeof(header))) return false;
+    return cd_xml_save_binary_body(doc, output_func, userdata);
+}
+
+static bool cd_xml_load_span(cd_xml_stringview_t* out, const cd_xml_binary_span_t* span, const char* pool, uint64_t pool_size)
+{
+    if (span->end < span->begin || pool_size < span->end) return false;
+    out->begin = pool + span->begin;
+    out->end = pool + span->end;
     return true;
 }
 
-static bool cd_xml_write_element_name(cd_xml_doc_t*      doc,
-                                      cd_xml_output_func output_func,
-                                      void*              userdata,
-                                      cd_xml_node_t*     elem)
+static bool cd_xml_load_ix(cd_xml_ix_t ix, uint64_t count)
 {
-    if (elem->data.element.namespace_ix != cd_xml_no_ix) {
-        assert(elem->data.element.namespace_ix < cd_xml_sb_size(doc->namespaces));
-        cd_xml_ns_t* ns = &doc->namespaces[elem->data.element.namespace_ix];
-        if(!cd_xml_strv_empty(ns->prefix)) {    // empty -> default namespace
-            if (!output_func(userdata, CD_XML_WRITE_HELPERV(ns->prefix))) return false;
-            if (!output_func(userdata, CD_XML_WRITE_HELPER(":"))) return false;
-        }
-    }
-    if (!output_func(userdata, CD_XML_WRITE_HELPERV(elem->data.element.name))) return false;
+    return ix == cd_xml_no_ix || ix < count;
+}
+
+// Mark ix as linked to, returns false if something already links to it.
+static bool cd_xml_load_link(unsigned char* linked, cd_xml_ix_t ix)
+{
+    if (ix == cd_xml_no_ix) return true;
+    if (linked[ix]) return false;
+    linked[ix] = 1;
     return true;
 }
 
-static bool cd_xml_write_element(cd_xml_doc_t*      doc,
-                                 cd_xml_output_func output_func,
-                                 void*              userdata,
-                                 cd_xml_node_ix_t   elem_ix,
-                                 size_t             depth,
-                                 bool               pretty)
+// Check that child, sibling and attribute links of a loaded doc form proper trees and lists.
+//
+// Indices are already known to be in range. If nothing is linked to twice, a cycle cannot be reached from
+// an item that nothing links to, so links are acyclic if every item is reached from such items. Last
+// child and last attribute must be the ends of their lists, as appending links from them.
+static cd_xml_parse_status_t cd_xml_load_check_links(cd_xml_doc_t* d)
 {
+    cd_xml_ix_t node_count = cd_xml_doc_node_count(d);
+    cd_xml_ix_t attribute_count = cd_xml_doc_attribute_count(d);
+    size_t count = node_count < attribute_count ? attribute_count : node_count;
+    if (count == 0) return CD_XML_STATUS_SUCCESS;
+    unsigned char* linked = (unsigned char*)cd_xml_alloc(&d->allocator, count);
+    cd_xml_ix_t* queue = (cd_xml_ix_t*)cd_xml_alloc(&d->allocator, sizeof(cd_xml_ix_t) * count);
+    if (linked == NULL || queue == NULL) {
+        if (linked) cd_xml_dealloc(&d->allocator, linked, count);
+        if (queue) cd_xml_dealloc(&d->allocator, queue, sizeof(cd_xml_ix_t) * count);
+        return CD_XML_STATUS_OUT_OF_MEMORY;
+    }
 
-    assert(elem_ix < cd_xml_sb_size(doc->nodes));
-    cd_xml_node_t* elem = &doc->nodes[elem_ix];
+    // Nodes, children and siblings form a binary tree, so visit breadth-first from unlinked nodes.
+    memset(linked, 0, node_count);
+    bool ok = true;
+    for (cd_xml_ix_t i = 0; ok && i < node_count; i++) {
+        const cd_xml_node_t* node = cd_xml_doc_node(d, i);
+        ok = cd_xml_load_link(linked, node->next_sibling) &&
+             (node->kind != CD_XML_NODE_ELEMENT || cd_xml_load_link(linked, node->data.element.first_child));
+    }
+    ok = ok && linked[0] == 0;
+    cd_xml_ix_t head = 0, tail = 0;
+    for (cd_xml_ix_t i = 0; ok && i < node_count; i++) {
+        if (!linked[i]) queue[tail++] = i;
+    }
+    while (ok && head < tail) {
+        cd_xml_ix_t node_ix = queue[head++];
+        const cd_xml_node_t* node = cd_xml_doc_node(d, node_ix);
+        if (node->next_sibling != cd_xml_no_ix) queue[tail++] = node->next_sibling;
+        if (node->kind == CD_XML_NODE_ELEMENT && node->data.element.first_child != cd_xml_no_ix) queue[tail++] = node->data.element.first_child;
+    }
+    ok = ok && tail == node_count;
 
-    if(!cd_xml_write_indent(doc,
-                            output_func,
-                            userdata,
-                            2 * depth,
-                            false,
-                            pretty)) return false;
-    
-    if (elem->kind == CD_XML_NODE_ELEMENT) {
-        if (!output_func(userdata, "<", 1)) return false;
+    // Attributes only form lists, so follow each list from its head, and elements must link to heads only.
+    memset(linked, 0, attribute_count);
+    for (cd_xml_ix_t i = 0; ok && i < attribute_count; i++) {
+        ok = cd_xml_load_link(linked, cd_xml_doc_attribute(d, i)->next_attribute);
+    }
+    cd_xml_ix_t reached = 0;
+    for (cd_xml_ix_t i = 0; ok && i < attribute_count; i++) {
+        if (linked[i]) continue;
+        for (cd_xml_ix_t att_ix = i; att_ix != cd_xml_no_ix; att_ix = cd_xml_doc_attribute(d, att_ix)->next_attribute) reached++;
+    }
+    ok = ok && reached == attribute_count;
+    for (cd_xml_ix_t i = 0; ok && i < node_count; i++) {
+        const cd_xml_node_t* node = cd_xml_doc_node(d, i);
+        if (node->kind == CD_XML_NODE_ELEMENT) ok = cd_xml_load_link(linked, node->data.element.first_attribute);
+    }
+
+    // Lists are now known to end, so their last items can be checked.
+    for (cd_xml_ix_t i = 0; ok && i < node_count; i++) {
+        const cd_xml_node_t* node = cd_xml_doc_node(d, i);
+        if (node->kind != CD_XML_NODE_ELEMENT) continue;
+        cd_xml_ix_t last = cd_xml_no_ix;
+        for (cd_xml_ix_t child_ix = node->data.element.first_child; child_ix != cd_xml_no_ix; child_ix = cd_xml_doc_node(d, child_ix)->next_sibling) last = child_ix;
+        ok = last == node->data.element.last_child;
+        last = cd_xml_no_ix;
+        for (cd_xml_ix_t att_ix = node->data.element.first_attribute; att_ix != cd_xml_no_ix; att_ix = cd_xml_doc_attribute(d, att_ix)->next_attribute) last = att_ix;
+        ok = ok && last == node->data.element.last_attribute;
+    }
+
+    cd_xml_dealloc(&d->allocator, linked, count);
+    cd_xml_dealloc(&d->allocator, queue, sizeof(cd_xml_ix_t) * count);
+    return ok ? CD_XML_STATUS_SUCCESS : CD_XML_STATUS_MALFORMED_BINARY;
+}
+
+cd_xml_parse_status_t cd_xml_load_binary(cd_xml_doc_t**     doc,
+                                         const void*        data,
+                                         size_t             size,
+                                         cd_xml_flags_t     flags)
+{
+    if(*doc != NULL) {
+        return CD_XML_STATUS_POINTER_NOT_NULL;
+    }
 
-        if(!cd_xml_write_element_name(doc, output_func, userdata, elem)) return false;
+    cd_xml_binary_header_t header;
+    if (size < sizeof(header)) return CD_XML_STATUS_MALFORMED_BINARY;
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, CD_XML_BINARY_MAGIC, sizeof(header.magic)) != 0) return CD_XML_STATUS_MALFORMED_BINARY;
+    if (header.version != CD_XML_BINARY_VERSION) return CD_XML_STATUS_UNSUPPORTED_VERSION;
+    if (header.endian != CD_XML_BINARY_ENDIAN) return CD_XML_STATUS_MALFORMED_BINARY;
+
+    // Check sizes in steps to avoid overflow on bogus counts.
+    uint64_t left = size - sizeof(header);
+    if (left / sizeof(cd_xml_binary_ns_t) < header.namespace_count) return CD_XML_STATUS_MALFORMED_BINARY;
+    left -= header.namespace_count * sizeof(cd_xml_binary_ns_t);
+    if (left / sizeof(cd_xml_binary_node_t) < header.node_count) return CD_XML_STATUS_MALFORMED_BINARY;
+    left -= header.node_count * sizeof(cd_xml_binary_node_t);
+    if (left / sizeof(cd_xml_binary_attribute_t) < header.attribute_count) return CD_XML_STATUS_MALFORMED_BINARY;
+    left -= header.attribute_count * sizeof(cd_xml_binary_attribute_t);
+    if (left != header.strings_size) return CD_XML_STATUS_MALFORMED_BINARY;
+    if (cd_xml_no_ix <= header.namespace_count || cd_xml_no_ix <= header.node_count || cd_xml_no_ix <= header.attribute_count) {
+        return CD_XML_STATUS_MALFORMED_BINARY;
+    }
 
-        if (elem_ix == 0) {
-            if(!cd_xml_write_namespace_defs(doc,
-                                            output_func, userdata,
-                                            elem, depth, pretty)) return false;
+    const char* body = (const char*)data + sizeof(header);
+    if ((flags & CD_XML_FLAGS_NO_CHECKSUM) == 0) {
+        cd_xml_checksum_t checksum;
+        cd_xml_checksum_init(&checksum);
+        cd_xml_checksum_update(&checksum, body, size - sizeof(header));
+        if (cd_xml_checksum_final(&checksum) != header.checksum) {
+            return CD_XML_STATUS_CHECKSUM_MISMATCH;
         }
-        if(!cd_xml_write_element_attributes(doc,
-                                            output_func, userdata,
-                                            elem, depth)) return false;
+    }
 
-        if (elem->data.element.first_child == cd_xml_no_ix) {
-            if (!output_func(userdata, "/>", 2)) return false;
-            return true;
+    const cd_xml_binary_ns_t* ns_recs = (const cd_xml_binary_ns_t*)body;
+    const cd_xml_binary_node_t* node_recs = (const cd_xml_binary_node_t*)(ns_recs + header.namespace_count);
+    const cd_xml_binary_attribute_t* att_recs = (const cd_xml_binary_attribute_t*)(node_recs + header.node_count);
+    const char* pool = (const char*)(att_recs + header.attribute_count);
+
+    *doc = cd_xml_init();
+    if (*doc == NULL) return CD_XML_STATUS_OUT_OF_MEMORY;
+    cd_xml_doc_t* d = *doc;
+
+    if (flags & CD_XML_FLAGS_COPY_STRINGS && header.strings_size) {
+        char* copy = SIZE_MAX < header.strings_size ? NULL : cd_xml_alloc_buf(d, (size_t)header.strings_size);
+        if (copy == NULL) {
+            cd_xml_free(doc);
+            return CD_XML_STATUS_OUT_OF_MEMORY;
+        }
+        memcpy(copy, pool, header.strings_size);
+        pool = copy;
+    }
+
+    if (header.namespace_count) {
+        if (!cd_xml__sb_grow_to(&d->allocator, (void**)&d->namespaces, sizeof(cd_xml_ns_t), (size_t)header.namespace_count)) {
+            cd_xml_parse_status_t status = cd_xml_sb_failure(d->namespaces) == CD_XML_STATUS_LIMIT_EXCEEDED || cd_xml__sb_max_capacity(sizeof(cd_xml_ns_t)) < header.namespace_count ? CD_XML_STATUS_LIMIT_EXCEEDED : CD_XML_STATUS_OUT_OF_MEMORY;
+            cd_xml_free(doc);
+            return status;
+        }
+        cd_xml__sb_size(d->namespaces) = (cd_xml_ix_t)header.namespace_count;
+    }
+    if (header.node_count && !cd_xml_resize_nodes(d, header.node_count)) {
+        cd_xml_free(doc);
+        return cd_xml_push_failure(header.node_count < cd_xml_no_ix ? (cd_xml_ix_t)header.node_count - 1 : cd_xml_no_ix, sizeof(cd_xml_node_t));
+    }
+    if (header.attribute_count && !cd_xml_resize_attributes(d, header.attribute_count)) {
+        cd_xml_free(doc);
+        return cd_xml_push_failure(header.attribute_count < cd_xml_no_ix ? (cd_xml_ix_t)header.attribute_count - 1 : cd_xml_no_ix, sizeof(cd_xml_attribute_t));
+    }
+
+    bool ok = true;
+    for (uint64_t i = 0; ok && i < header.namespace_count; i++) {
+        cd_xml_binary_ns_t rec;
+        memcpy(&rec, &ns_recs[i], sizeof(rec));
+        ok = cd_xml_load_span(&d->namespaces[i].prefix, &rec.prefix, pool, header.strings_size) &&
+             cd_xml_load_span(&d->namespaces[i].uri, &rec.uri, pool, header.strings_size);
+    }
+    for (uint64_t i = 0; ok && i < header.node_count; i++) {
+        cd_xml_binary_node_t rec;
+        memcpy(&rec, &node_recs[i], sizeof(rec));
+        cd_xml_node_t* node = cd_xml_doc_node(d, i);
+        node->next_sibling = rec.next_sibling;
+        ok = cd_xml_load_ix(rec.next_sibling, header.node_count);
+        if (rec.kind == CD_XML_NODE_ELEMENT) {
+            node->kind = CD_XML_NODE_ELEMENT;
+            node->data.element.namespace_ix = rec.namespace_ix;
+            node->data.element.first_child = rec.first_child;
+            node->data.element.last_child = rec.last_child;
+            node->data.element.first_attribute = rec.first_attribute;
+            node->data.element.last_attribute = rec.last_attribute;
+            ok = ok &&
+                 cd_xml_load_span(&node->data.element.name, &rec.text, pool, header.strings_size) &&
+                 cd_xml_load_ix(rec.namespace_ix, header.namespace_count) &&
+                 cd_xml_load_ix(rec.first_child, header.node_count) &&
+                 cd_xml_load_ix(rec.last_child, header.node_count) &&
+                 cd_xml_load_ix(rec.first_attribute, header.attribute_count) &&
+                 cd_xml_load_ix(rec.last_attribute, header.attribute_count);
+        }
+        else if (rec.kind == CD_XML_NODE_TEXT) {
+            node->kind = CD_XML_NODE_TEXT;
+            node->data.text.flags = (cd_xml_text_flags_t)rec.text_flags;
+            ok = ok && cd_xml_load_span(&node->data.text.content, &rec.text, pool, header.strings_size);
         }
         else {
-            if (!output_func(userdata, ">", 1)) return false;
+            ok = false;
+        }
+    }
+    for (uint64_t i = 0; ok && i < header.attribute_count; i++) {
+        cd_xml_binary_attribute_t rec;
+        memcpy(&rec, &att_recs[i], sizeof(rec));
+        cd_xml_attribute_t* att = cd_xml_doc_attribute(d, i);
+        att->namespace_ix = rec.namespace_ix;
+        att->next_attribute = rec.next_attribute;
+        ok = cd_xml_load_span(&att->name, &rec.name, pool, header.strings_size) &&
+             cd_xml_load_span(&att->value, &rec.value, pool, header.strings_size) &&
+             cd_xml_load_ix(rec.namespace_ix, header.namespace_count) &&
+             cd_xml_load_ix(rec.next_attribute, header.attribute_count);
+    }
 
-            for (cd_xml_node_ix_t child_ix = elem->data.element.first_child; child_ix != cd_xml_no_ix; child_ix = doc->nodes[child_ix].next_sibling) {
-                if (!cd_xml_write_element(doc, output_func, userdata, child_ix, depth + 1, pretty)) return false;
+    cd_xml_parse_status_t status = ok ? cd_xml_load_check_links(d) : CD_XML_STATUS_MALFORMED_BINARY;
+    if (status != CD_XML_STATUS_SUCCESS) {
+        cd_xml_free(doc);
+        return status;
+    }
+    return CD_XML_STATUS_SUCCESS;
+}
+
+// Decimal number split into sign, significant digits and a power-of-ten exponent.
+typedef struct {
+    uint64_t                    mantissa;                   // Up to 19 significant digits.
+    int                         exponent;                   // Power of ten to multiply mantissa with.
+    bool                        negative;                   // Number has a minus sign.
+    bool                        exact;                      // False if digits were dropped from mantissa.
+} cd_xml_decimal_t;
+
+// Parse a decimal number, returns false if token has a different syntax, like inf or nan.
+static bool cd_xml_parse_decimal(const char* p, const char* end, cd_xml_decimal_t* d)
+{
+    d->mantissa = 0;
+    d->exponent = 0;
+    d->negative = false;
+    d->exact = true;
+    if (p < end && (*p == '-' || *p == '+')) {
+        d->negative = *p++ == '-';
+    }
+    unsigned digits = 0;
+    unsigned significant = 0;
+    for (; p < end && '0' <= *p && *p <= '9'; p++, digits++) {
+        if (significant < 19) {
+            d->mantissa = 10 * d->mantissa + (unsigned)(*p - '0');
+            if (d->mantissa) significant++;
+        }
+        else {
+            d->exponent++;
+            if (*p != '0') d->exact = false;
+        }
+    }
+    if (p < end && *p == '.') {
+        p++;
+        for (; p < end && '0' <= *p && *p <= '9'; p++, digits++) {
+            if (significant < 19) {
+                d->mantissa = 10 * d->mantissa + (unsigned)(*p - '0');
+                if (d->mantissa) significant++;
+                d->exponent--;
+            }
+            else if (*p != '0') {
+                d->exact = false;
             }
+        }
+    }
+    if (digits == 0) return false;
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        p++;
+        bool negative = false;
+        if (p < end && (*p == '-' || *p == '+')) {
+            negative = *p++ == '-';
+        }
+        if (p == end) return false;
+        int e = 0;
+        for (; p < end && '0' <= *p && *p <= '9'; p++) {
+            if (e < 100000) e = 10 * e + (*p - '0');
+        }
+        d->exponent += negative ? -e : e;
+    }
+    return p == end;
+}
+
+// Fallback for numbers outside the exact fast paths, uses strtod or strtof on a zero-terminated copy.
+//
+// Those use the decimal point of the current locale, so the copy has the fraction digits moved into the
+// exponent and no decimal point. Only decimal numbers are copied, so inf, nan and hex floats are rejected.
+static bool cd_xml_parse_real_slow(const char* p, const char* end, double* out, bool single)
+{
+    char small[128];
+    size_t size = (size_t)(end - p) + 24;   // Room for 'e', sign and digits of a new exponent.
+    char* buf = size <= sizeof(small) ? small : (char*)CD_XML_MALLOC(size);
+    if (buf == NULL) return false;
+    char* q = buf;
+    if (p < end && (*p == '-' || *p == '+')) {
+        if (*p++ == '-') *q++ = '-';
+    }
+    size_t digits = 0;
+    int64_t exponent = 0;
+    for (; p < end && '0' <= *p && *p <= '9'; p++, digits++) *q++ = *p;
+    if (p < end && *p == '.') {
+        for (p++; p < end && '0' <= *p && *p <= '9'; p++, digits++, exponent--) *q++ = *p;
+    }
+    bool ok = digits != 0;
+    if (ok && p < end && (*p == 'e' || *p == 'E')) {
+        p++;
+        bool negative = false;
+        if (p < end && (*p == '-' || *p == '+')) {
+            negative = *p++ == '-';
+        }
+        ok = p < end && '0' <= *p && *p <= '9';
+        int64_t e = 0;
+        for (; p < end && '0' <= *p && *p <= '9'; p++) {
+            if (e < 1000000000000000) e = 10 * e + (*p - '0');   // Saturate way beyond any finite result.
+        }
+        exponent += negative ? -e : e;
+    }
+    ok = ok && p == end;
+    if (ok) {
+        *q++ = 'e';
+        if (exponent < 0) {
+            *q++ = '-';
+            exponent = -exponent;
+        }
+        char e_digits[20];
+        unsigned n = 0;
+        do {
+            e_digits[n++] = (char)('0' + exponent % 10);
+            exponent /= 10;
+        } while (exponent);
+        while (n) *q++ = e_digits[--n];
+        *q = '\0';
+
+        char* stop = NULL;
+        *out = single ? (double)strtof(buf, &stop) : strtod(buf, &stop);
+        ok = stop == q;
+    }
+    if (buf != small) CD_XML_FREE(buf);
+    return ok;
+}
+
+static bool cd_xml_parse_double_token(const char* p, const char* end, double* out)
+{
+    // Clinger's fast path: mantissa and power of ten are exact doubles, so one operation rounds correctly.
+    static const double pow10[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    cd_xml_decimal_t d;
+    if (cd_xml_parse_decimal(p, end, &d) && d.exact && d.mantissa <= (1ull << 53) && -22 <= d.exponent && d.exponent <= 22) {
+        double v = (double)d.mantissa;
+        v = d.exponent < 0 ? v / pow10[-d.exponent] : v * pow10[d.exponent];
+        *out = d.negative ? -v : v;
+        return true;
+    }
+    return cd_xml_parse_real_slow(p, end, out, false);
+}
 
-            if(!cd_xml_write_indent(doc,
-                                    output_func,
-                                    userdata,
-                                    2 * depth,
-                                    false,
-                                    pretty)) return false;
+static bool cd_xml_parse_float_token(const char* p, const char* end, float* out)
+{
+    static const float pow10[] = { 1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f };
+    cd_xml_decimal_t d;
+    if (cd_xml_parse_decimal(p, end, &d) && d.exact && d.mantissa <= (1ull << 24) && -10 <= d.exponent && d.exponent <= 10) {
+        float v = (float)d.mantissa;
+        v = d.exponent < 0 ? v / pow10[-d.exponent] : v * pow10[d.exponent];
+        *out = d.negative ? -v : v;
+        return true;
+    }
+    double v;
+    if (!cd_xml_parse_real_slow(p, end, &v, true)) return false;
+    *out = (float)v;
+    return true;
+}
 
-            if (!output_func(userdata, "<//", 2)) return false;
-            if(!cd_xml_write_element_name(doc, output_func, userdata, elem)) return false;
-            if (!output_func(userdata, ">", 1)) return false;
+static bool cd_xml_parse_int_token(const char* p, const char* end, int* out)
+{
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = *p++ == '-';
+    }
+    if (p == end) return false;
+    int64_t v = 0;
+    for (; p < end; p++) {
+        if (*p < '0' || '9' < *p) return false;
+        v = 10 * v + (*p - '0');
+        if ((int64_t)INT_MAX + 1 < v) return false;
+    }
+    if (negative) v = -v;
+    if (v < INT_MIN || INT_MAX < v) return false;
+    *out = (int)v;
+    return true;
+}
+
+// Kind of numbers to parse in cd_xml_parse_numbers.
+typedef enum {
+    CD_XML_NUMBER_FLOAT,
+    CD_XML_NUMBER_DOUBLE,
+    CD_XML_NUMBER_INT
+} cd_xml_number_kind_t;
+
+static size_t cd_xml_parse_numbers(const cd_xml_stringview_t* text, void* out, size_t cap, size_t count, cd_xml_number_kind_t kind)
+{
+    const char* p = text->begin;
+    const char* end = text->end;
+    while ((p = cd_xml_skip_space(p, end)) < end) {
+        const char* token_end = cd_xml_skip_nonspace(p, end);
+        bool ok = true;
+        if (count < cap) {
+            switch (kind) {
+            case CD_XML_NUMBER_FLOAT:  ok = cd_xml_parse_float_token(p, token_end, (float*)out + count); break;
+            case CD_XML_NUMBER_DOUBLE: ok = cd_xml_parse_double_token(p, token_end, (double*)out + count); break;
+            case CD_XML_NUMBER_INT:    ok = cd_xml_parse_int_token(p, token_end, (int*)out + count); break;
+            }
+        }
+        else {  // Out of capacity, only validate and count.
+            float f; double d; int i;
+            switch (kind) {
+            case CD_XML_NUMBER_FLOAT:  ok = cd_xml_parse_float_token(p, token_end, &f); break;
+            case CD_XML_NUMBER_DOUBLE: ok = cd_xml_parse_double_token(p, token_end, &d); break;
+            case CD_XML_NUMBER_INT:    ok = cd_xml_parse_int_token(p, token_end, &i); break;
+            }
         }
+        if (!ok) return (size_t)-1;
+        count++;
+        p = token_end;
     }
-    else if (elem->kind == CD_XML_NODE_TEXT) {
-        if (!cd_xml_encode_and_write(output_func, userdata, &elem->data.text.content)) return false;
+    return count;
+}
+
+static size_t cd_xml_parse_node_numbers(cd_xml_doc_t* doc, cd_xml_node_ix_t node_ix, void* out, size_t cap, cd_xml_number_kind_t kind)
+{
+    assert(node_ix < cd_xml_doc_node_count(doc) && "Illegal node index");
+    cd_xml_node_t* node = cd_xml_doc_node(doc, node_ix);
+    if (node->kind == CD_XML_NODE_TEXT) {
+        return cd_xml_parse_numbers(&node->data.text.content, out, cap, 0, kind);
     }
-    else {
-        assert(0 && "Illegal elem kind");
+    size_t count = 0;
+    for (cd_xml_node_ix_t child_ix = node->data.element.first_child; child_ix != cd_xml_no_ix; child_ix = cd_xml_doc_node(doc, child_ix)->next_sibling) {
+        cd_xml_node_t* child = cd_xml_doc_node(doc, child_ix);
+        if (child->kind == CD_XML_NODE_TEXT) {
+            count = cd_xml_parse_numbers(&child->data.text.content, out, cap, count, kind);
+            if (count == (size_t)-1) break;
+        }
+    }
+    return count;
+}
+
+size_t cd_xml_parse_floats(cd_xml_doc_t* doc, cd_xml_node_ix_t node, float* out, size_t cap)
+{
+    return cd_xml_parse_node_numbers(doc, node, out, cap, CD_XML_NUMBER_FLOAT);
+}
+
+size_t cd_xml_parse_doubles(cd_xml_doc_t* doc, cd_xml_node_ix_t node, double* out, size_t cap)
+{
+    return cd_xml_parse_node_numbers(doc, node, out, cap, CD_XML_NUMBER_DOUBLE);
+}
+
+size_t cd_xml_parse_ints(cd_xml_doc_t* doc, cd_xml_node_ix_t node, int* out, size_t cap)
+{
+    return cd_xml_parse_node_numbers(doc, node, out, cap, CD_XML_NUMBER_INT);
+}
+
+size_t cd_xml_parse_floats_strv(const cd_xml_stringview_t* text, float* out, size_t cap)
+{
+    return cd_xml_parse_numbers(text, out, cap, 0, CD_XML_NUMBER_FLOAT);
+}
+
+size_t cd_xml_parse_doubles_strv(const cd_xml_stringview_t* text, double* out, size_t cap)
+{
+    return cd_xml_parse_numbers(text, out, cap, 0, CD_XML_NUMBER_DOUBLE);
+}
+
+size_t cd_xml_parse_ints_strv(const cd_xml_stringview_t* text, int* out, size_t cap)
+{
+    return cd_xml_parse_numbers(text, out, cap, 0, CD_XML_NUMBER_INT);
+}
+
+// Base64 decoding table: 0-63 for digits, 64 for whitespace, 65 for padding and 255 for illegal.
+static const unsigned char cd_xml_base64_table[256] = {
+    255, 255, 255, 255, 255, 255, 255, 255, 255,  64,  64, 255, 255,  64, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+     64, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,  62, 255, 255, 255,  63,
+     52,  53,  54,  55,  56,  57,  58,  59,  60,  61, 255, 255, 255,  65, 255, 255,
+    255,   0,   1,   2,   3,   4,   5,   6,   7,   8,   9,  10,  11,  12,  13,  14,
+     15,  16,  17,  18,  19,  20,  21,  22,  23,  24,  25, 255, 255, 255, 255, 255,
+    255,  26,  27,  28,  29,  30,  31,  32,  33,  34,  35,  36,  37,  38,  39,  40,
+     41,  42,  43,  44,  45,  46,  47,  48,  49,  50,  51, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255
+};
+
+// State of base64 decoding across text spans.
+typedef struct {
+    uint32_t                    bits;                       // Bits of incomplete quad.
+    unsigned                    count;                      // Number of digits in incomplete quad.
+    unsigned                    padding;                    // Number of '=' that still may follow.
+    bool                        done;                       // Padding has been encountered.
+} cd_xml_base64_state_t;
+
+#ifdef CD_XML_SSSE3
+// Decode 16 base64 digits into 12 bytes, returns false if the block contains anything else than digits.
+static bool cd_xml_base64_block16(const char* p, unsigned char* out)
+{
+    const __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+    const __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i mask_2f = _mm_set1_epi8(0x2f);
+
+    __m128i in = _mm_loadu_si128((const __m128i*)p);
+    __m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(in, 4), mask_2f);
+    __m128i lo_nibbles = _mm_and_si128(in, mask_2f);
+    __m128i lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+    __m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+    if (_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128()))) return false;
+
+    __m128i roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(_mm_cmpeq_epi8(in, mask_2f), hi_nibbles));
+    __m128i values = _mm_add_epi8(in, roll);
+    __m128i merged = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+    merged = _mm_madd_epi16(merged, _mm_set1_epi32(0x00011000));
+    merged = _mm_shuffle_epi8(merged, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+
+    unsigned char tmp[16];
+    _mm_storeu_si128((__m128i*)tmp, merged);
+    memcpy(out, tmp, 12);
+    return true;
+}
+#endif
+
+#ifdef CD_XML_AVX2
+// Decode 32 base64 digits into 24 bytes, returns false if the block contains anything else than digits.
+static bool cd_xml_base64_block32(const char* p, unsigned char* out)
+{
+    const __m256i lut_lo = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a,
+                                            0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+    const __m256i lut_hi = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+                                            0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m256i lut_roll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+                                              0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i mask_2f = _mm256_set1_epi8(0x2f);
+
+    __m256i in = _mm256_loadu_si256((const __m256i*)p);
+    __m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(in, 4), mask_2f);
+    __m256i lo_nibbles = _mm256_and_si256(in, mask_2f);
+    __m256i lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+    __m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+    if (!_mm256_testz_si256(lo, hi)) return false;
+
+    __m256i roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(_mm256_cmpeq_epi8(in, mask_2f), hi_nibbles));
+    __m256i values = _mm256_add_epi8(in, roll);
+    __m256i merged = _mm256_maddubs_epi16(values, _mm256_set1_epi32(0x01400140));
+    merged = _mm256_madd_epi16(merged, _mm256_set1_epi32(0x00011000));
+    merged = _mm256_shuffle_epi8(merged, _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+                                                          2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+    merged = _mm256_permutevar8x32_epi32(merged, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+
+    unsigned char tmp[32];
+    _mm256_storeu_si256((__m256i*)tmp, merged);
+    memcpy(out, tmp, 24);
+    return true;
+}
+#endif
+
+// Decode a span of base64, returns false on illegal input.
+static bool cd_xml_base64_decode_span(cd_xml_base64_state_t* state, const char* p, const char* end, unsigned char** out)
+{
+    unsigned char* o = *out;
+    while (p < end) {
+        // Vectorized path for runs of digits at quad boundaries.
+        const char* scalar_end = end;
+        if (state->count == 0 && !state->done) {
+#ifdef CD_XML_AVX2
+            while (p + 32 <= end && cd_xml_base64_block32(p, o)) {
+                p += 32;
+                o += 24;
+            }
+#endif
+#ifdef CD_XML_SSSE3
+            while (p + 16 <= end && cd_xml_base64_block16(p, o)) {
+                p += 16;
+                o += 12;
+            }
+            // Block contains whitespace or padding, decode it as scalar before retrying.
+            scalar_end = p + 16 < end ? p + 16 : end;
+#endif
+        }
+        while (p < end && (p < scalar_end || state->count != 0)) {
+            unsigned v = cd_xml_base64_table[(unsigned char)*p++];
+            if (v < 64) {
+                if (state->done) return false;
+                state->bits = (state->bits << 6) | v;
+                if (++state->count == 4) {
+                    *o++ = (unsigned char)(state->bits >> 16);
+                    *o++ = (unsigned char)(state->bits >> 8);
+                    *o++ = (unsigned char)(state->bits);
+                    state->bits = 0;
+                    state->count = 0;
+                }
+            }
+            else if (v == 64) {
+                continue;
+            }
+            else if (v == 65) {
+                if (state->done) {
+                    if (state->padding == 0) return false;
+                    state->padding--;
+                }
+                else if (state->count == 2) {
+                    *o++ = (unsigned char)(state->bits >> 4);
+                    state->padding = 1;
+                    state->done = true;
+                }
+                else if (state->count == 3) {
+                    *o++ = (unsigned char)(state->bits >> 10);
+                    *o++ = (unsigned char)(state->bits >> 2);
+                    state->padding = 0;
+                    state->done = true;
+                }
+                else {
+                    return false;
+                }
+                state->bits = 0;
+                state->count = 0;
+            }
+            else {
+                return false;
+            }
+        }
     }
+    *out = o;
     return true;
 }
 
-bool cd_xml_write(cd_xml_doc_t* doc, cd_xml_output_func output_func, void* userdata, bool pretty)
+// Handle a missing final padding, returns false if the input ended inside a quad.
+static bool cd_xml_base64_decode_finish(cd_xml_base64_state_t* state, unsigned char** out)
 {
-    const char* decl = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>";
-    if (!output_func(userdata, decl, strlen(decl))) return false;
-    if (cd_xml_sb_size(doc->nodes) != 0) {
-        if (!cd_xml_write_element(doc, output_func, userdata, 0, 0, pretty)) return false;
+    unsigned char* o = *out;
+    switch (state->count) {
+    case 0: break;
+    case 2: *o++ = (unsigned char)(state->bits >> 4); break;
+    case 3: *o++ = (unsigned char)(state->bits >> 10); *o++ = (unsigned char)(state->bits >> 2); break;
+    default: return false;
+    }
+    *out = o;
+    return true;
+}
+
+static bool cd_xml_looks_like_base64(const cd_xml_stringview_t* text)
+{
+    for (const char* p = text->begin; p < text->end; p++) {
+        if (cd_xml_base64_table[(unsigned char)*p] == 255) return false;
     }
-    if (!output_func(userdata, "\n", 1)) return false;
     return true;
 }
 
+size_t cd_xml_text_base64_size(cd_xml_doc_t* doc, cd_xml_node_ix_t node_ix)
+{
+    assert(node_ix < cd_xml_doc_node_count(doc) && "Illegal node index");
+    cd_xml_node_t* node = cd_xml_doc_node(doc, node_ix);
+    size_t chars = 0;
+    if (node->kind == CD_XML_NODE_TEXT) {
+        chars = node->data.text.content.end - node->data.text.content.begin;
+    }
+    else {
+        for (cd_xml_node_ix_t child_ix = node->data.element.first_child; child_ix != cd_xml_no_ix; child_ix = cd_xml_doc_node(doc, child_ix)->next_sibling) {
+            cd_xml_node_t* child = cd_xml_doc_node(doc, child_ix);
+            if (child->kind == CD_XML_NODE_TEXT) {
+                chars += child->data.text.content.end - child->data.text.content.begin;
+            }
+        }
+    }
+    return 3 * ((chars + 3) / 4);
+}
+
+size_t cd_xml_text_base64_decode(cd_xml_doc_t* doc, cd_xml_node_ix_t node_ix, void* out)
+{
+    assert(node_ix < cd_xml_doc_node_count(doc) && "Illegal node index");
+    cd_xml_node_t* node = cd_xml_doc_node(doc, node_ix);
+    cd_xml_base64_state_t state = { 0, 0, 0, false };
+    unsigned char* o = (unsigned char*)out;
+    if (node->kind == CD_XML_NODE_TEXT) {
+        if (!cd_xml_base64_decode_span(&state, node->data.text.content.begin, node->data.text.content.end, &o)) return (size_t)-1;
+    }
+    else {
+        for (cd_xml_node_ix_t child_ix = node->data.element.first_child; child_ix != cd_xml_no_ix; child_ix = cd_xml_doc_node(doc, child_ix)->next_sibling) {
+            cd_xml_node_t* child = cd_xml_doc_node(doc, child_ix);
+            if (child->kind == CD_XML_NODE_TEXT) {
+                if (!cd_xml_base64_decode_span(&state, child->data.text.content.begin, child->data.text.content.end, &o)) return (size_t)-1;
+            }
+        }
+    }
+    if (!cd_xml_base64_decode_finish(&state, &o)) return (size_t)-1;
+    return o - (unsigned char*)out;
+}
+
 bool cd_xml_apply_visitor_recurse(cd_xml_doc_t*           doc,
                                   void*                   userdata,
                                   cd_xml_visit_elem_enter elem_enter,
@@ -1736,8 +7440,8 @@ bool cd_xml_apply_visitor_recurse(cd_xml_doc_t*           doc,
                                   cd_xml_visit_text       text,
                                   cd_xml_node_t*          elem)
 {
-    unsigned M = cd_xml_sb_size(doc->nodes);
-    unsigned N = cd_xml_sb_size(doc->attributes);
+    cd_xml_ix_t M = cd_xml_doc_node_count(doc);
+    cd_xml_ix_t N = cd_xml_doc_attribute_count(doc);
     assert(elem->kind == CD_XML_NODE_ELEMENT);
     
     if(elem_enter) {
@@ -1749,7 +7453,7 @@ bool cd_xml_apply_visitor_recurse(cd_xml_doc_t*           doc,
         cd_xml_att_ix_t att_ix = elem->data.element.first_attribute;
         while(att_ix != cd_xml_no_ix) {
             assert(att_ix < N);
-            cd_xml_attribute_t* att = &doc->attributes[att_ix];
+            cd_xml_attribute_t* att = cd_xml_doc_attribute(doc, att_ix);
             attribute(userdata, doc, att->namespace_ix, &att->name, &att->value);
             att_ix = att->next_attribute;
         }
@@ -1757,7 +7461,7 @@ bool cd_xml_apply_visitor_recurse(cd_xml_doc_t*           doc,
     cd_xml_node_ix_t child_ix = elem->data.element.first_child;
     while(child_ix != cd_xml_no_ix) {
         assert(child_ix < M);
-        cd_xml_node_t* child = &doc->nodes[child_ix];
+        cd_xml_node_t* child = cd_xml_doc_node(doc, child_ix);
         if(child->kind == CD_XML_NODE_ELEMENT) {
             if(!cd_xml_apply_visitor_recurse(doc,
                                              userdata,
@@ -1796,7 +7500,7 @@ bool cd_xml_apply_visitor(cd_xml_doc_t*           doc,
                           cd_xml_visit_text       text)
 {
     if(doc == NULL) return false;
-    if(cd_xml_sb_size(doc->nodes) == 0) return true;
+    if(cd_xml_doc_node_count(doc) == 0) return true;
     
     return cd_xml_apply_visitor_recurse(doc,
                                         userdata,
@@ -1804,7 +7508,7 @@ bool cd_xml_apply_visitor(cd_xml_doc_t*           doc,
                                         elem_exit,
                                         attribute,
                                         text,
-                                        &doc->nodes[0]);
+                                        cd_xml_doc_node(doc, 0));
 }
 
 
@@ -0,0 +1,322 @@
+// cd_xml_hpp - thin C++ wrapper around cd_xml.h.
+//
+//   Author:        Christopher Dyken
+//   Version:       0.1a
+//   License:       MIT
+//   Language:      C++17
+//   Repository:    https://github.com/cdyk/cdutils
+//
+// Introduction:
+// =============
+//
+//   Header-only C++ convenience layer on top of cd_xml.h. Handles are just a
+//   doc pointer and an index, and iterators walk first_child/next_sibling and
+//   first_attribute/next_attribute directly, so everything inlines down to the
+//   same loads as walking the indices by hand.
+//
+//   The C library itself must still be built by defining CD_XML_IMPLEMENTATION
+//   in one C file.
+//
+// How to use:
+// ===========
+//
+//     cd_xml::document doc;
+//     if (doc.parse(xml, xml_size) != CD_XML_STATUS_SUCCESS) { ... }
+//
+//     for (cd_xml::node child : doc.root().children()) {
+//         if (child.is_element() && child.name() == "item") {
+//             for (cd_xml::attribute att : child.attributes()) {
+//                 std::string_view name = att.name();
+//                 std::string_view value = att.value();
+//             }
+//         }
+//         else if (child.is_text()) {
+//             std::string_view text = child.text();
+//         }
+//     }
+//
+//   The document owns the cd_xml_doc_t and frees it on destruction. Use
+//   document::release to take ownership of the underlying doc, and
+//   document::get to pass it to the C API.
+//
+
+#ifndef CD_XML_HPP
+#define CD_XML_HPP
+
+#include <cstddef>
+#include <iterator>
+#include <string_view>
+
+#include "cd_xml.h"
+
+namespace cd_xml {
+
+    // Convert a C stringview to a std::string_view.
+    inline std::string_view view(const cd_xml_stringview_t& s) noexcept
+    {
+        return std::string_view(s.begin, size_t(s.end - s.begin));
+    }
+
+    // Convert a std::string_view to a C stringview.
+    inline cd_xml_stringview_t strv(std::string_view s) noexcept
+    {
+        return cd_xml_stringview_t{ s.data(), s.data() + s.size() };
+    }
+
+    // Handle to a namespace, is null if the namespace index is cd_xml_no_ix.
+    class ns
+    {
+    public:
+        ns() noexcept = default;
+        ns(cd_xml_doc_t* doc, cd_xml_ns_ix_t ix) noexcept : doc_(doc), ix_(ix) {}
+
+        explicit operator bool() const noexcept { return ix_ != cd_xml_no_ix; }
+        cd_xml_ns_ix_t index() const noexcept { return ix_; }
+
+        std::string_view prefix() const noexcept { return view(doc_->namespaces[ix_].prefix); }
+        std::string_view uri() const noexcept { return view(doc_->namespaces[ix_].uri); }
+
+    private:
+        cd_xml_doc_t*   doc_ = nullptr;
+        cd_xml_ns_ix_t  ix_ = cd_xml_no_ix;
+    };
+
+    // Handle to an attribute.
+    class attribute
+    {
+    public:
+        attribute() noexcept = default;
+        attribute(cd_xml_doc_t* doc, cd_xml_att_ix_t ix) noexcept : doc_(doc), ix_(ix) {}
+
+        explicit operator bool() const noexcept { return ix_ != cd_xml_no_ix; }
+        cd_xml_att_ix_t index() const noexcept { return ix_; }
+        const cd_xml_attribute_t& raw() const noexcept { return *cd_xml_doc_attribute(doc_, ix_); }
+
+        std::string_view name() const noexcept { return view(raw().name); }
+        std::string_view value() const noexcept { return view(raw().value); }
+        cd_xml::ns ns() const noexcept { return cd_xml::ns(doc_, raw().namespace_ix); }
+        attribute next() const noexcept { return attribute(doc_, raw().next_attribute); }
+
+        bool operator==(const attribute& other) const noexcept { return ix_ == other.ix_; }
+        bool operator!=(const attribute& other) const noexcept { return ix_ != other.ix_; }
+
+    private:
+        cd_xml_doc_t*   doc_ = nullptr;
+        cd_xml_att_ix_t ix_ = cd_xml_no_ix;
+    };
+
+    // Forward iterator following an index chain, Handle provides next().
+    template<typename Handle>
+    class chain_iterator
+    {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = Handle;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const Handle*;
+        using reference = const Handle&;
+
+        chain_iterator() noexcept = default;
+        explicit chain_iterator(Handle handle) noexcept : handle_(handle) {}
+
+        reference operator*() const noexcept { return handle_; }
+        pointer operator->() const noexcept { return &handle_; }
+        chain_iterator& operator++() noexcept { handle_ = handle_.next(); return *this; }
+        chain_iterator operator++(int) noexcept { chain_iterator rv = *this; ++*this; return rv; }
+
+        bool operator==(const chain_iterator& other) const noexcept { return handle_ == other.handle_; }
+        bool operator!=(const chain_iterator& other) const noexcept { return handle_ != other.handle_; }
+
+    private:
+        Handle handle_;
+    };
+
+    // Range of handles following an index chain, for use with range-based for.
+    template<typename Handle>
+    class chain_range
+    {
+    public:
+        explicit chain_range(Handle first) noexcept : first_(first) {}
+
+        chain_iterator<Handle> begin() const noexcept { return chain_iterator<Handle>(first_); }
+        chain_iterator<Handle> end() const noexcept { return chain_iterator<Handle>(); }
+        bool empty() const noexcept { return !first_; }
+
+    private:
+        Handle first_;
+    };
+
+    using attribute_range = chain_range<attribute>;
+
+    // Handle to a node, either an element or text.
+    class node
+    {
+    public:
+        node() noexcept = default;
+        node(cd_xml_doc_t* doc, cd_xml_node_ix_t ix) noexcept : doc_(doc), ix_(ix) {}
+
+        explicit operator bool() const noexcept { return ix_ != cd_xml_no_ix; }
+        cd_xml_node_ix_t index() const noexcept { return ix_; }
+        cd_xml_doc_t* doc() const noexcept { return doc_; }
+        const cd_xml_node_t& raw() const noexcept { return *cd_xml_doc_node(doc_, ix_); }
+
+        cd_xml_node_kind_t kind() const noexcept { return raw().kind; }
+        bool is_element() const noexcept { return raw().kind == CD_XML_NODE_ELEMENT; }
+        bool is_text() const noexcept { return raw().kind == CD_XML_NODE_TEXT; }
+        node next() const noexcept { return node(doc_, raw().next_sibling); }
+
+        // Element accessors, node must be an element.
+        std::string_view name() const noexcept { return view(raw().data.element.name); }
+        cd_xml::ns ns() const noexcept { return cd_xml::ns(doc_, raw().data.element.namespace_ix); }
+        node first_child() const noexcept { return node(doc_, raw().data.element.first_child); }
+        attribute first_attribute() const noexcept { return attribute(doc_, raw().data.element.first_attribute); }
+        chain_range<node> children() const noexcept { return chain_range<node>(first_child()); }
+        attribute_range attributes() const noexcept { return attribute_range(first_attribute()); }
+
+        // First child element with a given name, null handle if none.
+        node child(std::string_view name) const noexcept
+        {
+            for (node c = first_child(); c; c = c.next()) {
+                if (c.is_element() && c.name() == name) return c;
+            }
+            return node(doc_, cd_xml_no_ix);
+        }
+
+        // First attribute with a given name, null handle if none.
+        attribute find_attribute(std::string_view name) const noexcept
+        {
+            for (attribute a = first_attribute(); a; a = a.next()) {
+                if (a.name() == name) return a;
+            }
+            return attribute(doc_, cd_xml_no_ix);
+        }
+
+        // Text accessor, node must be text.
+        std::string_view text() const noexcept { return view(raw().data.text.content); }
+
+        bool operator==(const node& other) const noexcept { return ix_ == other.ix_; }
+        bool operator!=(const node& other) const noexcept { return ix_ != other.ix_; }
+
+    private:
+        cd_xml_doc_t*       doc_ = nullptr;
+        cd_xml_node_ix_t    ix_ = cd_xml_no_ix;
+    };
+
+    using node_range = chain_range<node>;
+
+    // Owning wrapper of a cd_xml_doc_t, move-only.
+    class document
+    {
+    public:
+        document() noexcept = default;
+        explicit document(cd_xml_doc_t* doc) noexcept : doc_(doc) {}
+        document(const document&) = delete;
+        document& operator=(const document&) = delete;
+        document(document&& other) noexcept : doc_(other.release()) {}
+        document& operator=(document&& other) noexcept
+        {
+            if (this != &other) reset(other.release());
+            return *this;
+        }
+        ~document() { reset(); }
+
+        // Parse XML into this document, replacing any previous contents.
+        cd_xml_parse_status_t parse(const char* data, size_t size, cd_xml_flags_t flags = CD_XML_FLAGS_NONE) noexcept
+        {
+            reset();
+            return cd_xml_init_and_parse(&doc_, data, size, flags);
+        }
+
+        cd_xml_parse_status_t parse(std::string_view xml, cd_xml_flags_t flags = CD_XML_FLAGS_NONE) noexcept
+        {
+            return parse(xml.data(), xml.size(), flags);
+        }
+
+        // Free current doc and take ownership of a new one.
+        void reset(cd_xml_doc_t* doc = nullptr) noexcept
+        {
+            if (doc_) cd_xml_free(&doc_);
+            doc_ = doc;
+        }
+
+        // Give up ownership of the doc.
+        cd_xml_doc_t* release() noexcept
+        {
+            cd_xml_doc_t* rv = doc_;
+            doc_ = nullptr;
+            return rv;
+        }
+
+        cd_xml_doc_t* get() const noexcept { return doc_; }
+        explicit operator bool() const noexcept { return doc_ != nullptr; }
+
+        size_t node_count() const noexcept { return doc_ ? cd_xml_doc_node_count(doc_) : 0; }
+        size_t attribute_count() const noexcept { return doc_ ? cd_xml_doc_attribute_count(doc_) : 0; }
+        size_t namespace_count() const noexcept { return doc_ ? cd_xml_sb_size(doc_->namespaces) : 0; }
+
+        // Root element, null handle if the doc is empty.
+        cd_xml::node root() const noexcept { return cd_xml::node(doc_, node_count() ? 0 : cd_xml_no_ix); }
+        cd_xml::node node(cd_xml_node_ix_t ix) const noexcept { return cd_xml::node(doc_, ix); }
+        cd_xml::attribute attribute(cd_xml_att_ix_t ix) const noexcept { return cd_xml::attribute(doc_, ix); }
+        cd_xml::ns ns(cd_xml_ns_ix_t ix) const noexcept { return cd_xml::ns(doc_, ix); }
+
+    private:
+        cd_xml_doc_t* doc_ = nullptr;
+    };
+
+    // Base class with no-op callbacks for cd_xml::visit, derive and hide the ones needed.
+    struct visitor
+    {
+        cd_xml_visit_result_t enter(node) noexcept { return CD_XML_VISIT_CONTINUE; }
+        bool exit(node) noexcept { return true; }
+        bool attribute(cd_xml::attribute) noexcept { return true; }
+        bool text(node) noexcept { return true; }
+    };
+
+    namespace detail {
+
+        template<typename Visitor>
+        bool visit_recurse(cd_xml_doc_t* doc, cd_xml_node_ix_t elem_ix, Visitor& v)
+        {
+            cd_xml_visit_result_t result = v.enter(node(doc, elem_ix));
+            if (result == CD_XML_VISIT_STOP) return false;
+            if (result == CD_XML_VISIT_SKIP_SUBTREE) return true;
+
+            const node_element_t& elem = cd_xml_doc_node(doc, elem_ix)->data.element;
+            for (cd_xml_att_ix_t att_ix = elem.first_attribute; att_ix != cd_xml_no_ix; att_ix = cd_xml_doc_attribute(doc, att_ix)->next_attribute) {
+                if (!v.attribute(cd_xml::attribute(doc, att_ix))) return false;
+            }
+            for (cd_xml_node_ix_t child_ix = elem.first_child; child_ix != cd_xml_no_ix; child_ix = cd_xml_doc_node(doc, child_ix)->next_sibling) {
+                if (cd_xml_doc_node(doc, child_ix)->kind == CD_XML_NODE_ELEMENT) {
+                    if (!visit_recurse(doc, child_ix, v)) return false;
+                }
+                else if (!v.text(node(doc, child_ix))) return false;
+            }
+            return v.exit(node(doc, elem_ix));
+        }
+
+    }
+
+    // Depth-first traversal of the subtree rooted at an element with statically dispatched callbacks.
+    //
+    // Visitor must provide enter, exit, attribute and text as in cd_xml::visitor. enter may return
+    // CD_XML_VISIT_SKIP_SUBTREE to skip the element's attributes, children and exit, or
+    // CD_XML_VISIT_STOP to abort, the other callbacks return false to abort.
+    //
+    // Returns false if the traversal was aborted.
+    template<typename Visitor>
+    bool visit(node root, Visitor& v)
+    {
+        if (!root) return true;
+        return detail::visit_recurse(root.doc(), root.index(), v);
+    }
+
+    template<typename Visitor>
+    bool visit(const document& doc, Visitor& v)
+    {
+        return visit(doc.root(), v);
+    }
+
+}
+
+#endif  // CD_XML_HPP
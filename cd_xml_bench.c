@@ -0,0 +1,525 @@
+// cd_xml_bench - throughput benchmark for cd_xml.h with a synthetic corpus generator.
+//
+//   Build with e.g.
+//
+//     cc -O2 -std=c99 cd_xml_bench.c -o cd_xml_bench -lpthread
+//
+//   and run
+//
+//     cd_xml_bench [--size MB] [--min-time SECONDS] [--corpus NAME] [--json] [--dump NAME]
+//
+//   For each corpus, parse (cd_xml_init_and_parse), write (cd_xml_write to a
+//   discarding sink) and visit (cd_xml_apply_visitor) are run repeatedly until
+//   --min-time has passed, and the best run is reported as MB/s and nodes/s
+//   together with the allocation counts of a single run. Peak RSS is reported
+//   for the whole process.
+//
+//   --dump writes a generated corpus to stdout, so the exact same input can
+//   be fed to other parsers.
+//
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <time.h>
+#include <sys/resource.h>
+#endif
+
+typedef struct {
+    size_t                      mallocs;                    // Number of malloc calls.
+    size_t                      reallocs;                   // Number of realloc calls.
+    size_t                      frees;                      // Number of free calls.
+} bench_alloc_counts_t;
+
+static bench_alloc_counts_t bench_allocs;
+
+static void* bench_malloc(size_t size)
+{
+    bench_allocs.mallocs++;
+    return malloc(size);
+}
+
+static void* bench_realloc(void* ptr, size_t size)
+{
+    bench_allocs.reallocs++;
+    return realloc(ptr, size);
+}
+
+static void bench_free(void* ptr)
+{
+    if (ptr) bench_allocs.frees++;
+    free(ptr);
+}
+
+#define CD_XML_MALLOC(size) bench_malloc(size)
+#define CD_XML_REALLOC(ptr,size) bench_realloc(ptr,size)
+#define CD_XML_FREE(ptr) bench_free(ptr)
+#define CD_XML_IMPLEMENTATION
+#include "cd_xml.h"
+
+
+// --- Timing and memory -------------------------------------------------------
+
+static double bench_seconds(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER freq, count;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return (double)count.QuadPart / (double)freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + 1e-9 * (double)ts.tv_nsec;
+#endif
+}
+
+// Peak resident set size in bytes, 0 if unknown.
+static size_t bench_peak_rss(void)
+{
+#ifdef _WIN32
+    return 0;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#ifdef __APPLE__
+    return (size_t)usage.ru_maxrss;             // Bytes on macOS.
+#else
+    return (size_t)usage.ru_maxrss * 1024u;     // Kilobytes on Linux and BSDs.
+#endif
+#endif
+}
+
+
+// --- Corpus generator --------------------------------------------------------
+
+typedef struct {
+    char*                       data;                       // Contents, all messages back to back.
+    size_t                      size;                       // Number of bytes in data.
+    size_t                      capacity;                   // Allocated size of data.
+    size_t*                     offsets;                    // Start offset of each message.
+    size_t                      message_count;              // Number of messages.
+    size_t                      message_capacity;           // Allocated size of offsets.
+} bench_corpus_t;
+
+static void bench_append(bench_corpus_t* corpus, const char* str, size_t len)
+{
+    if (corpus->capacity < corpus->size + len) {
+        size_t capacity = corpus->capacity ? 2 * corpus->capacity : 4096;
+        while (capacity < corpus->size + len) capacity *= 2;
+        corpus->data = (char*)realloc(corpus->data, capacity);
+        if (corpus->data == NULL) { fprintf(stderr, "Out of memory\n"); exit(EXIT_FAILURE); }
+        corpus->capacity = capacity;
+    }
+    memcpy(corpus->data + corpus->size, str, len);
+    corpus->size += len;
+}
+
+static void bench_appendf(bench_corpus_t* corpus, const char* fmt, ...)
+{
+    char buf[512];
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    if (n < 0) return;
+    bench_append(corpus, buf, (size_t)n < sizeof(buf) ? (size_t)n : sizeof(buf) - 1);
+}
+
+static void bench_begin_message(bench_corpus_t* corpus)
+{
+    if (corpus->message_capacity <= corpus->message_count) {
+        corpus->message_capacity = corpus->message_capacity ? 2 * corpus->message_capacity : 16;
+        corpus->offsets = (size_t*)realloc(corpus->offsets, sizeof(size_t) * corpus->message_capacity);
+        if (corpus->offsets == NULL) { fprintf(stderr, "Out of memory\n"); exit(EXIT_FAILURE); }
+    }
+    corpus->offsets[corpus->message_count++] = corpus->size;
+}
+
+static size_t bench_message_size(const bench_corpus_t* corpus, size_t i)
+{
+    size_t end = i + 1 < corpus->message_count ? corpus->offsets[i + 1] : corpus->size;
+    return end - corpus->offsets[i];
+}
+
+// Deterministic pseudo-random numbers, so corpora are identical between runs.
+static uint32_t bench_rand(uint32_t* state)
+{
+    *state = *state * 1664525u + 1013904223u;
+    return *state >> 8;
+}
+
+static const char* bench_words[] = {
+    "lorem", "ipsum", "dolor", "sit", "amet", "consectetur", "adipiscing", "elit",
+    "sed", "do", "eiusmod", "tempor", "incididunt", "ut", "labore", "et", "dolore"
+};
+#define BENCH_WORD_COUNT (sizeof(bench_words) / sizeof(bench_words[0]))
+
+static void bench_words_text(bench_corpus_t* corpus, uint32_t* rng, size_t words)
+{
+    for (size_t i = 0; i < words; i++) {
+        const char* word = bench_words[bench_rand(rng) % BENCH_WORD_COUNT];
+        if (i) bench_append(corpus, " ", 1);
+        bench_append(corpus, word, strlen(word));
+    }
+}
+
+// Many siblings below the root.
+static void bench_gen_wide(bench_corpus_t* corpus, size_t target)
+{
+    uint32_t rng = 1;
+    bench_begin_message(corpus);
+    bench_appendf(corpus, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<items>\n");
+    for (size_t i = 0; corpus->size < target; i++) {
+        bench_appendf(corpus, "  <item id=\"%zu\">", i);
+        bench_words_text(corpus, &rng, 1 + bench_rand(&rng) % 4);
+        bench_appendf(corpus, "</item>\n");
+    }
+    bench_appendf(corpus, "</items>\n");
+}
+
+// Deeply nested chains, each chain BENCH_DEPTH elements deep.
+#define BENCH_DEPTH 256
+static void bench_gen_deep(bench_corpus_t* corpus, size_t target)
+{
+    bench_begin_message(corpus);
+    bench_appendf(corpus, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<root>");
+    while (corpus->size < target) {
+        for (size_t d = 0; d < BENCH_DEPTH; d++) bench_appendf(corpus, "<n%zu>", d % 10);
+        bench_appendf(corpus, "leaf");
+        for (size_t d = BENCH_DEPTH; d--; ) bench_appendf(corpus, "</n%zu>", d % 10);
+    }
+    bench_appendf(corpus, "</root>\n");
+}
+
+// Elements with many attributes.
+static void bench_gen_attributes(bench_corpus_t* corpus, size_t target)
+{
+    uint32_t rng = 2;
+    bench_begin_message(corpus);
+    bench_appendf(corpus, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<records>\n");
+    for (size_t i = 0; corpus->size < target; i++) {
+        bench_appendf(corpus, "  <record");
+        for (size_t a = 0; a < 12; a++) {
+            bench_appendf(corpus, " attr%zu=\"%u\"", a, bench_rand(&rng) % 100000u);
+        }
+        bench_appendf(corpus, "/>\n");
+    }
+    bench_appendf(corpus, "</records>\n");
+}
+
+// Text and attribute values with lots of entities and character references.
+static void bench_gen_entities(bench_corpus_t* corpus, size_t target)
+{
+    static const char* entities[] = { "&amp;", "&lt;", "&gt;", "&quot;", "&apos;", "&#169;", "&#x20AC;" };
+    uint32_t rng = 3;
+    bench_begin_message(corpus);
+    bench_appendf(corpus, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<doc>\n");
+    while (corpus->size < target) {
+        bench_appendf(corpus, "  <p title=\"a &amp; b &lt; c\">");
+        for (size_t i = 0; i < 16; i++) {
+            bench_words_text(corpus, &rng, 1);
+            const char* e = entities[bench_rand(&rng) % 7];
+            bench_append(corpus, e, strlen(e));
+        }
+        bench_appendf(corpus, "</p>\n");
+    }
+    bench_appendf(corpus, "</doc>\n");
+}
+
+// Prefixed elements and attributes with namespace declarations at several levels.
+static void bench_gen_namespaces(bench_corpus_t* corpus, size_t target)
+{
+    uint32_t rng = 4;
+    bench_begin_message(corpus);
+    bench_appendf(corpus, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                          "<a:root xmlns=\"urn:default\" xmlns:a=\"urn:a\" xmlns:b=\"urn:b\" xmlns:c=\"urn:c\">\n");
+    for (size_t i = 0; corpus->size < target; i++) {
+        bench_appendf(corpus, "  <b:group xmlns:d=\"urn:d:%zu\" a:id=\"%zu\">", i % 32, i);
+        for (size_t j = 0; j < 4; j++) {
+            bench_appendf(corpus, "<c:entry d:key=\"%u\" b:kind=\"x\"><d:value>", bench_rand(&rng) % 1000u);
+            bench_words_text(corpus, &rng, 2);
+            bench_appendf(corpus, "</d:value><plain/></c:entry>");
+        }
+        bench_appendf(corpus, "</b:group>\n");
+    }
+    bench_appendf(corpus, "</a:root>\n");
+}
+
+// Few elements with large text payloads.
+static void bench_gen_large_text(bench_corpus_t* corpus, size_t target)
+{
+    uint32_t rng = 5;
+    bench_begin_message(corpus);
+    bench_appendf(corpus, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<texts>\n");
+    while (corpus->size < target) {
+        bench_appendf(corpus, "<text>");
+        bench_words_text(corpus, &rng, 16 * 1024);
+        bench_appendf(corpus, "</text>\n");
+    }
+    bench_appendf(corpus, "</texts>\n");
+}
+
+// Many small independent documents, parsed one by one.
+static void bench_gen_messages(bench_corpus_t* corpus, size_t target)
+{
+    uint32_t rng = 6;
+    for (size_t i = 0; corpus->size < target; i++) {
+        bench_begin_message(corpus);
+        bench_appendf(corpus, "<msg id=\"%zu\" type=\"update\"><key>k%u</key><value>", i, bench_rand(&rng) % 10000u);
+        bench_words_text(corpus, &rng, 3);
+        bench_appendf(corpus, "</value></msg>");
+    }
+}
+
+typedef struct {
+    const char*                 name;
+    void                      (*generate)(bench_corpus_t* corpus, size_t target);
+} bench_generator_t;
+
+static const bench_generator_t bench_generators[] = {
+    { "wide",           bench_gen_wide },
+    { "deep",           bench_gen_deep },
+    { "attributes",     bench_gen_attributes },
+    { "entities",       bench_gen_entities },
+    { "namespaces",     bench_gen_namespaces },
+    { "large-text",     bench_gen_large_text },
+    { "messages",       bench_gen_messages }
+};
+#define BENCH_GENERATOR_COUNT (sizeof(bench_generators) / sizeof(bench_generators[0]))
+
+
+// --- Benchmarks --------------------------------------------------------------
+
+typedef enum {
+    BENCH_PARSE = 0,
+    BENCH_WRITE,
+    BENCH_VISIT,
+    BENCH_VALIDATE,
+    BENCH_HASH,
+    BENCH_OP_COUNT
+} bench_op_t;
+
+static const char* bench_op_names[BENCH_OP_COUNT] = { "parse", "write", "visit", "validate", "hash" };
+
+typedef struct {
+    double                      best_seconds;               // Fastest run.
+    size_t                      runs;                       // Number of runs.
+    bench_alloc_counts_t        allocs;                     // Allocations of a single run.
+} bench_result_t;
+
+typedef struct {
+    size_t                      bytes;                      // Bytes passed to output callback.
+} bench_sink_t;
+
+static bool bench_sink_output(void* userdata, const char* ptr, size_t bytes)
+{
+    (void)ptr;
+    ((bench_sink_t*)userdata)->bytes += bytes;
+    return true;
+}
+
+static size_t bench_visited;
+
+static bool bench_visit_elem(void* userdata, cd_xml_doc_t* doc, cd_xml_ns_ix_t namespace_ix, cd_xml_stringview_t* name)
+{
+    (void)userdata; (void)doc; (void)namespace_ix; (void)name;
+    bench_visited++;
+    return true;
+}
+
+static bool bench_visit_attribute(void* userdata, cd_xml_doc_t* doc, cd_xml_ns_ix_t namespace_ix, cd_xml_stringview_t* name, cd_xml_stringview_t* value)
+{
+    (void)userdata; (void)doc; (void)namespace_ix; (void)name; (void)value;
+    bench_visited++;
+    return true;
+}
+
+static bool bench_visit_text(void* userdata, cd_xml_doc_t* doc, cd_xml_stringview_t* text)
+{
+    (void)userdata; (void)doc; (void)text;
+    bench_visited++;
+    return true;
+}
+
+// Parse all messages of the corpus, docs is either NULL or receives the parsed docs.
+static bool bench_parse_all(const bench_corpus_t* corpus, cd_xml_doc_t** docs)
+{
+    for (size_t i = 0; i < corpus->message_count; i++) {
+        cd_xml_doc_t* doc = NULL;
+        if (cd_xml_init_and_parse(&doc, corpus->data + corpus->offsets[i], bench_message_size(corpus, i), CD_XML_FLAGS_NONE) != CD_XML_STATUS_SUCCESS) {
+            fprintf(stderr, "Failed to parse message %zu\n", i);
+            return false;
+        }
+        if (docs) docs[i] = doc;
+        else cd_xml_free(&doc);
+    }
+    return true;
+}
+
+static bool bench_run_op(bench_op_t op, const bench_corpus_t* corpus, cd_xml_doc_t** docs)
+{
+    switch (op) {
+    case BENCH_PARSE:
+        return bench_parse_all(corpus, NULL);
+    case BENCH_WRITE:
+        for (size_t i = 0; i < corpus->message_count; i++) {
+            bench_sink_t sink = { 0 };
+            if (!cd_xml_write(docs[i], bench_sink_output, &sink, false)) return false;
+        }
+        return true;
+    case BENCH_VISIT:
+        for (size_t i = 0; i < corpus->message_count; i++) {
+            if (!cd_xml_apply_visitor(docs[i], NULL, bench_visit_elem, bench_visit_elem, bench_visit_attribute, bench_visit_text)) return false;
+        }
+        return true;
+    case BENCH_VALIDATE:
+        for (size_t i = 0; i < corpus->message_count; i++) {
+            if (cd_xml_validate(corpus->data + corpus->offsets[i], bench_message_size(corpus, i), CD_XML_FLAGS_NONE, NULL) != CD_XML_STATUS_SUCCESS) return false;
+        }
+        return true;
+    case BENCH_HASH:
+        for (size_t i = 0; i < corpus->message_count; i++) {
+            cd_xml_hash_t* hashes = malloc(sizeof(cd_xml_hash_t) * cd_xml_doc_node_count(docs[i]));
+            bool ok = hashes != NULL && cd_xml_hash_subtrees(docs[i], hashes);
+            free(hashes);
+            if (!ok) return false;
+        }
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool bench_measure(bench_op_t op, const bench_corpus_t* corpus, cd_xml_doc_t** docs, double min_time, bench_result_t* result)
+{
+    result->best_seconds = 0.0;
+    result->runs = 0;
+    double total = 0.0;
+    do {
+        bench_alloc_counts_t before = bench_allocs;
+        double start = bench_seconds();
+        if (!bench_run_op(op, corpus, docs)) return false;
+        double elapsed = bench_seconds() - start;
+        if (result->runs == 0 || elapsed < result->best_seconds) result->best_seconds = elapsed;
+        if (result->runs == 0) {
+            result->allocs.mallocs = bench_allocs.mallocs - before.mallocs;
+            result->allocs.reallocs = bench_allocs.reallocs - before.reallocs;
+            result->allocs.frees = bench_allocs.frees - before.frees;
+        }
+        result->runs++;
+        total += elapsed;
+    } while (total < min_time);
+    return true;
+}
+
+
+// --- Driver ------------------------------------------------------------------
+
+static void bench_usage(const char* argv0)
+{
+    fprintf(stderr, "Usage: %s [--size MB] [--min-time SECONDS] [--corpus NAME] [--json] [--dump NAME]\n", argv0);
+    fprintf(stderr, "Corpora:");
+    for (size_t i = 0; i < BENCH_GENERATOR_COUNT; i++) fprintf(stderr, " %s", bench_generators[i].name);
+    fprintf(stderr, "\n");
+}
+
+static const bench_generator_t* bench_find_generator(const char* name)
+{
+    for (size_t i = 0; i < BENCH_GENERATOR_COUNT; i++) {
+        if (strcmp(bench_generators[i].name, name) == 0) return &bench_generators[i];
+    }
+    fprintf(stderr, "Unknown corpus '%s'\n", name);
+    return NULL;
+}
+
+int main(int argc, char** argv)
+{
+    double size_mb = 16.0;
+    double min_time = 1.0;
+    const char* only = NULL;
+    const char* dump = NULL;
+    bool json = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) size_mb = atof(argv[++i]);
+        else if (strcmp(argv[i], "--min-time") == 0 && i + 1 < argc) min_time = atof(argv[++i]);
+        else if (strcmp(argv[i], "--corpus") == 0 && i + 1 < argc) only = argv[++i];
+        else if (strcmp(argv[i], "--dump") == 0 && i + 1 < argc) dump = argv[++i];
+        else if (strcmp(argv[i], "--json") == 0) json = true;
+        else { bench_usage(argv[0]); return EXIT_FAILURE; }
+    }
+    size_t target = (size_t)(size_mb * 1024.0 * 1024.0);
+
+    if (dump) {
+        const bench_generator_t* generator = bench_find_generator(dump);
+        if (generator == NULL) return EXIT_FAILURE;
+        bench_corpus_t corpus = { 0 };
+        generator->generate(&corpus, target);
+        fwrite(corpus.data, 1, corpus.size, stdout);
+        free(corpus.data);
+        free(corpus.offsets);
+        return EXIT_SUCCESS;
+    }
+    if (only && bench_find_generator(only) == NULL) return EXIT_FAILURE;
+
+    if (json) printf("{\n  \"version\": \"0.1a\",\n  \"results\": [");
+    else printf("%-12s %-8s %10s %12s %10s %10s %10s\n", "corpus", "op", "MB/s", "nodes/s", "mallocs", "reallocs", "frees");
+
+    bool first = true;
+    bool ok = true;
+    for (size_t g = 0; g < BENCH_GENERATOR_COUNT && ok; g++) {
+        if (only && strcmp(only, bench_generators[g].name) != 0) continue;
+
+        bench_corpus_t corpus = { 0 };
+        bench_generators[g].generate(&corpus, target);
+
+        cd_xml_doc_t** docs = (cd_xml_doc_t**)calloc(corpus.message_count, sizeof(cd_xml_doc_t*));
+        if (docs == NULL || !bench_parse_all(&corpus, docs)) { ok = false; break; }
+        size_t nodes = 0;
+        for (size_t i = 0; i < corpus.message_count; i++) {
+            nodes += cd_xml_doc_node_count(docs[i]) + cd_xml_doc_attribute_count(docs[i]);
+        }
+
+        for (int op = 0; op < BENCH_OP_COUNT; op++) {
+            bench_result_t result;
+            if (!bench_measure((bench_op_t)op, &corpus, docs, min_time, &result)) { ok = false; break; }
+            double mbs = (double)corpus.size / (1024.0 * 1024.0) / result.best_seconds;
+            double nps = (double)nodes / result.best_seconds;
+            if (json) {
+                printf("%s\n    { \"corpus\": \"%s\", \"op\": \"%s\", \"bytes\": %zu, \"messages\": %zu, \"nodes\": %zu, "
+                       "\"runs\": %zu, \"seconds\": %.9f, \"mb_per_s\": %.3f, \"nodes_per_s\": %.1f, "
+                       "\"mallocs\": %zu, \"reallocs\": %zu, \"frees\": %zu }",
+                       first ? "" : ",", bench_generators[g].name, bench_op_names[op], corpus.size, corpus.message_count, nodes,
+                       result.runs, result.best_seconds, mbs, nps,
+                       result.allocs.mallocs, result.allocs.reallocs, result.allocs.frees);
+            }
+            else {
+                printf("%-12s %-8s %10.1f %12.0f %10zu %10zu %10zu\n",
+                       bench_generators[g].name, bench_op_names[op], mbs, nps,
+                       result.allocs.mallocs, result.allocs.reallocs, result.allocs.frees);
+            }
+            first = false;
+        }
+
+        for (size_t i = 0; i < corpus.message_count; i++) cd_xml_free(&docs[i]);
+        free(docs);
+        free(corpus.data);
+        free(corpus.offsets);
+    }
+
+    if (json) printf("\n  ],\n  \"peak_rss\": %zu\n}\n", bench_peak_rss());
+    else printf("peak RSS: %.1f MB\n", (double)bench_peak_rss() / (1024.0 * 1024.0));
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
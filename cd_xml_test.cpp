@@ -1,8 +1,18 @@
 #include "cd_xml.h"
+#include "cd_xml.hpp"
 
 #include <cstdio>
 #include <cassert>
 #include <cstring>
+#include <string>
+#include <cstdlib>
+#include <clocale>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
 
 namespace {
 
@@ -12,6 +22,130 @@ namespace {
         return true;
     }
 
+    bool string_output_func(void* userdata, const char* ptr, size_t bytes)
+    {
+        static_cast<std::string*>(userdata)->append(ptr, bytes);
+        return true;
+    }
+
+    struct chunked_input_t {
+        std::string data;
+        size_t pos = 0;
+        size_t chunk = 1;
+    };
+
+    ptrdiff_t chunked_input_func(void* userdata, char* ptr, size_t bytes)
+    {
+        auto* input = static_cast<chunked_input_t*>(userdata);
+        size_t n = std::min(std::min(bytes, input->chunk), input->data.size() - input->pos);
+        memcpy(ptr, input->data.data() + input->pos, n);
+        input->pos += n;
+        return (ptrdiff_t)n;
+    }
+
+    std::string base64_encode(const std::vector<unsigned char>& data, size_t line_length)
+    {
+        const char* digits = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        std::string rv;
+        for (size_t i = 0; i < data.size(); i += 3) {
+            uint32_t bits = data[i] << 16;
+            if (i + 1 < data.size()) bits |= data[i + 1] << 8;
+            if (i + 2 < data.size()) bits |= data[i + 2];
+            rv += digits[(bits >> 18) & 63];
+            rv += digits[(bits >> 12) & 63];
+            rv += i + 1 < data.size() ? digits[(bits >> 6) & 63] : '=';
+            rv += i + 2 < data.size() ? digits[bits & 63] : '=';
+            if (line_length && (rv.size() % (line_length + 1)) == line_length) rv += "\n  ";
+        }
+        return rv;
+    }
+
+    struct static_visit_state_t {
+        size_t elements = 0;
+        size_t attributes = 0;
+        size_t texts = 0;
+        size_t exits = 0;
+    };
+
+    cd_xml_visit_result_t static_elem_enter(void* userdata, cd_xml_doc_t* doc, cd_xml_node_ix_t elem)
+    {
+        auto* state = static_cast<static_visit_state_t*>(userdata);
+        state->elements++;
+        cd_xml_stringview_t* name = &cd_xml_doc_node(doc, elem)->data.element.name;
+        if (name->end - name->begin == 4 && strncmp(name->begin, "skip", 4) == 0) return CD_XML_VISIT_SKIP_SUBTREE;
+        if (name->end - name->begin == 4 && strncmp(name->begin, "stop", 4) == 0) return CD_XML_VISIT_STOP;
+        return CD_XML_VISIT_CONTINUE;
+    }
+
+    bool static_elem_exit(void* userdata, cd_xml_doc_t* doc, cd_xml_node_ix_t elem)
+    {
+        static_cast<static_visit_state_t*>(userdata)->exits++;
+        return true;
+    }
+
+    bool static_attribute(void* userdata, cd_xml_doc_t* doc, cd_xml_att_ix_t attribute)
+    {
+        static_cast<static_visit_state_t*>(userdata)->attributes++;
+        return true;
+    }
+
+    bool static_text(void* userdata, cd_xml_doc_t* doc, cd_xml_node_ix_t text)
+    {
+        static_cast<static_visit_state_t*>(userdata)->texts++;
+        return true;
+    }
+
+    CD_XML_DEFINE_VISITOR(static_visit, static_elem_enter, static_elem_exit, static_attribute, static_text)
+
+    struct counting_visitor : cd_xml::visitor {
+        static_visit_state_t state;
+        cd_xml_visit_result_t enter(cd_xml::node elem)
+        {
+            state.elements++;
+            if (elem.name() == "skip") return CD_XML_VISIT_SKIP_SUBTREE;
+            if (elem.name() == "stop") return CD_XML_VISIT_STOP;
+            return CD_XML_VISIT_CONTINUE;
+        }
+        bool attribute(cd_xml::attribute) { state.attributes++; return true; }
+        bool text(cd_xml::node) { state.texts++; return true; }
+    };
+
+    struct counting_allocator_t {
+        size_t live_bytes = 0;
+        size_t calls = 0;
+        size_t fail_after = SIZE_MAX;   // Number of allocations to succeed before failing.
+    };
+
+    void* counting_alloc(void* context, size_t size)
+    {
+        auto* a = static_cast<counting_allocator_t*>(context);
+        if (a->fail_after == 0) return nullptr;
+        a->fail_after--;
+        a->live_bytes += size;
+        a->calls++;
+        return malloc(size);
+    }
+
+    void* counting_realloc(void* context, void* ptr, size_t old_size, size_t new_size)
+    {
+        auto* a = static_cast<counting_allocator_t*>(context);
+        assert(ptr != nullptr || old_size == 0);
+        if (a->fail_after == 0) return nullptr;
+        a->fail_after--;
+        a->live_bytes += new_size - old_size;
+        a->calls++;
+        return realloc(ptr, new_size);
+    }
+
+    void counting_free(void* context, void* ptr, size_t size)
+    {
+        auto* a = static_cast<counting_allocator_t*>(context);
+        assert(size <= a->live_bytes);
+        a->live_bytes -= size;
+        a->calls++;
+        free(ptr);
+    }
+
     bool visit_elem_enter(void* userdata, cd_xml_doc_t* doc, cd_xml_ns_ix_t namespace_ix, cd_xml_stringview_t* name)
     {
         fprintf(stderr, "** <%.*s>\n", (int)(name->end - name->begin), name->begin);
@@ -37,6 +171,113 @@ namespace {
         return true;
     }
 
+    cd_xml_hash_t root_hash(cd_xml_doc_t* doc)
+    {
+        std::vector<cd_xml_hash_t> hashes(cd_xml_doc_node_count(doc));
+        assert(cd_xml_hash_subtrees(doc, hashes.data()));
+        return hashes[0];
+    }
+
+    // Diff a against b, and patch a with the script both as is and after a round trip through XML. Returns
+    // the number of nodes in the script.
+    size_t check_diff(const std::string& a_xml, const std::string& b_xml)
+    {
+        cd_xml_doc_t* a = NULL;
+        cd_xml_doc_t* b = NULL;
+        assert(cd_xml_init_and_parse(&a, a_xml.data(), a_xml.size(), CD_XML_FLAGS_NONE) == CD_XML_STATUS_SUCCESS);
+        assert(cd_xml_init_and_parse(&b, b_xml.data(), b_xml.size(), CD_XML_FLAGS_NONE) == CD_XML_STATUS_SUCCESS);
+        cd_xml_hash_t expected = root_hash(b);
+
+        cd_xml_doc_t* script = cd_xml_diff(a, b);
+        assert(script);
+        std::string script_xml;
+        assert(cd_xml_write(script, string_output_func, &script_xml, false));
+        cd_xml_doc_t* shipped = NULL;
+        assert(cd_xml_init_and_parse(&shipped, script_xml.data(), script_xml.size(), CD_XML_FLAGS_NONE) == CD_XML_STATUS_SUCCESS);
+        cd_xml_doc_t* target = NULL;
+        assert(cd_xml_init_and_parse(&target, a_xml.data(), a_xml.size(), CD_XML_FLAGS_NONE) == CD_XML_STATUS_SUCCESS);
+        assert(cd_xml_patch(target, shipped));
+        cd_xml_hash_t patched = root_hash(target);
+        assert(patched.lo == expected.lo && patched.hi == expected.hi);
+
+        assert(cd_xml_patch(a, script));
+        patched = root_hash(a);
+        assert(patched.lo == expected.lo && patched.hi == expected.hi);
+
+        size_t size = cd_xml_doc_node_count(script);
+        cd_xml_free(&target);
+        cd_xml_free(&shipped);
+        cd_xml_free(&script);
+        cd_xml_free(&b);
+        cd_xml_free(&a);
+        return size;
+    }
+
+    // Element, or text if name is empty, of random docs for diff tests.
+    struct tree_t {
+        std::string name;
+        std::string text;
+        std::vector<std::pair<std::string, std::string>> attributes;
+        std::vector<tree_t> children;
+    };
+
+    uint32_t tree_rand(uint32_t& rng, uint32_t n)
+    {
+        rng = rng * 1664525u + 1013904223u;
+        return (rng >> 8) % n;
+    }
+
+    tree_t random_tree(uint32_t& rng, int depth)
+    {
+        static const char* names[] = { "a", "b", "p:c" };
+        static const char* attributes[] = { "id", "k", "p:x" };
+        tree_t tree;
+        tree.name = names[tree_rand(rng, 3)];
+        for (const char* name : attributes) {
+            if (tree_rand(rng, 2)) tree.attributes.emplace_back(name, std::to_string(tree_rand(rng, 3)));
+        }
+        size_t children = depth < 3 ? tree_rand(rng, 5) : 0;
+        for (size_t i = 0; i < children; i++) {
+            if (tree_rand(rng, 3) == 0 && (tree.children.empty() || !tree.children.back().text.empty())) {
+                tree_t text;
+                text.text = "t" + std::to_string(tree_rand(rng, 3));
+                tree.children.push_back(text);
+            }
+            else tree.children.push_back(random_tree(rng, depth + 1));
+        }
+        return tree;
+    }
+
+    void mutate_tree(tree_t& tree, uint32_t& rng)
+    {
+        if (!tree.children.empty() && tree_rand(rng, 2)) {
+            tree_t& child = tree.children[tree_rand(rng, (uint32_t)tree.children.size())];
+            if (!child.name.empty()) return mutate_tree(child, rng);
+        }
+        size_t pos = tree_rand(rng, (uint32_t)tree.children.size() + 1);
+        switch (tree_rand(rng, 5)) {
+        case 0: if (pos < tree.children.size()) tree.children.erase(tree.children.begin() + pos); break;
+        case 1: tree.children.insert(tree.children.begin() + pos, random_tree(rng, 2)); break;
+        case 2: if (!tree.attributes.empty()) tree.attributes.erase(tree.attributes.begin()); break;
+        case 3:
+            if (!tree.attributes.empty() && tree.attributes.back().first == "v") tree.attributes.back().second += "1";
+            else tree.attributes.emplace_back("v", std::to_string(tree_rand(rng, 3)));
+            break;
+        default: if (pos < tree.children.size() && tree.children[pos].name.empty()) tree.children[pos].text += "u"; break;
+        }
+    }
+
+    std::string tree_xml(const tree_t& tree, bool root)
+    {
+        if (tree.name.empty()) return tree.text;
+        std::string xml = "<" + tree.name + (root ? " xmlns:p=\"urn:p\"" : "");
+        for (auto& attribute : tree.attributes) xml += " " + attribute.first + "=\"" + attribute.second + "\"";
+        if (tree.children.empty()) return xml + "/>";
+        xml += ">";
+        for (auto& child : tree.children) xml += tree_xml(child, false);
+        return xml + "</" + tree.name + ">";
+    }
+
 
 }
 
@@ -63,6 +304,122 @@ int main(int argc, const char * argv[]) {
         cd_xml_free(&doc);
     }
 
+    {   // Streaming writer matches cd_xml_write
+
+        cd_xml_doc_t* doc = cd_xml_init();
+        assert(doc);
+
+        auto uri_str = cd_xml_strv("http://a.com");
+        auto a_str = cd_xml_strv("a");
+        auto foo_str = cd_xml_strv("foo");
+        auto bar_str = cd_xml_strv("bar");
+        auto baz_str = cd_xml_strv("baz");
+        auto quux_str = cd_xml_strv("qu<u>x");
+
+        auto ns = cd_xml_add_namespace(doc, &a_str, &uri_str, CD_XML_FLAGS_NONE);
+        auto foo = cd_xml_add_element(doc, cd_xml_no_ix, &foo_str, cd_xml_no_ix, CD_XML_FLAGS_NONE);
+        auto bar = cd_xml_add_element(doc, ns, &bar_str, foo, CD_XML_FLAGS_NONE);
+        cd_xml_add_attribute(doc, ns, &baz_str, &quux_str, bar, CD_XML_FLAGS_NONE);
+        cd_xml_add_text(doc, &quux_str, bar, CD_XML_FLAGS_NONE);
+        cd_xml_add_element(doc, cd_xml_no_ix, &baz_str, foo, CD_XML_FLAGS_NONE);
+        cd_xml_add_text(doc, &quux_str, foo, CD_XML_FLAGS_NONE);
+
+        for (bool pretty : { true, false }) {
+            std::string expected;
+            cd_xml_write(doc, string_output_func, &expected, pretty);
+
+            std::string streamed;
+            cd_xml_writer_t writer;
+            cd_xml_writer_init(&writer, string_output_func, &streamed, pretty);
+            auto wns = cd_xml_writer_add_namespace(&writer, &a_str, &uri_str);
+            cd_xml_writer_begin_element(&writer, cd_xml_no_ix, &foo_str);
+            cd_xml_writer_begin_element(&writer, wns, &bar_str);
+            cd_xml_writer_attribute(&writer, wns, &baz_str, &quux_str);
+            cd_xml_writer_text(&writer, &quux_str);
+            cd_xml_writer_end_element(&writer);
+            cd_xml_writer_begin_element(&writer, cd_xml_no_ix, &baz_str);
+            cd_xml_writer_end_element(&writer);
+            cd_xml_writer_text(&writer, &quux_str);
+            bool ok = cd_xml_writer_finish(&writer);
+            assert(ok);
+            assert(streamed == expected);
+        }
+        cd_xml_free(&doc);
+    }
+
+    {   // Parallel writer matches cd_xml_write
+
+        cd_xml_doc_t* doc = cd_xml_init();
+        assert(doc);
+
+        auto uri_str = cd_xml_strv("http://a.com");
+        auto a_str = cd_xml_strv("a");
+        auto foo_str = cd_xml_strv("foo");
+        auto bar_str = cd_xml_strv("bar");
+        auto baz_str = cd_xml_strv("baz");
+        auto quux_str = cd_xml_strv("qu&ux");
+
+        auto ns = cd_xml_add_namespace(doc, &a_str, &uri_str, CD_XML_FLAGS_NONE);
+        auto root = cd_xml_add_element(doc, ns, &foo_str, cd_xml_no_ix, CD_XML_FLAGS_NONE);
+        cd_xml_add_attribute(doc, cd_xml_no_ix, &baz_str, &quux_str, root, CD_XML_FLAGS_NONE);
+        auto deep = root;
+        for (int i = 0; i < 200; i++) {     // Skewed: one deep and wide subtree
+            deep = cd_xml_add_element(doc, cd_xml_no_ix, &bar_str, deep, CD_XML_FLAGS_NONE);
+            for (int j = 0; j < 5; j++) {
+                auto leaf = cd_xml_add_element(doc, ns, &baz_str, deep, CD_XML_FLAGS_NONE);
+                cd_xml_add_attribute(doc, ns, &baz_str, &quux_str, leaf, CD_XML_FLAGS_NONE);
+                cd_xml_add_text(doc, &quux_str, deep, CD_XML_FLAGS_NONE);
+            }
+        }
+        for (int i = 0; i < 50; i++) {
+            auto leaf = cd_xml_add_element(doc, cd_xml_no_ix, &baz_str, root, CD_XML_FLAGS_NONE);
+            cd_xml_add_text(doc, &quux_str, leaf, CD_XML_FLAGS_NONE);
+        }
+
+        for (bool pretty : { true, false }) {
+            std::string expected;
+            cd_xml_write(doc, string_output_func, &expected, pretty);
+            for (unsigned threads = 0; threads < 9; threads++) {
+                std::string parallel;
+                bool ok = cd_xml_write_parallel(doc, string_output_func, &parallel, pretty, threads);
+                assert(ok);
+                assert(parallel == expected);
+            }
+        }
+        cd_xml_free(&doc);
+    }
+
+#ifndef _WIN32
+    {   // File-descriptor sink matches cd_xml_write
+        const char* xml =
+            "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
+            "<foo moo=' doo &amp; dah '><gah quux='waldo&lt;&#x5d0;'>ᚠᚢᚦ&amp;ᚨᚱᚲ<meep/>æøå</gah><meh>meh</meh></foo>";
+        cd_xml_doc_t* doc = NULL;
+        auto rv = cd_xml_init_and_parse(&doc, xml, std::strlen(xml), flags);
+        assert(rv == CD_XML_STATUS_SUCCESS);
+
+        for (bool pretty : { true, false }) {
+            std::string expected;
+            cd_xml_write(doc, string_output_func, &expected, pretty);
+
+            int fds[2];
+            int prv = pipe(fds);
+            assert(prv == 0);
+            bool ok = cd_xml_write_fd(doc, fds[1], pretty);
+            assert(ok);
+            close(fds[1]);
+
+            std::string written;
+            char buf[256];
+            ssize_t n;
+            while ((n = read(fds[0], buf, sizeof(buf))) > 0) written.append(buf, n);
+            close(fds[0]);
+            assert(written == expected);
+        }
+        cd_xml_free(&doc);
+    }
+#endif
+
     {   // Namespaces
         const char* xml =
             "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
@@ -110,5 +467,1033 @@ int main(int argc, const char * argv[]) {
         cd_xml_free(&doc);
     }
 
+    {   // Binary snapshot round-trip
+        const char* xml =
+            "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+            "<foo xmlns='http://a.com' moo='&lt;doo&gt;'>\n"
+            "  <b:bar xmlns:b='http://b.com'>\n"
+            "    <baz b:bah='x'>text &amp; more</baz>\n"
+            "  </b:bar>\n"
+            "</foo>\n";
+        cd_xml_doc_t* doc = NULL;
+        cd_xml_parse_status_t rv = cd_xml_init_and_parse(&doc, xml, strlen(xml), flags);
+        assert(rv == CD_XML_STATUS_SUCCESS);
+
+        std::string snapshot;
+        bool ok = cd_xml_save_binary(doc, string_output_func, &snapshot);
+        assert(ok);
+
+        std::string expected;
+        cd_xml_write(doc, string_output_func, &expected, true);
+        cd_xml_free(&doc);
+
+        for (auto load_flags : { CD_XML_FLAGS_NONE, CD_XML_FLAGS_COPY_STRINGS }) {
+            cd_xml_doc_t* loaded = NULL;
+            rv = cd_xml_load_binary(&loaded, snapshot.data(), snapshot.size(), load_flags);
+            assert(rv == CD_XML_STATUS_SUCCESS);
+            std::string written;
+            cd_xml_write(loaded, string_output_func, &written, true);
+            assert(written == expected);
+            cd_xml_free(&loaded);
+        }
+
+        std::string corrupt = snapshot;
+        corrupt[corrupt.size() - 1] ^= 1;
+        cd_xml_doc_t* loaded = NULL;
+        rv = cd_xml_load_binary(&loaded, corrupt.data(), corrupt.size(), CD_XML_FLAGS_NONE);
+        assert(rv == CD_XML_STATUS_CHECKSUM_MISMATCH);
+        assert(loaded == NULL);
+        rv = cd_xml_load_binary(&loaded, snapshot.data(), snapshot.size() - 1, CD_XML_FLAGS_NONE);
+        assert(rv == CD_XML_STATUS_MALFORMED_BINARY);
+
+        std::string other_version = snapshot;
+        uint32_t version;
+        memcpy(&version, &other_version[8], sizeof(version));
+        version++;
+        memcpy(&other_version[8], &version, sizeof(version));
+        rv = cd_xml_load_binary(&loaded, other_version.data(), other_version.size(), CD_XML_FLAGS_NONE);
+        assert(rv == CD_XML_STATUS_UNSUPPORTED_VERSION && loaded == NULL);
+
+        // Links that are in range but do not form trees and lists, skipping the checksum as a forger would.
+        const char* small = "<a x='1' y='2'><b/><c/></a>";   // Nodes a=0, b=1, c=2 and attributes x=0, y=1.
+        rv = cd_xml_init_and_parse(&doc, small, strlen(small), CD_XML_FLAGS_NONE);
+        assert(rv == CD_XML_STATUS_SUCCESS);
+        std::string links;
+        assert(cd_xml_save_binary(doc, string_output_func, &links));
+        cd_xml_free(&doc);
+        uint64_t namespace_count;
+        memcpy(&namespace_count, &links[16], sizeof(namespace_count));
+        const size_t ix = sizeof(cd_xml_ix_t);
+        const size_t node_size = 16 + 6 * ix + 8;
+        const size_t nodes_offset = 56 + 32 * namespace_count;
+        const size_t attributes_offset = nodes_offset + 3 * node_size;
+        enum { first_child = 1, last_child = 2, first_attribute = 3, last_attribute = 4, next_sibling = 5 };
+        auto set_link = [&](std::string& snap, size_t offset, cd_xml_ix_t value) { memcpy(&snap[offset], &value, ix); };
+        auto node_link = [&](cd_xml_ix_t node, int field) { return nodes_offset + node * node_size + 16 + field * ix; };
+        auto next_attribute = [&](cd_xml_ix_t att) { return attributes_offset + att * (32 + 2 * ix) + 32 + ix; };
+        rv = cd_xml_load_binary(&loaded, links.data(), links.size(), CD_XML_FLAGS_NO_CHECKSUM);
+        assert(rv == CD_XML_STATUS_SUCCESS);
+        cd_xml_free(&loaded);
+        for (int c = 0; c < 6; c++) {
+            std::string cyclic = links;
+            switch (c) {
+            case 0: set_link(cyclic, node_link(2, next_sibling), 1); break;     // b is both first child and after c.
+            case 1: set_link(cyclic, node_link(2, next_sibling), 2); break;     // c follows itself.
+            case 2:                                                             // b and c only follow each other.
+                set_link(cyclic, node_link(0, first_child), cd_xml_no_ix);
+                set_link(cyclic, node_link(0, last_child), cd_xml_no_ix);
+                set_link(cyclic, node_link(2, next_sibling), 1);
+                break;
+            case 3: set_link(cyclic, next_attribute(1), 0); break;              // x is both first and after y.
+            case 4:                                                             // x and y only follow each other.
+                set_link(cyclic, node_link(0, first_attribute), cd_xml_no_ix);
+                set_link(cyclic, node_link(0, last_attribute), cd_xml_no_ix);
+                set_link(cyclic, next_attribute(1), 0);
+                break;
+            case 5: set_link(cyclic, node_link(0, last_child), 1); break;       // Appending to a would link b to c.
+            }
+            rv = cd_xml_load_binary(&loaded, cyclic.data(), cyclic.size(), CD_XML_FLAGS_NO_CHECKSUM);
+            assert(rv == CD_XML_STATUS_MALFORMED_BINARY && loaded == NULL);
+        }
+    }
+
+    {   // Selective parsing
+        const char* xml =
+            "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+            "<catalog xmlns:x='http://x.com' id='1'>\n"
+            "  dropped\n"
+            "  <book id='a'><title>A &amp; B</title><price>10</price></book>\n"
+            "  <x:book id='b'><title x:lang='en'>C</title><!-- <title> --><price>20</price></x:book>\n"
+            "  <magazine note='&quot;>&quot;' other=\"'/>'\"><title>M</title><?pi <title>?><deep><![CDATA[</magazine>]]></deep></magazine>\n"
+            "  <magazine/>\n"
+            "</catalog>\n";
+
+        const char* paths[] = { "catalog/book/title" };
+        cd_xml_parse_options_t options = {};
+        options.keep_paths = paths;
+        options.keep_path_count = 1;
+
+        cd_xml_doc_t* doc = NULL;
+        auto rv = cd_xml_init_and_parse_ex(&doc, xml, strlen(xml), flags, &options);
+        assert(rv == CD_XML_STATUS_SUCCESS);
+
+        std::string written;
+        cd_xml_write(doc, string_output_func, &written, false);
+        assert(written ==
+               "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
+               "<catalog xmlns:x=\"http://x.com\" id=\"1\">"
+               "<book id=\"a\"><title>A &amp; B</title></book>"
+               "<x:book id=\"b\"><title x:lang=\"en\">C</title></x:book>"
+               "</catalog>\n");
+        cd_xml_free(&doc);
+
+        const char* wildcard[] = { "/*/book/price" };
+        options.keep_paths = wildcard;
+        rv = cd_xml_init_and_parse_ex(&doc, xml, strlen(xml), flags, &options);
+        assert(rv == CD_XML_STATUS_SUCCESS);
+        written.clear();
+        cd_xml_write(doc, string_output_func, &written, false);
+        assert(written.find("<title") == std::string::npos);
+        assert(written.find("<price>20</price>") != std::string::npos);
+        assert(written.find("<magazine") == std::string::npos);
+        cd_xml_free(&doc);
+    }
+
+    {   // Numeric arrays
+        const char* xml =
+            "<mesh><floats count='7'>\n"
+            "  1.5 -2 3e2\t 0.1\n  1e-30                      123456789.123456789e-5\n"
+            "  0.30000000000000004</floats>"
+            "<ints>1 -2 2147483647 -2147483648</ints><bad>1 2 x</bad></mesh>";
+        cd_xml_doc_t* doc = NULL;
+        auto rv = cd_xml_init_and_parse(&doc, xml, strlen(xml), flags);
+        assert(rv == CD_XML_STATUS_SUCCESS);
+
+        const char* tokens[] = { "1.5", "-2", "3e2", "0.1", "1e-30", "123456789.123456789e-5", "0.30000000000000004" };
+        double doubles[7];
+        float floats[7];
+        auto n = cd_xml_parse_doubles(doc, 1, doubles, 7);
+        assert(n == 7);
+        n = cd_xml_parse_floats(doc, 1, floats, 7);
+        assert(n == 7);
+        for (int i = 0; i < 7; i++) {
+            assert(doubles[i] == std::strtod(tokens[i], nullptr));
+            assert(floats[i] == std::strtof(tokens[i], nullptr));
+        }
+        n = cd_xml_parse_doubles(doc, 1, doubles, 2);
+        assert(n == 7);
+
+        int ints[4];
+        n = cd_xml_parse_ints(doc, 3, ints, 4);
+        assert(n == 4 && ints[0] == 1 && ints[1] == -2 && ints[2] == 2147483647 && ints[3] == -2147483647 - 1);
+        n = cd_xml_parse_ints(doc, 5, ints, 4);
+        assert(n == (size_t)-1);
+
+        auto count = cd_xml_doc_attribute(doc, cd_xml_doc_node(doc, 1)->data.element.first_attribute)->value;
+        n = cd_xml_parse_ints_strv(&count, ints, 1);
+        assert(n == 1 && ints[0] == 7);
+        cd_xml_free(&doc);
+
+        // Tokens longer than the stack buffer of the slow path, and '.' regardless of locale.
+        std::string long_token = "0." + std::string(200, '0') + "12345678901234567890123456789";
+        cd_xml_stringview_t long_strv = { long_token.data(), long_token.data() + long_token.size() };
+        n = cd_xml_parse_doubles_strv(&long_strv, doubles, 1);
+        assert(n == 1 && doubles[0] == std::strtod(long_token.c_str(), nullptr));
+        n = cd_xml_parse_floats_strv(&long_strv, floats, 1);
+        assert(n == 1 && floats[0] == std::strtof(long_token.c_str(), nullptr));
+        const char* slow = "1.7976931348623157e308 2.5e-320";
+        cd_xml_stringview_t slow_strv = cd_xml_strv(slow);
+        for (const char* name : { "de_DE.UTF-8", "de_DE", "fr_FR.UTF-8", "fr_FR" }) {
+            if (setlocale(LC_NUMERIC, name) == nullptr) continue;
+            n = cd_xml_parse_doubles_strv(&slow_strv, doubles, 2);
+            assert(n == 2 && doubles[0] == 1.7976931348623157e308 && doubles[1] == 2.5e-320);
+            const char* comma = "2,5e-320";
+            cd_xml_stringview_t comma_strv = cd_xml_strv(comma);
+            assert(cd_xml_parse_doubles_strv(&comma_strv, doubles, 1) == (size_t)-1);
+            setlocale(LC_NUMERIC, "C");
+            break;
+        }
+        n = cd_xml_parse_doubles_strv(&slow_strv, doubles, 2);
+        assert(n == 2 && doubles[0] == 1.7976931348623157e308 && doubles[1] == 2.5e-320);
+
+        // Forms that strtod accepts, but that are not decimal numbers.
+        for (const char* other : { "inf", "-infinity", "nan", "0x1p3", "1e", "1e+", ".", "-.e1", "1.5.2", "1e5e5" }) {
+            cd_xml_stringview_t other_strv = cd_xml_strv(other);
+            assert(cd_xml_parse_doubles_strv(&other_strv, doubles, 1) == (size_t)-1);
+            assert(cd_xml_parse_floats_strv(&other_strv, floats, 1) == (size_t)-1);
+        }
+        for (const char* edge : { "1.", ".5", "-0.0", "+1e+0", "12345678901234567890.5e-3", "0.000001e-400", "1e1000000000000000000000" }) {
+            cd_xml_stringview_t edge_strv = cd_xml_strv(edge);
+            n = cd_xml_parse_doubles_strv(&edge_strv, doubles, 1);
+            assert(n == 1 && doubles[0] == std::strtod(edge, nullptr));
+            n = cd_xml_parse_floats_strv(&edge_strv, floats, 1);
+            assert(n == 1 && floats[0] == std::strtof(edge, nullptr));
+        }
+    }
+
+    {   // Base64
+        for (size_t size : { 0, 1, 2, 3, 47, 48, 100, 1000, 4099 }) {
+            std::vector<unsigned char> data(size);
+            for (size_t i = 0; i < size; i++) data[i] = (unsigned char)(i * 7919 + size);
+            for (size_t line_length : { 0, 76 }) {
+                std::string xml = "<image>\n  " + base64_encode(data, line_length) + "\n</image>";
+                cd_xml_doc_t* doc = NULL;
+                auto rv = cd_xml_init_and_parse(&doc, xml.data(), xml.size(), CD_XML_FLAGS_TAG_BASE64);
+                assert(rv == CD_XML_STATUS_SUCCESS);
+
+                std::vector<unsigned char> decoded(cd_xml_text_base64_size(doc, 0));
+                auto n = cd_xml_text_base64_decode(doc, 0, decoded.data());
+                assert(n == size);
+                decoded.resize(n);
+                assert(decoded == data);
+                if (size >= 1000) {
+                    assert(cd_xml_doc_node(doc, 1)->data.text.flags == CD_XML_TEXT_BASE64);
+                }
+                cd_xml_free(&doc);
+            }
+        }
+        const char* xml = "<image>QUJD=RA==</image>";
+        cd_xml_doc_t* doc = NULL;
+        auto rv = cd_xml_init_and_parse(&doc, xml, strlen(xml), flags);
+        assert(rv == CD_XML_STATUS_SUCCESS);
+        unsigned char decoded[16];
+        assert(cd_xml_text_base64_decode(doc, 0, decoded) == (size_t)-1);
+        cd_xml_free(&doc);
+    }
+
+    {   // C++ wrapper
+        const char* xml = "<a:catalog xmlns:a=\"urn:a\" id=\"1\"><book lang=\"en\" year=\"2001\">Title</book>tail<book/></a:catalog>";
+        cd_xml::document doc;
+        auto rv = doc.parse(xml);
+        assert(rv == CD_XML_STATUS_SUCCESS);
+
+        cd_xml::node root = doc.root();
+        assert(root && root.is_element() && root.name() == "catalog");
+        assert(root.ns() && root.ns().prefix() == "a" && root.ns().uri() == "urn:a");
+        assert(root.find_attribute("id").value() == "1");
+        assert(!root.find_attribute("missing"));
+
+        size_t elements = 0, texts = 0;
+        for (cd_xml::node child : root.children()) {
+            if (child.is_element()) {
+                assert(child.name() == "book");
+                elements++;
+            }
+            else {
+                assert(child.text() == "tail");
+                texts++;
+            }
+        }
+        assert(elements == 2 && texts == 1);
+
+        cd_xml::node book = root.child("book");
+        std::string atts;
+        for (cd_xml::attribute att : book.attributes()) {
+            atts += std::string(att.name()) + "=" + std::string(att.value()) + ";";
+        }
+        assert(atts == "lang=en;year=2001;");
+        assert(book.first_child().text() == "Title");
+        assert(book.next().is_text());
+        assert(book.next().next().attributes().empty());
+        assert(!root.child("missing"));
+
+        cd_xml::document moved(std::move(doc));
+        assert(!doc && moved.root().name() == "catalog");
+        cd_xml_doc_t* raw = moved.release();
+        assert(!moved);
+        cd_xml_free(&raw);
+    }
+
+    {   // Statically dispatched visitors
+        const char* xml = "<a x=\"1\"><b y=\"2\">t<c/></b><skip z=\"3\"><d>u</d></skip>v<e/></a>";
+        cd_xml_doc_t* doc = NULL;
+        auto rv = cd_xml_init_and_parse(&doc, xml, strlen(xml), flags);
+        assert(rv == CD_XML_STATUS_SUCCESS);
+
+        static_visit_state_t state;
+        assert(static_visit(doc, &state));
+        assert(state.elements == 5 && state.exits == 4 && state.attributes == 2 && state.texts == 2);
+
+        counting_visitor v;
+        assert(cd_xml::visit(cd_xml::node(doc, 0), v));
+        assert(v.state.elements == 5 && v.state.attributes == 2 && v.state.texts == 2);
+        cd_xml_free(&doc);
+
+        xml = "<a><b/><stop><c/></stop><d/></a>";
+        rv = cd_xml_init_and_parse(&doc, xml, strlen(xml), flags);
+        assert(rv == CD_XML_STATUS_SUCCESS);
+        state = static_visit_state_t();
+        assert(!static_visit(doc, &state));
+        assert(state.elements == 3 && state.exits == 1);
+        counting_visitor w;
+        assert(!cd_xml::visit(cd_xml::node(doc, 0), w));
+        assert(w.state.elements == 3);
+        cd_xml_free(&doc);
+    }
+
+#ifdef CD_XML_ENABLE_STATS
+    {   // Statistics
+        const char* xml = "<a xmlns:p=\"urn:p\" x=\"1 &amp; 2\"><p:b>t &lt; u</p:b><c/></a>";
+        cd_xml_stats_t stats;
+        memset(&stats, 0, sizeof(stats));
+        assert(cd_xml_stats_bind(&stats) == NULL);
+
+        cd_xml_doc_t* doc = NULL;
+        auto rv = cd_xml_init_and_parse(&doc, xml, strlen(xml), flags);
+        assert(rv == CD_XML_STATUS_SUCCESS);
+        assert(stats.nodes == 4);
+        assert(stats.attributes == 1);
+        assert(stats.namespaces == 1);
+        assert(stats.entity_decodes == 2);
+        assert(stats.tokens != 0);
+        assert(stats.arena_allocs == 2);
+        assert(stats.sb_reallocs != 0);
+
+        std::string out;
+        assert(cd_xml_write(doc, string_output_func, &out, false));
+        assert(stats.output_calls != 0 && stats.output_bytes == out.size());
+        cd_xml_free(&doc);
+
+        assert(cd_xml_stats_bind(NULL) == &stats);
+        uint64_t nodes = stats.nodes;
+        rv = cd_xml_init_and_parse(&doc, xml, strlen(xml), flags);
+        assert(rv == CD_XML_STATUS_SUCCESS);
+        assert(stats.nodes == nodes);
+        cd_xml_free(&doc);
+
+        // Worker threads of batch parse and parallel write count into the bound stats.
+        std::vector<cd_xml_stringview_t> inputs(8, cd_xml_stringview_t{ xml, xml + strlen(xml) });
+        std::vector<cd_xml_doc_t*> docs(inputs.size(), nullptr);
+        memset(&stats, 0, sizeof(stats));
+        cd_xml_stats_bind(&stats);
+        assert(cd_xml_parse_batch(inputs.data(), inputs.size(), flags, docs.data(), NULL, 4));
+        assert(stats.nodes == 4 * inputs.size());
+        assert(stats.entity_decodes == 2 * inputs.size());
+        out.clear();
+        assert(cd_xml_write_parallel(docs[0], string_output_func, &out, false, 4));
+        assert(stats.output_bytes == out.size());
+        assert(cd_xml_stats_bind(NULL) == &stats);
+        for (cd_xml_doc_t*& d : docs) cd_xml_free(&d);
+    }
+#endif
+
+    {   // Memory accounting and shrink-to-fit
+        const char* xml = "<a xmlns:p=\"urn:p\" x=\"1 &amp; 2\"><p:b y=\"z\">t &lt; u</p:b><c>v</c><c/></a>";
+        for (auto parse_flags : { CD_XML_FLAGS_NONE, CD_XML_FLAGS_COPY_STRINGS }) {
+            cd_xml_doc_t* doc = NULL;
+            auto rv = cd_xml_init_and_parse(&doc, xml, strlen(xml), parse_flags);
+            assert(rv == CD_XML_STATUS_SUCCESS);
+
+            std::string before;
+            assert(cd_xml_write(doc, string_output_func, &before, false));
+
+            cd_xml_memory_report_t report;
+            cd_xml_doc_memory(doc, &report);
+            assert(report.nodes.count == 6 && report.nodes.capacity >= 6);
+            assert(report.attributes.count == 2 && report.namespaces.count == 1);
+            assert(report.nodes.bytes_used == 6 * sizeof(cd_xml_node_t));
+            assert(report.bytes_used <= report.bytes_allocated);
+            if (parse_flags == CD_XML_FLAGS_NONE) {
+                assert(report.strings.count == 2);
+            }
+            else {
+                assert(report.strings.count > 2);
+            }
+
+            cd_xml_shrink_to_fit(doc);
+            cd_xml_memory_report_t shrunk;
+            cd_xml_doc_memory(doc, &shrunk);
+#ifdef CD_XML_SEGMENTED
+            assert(shrunk.nodes.capacity == report.nodes.capacity && shrunk.attributes.capacity == report.attributes.capacity);
+#else
+            assert(shrunk.nodes.capacity == 6 && shrunk.attributes.capacity == 2);
+#endif
+            assert(shrunk.namespaces.capacity == 1);
+            assert(shrunk.strings.count == 1);
+            assert(shrunk.strings.bytes_used == report.strings.bytes_used);
+            assert(shrunk.bytes_allocated < report.bytes_allocated);
+
+            std::string after;
+            assert(cd_xml_write(doc, string_output_func, &after, false));
+            assert(before == after);
+
+            cd_xml_stringview_t name = cd_xml_strv("d");
+            cd_xml_add_element(doc, cd_xml_no_ix, &name, 0, CD_XML_FLAGS_COPY_STRINGS);
+            assert(cd_xml_doc_node_count(doc) == 7);
+            cd_xml_free(&doc);
+        }
+    }
+
+    {   // Custom allocator
+        counting_allocator_t counts;
+        cd_xml_allocator_t allocator = { counting_alloc, counting_realloc, counting_free, &counts };
+        cd_xml_parse_options_t options = {};
+        options.allocator = &allocator;
+
+        const char* xml = "<a xmlns:p=\"urn:p\" x=\"1 &amp; 2\"><p:b>t &lt; u</p:b><c/></a>";
+        cd_xml_doc_t* doc = NULL;
+        auto rv = cd_xml_init_and_parse_ex(&doc, xml, strlen(xml), CD_XML_FLAGS_COPY_STRINGS, &options);
+        assert(rv == CD_XML_STATUS_SUCCESS);
+        assert(counts.calls != 0 && counts.live_bytes != 0);
+        cd_xml_shrink_to_fit(doc);
+        cd_xml_free(&doc);
+        assert(counts.live_bytes == 0);
+
+        xml = "<a><b></a>";
+        rv = cd_xml_init_and_parse_ex(&doc, xml, strlen(xml), flags, &options);
+        assert(rv != CD_XML_STATUS_SUCCESS && doc == NULL);
+        assert(counts.live_bytes == 0);
+
+        doc = cd_xml_init_ex(&allocator);
+        cd_xml_stringview_t name = cd_xml_strv("root");
+        cd_xml_add_element(doc, cd_xml_no_ix, &name, cd_xml_no_ix, CD_XML_FLAGS_COPY_STRINGS);
+        cd_xml_free(&doc);
+        assert(counts.live_bytes == 0);
+    }
+
+    {   // Whitespace and comments in text
+        const char* xml =
+            "<a>\n"
+            "  <b>  one  two \t\n</b>\n"
+            "  <c> x <!-- note --> y &amp; <!-- --> z </c>\n"
+            "  \n"
+            "</a>\n";
+        for (auto parse_flags : { CD_XML_FLAGS_NONE, CD_XML_FLAGS_COPY_STRINGS }) {
+            cd_xml_doc_t* doc = NULL;
+            auto rv = cd_xml_init_and_parse(&doc, xml, strlen(xml), parse_flags);
+            assert(rv == CD_XML_STATUS_SUCCESS);
+            assert(cd_xml_doc_node_count(doc) == 5);
+            const cd_xml_stringview_t& one = cd_xml_doc_node(doc, 2)->data.text.content;
+            assert(std::string(one.begin, one.end) == "one  two");
+            const cd_xml_stringview_t& x = cd_xml_doc_node(doc, 4)->data.text.content;
+            assert(std::string(x.begin, x.end) == "x  y &  z");
+            cd_xml_free(&doc);
+        }
+
+        // Processing instructions are kept in text, also when comments are stripped from it.
+        const char* pis[][2] = {
+            { "<a>x <!-- c --> y <?pi?> z</a>", "x  y <?pi?> z" },
+            { "<a>t<!-- c -->t<?xml version=\"1.0\"?></a>", "tt<?xml version=\"1.0\"?>" },
+            { "<a><?pi <?> <!-- c --> &lt;</a>", "<?pi <?>  <" },
+        };
+        for (auto& pi : pis) {
+            cd_xml_doc_t* doc = NULL;
+            auto rv = cd_xml_init_and_parse(&doc, pi[0], strlen(pi[0]), CD_XML_FLAGS_NONE);
+            assert(rv == CD_XML_STATUS_SUCCESS);
+            const cd_xml_stringview_t& text = cd_xml_doc_node(doc, 1)->data.text.content;
+            assert(std::string(text.begin, text.end) == pi[1]);
+            cd_xml_free(&doc);
+        }
+    }
+
+    {   // CDATA
+        const char* xml = "<a>x <![CDATA[ <b>&amp;]] ]]> y<![CDATA[]]><c><![CDATA[z]]></c></a>";
+        cd_xml_doc_t* doc = NULL;
+        auto rv = cd_xml_init_and_parse(&doc, xml, strlen(xml), CD_XML_FLAGS_NONE);
+        assert(rv == CD_XML_STATUS_SUCCESS);
+        assert(cd_xml_doc_node_count(doc) == 6);
+        const cd_xml_node_t* cdata = cd_xml_doc_node(doc, 2);
+        assert(cdata->kind == CD_XML_NODE_TEXT && cdata->data.text.flags == CD_XML_TEXT_CDATA);
+        assert(cdata->data.text.content.begin == strstr(xml, " <b>"));
+        assert(std::string(cdata->data.text.content.begin, cdata->data.text.content.end) == " <b>&amp;]] ");
+        assert(cd_xml_doc_node(doc, 1)->data.text.flags == CD_XML_TEXT_NONE);
+
+        std::string out;
+        assert(cd_xml_write(doc, string_output_func, &out, false));
+        assert(out.find("<a>x<![CDATA[ <b>&amp;]] ]]>y<c><![CDATA[z]]></c></a>") != std::string::npos);
+        cd_xml_free(&doc);
+
+        xml = "<a><![CDATA[ unterminated </a>";
+        rv = cd_xml_init_and_parse(&doc, xml, strlen(xml), CD_XML_FLAGS_NONE);
+        assert(rv != CD_XML_STATUS_SUCCESS && doc == NULL);
+
+        std::string streamed;
+        cd_xml_writer_t writer;
+        cd_xml_writer_init(&writer, string_output_func, &streamed, false);
+        cd_xml_stringview_t name = cd_xml_strv("a");
+        cd_xml_stringview_t text = cd_xml_strv("1]]>2");
+        assert(cd_xml_writer_begin_element(&writer, cd_xml_no_ix, &name));
+        assert(cd_xml_writer_cdata(&writer, &text));
+        assert(cd_xml_writer_finish(&writer));
+        assert(streamed.find("<a><![CDATA[1]]]]><![CDATA[>2]]></a>") != std::string::npos);
+
+        rv = cd_xml_init_and_parse(&doc, streamed.data(), streamed.size(), CD_XML_FLAGS_COPY_STRINGS);
+        assert(rv == CD_XML_STATUS_SUCCESS && cd_xml_doc_node_count(doc) == 3);
+        cd_xml_free(&doc);
+    }
+
+    {   // Input encodings
+        const char* expected = u8"long enough ascii run to use the wide path é€\U0001F600 z";
+        const char16_t* utf16 = u"<?xml version=\"1.0\" encoding=\"utf-16\"?><a b=\"é\">long enough ascii run to use the wide path é€\U0001F600 z</a>";
+        for (bool big_endian : { false, true }) {
+            for (bool bom : { false, true }) {
+                std::string bytes;
+                if (bom) bytes += big_endian ? "\xFE\xFF" : "\xFF\xFE";
+                for (const char16_t* p = utf16; *p; p++) {
+                    char hi = (char)(*p >> 8), lo = (char)(*p & 0xFF);
+                    bytes += big_endian ? hi : lo;
+                    bytes += big_endian ? lo : hi;
+                }
+                std::string input = bytes;
+                cd_xml_doc_t* doc = NULL;
+                auto rv = cd_xml_init_and_parse(&doc, input.data(), input.size(), CD_XML_FLAGS_NONE);
+                assert(rv == CD_XML_STATUS_SUCCESS);
+                input.assign(input.size(), '\0');
+                const cd_xml_stringview_t& text = cd_xml_doc_node(doc, 1)->data.text.content;
+                assert(std::string(text.begin, text.end) == expected);
+                const cd_xml_stringview_t& value = cd_xml_doc_attribute(doc, 0)->value;
+                assert(std::string(value.begin, value.end) == u8"é");
+                cd_xml_free(&doc);
+
+                bytes.pop_back();
+                rv = cd_xml_init_and_parse(&doc, bytes.data(), bytes.size(), CD_XML_FLAGS_NONE);
+                assert(rv == CD_XML_STATUS_MALFORMED_UTF16 && doc == NULL);
+            }
+        }
+
+        const char lone[] = "\xFF\xFE<\0a\0>\0\x00\xD8<\0/\0a\0>\0";
+        cd_xml_doc_t* doc = NULL;
+        auto rv = cd_xml_init_and_parse(&doc, lone, sizeof(lone) - 1, CD_XML_FLAGS_NONE);
+        assert(rv == CD_XML_STATUS_MALFORMED_UTF16 && doc == NULL);
+
+        std::string latin1 = "<?xml version='1.0' encoding='ISO-8859-1'?><a>long enough ascii run to use the wide path \xE9\xFF z</a>";
+        rv = cd_xml_init_and_parse(&doc, latin1.data(), latin1.size(), CD_XML_FLAGS_NONE);
+        assert(rv == CD_XML_STATUS_SUCCESS);
+        latin1.assign(latin1.size(), '\0');
+        const cd_xml_stringview_t& text = cd_xml_doc_node(doc, 1)->data.text.content;
+        assert(std::string(text.begin, text.end) == u8"long enough ascii run to use the wide path éÿ z");
+        cd_xml_free(&doc);
+
+        const char* bom = "\xEF\xBB\xBF<?xml version=\"1.0\" encoding=\"ascii\"?><a/>";
+        rv = cd_xml_init_and_parse(&doc, bom, strlen(bom), CD_XML_FLAGS_NONE);
+        assert(rv == CD_XML_STATUS_SUCCESS && cd_xml_doc_node_count(doc) == 1);
+        cd_xml_free(&doc);
+
+        const char* mismatch = "\xEF\xBB\xBF<?xml version=\"1.0\" encoding=\"latin1\"?><a/>";
+        rv = cd_xml_init_and_parse(&doc, mismatch, strlen(mismatch), CD_XML_FLAGS_NONE);
+        assert(rv == CD_XML_STATUS_UNSUPPORTED_ENCODING && doc == NULL);
+    }
+
+    {   // Record reader
+        std::string xml = "\xEF\xBB\xBF<?xml version=\"1.0\"?>\n<!-- <x> --><root xmlns=\"urn:d\" xmlns:p=\"urn:p&amp;q\" a='>'>\n";
+        for (int i = 0; i < 100; i++) {
+            xml += "  <p:rec id=\"" + std::to_string(i) + "\"><v>" + std::to_string(i) + "</v><!-- </p:rec> --><![CDATA[</p:rec>]]></p:rec>\n";
+        }
+        xml += "  <group><rec/></group>\n</root>\n";
+
+        // Odd chunk sizes make records straddle refills at varying offsets.
+        for (size_t chunk : { (size_t)1, (size_t)7, (size_t)13, (size_t)50, (size_t)333, xml.size() }) {
+            chunked_input_t input;
+            input.data = xml;
+            input.chunk = chunk;
+            cd_xml_record_reader_t* reader = cd_xml_record_reader_init(chunked_input_func, &input, 1, CD_XML_FLAGS_NONE, nullptr);
+            assert(reader);
+            size_t records = 0;
+            cd_xml_doc_t* record = nullptr;
+            cd_xml_parse_status_t rv;
+            while ((rv = cd_xml_record_reader_next(reader, &record)) == CD_XML_STATUS_SUCCESS && record) {
+                const cd_xml_node_t* root = cd_xml_doc_node(record, 0);
+                if (records < 100) {
+                    assert(cd_xml_doc_node_count(record) == 4);
+                    const cd_xml_ns_t& ns = record->namespaces[root->data.element.namespace_ix];
+                    assert(std::string(ns.uri.begin, ns.uri.end) == "urn:p&q");
+                    const cd_xml_node_t* v = cd_xml_doc_node(record, 1);
+                    assert(record->namespaces[v->data.element.namespace_ix].prefix.begin == nullptr);
+                    const cd_xml_stringview_t& text = cd_xml_doc_node(record, 2)->data.text.content;
+                    assert(std::string(text.begin, text.end) == std::to_string(records));
+                }
+                else {
+                    assert(std::string(root->data.element.name.begin, root->data.element.name.end) == "group");
+                    assert(cd_xml_doc_node_count(record) == 2);
+                }
+                records++;
+            }
+            assert(rv == CD_XML_STATUS_SUCCESS && records == 101);
+            assert(cd_xml_record_reader_next(reader, &record) == CD_XML_STATUS_SUCCESS && record == nullptr);
+            cd_xml_record_reader_free(&reader);
+            assert(reader == nullptr);
+        }
+
+        {   // Record doc and buffers are reused, so steady state allocates nothing per record.
+            chunked_input_t input;
+            input.data = "<root>";
+            for (int i = 0; i < 1000; i++) input.data += "<rec id='" + std::to_string(i % 10) + "'>a &amp; b<v>x</v></rec>";
+            input.data += "</root>";
+            input.chunk = 100;
+            counting_allocator_t counts;
+            cd_xml_allocator_t allocator = { counting_alloc, counting_realloc, counting_free, &counts };
+            cd_xml_record_reader_t* reader = cd_xml_record_reader_init(chunked_input_func, &input, 1, CD_XML_FLAGS_COPY_STRINGS, &allocator);
+            cd_xml_doc_t* record = nullptr;
+            size_t records = 0;
+            size_t warm_calls = 0;
+            while (cd_xml_record_reader_next(reader, &record) == CD_XML_STATUS_SUCCESS && record) {
+                if (++records == 10) warm_calls = counts.calls;
+            }
+            assert(records == 1000 && counts.calls == warm_calls);
+            cd_xml_record_reader_free(&reader);
+            assert(counts.live_bytes == 0);
+        }
+
+        chunked_input_t input;
+        input.data = "<root><a/><b></root>";
+        input.chunk = 3;
+        cd_xml_record_reader_t* reader = cd_xml_record_reader_init(chunked_input_func, &input, 1, CD_XML_FLAGS_NONE, nullptr);
+        cd_xml_doc_t* record = nullptr;
+        assert(cd_xml_record_reader_next(reader, &record) == CD_XML_STATUS_SUCCESS && record);
+        assert(cd_xml_record_reader_next(reader, &record) != CD_XML_STATUS_SUCCESS && record == nullptr);
+        assert(cd_xml_record_reader_next(reader, &record) != CD_XML_STATUS_SUCCESS);
+        cd_xml_record_reader_free(&reader);
+
+        input.data = "<root><a>";
+        input.pos = 0;
+        reader = cd_xml_record_reader_init(chunked_input_func, &input, 1, CD_XML_FLAGS_NONE, nullptr);
+        assert(cd_xml_record_reader_next(reader, &record) == CD_XML_STATUS_PREMATURE_EOF);
+        cd_xml_record_reader_free(&reader);
+
+#ifndef _WIN32
+        int fds[2];
+        int prv = pipe(fds);
+        assert(prv == 0);
+        const char* piped = "<root><a x=\"1\"/><a x=\"2\"/></root>";
+        ssize_t written = write(fds[1], piped, strlen(piped));
+        assert(written == (ssize_t)strlen(piped));
+        close(fds[1]);
+        reader = cd_xml_record_reader_init_fd(fds[0], 1, CD_XML_FLAGS_COPY_STRINGS, nullptr);
+        size_t records = 0;
+        while (cd_xml_record_reader_next(reader, &record) == CD_XML_STATUS_SUCCESS && record) {
+            const cd_xml_stringview_t& value = cd_xml_doc_attribute(record, 0)->value;
+            assert(std::string(value.begin, value.end) == std::to_string(++records));
+        }
+        assert(records == 2);
+        cd_xml_record_reader_free(&reader);
+        close(fds[0]);
+#endif
+    }
+
+    {   // Lazy parsing
+        const char* xml =
+            "<?xml version=\"1.0\"?><r xmlns=\"urn:d\" xmlns:p=\"urn:p\">"
+            "<p:a k='>\"<'>x<!-- </p:a> <b> --><b q=\">\"><c>1 &amp; 2</c><c/></b><![CDATA[</p:a>]]></p:a>"
+            "t<d><e xmlns:p=\"urn:q\"><p:f/></e></d></r>";
+        cd_xml_doc_t* eager = NULL;
+        auto rv = cd_xml_init_and_parse(&eager, xml, strlen(xml), CD_XML_FLAGS_NONE);
+        assert(rv == CD_XML_STATUS_SUCCESS);
+        std::string expected;
+        assert(cd_xml_write(eager, string_output_func, &expected, false));
+
+        cd_xml_parse_options_t options = {};
+        options.lazy = true;
+        cd_xml_doc_t* doc = NULL;
+        rv = cd_xml_init_and_parse_ex(&doc, xml, strlen(xml), CD_XML_FLAGS_NONE, &options);
+        assert(rv == CD_XML_STATUS_SUCCESS);
+        assert(cd_xml_doc_node_count(doc) == 1 && cd_xml_doc_node(doc, 0)->data.element.first_child == cd_xml_no_ix);
+        assert(!cd_xml_compact(doc));
+
+        assert(cd_xml_expand(doc, 0) == CD_XML_STATUS_SUCCESS);
+        assert(cd_xml_doc_node_count(doc) == 4);
+        const cd_xml_node_t* a = cd_xml_doc_node(doc, 1);
+        assert(std::string(a->data.element.name.begin, a->data.element.name.end) == "a" && a->data.element.first_child == cd_xml_no_ix);
+        assert(cd_xml_doc_node(doc, 2)->kind == CD_XML_NODE_TEXT);
+
+        // Expand everything breadth-first, handles stay valid as nodes are only appended.
+        for (cd_xml_node_ix_t i = 0; i < cd_xml_doc_node_count(doc); i++) {
+            if (cd_xml_doc_node(doc, i)->kind == CD_XML_NODE_ELEMENT) {
+                assert(cd_xml_expand(doc, i) == CD_XML_STATUS_SUCCESS);
+            }
+        }
+        assert(cd_xml_doc_node_count(doc) == cd_xml_doc_node_count(eager));
+        assert(cd_xml_expand(doc, 1) == CD_XML_STATUS_SUCCESS);
+        assert(cd_xml_doc_node_count(doc) == cd_xml_doc_node_count(eager));
+        std::string lazy;
+        assert(cd_xml_write(doc, string_output_func, &lazy, false));
+        assert(lazy == expected);
+        assert(cd_xml_compact(doc));
+        std::string compacted;
+        assert(cd_xml_write(doc, string_output_func, &compacted, false));
+        assert(compacted == expected);
+        cd_xml_free(&doc);
+        cd_xml_free(&eager);
+
+        xml = "<r><a><b></c></a></r>";
+        rv = cd_xml_init_and_parse_ex(&doc, xml, strlen(xml), CD_XML_FLAGS_NONE, &options);
+        assert(rv == CD_XML_STATUS_SUCCESS);
+        assert(cd_xml_expand(doc, 0) == CD_XML_STATUS_SUCCESS);
+        assert(cd_xml_expand(doc, 1) != CD_XML_STATUS_SUCCESS);
+        cd_xml_free(&doc);
+
+        // A failed expansion is undone, so retrying fails again instead of leaving a partial element.
+        xml = "<r><a>t<b x='1'><c/></b><d></e></a></r>";
+        rv = cd_xml_init_and_parse_ex(&doc, xml, strlen(xml), CD_XML_FLAGS_NONE, &options);
+        assert(rv == CD_XML_STATUS_SUCCESS);
+        assert(cd_xml_expand(doc, 0) == CD_XML_STATUS_SUCCESS);
+        auto node_count = cd_xml_doc_node_count(doc);
+        auto attribute_count = cd_xml_doc_attribute_count(doc);
+        for (int retry = 0; retry < 2; retry++) {
+            assert(cd_xml_expand(doc, 1) != CD_XML_STATUS_SUCCESS);
+            assert(cd_xml_doc_node_count(doc) == node_count && cd_xml_doc_attribute_count(doc) == attribute_count);
+            assert(cd_xml_doc_node(doc, 1)->data.element.first_child == cd_xml_no_ix);
+        }
+        cd_xml_free(&doc);
+
+        xml = "<r><a><b></a>";
+        rv = cd_xml_init_and_parse_ex(&doc, xml, strlen(xml), CD_XML_FLAGS_NONE, &options);
+        assert(rv == CD_XML_STATUS_PREMATURE_EOF && doc == NULL);
+
+        // Transcoded input is owned by the doc and must survive shrinking while elements are unexpanded.
+        std::string utf16 = "\xFF\xFE";
+        for (const char* c = "<r a=\"1&amp;\"><x>hello</x><y>world</y></r>"; *c; c++) { utf16 += *c; utf16 += '\0'; }
+        rv = cd_xml_init_and_parse_ex(&doc, utf16.data(), utf16.size(), CD_XML_FLAGS_NONE, &options);
+        assert(rv == CD_XML_STATUS_SUCCESS);
+        cd_xml_shrink_to_fit(doc);
+        assert(cd_xml_expand(doc, 0) == CD_XML_STATUS_SUCCESS);
+        cd_xml_shrink_to_fit(doc);
+        assert(cd_xml_expand(doc, 2) == CD_XML_STATUS_SUCCESS);
+
+        // Unexpanded x would be written and saved without its contents, so that is refused.
+        std::string shrunk;
+        assert(!cd_xml_write(doc, string_output_func, &shrunk, false));
+        shrunk.clear();
+        assert(!cd_xml_write_parallel(doc, string_output_func, &shrunk, false, 4));
+        shrunk.clear();
+        assert(!cd_xml_save_binary(doc, string_output_func, &shrunk));
+        shrunk.clear();
+        cd_xml_shrink_to_fit(doc);
+        assert(cd_xml_expand(doc, 1) == CD_XML_STATUS_SUCCESS);
+        assert(cd_xml_write(doc, string_output_func, &shrunk, false));
+        assert(shrunk == "<?xml version=\"1.0\" encoding=\"UTF-8\"?><r a=\"1&amp;\"><x>hello</x><y>world</y></r>\n");
+        cd_xml_free(&doc);
+    }
+
+    {   // Validation
+        const char* inputs[] = {
+            "<a/>",
+            "\xEF\xBB\xBF<?xml version=\"1.0\" encoding=\"utf-8\"?><?pi x?><a>t</a>",
+            "<r xmlns=\"urn:d\" xmlns:p=\"urn:p\"><p:a p:k='&lt;&#x41;&#66;' q=\"&quot;\">x &amp; y<!-- <b> --></p:a>"
+            "<b p:k='1'><![CDATA[</b>]]>\xC3\xA6\xE2\x82\xAC\xF0\x9F\x98\x80</b><c q:k='1' xmlns:q='urn:q'/></r>",
+            "<a></b>",
+            "<p:a xmlns:p=\"urn:p\"></q:a>",
+            "<a><b></a>",
+            "<a q:k='1'/>",
+            "<q:a/>",
+            "<a xmlns:p=''/>",
+            "<a>&foo;</a>",
+            "<a>&amp</a>",
+            "<a k='&#x12g;'/>",
+            "<a>\xC3(</a>",
+            "<a>\xFF</a>",
+            "<a k='\xE2\x82'/>",
+            "<a>",
+            "<a/><b/>",
+            "<?xml version=\"2.0\"?><a/>",
+            "<a><!-- x</a>",
+        };
+        for (const char* xml : inputs) {
+            cd_xml_doc_t* doc = NULL;
+            auto expected = cd_xml_init_and_parse(&doc, xml, strlen(xml), CD_XML_FLAGS_NONE);
+            if (doc) cd_xml_free(&doc);
+            size_t error_offset = 42;
+            auto rv = cd_xml_validate(xml, strlen(xml), CD_XML_FLAGS_NONE, &error_offset);
+            assert(rv == expected);
+            assert(rv != CD_XML_STATUS_SUCCESS || error_offset == 0);
+        }
+
+        size_t error_offset = 0;
+        const char* mismatch = "<a><b>text</c></a>";
+        assert(cd_xml_validate(mismatch, strlen(mismatch), CD_XML_FLAGS_NONE, &error_offset) == CD_XML_STATUS_MALFORMED_ENTITY);
+        assert(error_offset == 12);
+        const char* entity = "<a>0123456789abcdef0123456789 &nbsp;</a>";
+        assert(cd_xml_validate(entity, strlen(entity), CD_XML_FLAGS_NONE, &error_offset) == CD_XML_STATUS_MALFORMED_ENTITY);
+        assert(error_offset == 30);
+        const char* utf8 = "<a>0123456789abcdef0123456789 \xC3</a>";
+        assert(cd_xml_validate(utf8, strlen(utf8), CD_XML_FLAGS_NONE, &error_offset) == CD_XML_STATUS_MALFORMED_UTF8);
+        assert(error_offset == 30);
+        assert(cd_xml_validate("\xFF\xFE<\0a\0/\0>\0", 10, CD_XML_FLAGS_NONE, NULL) == CD_XML_STATUS_UNSUPPORTED_ENCODING);
+
+        std::string deep;
+        for (int i = 0; i < CD_XML_VALIDATE_MAX_DEPTH; i++) deep += "<a>";
+        for (int i = 0; i < CD_XML_VALIDATE_MAX_DEPTH; i++) deep += "</a>";
+        assert(cd_xml_validate(deep.data(), deep.size(), CD_XML_FLAGS_NONE, NULL) == CD_XML_STATUS_SUCCESS);
+        deep = "<a>" + deep + "</a>";
+        assert(cd_xml_validate(deep.data(), deep.size(), CD_XML_FLAGS_NONE, &error_offset) == CD_XML_STATUS_LIMIT_EXCEEDED);
+        assert(error_offset == 3 * CD_XML_VALIDATE_MAX_DEPTH);
+    }
+
+    {   // Mutation and compaction
+        const char* xml = "<a x=\"1\" y=\"2\" z=\"3\"><b>t</b><c/><d><e/></d></a>";
+        cd_xml_doc_t* doc = NULL;
+        auto rv = cd_xml_init_and_parse(&doc, xml, strlen(xml), CD_XML_FLAGS_NONE);
+        assert(rv == CD_XML_STATUS_SUCCESS);
+        // Nodes are a=0, b=1, t=2, c=3, d=4, e=5 and attributes x=0, y=1, z=2.
+
+        assert(cd_xml_remove_attribute(doc, 0, 1));
+        assert(!cd_xml_remove_attribute(doc, 0, 1));
+        assert(cd_xml_remove_attribute(doc, 0, 2));
+        assert(cd_xml_doc_node(doc, 0)->data.element.last_attribute == 0);
+        assert(cd_xml_remove_node(doc, 0, 1));
+        assert(!cd_xml_remove_node(doc, 0, 1));
+        assert(!cd_xml_remove_node(doc, 0, 5));
+        assert(cd_xml_move_node(doc, 4, 5, 0, 3));
+        assert(!cd_xml_move_node(doc, 0, 3, 4, 1));
+        assert(cd_xml_insert_before(doc, 4, cd_xml_no_ix, 1));
+
+        // Attached nodes cannot be inserted and nodes cannot be moved into their own subtree.
+        assert(!cd_xml_insert_before(doc, 4, cd_xml_no_ix, 3));
+        assert(!cd_xml_move_node(doc, 0, 4, 1, cd_xml_no_ix));
+        assert(!cd_xml_move_node(doc, 0, 4, 4, cd_xml_no_ix));
+        assert(cd_xml_remove_node(doc, 0, 4));
+        assert(!cd_xml_insert_before(doc, 1, cd_xml_no_ix, 4));
+        assert(cd_xml_insert_before(doc, 0, cd_xml_no_ix, 4));
+
+        std::string edited;
+        assert(cd_xml_write(doc, string_output_func, &edited, false));
+        assert(edited.find("<a x=\"1\"><e/><c/><d><b>t</b></d></a>") != std::string::npos);
+
+        assert(cd_xml_compact(doc));
+        assert(cd_xml_doc_node_count(doc) == 6 && cd_xml_doc_attribute_count(doc) == 1);
+        const char* names[] = { "a", "e", "c", "d", "b" };
+        for (cd_xml_node_ix_t i = 0; i < 5; i++) {
+            const cd_xml_stringview_t& name = cd_xml_doc_node(doc, i)->data.element.name;
+            assert(std::string(name.begin, name.end) == names[i]);
+        }
+        std::string compacted;
+        assert(cd_xml_write(doc, string_output_func, &compacted, false));
+        assert(compacted == edited);
+
+        assert(cd_xml_remove_node(doc, 0, 3));
+        assert(cd_xml_remove_node(doc, 0, 3) == false);
+        assert(cd_xml_compact(doc));
+        assert(cd_xml_doc_node_count(doc) == 3);
+        cd_xml_free(&doc);
+    }
+
+    {   // Subtree hashing
+        const char* xml = "<r xmlns:p=\"urn:x\"><p:a k=\"1\" l=\"2\">t</p:a><p:a k=\"1\" l=\"2\">t</p:a><b/></r>";
+        cd_xml_doc_t* doc = NULL;
+        auto rv = cd_xml_init_and_parse(&doc, xml, strlen(xml), CD_XML_FLAGS_NONE);
+        assert(rv == CD_XML_STATUS_SUCCESS);
+        // Nodes are r=0, a=1, t=2, a=3, t=4, b=5.
+        std::vector<cd_xml_hash_t> hashes(cd_xml_doc_node_count(doc));
+        assert(cd_xml_hash_subtrees(doc, hashes.data()));
+        auto equal = [](const cd_xml_hash_t& a, const cd_xml_hash_t& b) { return a.lo == b.lo && a.hi == b.hi; };
+        assert(equal(hashes[1], hashes[3]) && equal(hashes[2], hashes[4]));
+        assert(!equal(hashes[1], hashes[2]) && !equal(hashes[1], hashes[5]) && !equal(hashes[0], hashes[1]));
+
+        // Prefixes, attribute order and CDATA do not matter, namespace URIs and values do.
+        const char* others[] = {
+            "<q:a xmlns:q=\"urn:x\" l=\"2\" k=\"1\"><![CDATA[t]]></q:a>",
+            "<a xmlns=\"urn:x\" l=\"2\" k=\"1\">t</a>",
+            "<q:a xmlns:q=\"urn:y\" k=\"1\" l=\"2\">t</q:a>",
+            "<p:a xmlns:p=\"urn:x\" k=\"1\" l=\"3\">t</p:a>",
+            "<p:a xmlns:p=\"urn:x\" k=\"1\">t</p:a>",
+            "<p:a xmlns:p=\"urn:x\" k=\"1\" l=\"2\">tt</p:a>",
+        };
+        for (size_t i = 0; i < sizeof(others) / sizeof(others[0]); i++) {
+            cd_xml_doc_t* other = NULL;
+            rv = cd_xml_init_and_parse(&other, others[i], strlen(others[i]), CD_XML_FLAGS_NONE);
+            assert(rv == CD_XML_STATUS_SUCCESS);
+            std::vector<cd_xml_hash_t> other_hashes(cd_xml_doc_node_count(other));
+            assert(cd_xml_hash_subtrees(other, other_hashes.data()));
+            assert(equal(other_hashes[0], hashes[1]) == (i < 2));
+            cd_xml_free(&other);
+        }
+
+        // After moving a into b, a child precedes its parent.
+        assert(cd_xml_move_node(doc, 0, 1, 5, cd_xml_no_ix));
+        assert(cd_xml_hash_subtrees(doc, hashes.data()));
+        const char* moved = "<r xmlns:p=\"urn:x\"><p:a k=\"1\" l=\"2\">t</p:a><b><p:a k=\"1\" l=\"2\">t</p:a></b></r>";
+        cd_xml_doc_t* expected = NULL;
+        rv = cd_xml_init_and_parse(&expected, moved, strlen(moved), CD_XML_FLAGS_NONE);
+        assert(rv == CD_XML_STATUS_SUCCESS);
+        std::vector<cd_xml_hash_t> expected_hashes(cd_xml_doc_node_count(expected));
+        assert(cd_xml_hash_subtrees(expected, expected_hashes.data()));
+        assert(equal(hashes[0], expected_hashes[0]) && equal(hashes[5], expected_hashes[3]));
+        assert(cd_xml_compact(doc));
+        assert(cd_xml_hash_subtrees(doc, hashes.data()));
+        assert(equal(hashes[0], expected_hashes[0]));
+        cd_xml_free(&expected);
+        cd_xml_free(&doc);
+
+        cd_xml_parse_options_t options = {};
+        options.lazy = true;
+        rv = cd_xml_init_and_parse_ex(&doc, xml, strlen(xml), CD_XML_FLAGS_NONE, &options);
+        assert(rv == CD_XML_STATUS_SUCCESS);
+        assert(!cd_xml_hash_subtrees(doc, hashes.data()));
+        cd_xml_free(&doc);
+    }
+
+    {   // Diff and patch
+        const char* a = "<cfg xmlns:p=\"urn:p\"><item id=\"1\" v=\"a\"/><item id=\"2\" v=\"b\">x</item><item id=\"3\"/>"
+                        "<p:opt k=\"1\">text</p:opt><list><e>1</e><e>2</e><e>3</e></list></cfg>";
+        const char* b = "<cfg xmlns:q=\"urn:p\"><item id=\"0\"/><item id=\"2\" v=\"c\">y</item><item id=\"3\" q:w=\"1\"/>"
+                        "<q:opt>text</q:opt><list><e>1</e><e>2</e><e>3</e><e>4</e></list><new xmlns=\"urn:n\"><z/></new></cfg>";
+        check_diff(a, b);
+        check_diff(b, a);
+        assert(check_diff(a, a) == 1);  // Just <patch/>.
+        check_diff("<x k=\"1\"><c/>t</x>", "<p:y xmlns:p=\"urn:y\" j=\"2\"><c/>t</p:y>");
+
+        // Script size follows the change, not the doc.
+        std::string big_a = "<items>", big_b = "<items>";
+        for (int i = 0; i < 1000; i++) {
+            big_a += "<item id=\"" + std::to_string(i) + "\" v=\"" + std::to_string(i) + "\"/>";
+            big_b += "<item id=\"" + std::to_string(i) + "\" v=\"" + std::to_string(i == 500 ? -1 : i) + "\"/>";
+        }
+        big_a += "</items>";
+        big_b += "</items>";
+        assert(check_diff(big_a, big_b) <= 4);
+
+        // Scripts that do not fit are rejected.
+        cd_xml_doc_t* from = NULL;
+        cd_xml_doc_t* to = NULL;
+        cd_xml_doc_t* other = NULL;
+        assert(cd_xml_init_and_parse(&from, a, strlen(a), CD_XML_FLAGS_NONE) == CD_XML_STATUS_SUCCESS);
+        assert(cd_xml_init_and_parse(&to, b, strlen(b), CD_XML_FLAGS_NONE) == CD_XML_STATUS_SUCCESS);
+        assert(cd_xml_init_and_parse(&other, "<cfg/>", 6, CD_XML_FLAGS_NONE) == CD_XML_STATUS_SUCCESS);
+        cd_xml_doc_t* script = cd_xml_diff(from, to);
+        assert(script && !cd_xml_patch(other, script));
+        cd_xml_free(&script);
+        cd_xml_free(&other);
+        cd_xml_free(&to);
+        cd_xml_free(&from);
+
+        uint32_t rng = 1;
+        for (int i = 0; i < 1000; i++) {
+            tree_t tree = random_tree(rng, 0);
+            std::string from_xml = tree_xml(tree, true);
+            for (int k = 1 + tree_rand(rng, 3); k; k--) mutate_tree(tree, rng);
+            check_diff(from_xml, tree_xml(tree, true));
+            check_diff(from_xml, tree_xml(random_tree(rng, 0), true));
+        }
+    }
+
+    {   // Node storage
+        cd_xml_doc_t* doc = cd_xml_init();
+        cd_xml_stringview_t name = cd_xml_strv("e");
+        cd_xml_stringview_t value = cd_xml_strv("v");
+        cd_xml_node_ix_t root = cd_xml_add_element(doc, cd_xml_no_ix, &name, cd_xml_no_ix, CD_XML_FLAGS_NONE);
+        cd_xml_node_t* root_ptr = cd_xml_doc_node(doc, root);
+        for (size_t i = 0; i < 10000; i++) {
+            cd_xml_node_ix_t elem = cd_xml_add_element(doc, cd_xml_no_ix, &name, root, CD_XML_FLAGS_NONE);
+            cd_xml_add_attribute(doc, cd_xml_no_ix, &name, &value, elem, CD_XML_FLAGS_NONE);
+        }
+        assert(cd_xml_doc_node_count(doc) == 10001 && cd_xml_doc_attribute_count(doc) == 10000);
+#ifdef CD_XML_SEGMENTED
+        assert(root_ptr == cd_xml_doc_node(doc, root));
+#endif
+        (void)root_ptr;
+        size_t children = 0;
+        for (cd_xml_node_ix_t ix = cd_xml_doc_node(doc, root)->data.element.first_child; ix != cd_xml_no_ix; ix = cd_xml_doc_node(doc, ix)->next_sibling) {
+            assert(cd_xml_doc_attribute(doc, cd_xml_doc_node(doc, ix)->data.element.first_attribute)->value.begin == value.begin);
+            children++;
+        }
+        assert(children == 10000);
+        cd_xml_free(&doc);
+    }
+
+    {   // Out of memory
+        counting_allocator_t counts;
+        cd_xml_allocator_t allocator = { counting_alloc, counting_realloc, counting_free, &counts };
+        cd_xml_parse_options_t options = {};
+        options.allocator = &allocator;
+
+        std::string xml = "<a xmlns:p=\"urn:p\" x=\"1 &amp; 2\">";
+        for (size_t i = 0; i < 40; i++) xml += "<p:b y=\"" + std::to_string(i) + "\">t &lt; u</p:b>";
+        xml += "</a>";
+        bool succeeded = false;
+        for (size_t n = 0; !succeeded; n++) {
+            counts.fail_after = n;
+            cd_xml_doc_t* doc = NULL;
+            auto rv = cd_xml_init_and_parse_ex(&doc, xml.data(), xml.size(), CD_XML_FLAGS_COPY_STRINGS, &options);
+            assert(rv == CD_XML_STATUS_SUCCESS || (rv == CD_XML_STATUS_OUT_OF_MEMORY && doc == NULL));
+            succeeded = rv == CD_XML_STATUS_SUCCESS;
+            cd_xml_free(&doc);
+            assert(counts.live_bytes == 0);
+        }
+
+        counts.fail_after = SIZE_MAX;
+        cd_xml_doc_t* doc = cd_xml_init_ex(&allocator);
+        counts.fail_after = 0;
+        cd_xml_stringview_t name = cd_xml_strv("root");
+        assert(cd_xml_add_element(doc, cd_xml_no_ix, &name, cd_xml_no_ix, CD_XML_FLAGS_NONE) == cd_xml_no_ix);
+        assert(cd_xml_doc_node_count(doc) == 0);
+        counts.fail_after = SIZE_MAX;
+        assert(cd_xml_add_element(doc, cd_xml_no_ix, &name, cd_xml_no_ix, CD_XML_FLAGS_NONE) == 0);
+        cd_xml_free(&doc);
+        assert(counts.live_bytes == 0);
+    }
+
+    {   // Batch parsing
+        std::vector<std::string> messages;
+        for (size_t i = 0; i < 200; i++) {
+            if (i % 50 == 7) messages.push_back("<msg><broken></msg>");
+            else messages.push_back("<msg xmlns:p=\"urn:p\" id=\"" + std::to_string(i) + "\"><p:v>" + std::to_string(i * i) + "</p:v></msg>");
+        }
+        std::vector<cd_xml_stringview_t> inputs;
+        for (auto& m : messages) inputs.push_back(cd_xml_stringview_t{ m.data(), m.data() + m.size() });
+
+        for (unsigned threads : { 1, 3, 0 }) {
+            std::vector<cd_xml_doc_t*> docs(inputs.size());
+            std::vector<cd_xml_parse_status_t> statuses(inputs.size());
+            bool ok = cd_xml_parse_batch(inputs.data(), inputs.size(), flags, docs.data(), statuses.data(), threads);
+            assert(!ok);
+            for (size_t i = 0; i < inputs.size(); i++) {
+                cd_xml_doc_t* single = NULL;
+                auto rv = cd_xml_init_and_parse(&single, messages[i].data(), messages[i].size(), flags);
+                assert(rv == statuses[i]);
+                if (rv == CD_XML_STATUS_SUCCESS) {
+                    std::string a, b;
+                    assert(cd_xml_write(docs[i], string_output_func, &a, false));
+                    assert(cd_xml_write(single, string_output_func, &b, false));
+                    assert(a == b);
+                }
+                else {
+                    assert(docs[i] == NULL);
+                }
+                cd_xml_free(&single);
+                cd_xml_free(&docs[i]);
+            }
+        }
+        assert(cd_xml_parse_batch(inputs.data(), 0, flags, NULL, NULL, 0));
+    }
+
     return 0;
 }